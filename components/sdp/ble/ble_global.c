@@ -3,13 +3,15 @@
 
 #include <nimble/nimble_port.h>
 #include <nimble/nimble_port_freertos.h>
-#include <esp32/rom/crc.h>
+#include <sdp_crc.h>
+#include <sdp_trace.h>
 #include <esp_log.h>
 
 #include "ble_service.h"
 #include "sdp.h"
 
 #include "ble_global.h"
+#include "sdp_helpers.h"
 
 /**
  * @brief The general client host task
@@ -110,6 +112,7 @@ void report_ble_connection_error(int conn_handle, int code)
 
     if (b_peer != NULL)
     {
+        sdp_mesh_read_begin();
         struct sdp_peer *s_peer = sdp_mesh_find_peer_by_handle(b_peer->sdp_handle);
         if (s_peer != NULL)
         {
@@ -120,6 +123,7 @@ void report_ble_connection_error(int conn_handle, int code)
             ESP_LOGE(messaging_log_prefix, "Unresolved BLE peer (no or invalid SDP peer handle), conn handle %i", conn_handle);
             ESP_LOGE(messaging_log_prefix, "encountered a BLE error. Code: %i.", code);
         }
+        sdp_mesh_read_end();
         b_peer->failure_count++;
     }
     ESP_LOGE(messaging_log_prefix, "Unregistered peer (!) at conn handle %i encountered a BLE error. Code: %i.", conn_handle, code);
@@ -131,14 +135,40 @@ void report_ble_connection_error(int conn_handle, int code)
  */
 int ble_send_message(uint16_t conn_handle, void *data, int data_length)
 {
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return ble_send_message_v(conn_handle, &iov, 1);
+}
+
+/**
+ * @brief Send a message, given as segments, to a connected BLE peer
+ * The segments are gathered directly into the mbuf that NimBLE sends from.
+ * The first segment is expected to begin with the preamble.
+ */
+int ble_send_message_v(uint16_t conn_handle, const sdp_iovec_t *iov, int iovcnt)
+{
+    int data_length = sdp_iovec_length(iov, iovcnt);
 
     if (pdTRUE == xSemaphoreTake(xBLE_Comm_Semaphore, portMAX_DELAY))
     {
-        int ret;
-        ret = ble_gattc_write_flat(conn_handle, ble_spp_svc_gatt_read_val_handle, data, data_length, NULL, NULL);
+        int ret = BLE_HS_ENOMEM;
+        struct os_mbuf *om = ble_hs_mbuf_from_flat(iov[0].base, iov[0].length);
+        for (int i = 1; (om != NULL) && (i < iovcnt); i++)
+        {
+            if (os_mbuf_append(om, iov[i].base, iov[i].length) != 0)
+            {
+                os_mbuf_free_chain(om);
+                om = NULL;
+            }
+        }
+        if (om != NULL)
+        {
+            // The mbuf is consumed by the write, regardless of the outcome
+            ret = ble_gattc_write(conn_handle, ble_spp_svc_gatt_read_val_handle, om, NULL, NULL);
+        }
         if (ret == 0)
         {
-            ESP_LOGI(log_prefix, "ble_send_message: Success sending %i bytes of data! CRC32: %u", data_length, (int)crc32_be(0, data, data_length));
+            SDP_FRAME_LOGI(log_prefix, "ble_send_message: Success sending %i bytes of data! CRC32: %u", data_length, (int)sdp_frame_crc(iov[0].base));
+            sdp_iovec_count_sent(data_length);
         }
         else
         {
@@ -18,5 +18,6 @@ int ble_negotiate_mtu(uint16_t conn_handle);
 void ble_host_task(void *param);
 void report_ble_connection_error(int conn_handle, int code);
 int ble_send_message(uint16_t conn_handle, void *data, int data_length);
+int ble_send_message_v(uint16_t conn_handle, const sdp_iovec_t *iov, int iovcnt);
 
 #endif
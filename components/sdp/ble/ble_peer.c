@@ -77,16 +77,7 @@ ble_peer_find_sdp_peer_by_reverse_addr(sdp_mac_address *mac_address)
     reversed_address[4] = (uint8_t)(*mac_address)[1];
     reversed_address[5] = (uint8_t)(*mac_address)[0] - 2;
 
-    struct sdp_peer *peer;
-    SLIST_FOREACH(peer, &sdp_peers, next)
-    {
-        if (memcmp(&(peer->base_mac_address),&reversed_address, SDP_MAC_ADDR_LEN) == 0)
-        {
-            return peer;
-        }
-    }
-
-    return NULL;
+    return sdp_mesh_find_peer_by_base_mac_address(reversed_address);
 }
 
 
@@ -14,7 +14,10 @@
 #include "esp_now.h"
 
 #include "../sdp_mesh.h"
+#include "../sdp_peer.h"
 #include "../sdp_messaging.h"
+#include "../sdp_helpers.h"
+#include "../sdp_trace.h"
 
 
 char *espnow_messaging_log_prefix;
@@ -39,18 +42,28 @@ static void espnow_send_cb(const uint8_t *mac_addr, esp_now_send_status_t status
 {
     if (status == ESP_NOW_SEND_SUCCESS)
     {
-        ESP_LOGI(espnow_messaging_log_prefix, ">> In espnow_send_cb, send success.");
+        SDP_FRAME_LOGI(espnow_messaging_log_prefix, ">> In espnow_send_cb, send success.");
+        sdp_mesh_read_begin();
+        sdp_peer *peer = sdp_mesh_find_peer_by_base_mac_address(mac_addr);
+        if (peer) {
+            sdp_link_on_send_done(&peer->espnow_stats.link, true);
+            SDP_STATS_INC(peer, espnow, send_successes);
+        }
+        sdp_mesh_read_end();
     }
     if (status == ESP_NOW_SEND_FAIL)
     {
         ESP_LOGW(espnow_messaging_log_prefix, ">> In espnow_send_cb, send failure, mac address:");
         ESP_LOG_BUFFER_HEX(espnow_messaging_log_prefix, mac_addr, SDP_MAC_ADDR_LEN);
+        sdp_mesh_read_begin();
         sdp_peer *peer = sdp_mesh_find_peer_by_base_mac_address(mac_addr);
         if (peer) {
-            peer->espnow_stats.send_failures++;
+            sdp_link_on_send_done(&peer->espnow_stats.link, false);
+            SDP_STATS_INC(peer, espnow, send_failures);
         } else {
             ESP_LOGE(espnow_messaging_log_prefix, "espnow_send_message() - no peer found matching dest_mac_address.");
         }
+        sdp_mesh_read_end();
 
     }
 }
@@ -68,19 +81,20 @@ static void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len
     }
 
     //sdp_peer *peer = sdp_mesh_find_peer_by_base_mac_address(esp_now_info->des_addr);
+    sdp_mesh_read_begin();
     sdp_peer *peer = sdp_mesh_find_peer_by_base_mac_address(mac_addr);
     if (peer != NULL)
     {
-        ESP_LOGI(espnow_messaging_log_prefix, "<< espnow_recv_cb got a message from a peer. Data:");
+        SDP_FRAME_LOGI(espnow_messaging_log_prefix, "<< espnow_recv_cb got a message from a peer. Data:");
         //ESP_LOGI(espnow_messaging_log_prefix, "<< espnow_recv_cb got a message from a peer. rssi: %i, rate %u, data:",
         //esp_now_info->rx_ctrl->rssi, esp_now_info->rx_ctrl->rate);
-        ESP_LOG_BUFFER_HEX(espnow_messaging_log_prefix, data, len);
+        SDP_FRAME_HEX(espnow_messaging_log_prefix, data, len);
     }
     else
     {
         /* We will not */
-        ESP_LOGI(espnow_messaging_log_prefix, "<< espnow_recv_cb got a message from an unknown peer. Data:");
-        ESP_LOG_BUFFER_HEX(espnow_messaging_log_prefix, data, len);
+        ESP_LOGI(espnow_messaging_log_prefix, "<< espnow_recv_cb got a message from an unknown peer.");
+        SDP_FRAME_HEX(espnow_messaging_log_prefix, data, len);
         /* Remember peer. */
         esp_now_peer_info_t *espnow_peer = malloc(sizeof(esp_now_peer_info_t));
         /* TODO: These seem arbitrary, see how channel and such is handled*/
@@ -95,6 +109,7 @@ static void espnow_recv_cb(const uint8_t *mac_addr, const uint8_t *data, int len
         
     }
     handle_incoming(peer, data, len, SDP_MT_ESPNOW);
+    sdp_mesh_read_end();
 }
 
 
@@ -138,17 +153,42 @@ static void espnow_deinit(espnow_send_param_t *send_param)
  * @brief Sends a message through ESPNOW.
  */
 int espnow_send_message(sdp_mac_address *dest_mac_address, void *data, int data_length, bool just_checking)
+{
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return espnow_send_message_v(dest_mac_address, &iov, 1, just_checking);
+}
+
+/**
+ * @brief Sends a message, given as segments, through ESPNOW.
+ * esp_now_send() needs the frame in one buffer, so several segments are gathered on the stack.
+ */
+int espnow_send_message_v(sdp_mac_address *dest_mac_address, const sdp_iovec_t *iov, int iovcnt, bool just_checking)
 {
     // TODO: Check if this actually needs a worker and a queue.
+    uint8_t frame[ESP_NOW_MAX_DATA_LEN];
+    const uint8_t *data = iov[0].base;
+    int data_length = iov[0].length;
+    if (iovcnt > 1)
+    {
+        data_length = sdp_iovec_gather(frame, ESP_NOW_MAX_DATA_LEN, iov, iovcnt);
+        if (data_length < 0)
+        {
+            ESP_LOGE(espnow_messaging_log_prefix, "Message too long for ESP-NOW (max %i bytes).", ESP_NOW_MAX_DATA_LEN);
+            return -SDP_ERR_MESSAGE_TOO_LONG;
+        }
+        data = frame;
+    }
     int rc = esp_now_send(dest_mac_address, data, data_length);
     if (rc != ESP_OK)
     {
+        sdp_mesh_read_begin();
         sdp_peer *peer = sdp_mesh_find_peer_by_base_mac_address(dest_mac_address);
         if (peer) {
-            peer->espnow_stats.send_failures++;
+            SDP_STATS_INC(peer, espnow, send_failures);
         } else {
             ESP_LOGE(espnow_messaging_log_prefix, "espnow_send_message() - no peer found matching dest_mac_address.");
         }
+        sdp_mesh_read_end();
         ESP_LOGE(espnow_messaging_log_prefix, "Mac-address:");
         ESP_LOG_BUFFER_HEX_LEVEL(espnow_messaging_log_prefix, dest_mac_address, SDP_MAC_ADDR_LEN, ESP_LOG_ERROR);
         if (!just_checking) {
@@ -197,6 +237,7 @@ int espnow_send_message(sdp_mac_address *dest_mac_address, void *data, int data_
         // espnow_deinit(send_param);
         // vTaskDelete(NULL);
     }
+    sdp_iovec_count_sent(data_length);
 
     return rc;
 }
@@ -77,6 +77,7 @@ typedef struct {
 } espnow_send_param_t;
 
 int espnow_send_message(sdp_mac_address *dest_mac_address, void *data, int data_length, bool just_checking);
+int espnow_send_message_v(sdp_mac_address *dest_mac_address, const sdp_iovec_t *iov, int iovcnt, bool just_checking);
 
 void espnow_messaging_init(char * _log_prefix);
 
@@ -10,6 +10,7 @@
 
 #include "esp_log.h"
 #include "../sdp_helpers.h"
+#include "../sdp_task.h"
 
 #include "gsm_task.h"
 #include "gsm_mqtt.h"
@@ -136,7 +137,7 @@ void gsm_init(char *_log_prefix)
     xEventGroupClearBits(gsm_event_group, GSM_CONNECT_BIT | GSM_GOT_DATA_BIT | GSM_SHUTTING_DOWN_BIT);
 
     ESP_LOGI(gsm_log_prefix, "* Registering GSM main task...");
-    int rc = xTaskCreatePinnedToCore((TaskFunction_t)gsm_start, "GSM main task", /*8192*/ 16384, 
+    int rc = sdp_task_create((TaskFunction_t)gsm_start, "GSM main task", CONFIG_SDP_GSM_TASK_STACK_SIZE, 
         (void *)gsm_log_prefix, 5, &gsm_modem_setup_task, 0);
     if (rc != pdPASS)
     {
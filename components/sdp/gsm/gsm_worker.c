@@ -11,6 +11,7 @@
 
 #include "gsm_worker.h"
 #include "sdp_work_queue.h"
+#include "sdp_pool.h"
 
 #include <sys/queue.h>
 
@@ -36,16 +37,19 @@ void gsm_insert_tail(work_queue_item_t *new_item) {
     STAILQ_INSERT_TAIL(&gsm_work_q, new_item, items);
 }
 
+static work_stamp_t *gsm_item_stamp(work_queue_item_t *queue_item) {
+    return &queue_item->stamp;
+}
+
+static int gsm_item_type(work_queue_item_t *queue_item) {
+    return queue_item->work_type;
+}
+
 esp_err_t gsm_safe_add_work_queue(work_queue_item_t *new_item) {   
     return safe_add_work_queue(&gsm_queue_context, new_item);
 }
 void gsm_cleanup_queue_task(work_queue_item_t *queue_item) {
-    if (queue_item != NULL)
-    {
-        free(queue_item->parts);
-        free(queue_item->raw_data);
-        free(queue_item);
-    }
+    sdp_free_work_item(queue_item);
     cleanup_queue_task(&gsm_queue_context);
 }
 
@@ -53,9 +57,13 @@ void gsm_set_queue_blocked(bool blocked) {
     set_queue_blocked(&gsm_queue_context,blocked);
 }
 
+queue_context *gsm_get_queue_context() {
+    return &gsm_queue_context;
+}
+
 void gsm_shutdown_worker() {
     ESP_LOGI(gsm_worker_log_prefix, "Telling gsm worker to shut down.");
-    gsm_queue_context.shutdown = true;
+    shutdown_work_queue(&gsm_queue_context);
 }
 
 esp_err_t gsm_init_worker(work_callback work_cb, char *_log_prefix)
@@ -68,7 +76,13 @@ esp_err_t gsm_init_worker(work_callback work_cb, char *_log_prefix)
     gsm_queue_context.remove_first_queueitem_cb = &gsm_remove_first_queue_item; 
     gsm_queue_context.insert_tail_cb = &gsm_insert_tail;
     gsm_queue_context.on_work_cb = work_cb; 
+    gsm_queue_context.item_stamp_cb = (item_stamp *)&gsm_item_stamp;
+    gsm_queue_context.item_type_cb = (item_type *)&gsm_item_type;
     gsm_queue_context.max_task_count = 1;
+    /* Senders wait a little for room, and then fail, rather than the frames piling up */
+    gsm_queue_context.capacity = CONFIG_SDP_MEDIA_QUEUE_CAPACITY;
+    gsm_queue_context.full_policy = SDP_QUEUE_BLOCK;
+    gsm_queue_context.block_timeout = pdMS_TO_TICKS(CONFIG_SDP_MEDIA_QUEUE_BLOCK_MS);
     // This queue cannot start processing items until GSM is initialized
     gsm_queue_context.blocked = true;
 
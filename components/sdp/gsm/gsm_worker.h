@@ -14,6 +14,7 @@
  *********************/
 
 #include "../sdp_def.h"
+#include "../sdp_work_queue.h"
 #include "esp_err.h"
 
 /*********************
@@ -24,6 +25,7 @@ esp_err_t gsm_init_worker(work_callback work_cb, work_callback priority_cb, char
 esp_err_t gsm_safe_add_work_queue(work_queue_item_t *new_item);
 void gsm_set_queue_blocked(bool blocked);
 void gsm_shutdown_worker();
+queue_context *gsm_get_queue_context();
 void gsm_cleanup_queue_task(work_queue_item_t *queue_item);
 
 #endif
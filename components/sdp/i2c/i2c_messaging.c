@@ -2,12 +2,14 @@
 #include <sdkconfig.h>
 
 #include "driver/i2c.h"
-#include "esp32/rom/crc.h"
+#include <sdp_crc.h>
+#include <sdp_trace.h>
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <sdp_mesh.h>
 #include <sdp_peer.h>
 #include <sdp_messaging.h>
+#include <sdp_helpers.h>
 #include "i2c_peer.h"
 
 #include <string.h>
@@ -114,7 +116,7 @@ esp_err_t i2c_driver_set_master(bool is_master, bool dont_delete)
 int calc_timeout_ms(uint32_t data_length)
 {
     int timeout_ms = (data_length / (CONFIG_I2C_MAX_FREQ_HZ / 16) * 1000) + CONFIG_I2C_ACKNOWLEGMENT_TIMEOUT_MS;
-    ESP_LOGI(i2c_messaging_log_prefix, "I2C - Timeout calculated to %i ms.", timeout_ms);
+    SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C - Timeout calculated to %i ms.", timeout_ms);
     return timeout_ms;
 }
 
@@ -123,8 +125,9 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
 {
 
     int retval = ESP_FAIL;
-    ESP_LOGI(i2c_messaging_log_prefix, ">> I2C send message to %hhu,  %i bytes.", peer->i2c_address, data_length);
-    uint32_t crc_msg = crc32_be(0, (uint8_t *)data + 4, data_length - 4);
+    SDP_FRAME_LOGI(i2c_messaging_log_prefix, ">> I2C send message to %hhu,  %i bytes.", peer->i2c_address, data_length);
+    /* The CRC was computed when the preamble was written, the receipt should echo it */
+    uint32_t crc_msg = sdp_frame_crc((uint8_t *)data);
     ESP_ERROR_CHECK(i2c_driver_set_master(true, false));
 
     uint64_t starttime;
@@ -142,7 +145,7 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
     {
         gpio_set_level(CONFIG_I2C_SDA_IO, 0);
 
-        ESP_LOGI(i2c_messaging_log_prefix, "I2C Master - >> SDA was high, now set to low, sending.");
+        SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Master - >> SDA was high, now set to low, sending.");
         gpio_set_level(CONFIG_I2C_SDA_IO, 0);
         int send_retries = 0;
         esp_err_t send_ret = ESP_FAIL;
@@ -164,11 +167,12 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
 
         if (send_ret == ESP_OK)
         {
-            float speed = (float)(data_length / ((float)(esp_timer_get_time() - starttime)) * 1000000);
-            ESP_LOGI(i2c_messaging_log_prefix, "I2C Master - >> %d byte packet sent...speed %f byte/s, air time: %lli , return value: %i", 
-                data_length, speed, esp_timer_get_time() - starttime, send_ret);
-            peer->i2c_stats.actual_speed = (peer->i2c_stats.actual_speed + speed) / 2;
+            uint32_t delivery_time = (uint32_t)(esp_timer_get_time() - starttime);
+            SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Master - >> %d byte packet sent...speed %f byte/s, air time: %"PRIu32" , return value: %i", 
+                data_length, (float)data_length / delivery_time * 1000000, delivery_time, send_ret);
+            sdp_link_on_delivery(&peer->i2c_stats.link, data_length, delivery_time);
             peer->i2c_stats.theoretical_speed = (CONFIG_I2C_MAX_FREQ_HZ / 2);
+            sdp_iovec_count_sent(data_length);
 
             vTaskDelay(calc_timeout_ms(data_length) / portTICK_PERIOD_MS);
             uint8_t *rcv_data = malloc(6);
@@ -205,7 +209,7 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
                 uint32_t crc_response;
                 //
                 if ((rcv_data[0] == 0xff) && (rcv_data[1] == 0x00)) {
-                    ESP_LOGI(i2c_messaging_log_prefix, "I2C Master - << Slave says it was correct");
+                    SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Master - << Slave says it was correct");
 
                     memcpy(&crc_response, rcv_data + 2, 4);
 
@@ -215,8 +219,8 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
 
                     if (crc_msg == crc_response)
                     {
-                        ESP_LOGI(i2c_messaging_log_prefix, "I2C Master - << Got a matching crc %"PRIu32".", crc_response);
-                        ESP_LOGI(i2c_messaging_log_prefix, "I2C Master - II %"PRIu32"", peer->i2c_stats.send_successes);
+                        SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Master - << Got a matching crc %"PRIu32".", crc_response);
+                        SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Master - II %"PRIu16"", peer->i2c_stats.send_successes);
                         retval = ESP_OK;
                     }
                     else
@@ -224,12 +228,14 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
                         ESP_LOGE(i2c_messaging_log_prefix, "I2C Master - << Got a bad crc: %"PRIu32"! (correct would be %"PRIu32"",
                                 crc_response, crc_msg);
                         ESP_LOG_BUFFER_HEXDUMP(i2c_messaging_log_prefix, rcv_data, 6, ESP_LOG_ERROR);
+                        SDP_TRACE(SDP_TRACE_BAD_RECEIPT, peer, SDP_MT_I2C, data_length, crc_msg);
                         i2c_crc_failures++;
                         retval = -SDP_ERR_SEND_FAIL;
                     }
                 } else if ((rcv_data[0] == 0x0) && (rcv_data[1] == 0xff)) {
                     ESP_LOGW(i2c_messaging_log_prefix, "I2C Master - << Slave says it was wrong ");
                     ESP_LOG_BUFFER_HEXDUMP(i2c_messaging_log_prefix, rcv_data, 6, ESP_LOG_INFO);
+                    SDP_TRACE(SDP_TRACE_BAD_RECEIPT, peer, SDP_MT_I2C, data_length, crc_msg);
                     retval = -SDP_ERR_SEND_FAIL;
                 } else {
                     ESP_LOGE(i2c_messaging_log_prefix, "I2C Master - << We need look a bit closer ");
@@ -264,12 +270,12 @@ int i2c_send_message(sdp_peer *peer, char *data, int data_length, bool just_chec
     if (retval != ESP_OK)
     {
         // We have failed sending data to this peer, report it.
-        peer->i2c_stats.send_failures++;
+        SDP_STATS_INC(peer, i2c, send_failures);
     }
     else
     {
-        peer->i2c_stats.send_successes++;
-        ESP_LOGI(i2c_messaging_log_prefix, "I2C Master Peer name: %s - II 2 %"PRIu32"", peer->name, peer->i2c_stats.send_successes);
+        SDP_STATS_INC(peer, i2c, send_successes);
+        SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Master Peer name: %s - II 2 %"PRIu16"", peer->name, peer->i2c_stats.send_successes);
     }
 
     ESP_ERROR_CHECK(i2c_driver_set_master(false, false));
@@ -312,20 +318,25 @@ void i2c_do_on_poll_cb(queue_context *q_context)
     // It has to be at least longer than the preamble and the address byte.
     if (data_len > SDP_PREAMBLE_LENGTH + 1)
     {
-        ESP_LOGI(i2c_messaging_log_prefix, "I2C Slave - << Got data, length %i bytes.", data_len);
+        SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Slave - << Got data, length %i bytes.", data_len);
         uint8_t i2c_address = (uint8_t)rcv_data[0];
-        uint32_t crc32_in = 0;
-        memcpy(&crc32_in, rcv_data + 1, 4);
-        uint32_t crc_calc = crc32_be(0, rcv_data + 5, data_len - 5);
+        uint32_t crc32_in = sdp_frame_crc(rcv_data + 1);
+        uint32_t crc_calc = sdp_frame_crc_calc(rcv_data + 1, data_len - 1);
 
         // TODO: It is not optimal to do this here, the lookup may be really fast, but the receipt should be immidiate. 
         // Probably the logging above needs to go as well.
+        sdp_mesh_read_begin();
         sdp_peer *peer = sdp_mesh_find_peer_by_i2c_address(i2c_address);
+        /* The response is written to the bus, so the peer is referenced rather than kept in the read section */
+        sdp_mesh_peer_ref(peer);
+        sdp_mesh_read_end();
 
         uint8_t response[6];
+        bool refused = false;
         if (crc32_in != crc_calc)
         {
             ESP_LOGW(i2c_messaging_log_prefix, "I2C Slave - << CRC Mismatch crc32_in: %"PRIu32",crc_calc: %"PRIu32". Create response:", crc32_in, crc_calc);
+            SDP_TRACE(SDP_TRACE_RX_BAD_CRC, peer, SDP_MT_I2C, data_len - 1, crc32_in);
             response[0] = 0x00;
             response[1] = 0xff;
             if (peer) {
@@ -336,31 +347,40 @@ void i2c_do_on_poll_cb(queue_context *q_context)
                  * Also, new peers are only added if the CRC is correct, and in that case it is unlikely that errors would just 
                  * concern the adress. Also, the HI message contains the mac_address. 
                  */
-                peer->i2c_stats.receive_failures++;
+                SDP_STATS_INC(peer, i2c, receive_failures);
                 
             } else {
                 i2c_unknown_failures++;
 
             }
             ret = ESP_FAIL;
+        } else if (sdp_frame_refused(rcv_data + 1, data_len - 1)) {
+            /* The work queue is full, a negative receipt makes the peer resend later */
+            ESP_LOGW(i2c_messaging_log_prefix, "I2C Slave - << The work queue is full, refusing the message.");
+            response[0] = 0x00;
+            response[1] = 0xff;
+            refused = true;
         }  else {
-            ESP_LOGI(i2c_messaging_log_prefix, "I2C Slave - << Got %i bytes of data from %hhu. crc32 : %"PRIu32", create response.", data_len, i2c_address, crc_calc);
+            SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Slave - << Got %i bytes of data from %hhu. crc32 : %"PRIu32", create response.", data_len, i2c_address, crc_calc);
             
             if (!peer)
             {
                 char *new_name;
                 asprintf(&new_name, "UNKNOWN_%"PRIu32"", i2c_unknown_counter++);
                 ESP_LOGI(i2c_messaging_log_prefix, "I2C Slave - >> New peer, adding.");
+                sdp_mesh_read_begin();
                 peer = sdp_add_init_new_peer_i2c(new_name, i2c_address);
+                sdp_mesh_peer_ref(peer);
+                sdp_mesh_read_end();
             }
-            peer->i2c_stats.receive_successes++;
+            SDP_STATS_INC(peer, i2c, receive_successes);
             
             response[0] = 0xff;
             response[1] = 0x00;   
             ret = ESP_OK;
         }
         memcpy(&(response[2]) , &crc32_in, (size_t)4);
-        ESP_LOG_BUFFER_HEXDUMP(i2c_messaging_log_prefix, &response, 6, ESP_LOG_INFO);
+        SDP_FRAME_HEXDUMP(i2c_messaging_log_prefix, &response, 6);
 
         ret = i2c_slave_write_buffer(CONFIG_I2C_CONTROLLER_NUM, &response, 6,
                                      I2C_TIMEOUT_MS / portTICK_PERIOD_MS);
@@ -368,18 +388,22 @@ void i2c_do_on_poll_cb(queue_context *q_context)
         {
             ESP_LOGE(i2c_messaging_log_prefix, "I2C Slave - >> Got an error from sending back data: %i", ret);
             if (peer) {
-                peer->i2c_stats.send_failures++; // TODO: Not sure how this should count, but probably it should
+                SDP_STATS_INC(peer, i2c, send_failures); // TODO: Not sure how this should count, but probably it should
             }
             
         }
         else
         {
-            ESP_LOGI(i2c_messaging_log_prefix, "I2C Slave - >> Sent a %i bytes with length of %i bytes and crc of %"PRIu32".", ret, data_len, crc_calc);
-            peer->i2c_stats.send_successes++;       
+            SDP_FRAME_LOGI(i2c_messaging_log_prefix, "I2C Slave - >> Sent a %i bytes with length of %i bytes and crc of %"PRIu32".", ret, data_len, crc_calc);
+            SDP_STATS_INC(peer, i2c, send_successes);       
         }
 
 
-        handle_incoming(peer, rcv_data + 1, data_len - 1, SDP_MT_I2C);
+        if (!refused)
+        {
+            handle_incoming(peer, rcv_data + 1, data_len - 1, SDP_MT_I2C);
+        }
+        sdp_mesh_peer_unref(peer);
     }
     else if (data_len > 0)
     {
@@ -396,7 +420,7 @@ void i2c_do_on_poll_cb(queue_context *q_context)
 
 void i2c_do_on_work_cb(i2c_queue_item_t *work_item)
 {
-    ESP_LOGI(i2c_messaging_log_prefix, ">> In i2c work callback.");
+    SDP_FRAME_LOGI(i2c_messaging_log_prefix, ">> In i2c work callback.");
 
 
     int retval = ESP_FAIL;
@@ -409,16 +433,30 @@ void i2c_do_on_work_cb(i2c_queue_item_t *work_item)
             // Call the poll function as it was called by the queue to listen for response before retrying
             // TODO: There is no special reason why poll needs to have been called by the queue. 
             // We should probably remove queue context.
-            ESP_LOGI(i2c_messaging_log_prefix, ">> Retry %i failed.", send_retries + 1);
+            SDP_FRAME_LOGI(i2c_messaging_log_prefix, ">> Retry %i failed.", send_retries + 1);
             
         }
         i2c_do_on_poll_cb(i2c_get_queue_context());
         send_retries++;
 
     } while ((retval != ESP_OK) && (send_retries < CONFIG_I2C_RESEND_COUNT));
-    // We have failed retrying, if we are supposed to, try resending (and rescoring)
-    if ((retval != ESP_OK) && (!work_item->just_checking)) {
-        sdp_send_message(work_item->peer, work_item->data, work_item->data_length);
+    if (!work_item->just_checking) {
+        SDP_TRACE(retval == ESP_OK ? SDP_TRACE_TX : SDP_TRACE_TX_FAIL, work_item->peer, SDP_MT_I2C, 
+                  work_item->data_length, sdp_frame_crc((uint8_t *)work_item->data));
+    }
+    sdp_tx_item_t *tx_item = work_item->tx_item;
+    if (tx_item != NULL) {
+        // Sent using sdp_send_async(), which handles resending (and rescoring).
+        // The data belongs to the transmit item, which may reuse the queue item, so it is freed first.
+        i2c_free_queue_item(work_item);
+        sdp_send_complete(tx_item, retval == ESP_OK ? SDP_MT_I2C : -SDP_MT_I2C);
+    } else {
+        // We have failed retrying, if we are supposed to, try resending (and rescoring)
+        if ((retval != ESP_OK) && (!work_item->just_checking)) {
+            sdp_send_message(work_item->peer, work_item->data, work_item->data_length);
+        }
+        // The data is stored with the item
+        i2c_free_queue_item(work_item);
     }
 }
 
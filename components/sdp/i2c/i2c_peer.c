@@ -20,12 +20,11 @@ void i2c_stat_reset(sdp_peer *peer)
     peer->i2c_stats.send_failures = 0;
     peer->i2c_stats.receive_successes = 0;
     peer->i2c_stats.receive_failures = 0;
-    peer->i2c_stats.score_count = 0;
 }
 
 void i2c_peer_init_peer(sdp_peer *peer)
 {
-    memset(peer->i2c_stats.failure_rate_history, 0, sizeof(float) * FAILURE_RATE_HISTORY_LENGTH);
+    memset(&peer->i2c_stats.link, 0, sizeof(sdp_link_estimate));
 
     i2c_stat_reset(peer);
 }
@@ -49,31 +48,15 @@ float i2c_score_peer(sdp_peer *peer, int data_length)
     // TODO: Obviously, the length score should go down if we are forced to slow down, with a low actual speed.
     float length_score = sdp_helper_calc_suitability(data_length, 50, 1000, 0.005);
  
-    ESP_LOGD(i2c_peer_log_prefix, "peer: %s ss: %"PRIu32", rs: %"PRIu32", sf: %"PRIu32", rf: %"PRIu32" ", peer->name,
+    ESP_LOGD(i2c_peer_log_prefix, "peer: %s ss: %"PRIu16", rs: %"PRIu16", sf: %"PRIu16", rf: %"PRIu16" ", peer->name,
              peer->i2c_stats.send_successes, peer->i2c_stats.receive_successes,
              peer->i2c_stats.send_failures, peer->i2c_stats.receive_failures);
     // Success score
 
-    float failure_rate = 0;
-
-    if (peer->i2c_stats.send_successes + peer->i2c_stats.receive_successes > 0)
-    {
-        // Neutral if failures are lower than 0.01 of tries.
-        failure_rate = ((float)peer->i2c_stats.send_failures + (float)peer->i2c_stats.receive_failures) /
-                       ((float)peer->i2c_stats.send_successes + (float)peer->i2c_stats.receive_successes);
-    }
-    else if (peer->i2c_stats.send_failures + peer->i2c_stats.receive_failures > 0)
-    {
-        // If there are only failures, that causes a 1 as a failure fraction
-        failure_rate = 1;
-    }
-    if (failure_rate > 1)
-    {
-        failure_rate = 1;
-    }
+    float failure_rate = sdp_link_loss_rate(&(peer->i2c_stats.link));
 
     // A failure fraction of 0.1 - 0. No failures - 25. Anything over 0.5 returns -100.
-    float success_score = 10 - (add_to_failure_rate_history(&(peer->i2c_stats), failure_rate) * 100);
+    float success_score = 10 - (failure_rate * 100);
     if (success_score < -100)
     {
         success_score = -100;
@@ -87,12 +70,7 @@ float i2c_score_peer(sdp_peer *peer, int data_length)
     ESP_LOGI(i2c_peer_log_prefix, "I2C - Scoring - peer: %s LSCR  : %f FR: %f, SSCR : %f - TSCR  = %f",
         peer->name, length_score, failure_rate, success_score, total_score);
 
-    peer->i2c_stats.last_score = (total_score + peer->i2c_stats.last_score) / 2;
-    peer->i2c_stats.last_score_time = esp_timer_get_time();
-
-    i2c_stat_reset(peer);
-
-    return peer->i2c_stats.last_score;
+    return total_score;
 }
 
 
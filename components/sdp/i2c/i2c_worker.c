@@ -16,6 +16,10 @@
 #include <esp_log.h>
 #include <string.h>
 
+#include "../sdp_helpers.h"
+#include "../sdp_mesh.h"
+#include "../orchestration/orchestration.h"
+
 // The queue context
 struct queue_context i2c_queue_context;
 
@@ -37,21 +41,109 @@ void i2c_insert_tail(i2c_queue_item_t *new_item) {
     STAILQ_INSERT_TAIL(&i2c_work_q, new_item, items);
 }
 
+static work_stamp_t *i2c_item_stamp(i2c_queue_item_t *queue_item) {
+    return &queue_item->stamp;
+}
+
+/* The work type is in the preamble of the frame */
+static int i2c_item_type(i2c_queue_item_t *queue_item) {
+    return queue_item->data_length > 4 ? queue_item->data[4] : 0;
+}
+
 esp_err_t i2c_safe_add_work_queue(sdp_peer *peer, char *data, int data_length, bool just_checking) {  
-    i2c_queue_item_t *new_item = malloc(sizeof(i2c_queue_item_t)); 
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return i2c_safe_add_work_queue_v(peer, &iov, 1, just_checking);
+}
+
+/**
+ * @brief Queue a frame given as segments, they are gathered into the queue item
+ */
+esp_err_t i2c_safe_add_work_queue_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, bool just_checking) {  
+    int data_length = sdp_iovec_length(iov, iovcnt);
+    i2c_queue_item_t *new_item = malloc(sizeof(i2c_queue_item_t) + data_length); 
+    if (new_item == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    /* The item is sent after the caller has returned, it keeps the peer until it is freed */
+    sdp_mesh_peer_ref(peer);
     new_item->peer = peer;
-    new_item->data = malloc(data_length);
-    memcpy(new_item->data,data, data_length);
-    new_item->data_length = data_length;
+    // The data is stored right after the item, and freed with it
+    new_item->data = (char *)(new_item + 1);
+    new_item->data_length = sdp_iovec_gather((uint8_t *)new_item->data, data_length, iov, iovcnt);
     new_item->just_checking = just_checking;
-    return safe_add_work_queue(&i2c_queue_context, new_item);
+    new_item->tx_item = NULL;
+    /* Checking a connection is done regardless */
+    new_item->stamp.deadline = just_checking ? 0 : sdp_orchestration_deadline(peer);
+    esp_err_t rc = safe_add_work_queue(&i2c_queue_context, new_item);
+    if (rc != ESP_OK) {
+        i2c_free_queue_item(new_item);
+    }
+    return rc;
+}
+
+/* Acknowledgements keep their queue item in their slot */
+_Static_assert(sizeof(i2c_queue_item_t) <= SDP_SEND_ACK_MEDIA_ITEM_SIZE, "SDP_SEND_ACK_MEDIA_ITEM_SIZE is too small");
+
+/**
+ * @brief Free a queue item, unless it is in the slot of an acknowledgement (see sdp_send_ack_media_item())
+ * Call before sdp_send_complete(), which may reuse the slot.
+ * Items of a transmit item use its reference to the peer, the others release their own.
+ */
+void i2c_free_queue_item(i2c_queue_item_t *queue_item) {
+    if (queue_item->tx_item == NULL) {
+        sdp_mesh_peer_unref(queue_item->peer);
+        free(queue_item);
+    } else if ((void *)queue_item != sdp_send_ack_media_item(queue_item->tx_item)) {
+        free(queue_item);
+    }
+}
+
+/**
+ * @brief Queue a frame from sdp_send_async(), the outcome is reported using sdp_send_complete()
+ */
+esp_err_t i2c_safe_add_tx_item(sdp_tx_item_t *tx_item) {
+    /* An acknowledgement has room for the queue item in its slot, and must not wait for the queue */
+    i2c_queue_item_t *new_item = sdp_send_ack_media_item(tx_item);
+    bool ack = new_item != NULL;
+    if (!ack) {
+        new_item = malloc(sizeof(i2c_queue_item_t));
+    }
+    if (new_item == NULL) {
+        return ESP_ERR_NO_MEM;
+    }
+    new_item->peer = tx_item->peer;
+    new_item->data = (char *)tx_item->data;
+    new_item->data_length = tx_item->data_length;
+    new_item->just_checking = false;
+    new_item->tx_item = tx_item;
+    new_item->stamp.deadline = tx_item->stamp.deadline;
+    esp_err_t rc = ack ? safe_add_work_queue_no_wait(&i2c_queue_context, new_item)
+                       : safe_add_work_queue(&i2c_queue_context, new_item);
+    if (rc != ESP_OK) {
+        i2c_free_queue_item(new_item);
+    }
+    return rc;
 }
+
+/**
+ * @brief Skip a frame that has passed its deadline, the peer has given up on it
+ */
+static void i2c_item_expired(i2c_queue_item_t *queue_item) {
+    sdp_tx_item_t *tx_item = queue_item->tx_item;
+    if (tx_item == NULL) {
+        ESP_LOGW(i2c_worker_log_prefix, ">> Not sending to %s, the deadline has passed.", queue_item->peer->name);
+        __atomic_fetch_add(&queue_item->peer->expired_count, 1, __ATOMIC_RELAXED);
+    }
+    i2c_free_queue_item(queue_item);
+    if (tx_item != NULL) {
+        sdp_send_expired(tx_item);
+    }
+}
+
 void i2c_cleanup_queue_task(i2c_queue_item_t *queue_item) {
     if (queue_item != NULL)
     {    
-        free(queue_item->peer);
-        free(queue_item->data);
-        free(queue_item);
+        i2c_free_queue_item(queue_item);
     }
     cleanup_queue_task(&i2c_queue_context);
 }
@@ -66,7 +158,7 @@ void i2c_set_queue_blocked(bool blocked) {
 
 void i2c_shutdown_worker() {
     ESP_LOGI(i2c_worker_log_prefix, "Telling i2c worker to shut down.");
-    i2c_queue_context.shutdown = true;
+    shutdown_work_queue(&i2c_queue_context);
 }
 
 esp_err_t i2c_init_worker(work_callback work_cb, poll_callback poll_cb, char *_log_prefix)
@@ -79,8 +171,15 @@ esp_err_t i2c_init_worker(work_callback work_cb, poll_callback poll_cb, char *_l
     i2c_queue_context.remove_first_queueitem_cb = &i2c_remove_first_queue_item; 
     i2c_queue_context.insert_tail_cb = &i2c_insert_tail;
     i2c_queue_context.on_work_cb = work_cb; 
+    i2c_queue_context.item_stamp_cb = (item_stamp *)&i2c_item_stamp;
+    i2c_queue_context.item_type_cb = (item_type *)&i2c_item_type;
+    i2c_queue_context.on_expired_cb = (work_callback *)&i2c_item_expired;
     i2c_queue_context.on_poll_cb = poll_cb;
     i2c_queue_context.max_task_count = 1;
+    /* Senders wait a little for room, and then fail, rather than the frames piling up */
+    i2c_queue_context.capacity = CONFIG_SDP_MEDIA_QUEUE_CAPACITY;
+    i2c_queue_context.full_policy = SDP_QUEUE_BLOCK;
+    i2c_queue_context.block_timeout = pdMS_TO_TICKS(CONFIG_SDP_MEDIA_QUEUE_BLOCK_MS);
     // This queue cannot start processing items until i2c is initialized
     i2c_queue_context.blocked = true;
     i2c_queue_context.multitasking = false;
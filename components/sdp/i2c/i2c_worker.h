@@ -15,6 +15,7 @@
 
 #include "../sdp_def.h"
 #include "../sdp_work_queue.h"
+#include "../sdp_send.h"
 
 /*********************
  *      DEFINES
@@ -33,12 +34,19 @@ typedef struct i2c_queue_item
     /* We are just checking a problematic connection, dial down the logging and do not retry using other media. 
     TODO: Change this into some log level instead? Or is logging even relevant later? We will probably have a centralized logging service. */
     bool just_checking;
+    /* Set if the frame was sent using sdp_send_async(), the data then belongs to it */
+    sdp_tx_item_t *tx_item;
+    /* When it was queued and taken from the queue */
+    work_stamp_t stamp;
     /* Queue reference */
     STAILQ_ENTRY(i2c_queue_item)
     items;
 } i2c_queue_item_t;
 
 esp_err_t i2c_safe_add_work_queue(sdp_peer *peer, char *data, int data_length, bool just_checking);
+esp_err_t i2c_safe_add_work_queue_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, bool just_checking);
+esp_err_t i2c_safe_add_tx_item(sdp_tx_item_t *tx_item);
+void i2c_free_queue_item(i2c_queue_item_t *queue_item);
 
 esp_err_t i2c_init_worker(work_callback work_cb, poll_callback poll_cb, char *_log_prefix);
 
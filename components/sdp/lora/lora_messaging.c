@@ -8,12 +8,13 @@
 #include "lora_sx127x_lib.h"
 #endif
 
-#include "esp32/rom/crc.h"
+#include "sdp_crc.h"
 #include <esp_log.h>
 #include <esp_timer.h>
 #include <sdp_mesh.h>
 #include <sdp_helpers.h>
 #include <sdp_messaging.h>
+#include <sdp_trace.h>
 
 #include <string.h>
 
@@ -35,54 +36,61 @@ int lora_send_message(sdp_peer *peer, char *data, int data_length, bool just_che
         // Based on settings, Kbits/sec and thus time-to-send should be possible to calculate and figure out if it is too big of a message.
         return SDP_ERR_MESSAGE_TOO_LONG;
     }
-    uint8_t *tmp_data;
-    uint16_t message_len;
+    // The addressing is sent as a separate header segment, written to the radio together with the data
+    uint8_t header[SDP_MAC_ADDR_LEN * 2];
+    sdp_iovec_t iov[2] = {{.base = header, .length = 0},
+                          {.base = data, .length = data_length}};
 	if (peer->state != PEER_UNKNOWN) {
         uint8_t relation_size = sizeof(peer->relation_id);
         // We have an established relation, use the relation id
-        ESP_LOGI(lora_messaging_log_prefix, ">> Relation id > 0: %"PRIu32", size: %hhu.", peer->relation_id, relation_size);
-        message_len = relation_size + data_length;
-        tmp_data = malloc(message_len);
+        SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> Relation id > 0: %"PRIu32", size: %hhu.", peer->relation_id, relation_size);
         // Add the destination address
-        memcpy(tmp_data, &(peer->relation_id), relation_size);
-        // Add the data
-        memcpy(tmp_data + relation_size , data, data_length);
+        memcpy(header, &(peer->relation_id), relation_size);
+        iov[0].length = relation_size;
 
     } else {
-        ESP_LOGI(lora_messaging_log_prefix, ">> Relation id = 0, connecting using mac adresses");
+        SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> Relation id = 0, connecting using mac adresses");
         // We have no established relation, sending both mac adresses
-        message_len = (SDP_MAC_ADDR_LEN * 2) + data_length;
-        tmp_data = malloc(message_len);
         // Add the destination address
-        memcpy(tmp_data, &(peer->base_mac_address), SDP_MAC_ADDR_LEN);
+        memcpy(header, &(peer->base_mac_address), SDP_MAC_ADDR_LEN);
         // Add source address
-        memcpy(tmp_data + SDP_MAC_ADDR_LEN, sdp_host.base_mac_address, SDP_MAC_ADDR_LEN);
-        // Add the data
-        memcpy(tmp_data + (SDP_MAC_ADDR_LEN * 2) , data, data_length);
+        memcpy(header + SDP_MAC_ADDR_LEN, sdp_host.base_mac_address, SDP_MAC_ADDR_LEN);
+        iov[0].length = SDP_MAC_ADDR_LEN * 2;
+    }
+    // Maximum Payload size of SX126x/SX127x is 255/256 bytes. 
+    // The header and the data are written to the radio's FIFO as they are, there is no need to gather them here.
+    int message_len = iov[0].length + iov[1].length;
+    if (message_len > 255) {
+		ESP_LOGE(lora_messaging_log_prefix, ">> Message too long including addressing: %i", data_length);
+        return SDP_ERR_MESSAGE_TOO_LONG;
     }
 
 	
 // TODO: Make some way of handling longer messages
 
 	uint64_t starttime;
+	/* When sending started, for the link estimate */
+	uint64_t sendtime;
 	int tx_count = 0;
 
 	tx_count++;
 	
-	ESP_LOGI(lora_messaging_log_prefix, ">> Sending message: \"%.*s\", data is %i, total %i bytes...", data_length-4, data+4, data_length, data_length + (SDP_MAC_ADDR_LEN *2));
-	ESP_LOGI(lora_messaging_log_prefix, ">> Data (including all) preamble): ");
-    ESP_LOG_BUFFER_HEX(lora_messaging_log_prefix, (uint8_t *)tmp_data, message_len);  
+	SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> Sending message: \"%.*s\", data is %i, total %i bytes...", data_length-4, data+4, data_length, data_length + (SDP_MAC_ADDR_LEN *2));
+	SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> Data (including all) preamble): ");
+    SDP_FRAME_HEX(lora_messaging_log_prefix, header, iov[0].length);
+    SDP_FRAME_HEX(lora_messaging_log_prefix, (uint8_t *)data, data_length);
     starttime = esp_timer_get_time();
+    sendtime = starttime;
 
  	#ifdef CONFIG_LORA_SX126X
-    LoRaSend((uint8_t *)tmp_data, message_len, SX126x_TXMODE_SYNC);
+    LoRaSendV(iov, 2, SX126x_TXMODE_SYNC);
 	#endif
     #ifdef CONFIG_LORA_SX127X
-    lora_send_packet((uint8_t *)tmp_data, message_len);
+    lora_send_packet_v(iov, 2);
 	#endif
-    free(tmp_data);
+    sdp_iovec_count_sent(message_len);
 
-    ESP_LOGI(lora_messaging_log_prefix, ">> %d byte packet sent...speed %f byte/s", message_len, 
+    SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> %d byte packet sent...speed %f byte/s", message_len, 
 	(float)(message_len/((float)(esp_timer_get_time()-starttime))*1000000));
 
     // TODO: Add a check for the CRC response
@@ -102,7 +110,7 @@ int lora_send_message(sdp_peer *peer, char *data, int data_length, bool just_che
                     ESP_LOGE(lora_messaging_log_prefix, "<< Timed out waiting for receipt from %s.", peer->name); 
                 }
                 vTaskDelay(1);
-                peer->lora_stats.receive_failures++;
+                SDP_STATS_INC(peer, lora, receive_failures);
                 return ESP_FAIL;
             }
             vTaskDelay(1);
@@ -131,17 +139,19 @@ int lora_send_message(sdp_peer *peer, char *data, int data_length, bool just_che
         }
         if ((memcmp(&buf, &peer->relation_id, 4) == 0) && (message_length >= 6)) {
            if ((buf[4] == 0xff)&& buf[5] == 0x00) {
-                ESP_LOGI(lora_messaging_log_prefix, "<< Success message from %s.", peer->name); 
-                peer->lora_stats.receive_successes++;
+                SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< Success message from %s.", peer->name); 
+                sdp_link_on_delivery(&peer->lora_stats.link, message_len, (uint32_t)(esp_timer_get_time() - sendtime));
+                SDP_STATS_INC(peer, lora, receive_successes);
                 return ESP_OK;
-           } else if (buf[4] == 0xff && buf[4] == 0x00) {
+           } else if ((buf[4] == 0x00) && (buf[5] == 0xff)) {
                 ESP_LOGW(lora_messaging_log_prefix, "<< Bad CRC message from %s.", peer->name); 
-                peer->lora_stats.receive_failures++;
+                SDP_TRACE(SDP_TRACE_BAD_RECEIPT, peer, SDP_MT_LoRa, data_length, sdp_frame_crc((uint8_t *)data));
+                SDP_STATS_INC(peer, lora, receive_failures);
                 return ESP_FAIL;
            } else {
                 ESP_LOGE(lora_messaging_log_prefix, "<< Badly formatted CRC message from %s.", peer->name); 
                 ESP_LOG_BUFFER_HEX(lora_messaging_log_prefix, (uint8_t *)buf, message_length); 
-                peer->lora_stats.receive_failures++;
+                SDP_STATS_INC(peer, lora, receive_failures);
                 return ESP_FAIL;
            }
             
@@ -154,35 +164,54 @@ int lora_send_message(sdp_peer *peer, char *data, int data_length, bool just_che
     if (!just_checking) {
         ESP_LOGE(lora_messaging_log_prefix, "<< Timed out waiting for a receipt from %s.", peer->name);
     }
-    peer->lora_stats.receive_failures++; 
+    SDP_STATS_INC(peer, lora, receive_failures); 
 	return ESP_FAIL;
 
 }
 
 void lora_do_on_work_cb(lora_queue_item_t *work_item) {
-    ESP_LOGI(lora_messaging_log_prefix, ">> In LoRa work callback.");
+    SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> In LoRa work callback.");
     // Listen first
     lora_do_on_poll_cb(lora_get_queue_context());
     int retval = ESP_FAIL;
     int send_retries = 0;
     do
     {
-        int retval = lora_send_message(work_item->peer, work_item->data, work_item->data_length, work_item->just_checking);
+        retval = lora_send_message(work_item->peer, work_item->data, work_item->data_length, work_item->just_checking);
+        if (retval == SDP_ERR_MESSAGE_TOO_LONG)
+        {
+            // It will not get any shorter
+            break;
+        }
         if ((retval != ESP_OK) && (send_retries < CONFIG_I2C_RESEND_COUNT))
         {
             // Call the poll function as it was called by the queue to listen for response before retrying
             // TODO: There is no special reason why poll needs to have been called by the queue. 
             // We should probably remove queue context.
-            ESP_LOGI(lora_messaging_log_prefix, ">> Retry %i failed.", send_retries + 1);
+            SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> Retry %i failed.", send_retries + 1);
             lora_do_on_poll_cb(lora_get_queue_context());
         }
         
         send_retries++;
 
     } while ((retval != ESP_OK) && (send_retries < CONFIG_I2C_RESEND_COUNT));
-    // We have failed retrying, if we are supposed to, try resending (and rescoring)
-    if ((retval != ESP_OK) && (!work_item->just_checking)) {
-        sdp_send_message(work_item->peer, work_item->data, work_item->data_length);
+    if (!work_item->just_checking) {
+        SDP_TRACE(retval == ESP_OK ? SDP_TRACE_TX : SDP_TRACE_TX_FAIL, work_item->peer, SDP_MT_LoRa, 
+                  work_item->data_length, sdp_frame_crc((uint8_t *)work_item->data));
+    }
+    sdp_tx_item_t *tx_item = work_item->tx_item;
+    if (tx_item != NULL) {
+        // Sent using sdp_send_async(), which handles resending (and rescoring).
+        // The data belongs to the transmit item, which may reuse the queue item, so it is freed first.
+        lora_free_queue_item(work_item);
+        sdp_send_complete(tx_item, retval == ESP_OK ? SDP_MT_LoRa : -SDP_MT_LoRa);
+    } else {
+        // We have failed retrying, if we are supposed to, try resending (and rescoring)
+        if ((retval != ESP_OK) && (!work_item->just_checking)) {
+            sdp_send_message(work_item->peer, work_item->data, work_item->data_length);
+        }
+        // The data is stored with the item
+        lora_free_queue_item(work_item);
     }
 
     #ifdef CONFIG_LORA_SX127X   
@@ -244,11 +273,11 @@ void lora_do_on_poll_cb(queue_context *q_context) {
             
         }
         
-        ESP_LOGI(lora_messaging_log_prefix, "<< In LoRa POLL callback;lora_received %i bytes.", message_length);
-        ESP_LOGI(lora_messaging_log_prefix, "<< Received data (including all) preamble): ");
-        ESP_LOG_BUFFER_HEXDUMP(lora_messaging_log_prefix, &buf,message_length, ESP_LOG_INFO);  
-        ESP_LOGI(lora_messaging_log_prefix, "<< sdp_host.base_mac_address: ");
-        ESP_LOG_BUFFER_HEX(lora_messaging_log_prefix, &sdp_host.base_mac_address,SDP_MAC_ADDR_LEN);
+        SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< In LoRa POLL callback;lora_received %i bytes.", message_length);
+        SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< Received data (including all) preamble): ");
+        SDP_FRAME_HEXDUMP(lora_messaging_log_prefix, &buf, message_length);
+        SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< sdp_host.base_mac_address: ");
+        SDP_FRAME_HEX(lora_messaging_log_prefix, &sdp_host.base_mac_address, SDP_MAC_ADDR_LEN);
 
         // TODO: Do some kind of better non-hardcoded length check. Perhaps it just has to be longer then the mac address?
         if (message_length > SDP_PREAMBLE_LENGTH + 1) {
@@ -265,37 +294,42 @@ void lora_do_on_poll_cb(queue_context *q_context) {
                     data_start = (SDP_MAC_ADDR_LEN *2);
                     relation_id = calc_relation_id(&buf, &buf[6]);
                 } else {
-                    ESP_LOGI(lora_messaging_log_prefix, "<< Matching mac but too short. Too short %d byte,:[%.*s], RSSI %i", 
+                    SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< Matching mac but too short. Too short %d byte,:[%.*s], RSSI %i", 
                         message_length, message_length, (char *)&buf , get_rssi());
                     goto finish;
                 }                
             } else {
                 memcpy(&relation_id, buf, 4);
-                ESP_LOGI(lora_messaging_log_prefix, "Relation id in first bytes %"PRIu32"", relation_id);
+                SDP_FRAME_LOGI(lora_messaging_log_prefix, "Relation id in first bytes %"PRIu32"", relation_id);
                 src_mac_addr = relation_id_to_mac_address(relation_id);
                 if (src_mac_addr == NULL) {
-                    ESP_LOGI(lora_messaging_log_prefix, "<< %d byte packet to someone else received:[%.*s], RSSI %i", 
+                    SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< %d byte packet to someone else received:[%.*s], RSSI %i", 
                         message_length, message_length, (char *)&buf , get_rssi());
                     goto finish;
                 }
                 data_start = sizeof(uint32_t);
             }
 
-            ESP_LOGI(lora_messaging_log_prefix, "<< %d byte packet received:[%.*s], RSSI %i", 
+            SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< %d byte packet received:[%.*s], RSSI %i", 
             message_length, message_length, (char *)&buf , get_rssi());
+            sdp_mesh_read_begin();
             sdp_peer *peer = sdp_mesh_find_peer_by_base_mac_address(src_mac_addr);
+            /* The response takes airtime, so the peer is referenced rather than kept in the read section */
+            sdp_mesh_peer_ref(peer);
+            sdp_mesh_read_end();
             
             uint8_t *rcv_data = &buf[data_start];
-            uint32_t crc32_in = 0;
-            memcpy(&crc32_in, rcv_data, 4);
-            uint32_t crc_calc = crc32_be(0, rcv_data + 4, message_length - data_start - 4);
+            uint32_t crc32_in = sdp_frame_crc(rcv_data);
+            uint32_t crc_calc = sdp_frame_crc_calc(rcv_data, message_length - data_start);
             uint8_t response[6];
             memcpy(&response, &relation_id, 4);
             int ret = ESP_OK;
+            bool refused = false;
             if (crc32_in != crc_calc)
             {
                 ESP_LOGW(lora_messaging_log_prefix, "<< LoRa - CRC Mismatch crc32_in: %"PRIu32",crc_calc: %"PRIu32" Create response:", 
                     crc32_in, crc_calc);
+                SDP_TRACE(SDP_TRACE_RX_BAD_CRC, peer, SDP_MT_LoRa, message_length - data_start, crc32_in);
                 response[4] = 0x00;
                 response[5] = 0xff;
                 if (peer) {
@@ -306,21 +340,27 @@ void lora_do_on_poll_cb(queue_context *q_context) {
                      * Also, new peers are only added if the CRC is correct, and in that case it is unlikely that errors would just 
                      * concern the adress. Also, the HI message contains the mac_address. 
                      */
-                    peer->lora_stats.receive_failures++;
+                    SDP_STATS_INC(peer, lora, receive_failures);
                     
                 } else {
                     lora_unknown_failures++;
 
                 }
                 ret = ESP_FAIL;
-            }  else {
-                ESP_LOGI(lora_messaging_log_prefix, "<< LoRa - Got %i bytes of data. crc32 : %"PRIu32", create response.", 6, crc_calc);
+            } else if (sdp_frame_refused(rcv_data, message_length - data_start)) {
+                /* The work queue is full, a negative receipt makes the peer resend later */
+                ESP_LOGW(lora_messaging_log_prefix, "<< LoRa - The work queue is full, refusing the message.");
+                response[4] = 0x00;
+                response[5] = 0xff;
+                refused = true;
+            } else {
+                SDP_FRAME_LOGI(lora_messaging_log_prefix, "<< LoRa - Got %i bytes of data. crc32 : %"PRIu32", create response.", 6, crc_calc);
                                 
                 response[4] = 0xff;
                 response[5] = 0x00;   
             }
 
-            ESP_LOG_BUFFER_HEXDUMP(lora_messaging_log_prefix, &response, 6, ESP_LOG_INFO);
+            SDP_FRAME_HEXDUMP(lora_messaging_log_prefix, &response, 6);
             int64_t starttime = esp_timer_get_time();
             
             #ifdef CONFIG_LORA_SX126X
@@ -329,16 +369,22 @@ void lora_do_on_poll_cb(queue_context *q_context) {
             #ifdef CONFIG_LORA_SX127X
             lora_send_packet(&response, 6);            
             #endif
-            ESP_LOGI(lora_messaging_log_prefix, ">> %d byte packet sent...speed %f byte/s", 6, 
+            SDP_FRAME_LOGI(lora_messaging_log_prefix, ">> %d byte packet sent...speed %f byte/s", 6, 
             (float)(6/((float)(esp_timer_get_time()-starttime))*1000000));
             if (!peer) {
                 char *new_name;
                 asprintf(&new_name, "UNKNOWN_%i", lora_unknown_counter++);
                 
+                sdp_mesh_read_begin();
                 peer = sdp_add_init_new_peer(new_name, src_mac_addr, SDP_MT_LoRa);
-                peer->lora_stats.receive_successes++;
+                sdp_mesh_peer_ref(peer);
+                sdp_mesh_read_end();
+                SDP_STATS_INC(peer, lora, receive_successes);
+            }
+            if (!refused) {
+                handle_incoming(peer, buf + data_start, message_length - data_start, SDP_MT_LoRa);    
             }
-            handle_incoming(peer, buf + data_start, message_length - data_start, SDP_MT_LoRa);    
+            sdp_mesh_peer_unref(peer);
   
         }
         
@@ -323,9 +323,23 @@ uint8_t LoRaReceive(uint8_t *pData, uint16_t len)
 
 
 bool LoRaSend(uint8_t *pData, uint8_t len, uint8_t mode)
+{
+	sdp_iovec_t iov = {.base = pData, .length = len};
+	return LoRaSendV(&iov, 1, mode);
+}
+
+/**
+ * Send a packet given as segments, they are written to the FIFO one after the other
+ */
+bool LoRaSendV(const sdp_iovec_t *iov, int iovcnt, uint8_t mode)
 {
 	uint16_t irqStatus;
 	bool rv = false;
+	uint8_t len = 0;
+	for (int i = 0; i < iovcnt; i++)
+	{
+		len += iov[i].length;
+	}
 	
 	if ( txActive == false )
 	{
@@ -337,7 +351,7 @@ bool LoRaSend(uint8_t *pData, uint8_t len, uint8_t mode)
 		//ClearIrqStatus(SX126X_IRQ_TX_DONE | SX126X_IRQ_TIMEOUT);
 		ClearIrqStatus(SX126X_IRQ_ALL);
 		
-		WriteBuffer(pData, len);
+		WriteBufferV(iov, iovcnt);
 		SetTx(500);
 
 		if ( mode & SX126x_TXMODE_SYNC )
@@ -865,6 +879,32 @@ void WriteBuffer(uint8_t *txData, uint8_t txDataLen)
 }
 
 
+void WriteBufferV(const sdp_iovec_t *iov, int iovcnt)
+{
+	// ensure BUSY is low (state meachine ready)
+	WaitForIdle(BUSY_WAIT);
+
+	// start transfer
+	gpio_set_level(SX126x_SPI_SELECT, LOW);
+
+	spi_transfer(SX126X_CMD_WRITE_BUFFER); // 0x0E
+	spi_transfer(0); //offset in tx fifo
+	for( int i = 0; i < iovcnt; i++ )
+	{
+		const uint8_t *txData = iov[i].base;
+		for( uint16_t j = 0; j < iov[i].length; j++ )
+		{ 
+			 spi_transfer( txData[j]);	
+		}
+	}
+
+	// stop transfer
+	gpio_set_level(SX126x_SPI_SELECT, HIGH);
+
+	// wait for BUSY to go low
+	WaitForIdle(BUSY_WAIT);
+}
+
 void WriteRegister(uint16_t reg, uint8_t* data, uint8_t numBytes) {
 	// ensure BUSY is low (state meachine ready)
 	WaitForIdle(BUSY_WAIT);
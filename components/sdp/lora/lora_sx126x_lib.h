@@ -5,6 +5,7 @@
 #ifdef CONFIG_LORA_SX126X
 
 #include "driver/spi_master.h"
+#include "../sdp_def.h"
 
 //return values
 #define ERR_NONE                        0
@@ -376,6 +377,7 @@ int16_t  LoRaBegin(uint32_t frequencyInHz, int8_t txPowerInDbm, float tcxoVoltag
 void     LoRaConfig(uint8_t spreadingFactor, uint8_t bandwidth, uint8_t codingRate, uint16_t preambleLength, uint8_t payloadLen, bool crcOn, bool invertIrq);
 uint8_t  LoRaReceive(uint8_t *pData, uint16_t len);
 bool     LoRaSend(uint8_t *pData, uint8_t len, uint8_t mode);
+bool     LoRaSendV(const sdp_iovec_t *iov, int iovcnt, uint8_t mode);
 void     LoRaDebugPrint(bool enable);
 
 // Private function
@@ -420,6 +422,7 @@ void     Wakeup(void);
 void     WaitForIdle(unsigned long timeout);
 uint8_t  ReadBuffer(uint8_t *rxData,  uint8_t maxLen);
 void     WriteBuffer(uint8_t *txData, uint8_t txDataLen);
+void     WriteBufferV(const sdp_iovec_t *iov, int iovcnt);
 void     WriteRegister(uint16_t reg, uint8_t* data, uint8_t numBytes);
 void     ReadRegister(uint16_t reg, uint8_t* data, uint8_t numBytes);
 void     WriteCommand(uint8_t cmd, uint8_t* data, uint8_t numBytes);
@@ -149,6 +149,46 @@ lora_write_reg_buffer(int reg, uint8_t *val, int len)
    free(out);
 }
 
+/**
+ * Write a packet, given as segments, to the FIFO.
+ * The segments are gathered right after the register address into the SPI transmit buffer, 
+ * which is static as only the LoRa worker sends.
+ * @return The number of bytes written, -1 if they do not fit in the FIFO
+ */
+static int
+lora_write_fifo_v(const sdp_iovec_t *iov, int iovcnt)
+{
+   static uint8_t out[1 + 256] __attribute__((aligned(4)));
+   int len = 0;
+   out[0] = 0x80 | REG_FIFO;
+   for (int i = 0; i < iovcnt; i++) {
+      if (len + iov[i].length > sizeof(out) - 1) {
+         return -1;
+      }
+#if BUFFER_IO
+      memcpy(out + 1 + len, iov[i].base, iov[i].length);
+#else
+      for (int j = 0; j < iov[i].length; j++)
+         lora_write_reg(REG_FIFO, ((const uint8_t *)iov[i].base)[j]);
+#endif
+      len += iov[i].length;
+   }
+#if BUFFER_IO
+   spi_transaction_t t = {
+      .flags = 0,
+      .length = 8 * (len + 1),
+      .tx_buffer = out,
+      .rx_buffer = NULL
+   };
+#if SPI_TRANSMIT
+   spi_device_transmit(__spi, &t);
+#else
+   spi_device_polling_transmit(__spi, &t);
+#endif
+#endif
+   return len;
+}
+
 /**
  * Read the current value of a register.
  * @param reg Register index.
@@ -594,6 +634,17 @@ int lora_init_local(void)
  */
 void 
 lora_send_packet(uint8_t *buf, int size)
+{
+   sdp_iovec_t iov = {.base = buf, .length = size};
+   lora_send_packet_v(&iov, 1);
+}
+
+/**
+ * Send a packet given as segments, like a header and a frame.
+ * They are only gathered into the SPI transmit buffer of the FIFO write.
+ */
+void 
+lora_send_packet_v(const sdp_iovec_t *iov, int iovcnt)
 {
    /*
     * Transfer data to radio.
@@ -601,12 +652,10 @@ lora_send_packet(uint8_t *buf, int size)
    lora_idle();
    lora_write_reg(REG_FIFO_ADDR_PTR, 0);
 
-#if BUFFER_IO
-   lora_write_reg_buffer(REG_FIFO, buf, size);
-#else
-   for(int i=0; i<size; i++) 
-      lora_write_reg(REG_FIFO, *buf++);
-#endif
+   int size = lora_write_fifo_v(iov, iovcnt);
+   if (size < 0) {
+      return;
+   }
    
    lora_write_reg(REG_PAYLOAD_LENGTH, size);
    
@@ -5,6 +5,7 @@
 #ifdef CONFIG_LORA_SX127X
 
 #include <stdint.h>
+#include "../sdp_def.h"
 
 void lora_reset(void);
 void lora_explicit_header_mode(void);
@@ -30,6 +31,7 @@ void lora_enable_crc(void);
 void lora_disable_crc(void);
 int lora_init_local(void);
 void lora_send_packet(uint8_t *buf, int size);
+void lora_send_packet_v(const sdp_iovec_t *iov, int iovcnt);
 int lora_receive_packet(uint8_t *buf, int size);
 int lora_received(void);
 int lora_packet_rssi(void);
@@ -14,6 +14,9 @@
 #include <esp_heap_caps.h>
 #include <esp_log.h>
 
+#include "sdp_pool.h"
+#include "sdp_task.h"
+
 
 
 
@@ -136,6 +139,10 @@ void monitor_memory()
     sample_count++;
     ESP_LOG_LEVEL(level, memory_monitor_log_prefix, "Monitor reporting on available resources. Memory:\nCurrently: %i, avg mem: %.0f bytes. \nDeltas - Avg vs 1st: %.0f, Last vs now: %i. \nExtremes - Least: %i, Most(before init): %i. ",
                   curr_mem_avail, avg_mem_avail, avg_mem_avail - first_average_memory_available, delta_mem_avail, least_memory_available, most_memory_available);
+    /* Pool exhaustion means that the heap is being used on the receive path again */
+    sdp_pool_on_monitor();
+    /* The peak stack use of the SDP tasks, to tune their sizes */
+    sdp_task_on_monitor();
 }
 
 void memory_monitor_init(char *_log_prefix) {
@@ -11,7 +11,33 @@
 #include "monitor_queue.h"
 
 #include "sdp_worker.h"
+#include "sdp_send.h"
+#include "sdp_trace.h"
+#include "sdp_fragment.h"
+#include "sdp_work_queue.h"
+
+#ifdef CONFIG_SDP_LOAD_LORA
+#include "lora/lora_worker.h"
+#endif
+#ifdef CONFIG_SDP_LOAD_I2C
+#include "i2c/i2c_worker.h"
+#endif
+#ifdef CONFIG_SDP_LOAD_UMTS
+#include "gsm/gsm_worker.h"
+#endif
 
 void monitor_queue() {
     sdp_worker_on_monitor();
+    sdp_send_on_monitor();
+    sdp_trace_on_monitor();
+    sdp_fragment_on_monitor();
+#ifdef CONFIG_SDP_LOAD_LORA
+    work_queue_on_monitor(lora_get_queue_context());
+#endif
+#ifdef CONFIG_SDP_LOAD_I2C
+    work_queue_on_monitor(i2c_get_queue_context());
+#endif
+#ifdef CONFIG_SDP_LOAD_UMTS
+    work_queue_on_monitor(gsm_get_queue_context());
+#endif
 }
\ No newline at end of file
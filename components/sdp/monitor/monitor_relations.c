@@ -16,6 +16,7 @@
 #include <freertos/FreeRTOS.h>
 #include <freertos/queue.h>
 
+#include <string.h>
 #include <esp_log.h>
 #include <esp_timer.h>
 
@@ -50,7 +51,7 @@ void check_peer(sdp_peer *peer, void *qos_message){
     #ifdef CONFIG_SDP_LOAD_ESP_NOW
     if (peer->supported_media_types & SDP_MT_ESPNOW) {
         if((peer->espnow_stats.last_score < UNACCEPTABLE_SCORE) || 
-        (peer->espnow_stats.last_score_time < (curr_time - (ESPNOW_HEARTBEAT_MS/portTICK_PERIOD_MS)))) {
+        ((uint64_t)peer->espnow_stats.last_score_time * 1000 < (curr_time - (ESPNOW_HEARTBEAT_MS/portTICK_PERIOD_MS)))) {
                 
             sdp_send_message_media_type(peer, qos_message, SDP_PREAMBLE_LENGTH + 2, SDP_MT_ESPNOW, false);
         }
@@ -59,7 +60,7 @@ void check_peer(sdp_peer *peer, void *qos_message){
     #ifdef CONFIG_SDP_LOAD_LoRa
     if (peer->supported_media_types & SDP_MT_LoRa) {
         if((peer->i2c_stats.last_score < UNACCEPTABLE_SCORE) || 
-        (peer->i2c_stats.last_score_time < (curr_time - (LORA_HEARTBEAT_MS/portTICK_PERIOD_MS)))) {
+        ((uint64_t)peer->i2c_stats.last_score_time * 1000 < (curr_time - (LORA_HEARTBEAT_MS/portTICK_PERIOD_MS)))) {
                 
             sdp_send_message_media_type(peer, qos_message, SDP_PREAMBLE_LENGTH + 2, SDP_MT_LoRa, false);
         }
@@ -68,7 +69,7 @@ void check_peer(sdp_peer *peer, void *qos_message){
     #ifdef CONFIG_SDP_LOAD_I2C
     if (peer->supported_media_types & SDP_MT_I2C) {
         if((peer->i2c_stats.last_score < UNACCEPTABLE_SCORE) || 
-        (peer->i2c_stats.last_score_time < (curr_time - (I2C_HEARTBEAT_MS/portTICK_PERIOD_MS)))) {
+        ((uint64_t)peer->i2c_stats.last_score_time * 1000 < (curr_time - (I2C_HEARTBEAT_MS/portTICK_PERIOD_MS)))) {
                 
             sdp_send_message_media_type(peer, qos_message, SDP_PREAMBLE_LENGTH + 2, SDP_MT_I2C, false);
         }
@@ -98,15 +99,52 @@ void check_peer(sdp_peer *peer, void *qos_message){
 
 void monitor_relations(){
     uint16_t empty_payload = 0x00f0;
-    uint8_t *qos_message = sdp_add_preamble(QOS, 0, &empty_payload, 2);
+    uint8_t qos_message[SDP_PREAMBLE_LENGTH + sizeof(empty_payload)];
+    memcpy(qos_message + SDP_PREAMBLE_LENGTH, &empty_payload, sizeof(empty_payload));
+    sdp_write_preamble(qos_message, QOS, 0, sizeof(empty_payload));
     struct sdp_peer *peer;
     ESP_LOGI("MONITOR", "in monitor_relations()");
-
+    sdp_mesh_on_monitor();
+    sdp_relations_on_monitor();
+
+    /* check_peer() may send, so the peers are referenced in the read section and checked after it */
+    struct sdp_peer **peers = malloc(sizeof(struct sdp_peer *) * CONFIG_SDP_PEER_REGISTRY_SIZE);
+    if (peers == NULL) {
+        ESP_LOGE("MONITOR", "Out of memory checking the peers.");
+        return;
+    }
+    int peer_count = 0;
+    sdp_mesh_read_begin();
     SLIST_FOREACH(peer, get_peer_list(), next)
     {
+        if (peer_count == CONFIG_SDP_PEER_REGISTRY_SIZE) {
+            break;
+        }
+        sdp_mesh_peer_ref(peer);
+        peers[peer_count++] = peer;
+    }
+    sdp_mesh_read_end();
+
+    for (int i = 0; i < peer_count; i++)
+    {
+        peer = peers[i];
         ESP_LOGI("MONITOR", " Checking peer: %s", peer->name);
+        if (peer->expired_count > 0)
+        {
+            ESP_LOGW("MONITOR", " Peer %s has had %"PRIu32" work items expire, as it or we went to sleep.", peer->name, peer->expired_count);
+        }
+        #ifdef CONFIG_SDP_LOAD_ESP_NOW
+        sdp_link_log("MONITOR", "ESP-NOW", &peer->espnow_stats.link);
+        #endif
+        #ifdef CONFIG_SDP_LOAD_LORA
+        sdp_link_log("MONITOR", "LoRa", &peer->lora_stats.link);
+        #endif
+        #ifdef CONFIG_SDP_LOAD_I2C
+        sdp_link_log("MONITOR", "I2C", &peer->i2c_stats.link);
+        #endif
         check_peer(peer, qos_message);
-           
+        sdp_mesh_peer_unref(peer);
     }
+    free(peers);
 
 }
@@ -20,6 +20,9 @@
 
 #include <sleep/sleep.h>
 
+/* Upper bound of a NEXT-message: "NEXT", a 64-bit and a 32-bit integer, and separators */
+#define NEXT_MESSAGE_MAX_LENGTH 40
+
 char *orchestration_log_prefix;
 before_sleep *on_before_sleep_cb;
 
@@ -70,29 +73,27 @@ int sdp_orchestration_send_next_message(work_queue_item_t *queue_item)
 
     int retval;
 
-    uint8_t *next_msg = NULL;
+    uint8_t next_msg[SDP_PREAMBLE_LENGTH + NEXT_MESSAGE_MAX_LENGTH];
 
     ESP_LOGI(orchestration_log_prefix, "BEFORE NEXT get_time_since_start() = %"PRIu64, get_time_since_start());
     /* TODO: Handle the 64bit loop-around after 79 days ? */
     uint64_t delta_next = next_time - get_time_since_start();
     ESP_LOGI(orchestration_log_prefix, "BEFORE NEXT delta_next = %"PRIu64, delta_next);
 
-    /*  Cannot send uint64_t into va_args in add_to_message */
-    char * c_delta_next;
-    asprintf(&c_delta_next, "%"PRIu64, delta_next);
-
-    int next_length = add_to_message(&next_msg, "NEXT|%s|%i", c_delta_next, SDP_AWAKE_TIME_uS);
+    sdp_message_builder builder;
+    sdp_builder_init(&builder, next_msg, sizeof(next_msg), true);
+    sdp_builder_add(&builder, "NEXT|%"PRIu64"|%i", delta_next, SDP_AWAKE_TIME_uS);
+    int next_length = sdp_builder_finish(&builder, ORCHESTRATION, queue_item->conversation_id);
 
     if (next_length > 0)
     {
-        retval = sdp_reply(*queue_item, ORCHESTRATION, next_msg, next_length);
+        retval = sdp_send_message(queue_item->peer, next_msg, next_length);
     }
     else
     {
         // Returning the negative of the return value as that denotes an error.
         retval = -next_length;
     }
-    free(next_msg);
     return retval;
 }
 
@@ -117,6 +118,70 @@ void sleep_until_peer_available(sdp_peer *peer, uint64_t margin_us)
     }
 }
 
+/**
+ * @brief When the current availability window of a peer ends, in microseconds from first boot
+ * It is derived from its NEXT message, as the windows repeat every awake and sleep period.
+ * @return int64_t The end of the window, in the past if the peer is asleep, 0 if unknown.
+ */
+static int64_t peer_window_end(sdp_peer *peer, uint64_t now)
+{
+    if (peer == NULL || peer->next_availability == 0)
+    {
+        return 0;
+    }
+    if (now < peer->next_availability)
+    {
+        /* The NEXT message was sent during the window before the announced one */
+        return (int64_t)peer->next_availability - (int64_t)(SDP_SLEEP_TIME_uS);
+    }
+    uint64_t period = (uint64_t)(SDP_AWAKE_TIME_uS) + (uint64_t)(SDP_SLEEP_TIME_uS);
+    uint64_t window_start = peer->next_availability + ((now - peer->next_availability) / period) * period;
+    return (int64_t)(window_start + (uint64_t)(SDP_AWAKE_TIME_uS));
+}
+
+/**
+ * @brief The deadline of frames to a peer, and of its requests that are to be answered: the end of the peer's availability window,
+ * or when we go to sleep ourselves, if that is earlier, less a margin to get it done.
+ * @param peer The peer, or NULL for just our own awake time
+ * @return int64_t The deadline as an esp_timer time, 0 if there is none
+ */
+int64_t sdp_orchestration_deadline(sdp_peer *peer)
+{
+#if CONFIG_SDP_WORK_DEADLINES
+    int64_t now = esp_timer_get_time();
+    int64_t deadline = 0;
+    /* Only if the orchestrator is timing our sleep */
+    if (wait_for_sleep_started > 0)
+    {
+        deadline = wait_for_sleep_started + wait_time + requested_time;
+        if (deadline > SDP_AWAKE_TIMEBOX_uS)
+        {
+            deadline = SDP_AWAKE_TIMEBOX_uS;
+        }
+    }
+    uint64_t since_start = get_time_since_start();
+    int64_t window_end = peer_window_end(peer, since_start);
+    if (window_end > 0)
+    {
+        /* Convert from time since first boot */
+        int64_t peer_deadline = now + (window_end - (int64_t)since_start);
+        if ((deadline == 0) || (peer_deadline < deadline))
+        {
+            deadline = peer_deadline;
+        }
+    }
+    if (deadline == 0)
+    {
+        return 0;
+    }
+    deadline -= (int64_t)CONFIG_SDP_WORK_DEADLINE_MARGIN_MS * 1000;
+    /* 0 means no deadline, an already passed one must still be set */
+    return deadline > 0 ? deadline : 1;
+#else
+    return 0;
+#endif
+}
+
 /**
  * @brief Ask to wait with sleep for a specific amount of time from now 
  * @param ask Returns false if request is denied
@@ -17,6 +17,8 @@ void sdp_orchestration_init(char * _log_prefix, before_sleep _on_before_sleep_cb
 
 void sleep_until_peer_available(sdp_peer *peer, uint64_t margin_us);
 
+int64_t sdp_orchestration_deadline(sdp_peer *peer);
+
 //  Availability When/Next messaging
 
 int sdp_orchestration_send_when_message(sdp_peer *peer);
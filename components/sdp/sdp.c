@@ -28,6 +28,13 @@
 #include "sdp_worker.h"
 #include "sdp_messaging.h"
 #include "sdp_helpers.h"
+#include "sdp_pool.h"
+#include "sdp_send.h"
+#include "sdp_trace.h"
+#include "sdp_fragment.h"
+#include "sdp_task.h"
+#include "sdp_relations.h"
+#include "sdp_snapshot.h"
 
 #if ESP_IDF_VERSION < ESP_IDF_VERSION_VAL(5, 0, 0)
 #error "Currenctly, SDP requires at least ESP-IDF version 5."
@@ -124,7 +131,8 @@ int sdp_init(work_callback *work_cb, work_callback *priority_cb, before_sleep *b
     sdp_init_monitor(sdp_log_prefix);
     
     // Then initialize sleep functionality  
-    if (sleep_init(sdp_log_prefix))
+    bool woke_from_sleep = sleep_init(sdp_log_prefix);
+    if (woke_from_sleep)
     {
         ESP_LOGI(sdp_log_prefix, "Needs to consider that we returned from sleep.");
     }
@@ -151,9 +159,17 @@ int sdp_init(work_callback *work_cb, work_callback *priority_cb, before_sleep *b
         ret = nvs_flash_init();
     }
     ESP_ERROR_CHECK(ret);
+    /* The relations that do not fit in RTC memory are kept in NVS */
+    sdp_relations_init(_log_prefix);
     
+    sdp_pool_init(_log_prefix);
+    sdp_trace_init(_log_prefix);
+    sdp_task_init(_log_prefix);
     sdp_init_worker(work_cb, _log_prefix);
     sdp_init_messaging(_log_prefix, priority_cb);
+    sdp_send_init(_log_prefix);
+    sdp_fragment_init(_log_prefix);
+    sdp_snapshot_init(_log_prefix);
     // Create the default event loop (almost all technologies use it    )
     ESP_ERROR_CHECK(esp_event_loop_create_default());
 
@@ -175,9 +191,16 @@ int sdp_init(work_callback *work_cb, work_callback *priority_cb, before_sleep *b
 #ifdef CONFIG_SDP_LOAD_LORA
     lora_init(_log_prefix);
 #endif
+    /* The medias are initialized, so the peers from before sleeping can be added to them */
+    if (woke_from_sleep)
+    {
+        sdp_snapshot_restore();
+    }
     char mt_log[1000] = "";
     log_media_types(get_host_supported_media_types(), &mt_log);
     ESP_LOGI(_log_prefix, "Supported media types:%s", mt_log);
+    /* All SDP tasks are started now, to tune the stack sizes, see the monitor for later peaks */
+    sdp_task_report();
     ESP_LOGI(_log_prefix, "SDP initiated!");
     return ESP_OK;
 }
@@ -0,0 +1,105 @@
+/**
+ * @file sdp_crc.c
+ * @author Nicklas Borjesson
+ * @brief The CRC32 used in SDP frames
+ * This is the big endian CRC32 (polynomial 0x04C11DB7, inverted in and out) of the ESP32 ROM.
+ * On target, the ROM routine is used. On the Linux host target, there is no ROM, so a
+ * slicing-by-8 table implementation that gives the same results is used instead.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_crc.h"
+
+#include <string.h>
+#include "sdp_def.h"
+
+#ifdef CONFIG_IDF_TARGET_LINUX
+
+#include <stdbool.h>
+
+/* crc_table[0] is the ordinary byte-wise table, crc_table[n] advances a byte n bytes further */
+static uint32_t crc_table[8][256];
+static bool crc_table_ready = false;
+
+/* The tables are always the same, so racing initializations write the same values */
+static void init_crc_table()
+{
+    for (int n = 0; n < 256; n++)
+    {
+        uint32_t crc = (uint32_t)n << 24;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+        }
+        crc_table[0][n] = crc;
+    }
+    for (int n = 0; n < 256; n++)
+    {
+        for (int k = 1; k < 8; k++)
+        {
+            crc_table[k][n] = (crc_table[k - 1][n] << 8) ^ crc_table[0][crc_table[k - 1][n] >> 24];
+        }
+    }
+    crc_table_ready = true;
+}
+
+uint32_t sdp_crc32(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *buf = data;
+    if (!crc_table_ready)
+    {
+        init_crc_table();
+    }
+    crc = ~crc;
+    /* Eight bytes at a time, the first four are folded into the crc */
+    while (length >= 8)
+    {
+        crc ^= ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+        crc = crc_table[7][crc >> 24] ^ crc_table[6][(crc >> 16) & 0xff] ^
+              crc_table[5][(crc >> 8) & 0xff] ^ crc_table[4][crc & 0xff] ^
+              crc_table[3][buf[4]] ^ crc_table[2][buf[5]] ^
+              crc_table[1][buf[6]] ^ crc_table[0][buf[7]];
+        buf += 8;
+        length -= 8;
+    }
+    while (length--)
+    {
+        crc = crc_table[0][(crc >> 24) ^ *buf++] ^ (crc << 8);
+    }
+    return ~crc;
+}
+
+#else
+
+#include <esp32/rom/crc.h>
+
+uint32_t sdp_crc32(uint32_t crc, const void *data, size_t length)
+{
+    return crc32_be(crc, data, length);
+}
+
+#endif
+
+/**
+ * @brief Get the CRC that is already in the preamble of a frame, nothing is computed
+ */
+uint32_t sdp_frame_crc(const uint8_t *frame)
+{
+    uint32_t crc;
+    memcpy(&crc, frame, SDP_CRC_LENGTH);
+    return crc;
+}
+
+/**
+ * @brief Compute the CRC of a received frame, to compare with sdp_frame_crc()
+ *
+ * @param frame The frame, beginning with the preamble
+ * @param frame_length The length of the frame, at least SDP_CRC_LENGTH
+ * @return uint32_t The CRC of everything after the CRC field
+ */
+uint32_t sdp_frame_crc_calc(const uint8_t *frame, int frame_length)
+{
+    return sdp_crc32(0, frame + SDP_CRC_LENGTH, frame_length - SDP_CRC_LENGTH);
+}
@@ -0,0 +1,22 @@
+/**
+ * @file sdp_crc.h
+ * @author Nicklas Borjesson
+ * @brief The CRC32 used in SDP frames
+ * The CRC of a frame is computed once, when its preamble is written or when it is received,
+ * and is then carried with the frame instead of being recomputed.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_CRC_H_
+#define _SDP_CRC_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+uint32_t sdp_crc32(uint32_t crc, const void *data, size_t length);
+uint32_t sdp_frame_crc(const uint8_t *frame);
+uint32_t sdp_frame_crc_calc(const uint8_t *frame, int frame_length);
+
+#endif
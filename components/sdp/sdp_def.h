@@ -91,7 +91,11 @@ typedef enum e_sdp_error_codes
     /* Message to long to comply */
     SDP_ERR_MESSAGE_TOO_LONG = 16,
     /* This feature is not supported */
-    SDP_ERR_NOT_SUPPORTED = 17    
+    SDP_ERR_NOT_SUPPORTED = 17,
+    /* The work queue is full, the item was rejected */
+    SDP_ERR_QUEUE_FULL = 18,
+    /* The item was not handled before its deadline */
+    SDP_ERR_EXPIRED = 19
 } e_sdp_error_codes;
 
 /* Common warning codes */
@@ -113,7 +117,7 @@ typedef enum e_sdp_warning_codes
  * Like requests, they are put on the work queue for consumption by the worker.
  *
  * PRIORITY: A priority message.
- * These are not put on the queue, but handled immidiately.
+ * These are not put on the normal queue, but on a separate priority queue, whose worker preempts normal work.
  * Examples may be message about an urgent problem, an emergency message (alarm) or an explicit instruction.
  * Immidiately, the peer responds with the CRC32 of the message, to prove to the reporter
  * that the message has been received before it invokes the callback.
@@ -121,6 +125,9 @@ typedef enum e_sdp_warning_codes
  * Emergency messages will be retried if the CRC32 doesn't match.
  *
  * ORCHESTRATION: This is about handling peers and controlling the mesh.
+ *
+ * FRAGMENT: A part of a frame that was too long for the media, see sdp_fragment.c.
+ * FRAGMENT_STATUS: Tells the sender of a fragmented frame which fragments that has been received.
  * TODO: Move this into readme.md
  *
  * > 1000:
@@ -135,9 +142,25 @@ typedef enum e_work_type
     DATA = 3,
     PRIORITY = 4,
     ORCHESTRATION = 5,
-    QOS = 6 
+    QOS = 6,
+    FRAGMENT = 7,
+    FRAGMENT_STATUS = 8
 } e_work_type;
 
+/* The number of work types */
+#define SDP_WORK_TYPE_COUNT 9
+
+/**
+ * @brief When a work item was queued and when a worker took it, maintained by the work queue
+ */
+typedef struct work_stamp
+{
+    int64_t queued_at;
+    int64_t dequeued_at;
+    /* If set, the item is not worth handling after this time (esp_timer), see sdp_orchestration_deadline() */
+    int64_t deadline;
+} work_stamp_t;
+
 /**
  * @brief Supported media types
  * These are the media types, "ALL" is used as a way to broadcast over all types
@@ -203,8 +226,46 @@ typedef uint8_t sdp_mac_address[SDP_MAC_ADDR_LEN];
 /* A peer name in SDP */
 typedef char sdp_peer_name[CONFIG_SDP_PEER_NAME_LEN];
 
+/**
+ * @brief A segment of an outgoing frame
+ * Frames are passed down to the media as lists of segments (like headers and payload), 
+ * and are only gathered into one buffer where the media needs that.
+ */
+typedef struct sdp_iovec
+{
+    /* The segment data */
+    const void *base;
+    /* The length of the segment, fragmented frames may be longer than 64 KiB */
+    uint32_t length;
+} sdp_iovec_t;
+
+/* The maximum number of segments in a frame */
+#define SDP_IOVEC_MAX 4
 
-#define FAILURE_RATE_HISTORY_LENGTH 4
+
+/**
+ * @brief The estimated quality of a link to a peer over a media, see sdp_link.h
+ * Fed by the delivery times of frames and by the outcomes of sends and receives.
+ */
+typedef struct sdp_link_estimate
+{
+    /* Moving averages of the length (bytes) and delivery time (us) of frames, of the squared length and 
+    of length * time. Delivery time as a linear function of length is fitted to them. */
+    float mean_length;
+    float mean_time;
+    float mean_length_sq;
+    float mean_length_time;
+    /* Smoothed round-trip time and its variation from the fitted delivery time of the length, us */
+    uint32_t srtt;
+    uint32_t rttvar;
+    /* When the frame awaiting an acknowledgement was sent (us, wraps) and its length, 0 if none */
+    uint32_t send_time;
+    uint16_t send_length;
+    /* Moving average of losses, 0-65535 meaning 0-1 */
+    uint16_t loss_rate;
+    /* Number of delivery times, stops at 255 */
+    uint8_t samples;
+} sdp_link_estimate;
 
 /**
  * @brief Media 
@@ -213,52 +274,62 @@ typedef char sdp_peer_name[CONFIG_SDP_PEER_NAME_LEN];
  */
 struct sdp_peer_media_stats
 {
-
-    /* Last time peer was scored TODO: Unclear if this is used*/
-    uint64_t last_score_time;
+    /* Supported speed bit/s */
+    uint32_t theoretical_speed;
     /* Last score */
     float last_score;
-    /* How many times score has been calculated since reset */
-    float score_count;  
-    // TODO: We really don't need this to be more than bytes. 0-255 is way enough detail.
-    /* Length of the history */
-    float failure_rate_history[FAILURE_RATE_HISTORY_LENGTH];
+    /* Last time peer was scored, in milliseconds since boot */
+    uint32_t last_score_time;
 
-    /* Number of crc mismatches from the peer */
-    uint32_t crc_mismatches;
-        
-    /* Supported speed bit/s */
-    uint32_t theoretical_speed;
-    /* Actual speed bit/s. 
-    NOTE: Always lower than theoretical, and with small payloads; *much* lower */
-    uint32_t actual_speed;
+    /* The estimated round-trip time, goodput and loss. NOTE: Goodput is always lower than the theoretical speed, 
+    and with small payloads; *much* lower */
+    sdp_link_estimate link;
+
+    /* The counters below are reset every SDP_STATS_WINDOW outcomes, and saturate rather than wrap, see SDP_STATS_INC() */
 
     /* Number of times we have failed sending to a peer since last check */
-    uint32_t send_failures;
+    uint16_t send_failures;
     /* Number of times we have failed receiving data from a peer since last check */
-    uint32_t receive_failures;    
+    uint16_t receive_failures;    
     /* Number of times we have succeeded sending to a peer since last check */
-    uint32_t send_successes;
+    uint16_t send_successes;
     /* Number of times we have succeeed eceiving data from a peer since last check */
-    uint32_t receive_successes;    
-    
-
+    uint16_t receive_successes;    
+    /* Number of crc mismatches from the peer */
+    uint16_t crc_mismatches;
 };
 
+/* The number of send and receive outcomes after which the counters start over and medias are selected anew */
+#define SDP_STATS_WINDOW 16
 
+/* Media selections are cached per size class of the data, 16 bytes or less, 32 or less, .., more than 1024 */
+#define SDP_MEDIA_SIZE_CLASSES 8
 
-/* This is the maximum number of peers */
-/* NOTE: A list of relations, it relations+mac_addresses (4 + 6 * SDP_MAX_PEERS) is stored
-* in RTC memory, so 32 peers mean 320 bytes of the 8K RTC memory
-*/
-#define SDP_MAX_PEERS 32
+/* Until a media has SDP_MEDIA_PROBE_SAMPLES delivery times, every SDP_MEDIA_PROBE_INTERVAL:th selection 
+sends over it instead of over the best media, to measure its link, see select_media() */
+#define SDP_MEDIA_PROBE_INTERVAL 4
+#define SDP_MEDIA_PROBE_SAMPLES 16
 
-/* A peer */
+/**
+ * @brief A peer
+ * The fields used for every frame come first, and the name and the media statistics, only used when
+ * adding peers and scoring medias, last. The lookup keys are also kept in the peer registry.
+ */
 typedef struct sdp_peer
 {
-    /* The name of the peer*/
-    sdp_peer_name name;
-    
+    /* The unique handle of the peer*/
+    uint16_t peer_handle;    
+    /* Eight bits of the media types*/
+    sdp_media_types supported_media_types;
+    #if CONFIG_SDP_LOAD_I2C
+    uint8_t i2c_address;
+    #endif
+    /* The peer state, if unknown, it cannot be used in many situations*/
+    e_peer_state state;    
+     /** A generated 32-bit crc32 of the peers and this peers mac addresses
+      * Used by non-addressed and low-bandwith medias (LoRa) to economically resolve peers w
+      */
+    uint32_t relation_id;   
     /**
      * @brief Following is the the 6-byte base MAC adress of the peer.
      * Note that the other MAC-adresses are offset, and in BLE´s case little-endian, for example. More info here:
@@ -266,23 +337,38 @@ typedef struct sdp_peer
      */
     sdp_mac_address base_mac_address;
 
-    /* Eight bits of the media types*/
-    sdp_media_types supported_media_types;
-
     /* Protocol version*/
     uint8_t protocol_version;
     /* Minimum supported protocol version*/
     uint8_t min_protocol_version;
-     /** A generated 32-bit crc32 of the peers and this peers mac addresses
-      * Used by non-addressed and low-bandwith medias (LoRa) to economically resolve peers w
-      */
-    uint32_t relation_id;   
-    /* The unique handle of the peer*/
-    uint16_t peer_handle;    
-    /* The peer state, if unknown, it cannot be used in many situations*/
-    e_peer_state state;    
+    #if CONFIG_SDP_LOAD_ESP_NOW
+    bool espnow_peer_added;
+    #endif
+
+#ifdef CONFIG_SDP_LOAD_BLE
+    /* The connection handle of the BLE connection, NimBLE has its own peer handling.*/
+    int ble_conn_handle;
+#endif
+
+    SLIST_ENTRY(sdp_peer)
+    next;
+    /* References held by queued items and sends, a deleted peer is not freed while there are any */
+    uint32_t ref_count;
+    /* A deleted peer waits in the list of retired peers until it is no longer used, see sdp_mesh.c */
+    struct sdp_peer *retired_next;
+
+    /* The media selected for each size class, SDP_MT_NONE if not selected since the statistics changed */
+    sdp_media_types media_selection[SDP_MEDIA_SIZE_CLASSES];
+    /* Media selections made while a media was being probed, see SDP_MEDIA_PROBE_INTERVAL */
+    uint8_t media_probe_count;
+
     /* Next availability (measured in mikroseconds from first boot)*/
     uint64_t next_availability;
+    /* Items to or from the peer that expired in a queue, as the peer or we were going to sleep */
+    uint32_t expired_count;
+
+    /* The name of the peer*/
+    sdp_peer_name name;
 
     /* Media-specific statistics, used by transmission optimizer */
     #if CONFIG_SDP_LOAD_BLE
@@ -291,7 +377,6 @@ typedef struct sdp_peer
 
     #if CONFIG_SDP_LOAD_ESP_NOW
     struct sdp_peer_media_stats espnow_stats;
-    bool espnow_peer_added;
     #endif
 
     #if CONFIG_SDP_LOAD_LORA
@@ -299,19 +384,13 @@ typedef struct sdp_peer
     #endif
     #if CONFIG_SDP_LOAD_I2C
     struct sdp_peer_media_stats i2c_stats;
-    uint8_t i2c_address;
     #endif
-    
-    SLIST_ENTRY(sdp_peer)
-    next;
-
-#ifdef CONFIG_SDP_LOAD_BLE
-    /* The connection handle of the BLE connection, NimBLE has its own peer handling.*/
-    int ble_conn_handle;
-#endif
 
 } sdp_peer;
 
+/* Messages with up to this many parts keep their part pointers inside the work item */
+#define SDP_INLINE_PART_COUNT 8
+
 /**
  * @brief This is the request queue
  * The queue is served by worker tasks in a thread-safe manner.
@@ -328,16 +407,22 @@ typedef struct work_queue_item
     uint16_t conversation_id;
     /* The data */
     char *raw_data;
-    /* The length of the data in bytes */
-    uint16_t raw_data_length;
+    /* The length of the data in bytes, reassembled frames may be longer than 64 KiB */
+    uint32_t raw_data_length;
     /* The message parts as an array of null-terminated strings */
     char **parts;
     /* The number of message parts */
     int partcount;
+    /* Storage for the parts pointers of short messages, parts points here unless there are more */
+    char *inline_parts[SDP_INLINE_PART_COUNT];
     /* The underlying media type, avoid using this data to stay tech agnostic */
     enum e_media_type media_type;
     /* The peer */
     struct sdp_peer *peer;
+    /* When the frame was received, in microseconds since boot */
+    int64_t received_at;
+    /* When it was queued and taken from the queue */
+    work_stamp_t stamp;
 
     /* Queue reference */
     STAILQ_ENTRY(work_queue_item)
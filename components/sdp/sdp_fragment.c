@@ -0,0 +1,563 @@
+/**
+ * @file sdp_fragment.c
+ * @author Nicklas Borjesson
+ * @brief Fragmentation and reassembly of frames that are too long for a media
+ * A frame that is longer than the MTU of the selected media is sent as a number of FRAGMENT frames,
+ * each with a sdp_fragment_header_t and a chunk of the original frame.
+ * The last fragment sent in each round asks the receiver for a FRAGMENT_STATUS, a bitmap of the
+ * fragments it has. Only the missing fragments are then resent, until SDP_FRAGMENT_ROUNDS rounds in a row
+ * has made no progress.
+ *
+ * The receiver reassembles into one buffer per frame, in a fixed number of slots, and passes the
+ * complete frame to handle_incoming(). Slots that stop receiving fragments are freed after a timeout.
+ * Completed frames keep their slot (but not their buffer) until the timeout, to be able to answer
+ * late status requests. Slots hold a reference to their peer (see sdp_mesh_peer_ref()) while in use.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_fragment.h"
+
+#include <string.h>
+#include <limits.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+#include "sdp_messaging.h"
+#include "sdp_mesh.h"
+#include "sdp_helpers.h"
+#include "sdp_send.h"
+#include "sdp_crc.h"
+
+/* The log prefix for all logging */
+char *fragment_log_prefix = NULL;
+
+/* The states of the slots */
+#define FRAGMENT_SLOT_FREE 0
+#define FRAGMENT_SLOT_RECEIVING 1
+#define FRAGMENT_SLOT_DONE 2
+
+/**
+ * @brief A frame being reassembled
+ */
+typedef struct reassembly_slot
+{
+    uint8_t state;
+    sdp_peer *peer;
+    uint16_t message_id;
+    uint16_t count;
+    uint16_t received_count;
+    uint16_t chunk_size;
+    uint32_t total_length;
+    /* The reassembled frame */
+    uint8_t *buffer;
+    /* The fragments received so far */
+    uint8_t received[SDP_FRAGMENT_BITMAP_SIZE];
+    /* When the slot is freed unless more fragments arrive */
+    int64_t deadline;
+} reassembly_slot;
+
+/**
+ * @brief A fragmented frame being sent, waiting for status from the receiver
+ */
+typedef struct outgoing_slot
+{
+    bool in_use;
+    sdp_peer *peer;
+    uint16_t message_id;
+    /* The fragments the receiver has said it has */
+    uint8_t received[SDP_FRAGMENT_BITMAP_SIZE];
+    /* Given when a status arrives */
+    SemaphoreHandle_t status;
+    StaticSemaphore_t status_buffer;
+} outgoing_slot;
+
+static reassembly_slot reassembly_slots[CONFIG_SDP_FRAGMENT_SLOTS];
+static outgoing_slot outgoing_slots[CONFIG_SDP_FRAGMENT_SLOTS];
+static SemaphoreHandle_t x_fragment_semaphore = NULL;
+static uint16_t next_message_id = 0;
+
+/* Statistics */
+uint32_t fragment_sent_count = 0;
+uint32_t fragment_resent_count = 0;
+uint32_t fragment_reassembled_count = 0;
+uint32_t fragment_timeout_count = 0;
+uint32_t fragment_rejected_count = 0;
+
+#define BITMAP_SET(bitmap, index) ((bitmap)[(index) >> 3] |= (uint8_t)(1 << ((index) & 7)))
+#define BITMAP_TEST(bitmap, index) (((bitmap)[(index) >> 3] >> ((index) & 7)) & 1)
+
+/**
+ * @brief The longest frame a media can carry
+ * Media without a limit (or not supported) returns INT_MAX.
+ */
+int sdp_fragment_mtu(e_media_type media_type)
+{
+    switch (media_type)
+    {
+    case SDP_MT_ESPNOW:
+        /* ESP_NOW_MAX_DATA_LEN */
+        return 250;
+    case SDP_MT_LoRa:
+        /* The SX126x/SX127x payload length is 8 bit, so at most 255 bytes, which may begin with two mac addresses */
+        return 255 - (SDP_MAC_ADDR_LEN * 2);
+    case SDP_MT_I2C:
+        /* The I2C slave buffer is 1000 bytes, including the address byte */
+        return 999;
+    case SDP_MT_BLE:
+#ifdef CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU
+        return CONFIG_BT_NIMBLE_ATT_PREFERRED_MTU - 3;
+#else
+        return 20;
+#endif
+    default:
+        return INT_MAX;
+    }
+}
+
+/**
+ * @brief Free reassembly slots that has timed out, must be called with the semaphore taken
+ */
+static void prune_slots(int64_t now)
+{
+    for (int i = 0; i < CONFIG_SDP_FRAGMENT_SLOTS; i++)
+    {
+        reassembly_slot *slot = &reassembly_slots[i];
+        if ((slot->state != FRAGMENT_SLOT_FREE) && (slot->deadline < now))
+        {
+            if (slot->state == FRAGMENT_SLOT_RECEIVING)
+            {
+                ESP_LOGW(fragment_log_prefix, "<< Gave up reassembling message %hu from %s, got %hu of %hu fragments.",
+                         slot->message_id, slot->peer->name, slot->received_count, slot->count);
+                free(slot->buffer);
+                fragment_timeout_count++;
+            }
+            sdp_mesh_peer_unref(slot->peer);
+            slot->peer = NULL;
+            slot->buffer = NULL;
+            slot->state = FRAGMENT_SLOT_FREE;
+        }
+    }
+}
+
+/**
+ * @brief Find the slot of a frame, or claim a free one. Must be called with the semaphore taken.
+ * If there is no free slot, the completed frame that is closest to timing out gives up its slot.
+ * @return reassembly_slot* The slot, NULL if there is no free slot or no memory for the frame
+ */
+static reassembly_slot *get_slot(sdp_peer *peer, const sdp_fragment_header_t *header)
+{
+    reassembly_slot *free_slot = NULL;
+    for (int i = 0; i < CONFIG_SDP_FRAGMENT_SLOTS; i++)
+    {
+        reassembly_slot *slot = &reassembly_slots[i];
+        if ((slot->state != FRAGMENT_SLOT_FREE) && (slot->peer == peer) && (slot->message_id == header->message_id))
+        {
+            return slot;
+        }
+        if ((slot->state == FRAGMENT_SLOT_FREE) ||
+            ((slot->state == FRAGMENT_SLOT_DONE) && ((free_slot == NULL) ||
+                                                     ((free_slot->state == FRAGMENT_SLOT_DONE) && (slot->deadline < free_slot->deadline)))))
+        {
+            if ((free_slot == NULL) || (free_slot->state == FRAGMENT_SLOT_DONE))
+            {
+                free_slot = slot;
+            }
+        }
+    }
+    if (free_slot == NULL)
+    {
+        return NULL;
+    }
+    uint8_t *buffer = malloc(header->total_length);
+    if (buffer == NULL)
+    {
+        return NULL;
+    }
+    /* A completed frame may give up its slot */
+    sdp_mesh_peer_unref(free_slot->peer);
+    sdp_mesh_peer_ref(peer);
+    free_slot->buffer = buffer;
+    free_slot->state = FRAGMENT_SLOT_RECEIVING;
+    free_slot->peer = peer;
+    free_slot->message_id = header->message_id;
+    free_slot->count = header->count;
+    free_slot->received_count = 0;
+    free_slot->chunk_size = header->chunk_size;
+    free_slot->total_length = header->total_length;
+    memset(free_slot->received, 0, SDP_FRAGMENT_BITMAP_SIZE);
+    return free_slot;
+}
+
+/**
+ * @brief Tell the sender which fragments we have
+ */
+static void send_status(sdp_peer *peer, uint16_t message_id, uint16_t count, const uint8_t *received)
+{
+    uint8_t preamble[SDP_PREAMBLE_LENGTH];
+    uint16_t status_header[2] = {message_id, count};
+    sdp_iovec_t iov[3] = {{.base = preamble, .length = SDP_PREAMBLE_LENGTH},
+                          {.base = status_header, .length = sizeof(status_header)},
+                          {.base = received, .length = (count + 7) / 8}};
+    sdp_write_preamble_v(preamble, FRAGMENT_STATUS, 0, &iov[1], 2);
+    // This is called from the receiving context, so it must neither wait for the radio nor the heap.
+    // sdp_send_ack_v() does neither, a status that can't be queued right away is dropped, as if it was lost.
+    if (sdp_send_ack_v(peer, iov, 3) != SDP_OK)
+    {
+        ESP_LOGD(fragment_log_prefix, ">> Dropped the status of message %hu to %s.", message_id, peer->name);
+    }
+}
+
+/**
+ * @brief Handle an incoming FRAGMENT frame, called by handle_incoming()
+ * When the last fragment has arrived, the reassembled frame is passed to handle_incoming().
+ *
+ * @param peer The peer
+ * @param data The fragment frame, including the preamble
+ * @param data_len The length of the fragment frame
+ * @param media_type The media it arrived on
+ * @return int SDP_OK, or a negative error if the fragment could not be used
+ */
+int sdp_fragment_on_fragment(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type)
+{
+    sdp_fragment_header_t header;
+    if (data_len <= SDP_PREAMBLE_LENGTH + (int)sizeof(header))
+    {
+        return -SDP_ERR_MESSAGE_TOO_SHORT;
+    }
+    memcpy(&header, data + SDP_PREAMBLE_LENGTH, sizeof(header));
+    const uint8_t *chunk = data + SDP_PREAMBLE_LENGTH + sizeof(header);
+    int chunk_length = data_len - SDP_PREAMBLE_LENGTH - sizeof(header);
+    bool status_requested = (header.index & SDP_FRAGMENT_REQUEST_STATUS) != 0;
+    uint16_t index = header.index & ~SDP_FRAGMENT_REQUEST_STATUS;
+    uint32_t offset = (uint32_t)index * header.chunk_size;
+
+    // The fragment must be consistent with itself, and the frame must not be larger than we allow
+    if ((header.count == 0) || (header.count > SDP_FRAGMENT_MAX_COUNT) || (index >= header.count) ||
+        (header.total_length > CONFIG_SDP_FRAGMENT_MAX_LENGTH) || (header.chunk_size == 0) ||
+        ((uint32_t)header.chunk_size * header.count < header.total_length) ||
+        (offset + chunk_length > header.total_length) ||
+        ((index < header.count - 1) && (chunk_length != header.chunk_size)))
+    {
+        ESP_LOGE(fragment_log_prefix, "<< Invalid fragment %hu of %hu from %s, %i bytes (total length %"PRIu32").",
+                 index, header.count, peer->name, chunk_length, header.total_length);
+        fragment_rejected_count++;
+        return -SDP_ERR_INVALID_PARAM;
+    }
+
+    uint8_t status[SDP_FRAGMENT_BITMAP_SIZE];
+    uint8_t *complete_frame = NULL;
+    uint32_t complete_length = 0;
+    int64_t now = esp_timer_get_time();
+
+    if (xSemaphoreTake(x_fragment_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return -SDP_ERR_SEMAPHORE;
+    }
+    prune_slots(now);
+    reassembly_slot *slot = get_slot(peer, &header);
+    if (slot == NULL)
+    {
+        xSemaphoreGive(x_fragment_semaphore);
+        ESP_LOGE(fragment_log_prefix, "<< No room to reassemble a %"PRIu32" byte message from %s.", header.total_length, peer->name);
+        fragment_rejected_count++;
+        return -SDP_ERR_OUT_OF_MEMORY;
+    }
+    if ((slot->state == FRAGMENT_SLOT_RECEIVING) && !BITMAP_TEST(slot->received, index))
+    {
+        memcpy(slot->buffer + offset, chunk, chunk_length);
+        BITMAP_SET(slot->received, index);
+        slot->received_count++;
+        if (slot->received_count == slot->count)
+        {
+            /* The slot is kept without its buffer, to answer any late status requests */
+            complete_frame = slot->buffer;
+            complete_length = slot->total_length;
+            slot->buffer = NULL;
+            slot->state = FRAGMENT_SLOT_DONE;
+        }
+    }
+    slot->deadline = now + ((int64_t)CONFIG_SDP_FRAGMENT_TIMEOUT_MS * 1000);
+    if (status_requested || (complete_frame != NULL))
+    {
+        memcpy(status, slot->received, SDP_FRAGMENT_BITMAP_SIZE);
+    }
+    xSemaphoreGive(x_fragment_semaphore);
+
+    if (status_requested || (complete_frame != NULL))
+    {
+        send_status(peer, header.message_id, header.count, status);
+    }
+    if (complete_frame != NULL)
+    {
+        fragment_reassembled_count++;
+        if ((complete_length > SDP_PREAMBLE_LENGTH) &&
+            (sdp_frame_crc(complete_frame) == sdp_frame_crc_calc(complete_frame, complete_length)))
+        {
+            handle_incoming(peer, complete_frame, complete_length, media_type);
+        }
+        else
+        {
+            ESP_LOGE(fragment_log_prefix, "<< Reassembled message %hu from %s failed the CRC check.", header.message_id, peer->name);
+            fragment_rejected_count++;
+        }
+        free(complete_frame);
+    }
+    return SDP_OK;
+}
+
+/**
+ * @brief Handle an incoming FRAGMENT_STATUS frame, called by handle_incoming()
+ */
+int sdp_fragment_on_status(sdp_peer *peer, const uint8_t *data, int data_len)
+{
+    uint16_t status_header[2];
+    if (data_len < SDP_PREAMBLE_LENGTH + (int)sizeof(status_header))
+    {
+        return -SDP_ERR_MESSAGE_TOO_SHORT;
+    }
+    memcpy(status_header, data + SDP_PREAMBLE_LENGTH, sizeof(status_header));
+    int bitmap_length = (status_header[1] + 7) / 8;
+    if ((status_header[1] > SDP_FRAGMENT_MAX_COUNT) ||
+        (data_len < SDP_PREAMBLE_LENGTH + (int)sizeof(status_header) + bitmap_length))
+    {
+        return -SDP_ERR_INVALID_PARAM;
+    }
+    const uint8_t *bitmap = data + SDP_PREAMBLE_LENGTH + sizeof(status_header);
+
+    if (xSemaphoreTake(x_fragment_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return -SDP_ERR_SEMAPHORE;
+    }
+    for (int i = 0; i < CONFIG_SDP_FRAGMENT_SLOTS; i++)
+    {
+        outgoing_slot *slot = &outgoing_slots[i];
+        if (slot->in_use && (slot->peer == peer) && (slot->message_id == status_header[0]))
+        {
+            for (int b = 0; b < bitmap_length; b++)
+            {
+                slot->received[b] |= bitmap[b];
+            }
+            xSemaphoreGive(slot->status);
+            break;
+        }
+    }
+    xSemaphoreGive(x_fragment_semaphore);
+    return SDP_OK;
+}
+
+/**
+ * @brief Send one fragment of a frame
+ */
+static int send_fragment(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, const sdp_fragment_header_t *header,
+                         uint16_t index, bool request_status, e_media_type media_type, bool just_checking)
+{
+    uint8_t preamble[SDP_PREAMBLE_LENGTH];
+    sdp_fragment_header_t fragment_header = *header;
+    fragment_header.index = index | (request_status ? SDP_FRAGMENT_REQUEST_STATUS : 0);
+
+    uint32_t offset = (uint32_t)index * header->chunk_size;
+    int chunk_length = (index == header->count - 1) ? header->total_length - offset : header->chunk_size;
+
+    sdp_iovec_t fragment_iov[2 + SDP_IOVEC_MAX];
+    fragment_iov[0].base = preamble;
+    fragment_iov[0].length = SDP_PREAMBLE_LENGTH;
+    fragment_iov[1].base = &fragment_header;
+    fragment_iov[1].length = sizeof(fragment_header);
+    int chunk_iovcnt = sdp_iovec_slice(&fragment_iov[2], SDP_IOVEC_MAX, iov, iovcnt, offset, chunk_length);
+    if (chunk_iovcnt < 0)
+    {
+        return chunk_iovcnt;
+    }
+    sdp_write_preamble_v(preamble, FRAGMENT, 0, &fragment_iov[1], 1 + chunk_iovcnt);
+    return sdp_send_message_media_type_v(peer, fragment_iov, 2 + chunk_iovcnt, media_type, just_checking);
+}
+
+static outgoing_slot *claim_outgoing_slot(sdp_peer *peer, uint16_t message_id)
+{
+    outgoing_slot *claimed = NULL;
+    if (xSemaphoreTake(x_fragment_semaphore, portMAX_DELAY) == pdTRUE)
+    {
+        for (int i = 0; i < CONFIG_SDP_FRAGMENT_SLOTS; i++)
+        {
+            if (!outgoing_slots[i].in_use)
+            {
+                claimed = &outgoing_slots[i];
+                claimed->in_use = true;
+                sdp_mesh_peer_ref(peer);
+                claimed->peer = peer;
+                claimed->message_id = message_id;
+                memset(claimed->received, 0, SDP_FRAGMENT_BITMAP_SIZE);
+                /* Forget any status of an earlier message */
+                xSemaphoreTake(claimed->status, 0);
+                break;
+            }
+        }
+        xSemaphoreGive(x_fragment_semaphore);
+    }
+    return claimed;
+}
+
+static void release_outgoing_slot(outgoing_slot *slot)
+{
+    if (xSemaphoreTake(x_fragment_semaphore, portMAX_DELAY) == pdTRUE)
+    {
+        slot->in_use = false;
+        sdp_mesh_peer_unref(slot->peer);
+        slot->peer = NULL;
+        xSemaphoreGive(x_fragment_semaphore);
+    }
+}
+
+/**
+ * @brief Send a frame that is too long for the media as fragments, called by sdp_send_message_media_type_v()
+ * This blocks until the receiver says it has all fragments, or the rounds are used up.
+ *
+ * @param peer The peer
+ * @param iov The segments of the frame, including the preamble
+ * @param iovcnt The number of segments
+ * @param media_type The media to send the fragments on
+ * @param just_checking Passed on to the media
+ * @return int The media type if successful, a negative value on failure
+ */
+int sdp_fragment_send(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, e_media_type media_type, bool just_checking)
+{
+    int total_length = sdp_iovec_length(iov, iovcnt);
+    int chunk_size = sdp_fragment_mtu(media_type) - SDP_PREAMBLE_LENGTH - (int)sizeof(sdp_fragment_header_t);
+    int count = (total_length + chunk_size - 1) / chunk_size;
+    if ((total_length > CONFIG_SDP_FRAGMENT_MAX_LENGTH) || (count > SDP_FRAGMENT_MAX_COUNT))
+    {
+        ESP_LOGE(fragment_log_prefix, ">> A %i byte message is too long to fragment (max %i bytes).",
+                 total_length, CONFIG_SDP_FRAGMENT_MAX_LENGTH);
+        return -SDP_ERR_MESSAGE_TOO_LONG;
+    }
+
+    sdp_fragment_header_t header = {
+        .message_id = __atomic_fetch_add(&next_message_id, 1, __ATOMIC_RELAXED),
+        .index = 0,
+        .count = count,
+        .chunk_size = chunk_size,
+        .total_length = total_length};
+
+    outgoing_slot *slot = claim_outgoing_slot(peer, header.message_id);
+    if (slot == NULL)
+    {
+        ESP_LOGE(fragment_log_prefix, ">> Too many fragmented messages are being sent at the same time.");
+        return -SDP_ERR_SEND_FAIL;
+    }
+    ESP_LOGI(fragment_log_prefix, ">> Sending a %i byte message to %s as %i fragments.", total_length, peer->name, count);
+
+    /* The fragments that has not been confirmed */
+    uint8_t pending[SDP_FRAGMENT_BITMAP_SIZE];
+    memset(pending, 0, SDP_FRAGMENT_BITMAP_SIZE);
+    for (int i = 0; i < count; i++)
+    {
+        BITMAP_SET(pending, i);
+    }
+
+    int result = -media_type;
+    int missing = count;
+    bool first_round = true;
+    /* Give up when a number of rounds in a row has not got any more fragments through */
+    int idle_rounds = 0;
+    while (idle_rounds < SDP_FRAGMENT_ROUNDS)
+    {
+        int last = count - 1;
+        while (!BITMAP_TEST(pending, last))
+        {
+            last--;
+        }
+        int sent = 0;
+        for (int i = 0; i <= last; i++)
+        {
+            if (BITMAP_TEST(pending, i))
+            {
+                // A failed fragment is just missing, and is resent in the next round
+                send_fragment(peer, iov, iovcnt, &header, i, i == last, media_type, just_checking);
+                sent++;
+            }
+        }
+        if (first_round)
+        {
+            fragment_sent_count += sent;
+            first_round = false;
+        }
+        else
+        {
+            fragment_resent_count += sent;
+        }
+
+        /* Wait for the status, each fragment may have to wait for a receipt */
+        if (xSemaphoreTake(slot->status, ((sent + 1) * CONFIG_SDP_RECEIPT_TIMEOUT_MS) / portTICK_PERIOD_MS) == pdTRUE)
+        {
+            int still_missing = 0;
+            xSemaphoreTake(x_fragment_semaphore, portMAX_DELAY);
+            for (int i = 0; i < count; i++)
+            {
+                if (BITMAP_TEST(slot->received, i))
+                {
+                    pending[i >> 3] &= (uint8_t)~(1 << (i & 7));
+                }
+                else
+                {
+                    BITMAP_SET(pending, i);
+                    still_missing++;
+                }
+            }
+            xSemaphoreGive(x_fragment_semaphore);
+            if (still_missing == 0)
+            {
+                result = media_type;
+                break;
+            }
+            idle_rounds = still_missing < missing ? 0 : idle_rounds + 1;
+            missing = still_missing;
+            ESP_LOGI(fragment_log_prefix, ">> %s is missing %i fragments, resending them.", peer->name, missing);
+        }
+        else
+        {
+            /* No status, the fragment asking for it may have been lost, so only that one is resent */
+            memset(pending, 0, SDP_FRAGMENT_BITMAP_SIZE);
+            BITMAP_SET(pending, last);
+            idle_rounds++;
+        }
+    }
+    release_outgoing_slot(slot);
+    if (result < 0)
+    {
+        ESP_LOGE(fragment_log_prefix, ">> Failed sending a %i byte message to %s in fragments.", total_length, peer->name);
+    }
+    return result;
+}
+
+void sdp_fragment_on_monitor()
+{
+    if (fragment_log_prefix == NULL)
+    {
+        return;
+    }
+    if (xSemaphoreTake(x_fragment_semaphore, portMAX_DELAY) == pdTRUE)
+    {
+        prune_slots(esp_timer_get_time());
+        xSemaphoreGive(x_fragment_semaphore);
+    }
+    ESP_LOGI(fragment_log_prefix, "Fragments: %"PRIu32" sent, %"PRIu32" resent, %"PRIu32" messages reassembled, "
+             "%"PRIu32" timed out, %"PRIu32" rejected.", fragment_sent_count, fragment_resent_count,
+             fragment_reassembled_count, fragment_timeout_count, fragment_rejected_count);
+}
+
+void sdp_fragment_init(char *_log_prefix)
+{
+    fragment_log_prefix = _log_prefix;
+    x_fragment_semaphore = xSemaphoreCreateMutex();
+    for (int i = 0; i < CONFIG_SDP_FRAGMENT_SLOTS; i++)
+    {
+        outgoing_slots[i].status = xSemaphoreCreateBinaryStatic(&outgoing_slots[i].status_buffer);
+    }
+    /* Start somewhere random, so that a restarted peer does not reuse the ids of its last messages */
+    next_message_id = (uint16_t)esp_random();
+}
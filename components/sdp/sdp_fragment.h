@@ -0,0 +1,57 @@
+/**
+ * @file sdp_fragment.h
+ * @author Nicklas Borjesson
+ * @brief Fragmentation and reassembly of frames that are too long for a media
+ * This is transparent: sdp_send_message_media_type_v() fragments frames that doesn't fit the media,
+ * and handle_incoming() passes fragments here, and gets the reassembled frame back.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_FRAGMENT_H_
+#define _SDP_FRAGMENT_H_
+
+#include "sdp_def.h"
+
+/* The most fragments a frame can be split into, this keeps the status bitmap small enough for any media */
+#define SDP_FRAGMENT_MAX_COUNT 1024
+#define SDP_FRAGMENT_BITMAP_SIZE (SDP_FRAGMENT_MAX_COUNT / 8)
+
+/* The longest FRAGMENT_STATUS frame: the preamble, the message id and count, and the bitmap */
+#define SDP_FRAGMENT_STATUS_MAX_LENGTH (SDP_PREAMBLE_LENGTH + 2 * sizeof(uint16_t) + SDP_FRAGMENT_BITMAP_SIZE)
+
+/* Set in the index of the last fragment sent in a round, to make the receiver reply with a status */
+#define SDP_FRAGMENT_REQUEST_STATUS 0x8000
+
+/* How many rounds of resending in a row that may fail to get any more fragments through before giving up */
+#define SDP_FRAGMENT_ROUNDS 4
+
+/**
+ * @brief The header that follows the preamble of a FRAGMENT frame
+ */
+typedef struct __attribute__((packed)) sdp_fragment_header
+{
+    /* Identifies the fragmented frame together with the peer */
+    uint16_t message_id;
+    /* The index of this fragment, possibly with SDP_FRAGMENT_REQUEST_STATUS set */
+    uint16_t index;
+    /* The number of fragments */
+    uint16_t count;
+    /* The length of all fragments but the last */
+    uint16_t chunk_size;
+    /* The length of the whole frame */
+    uint32_t total_length;
+} sdp_fragment_header_t;
+
+int sdp_fragment_mtu(e_media_type media_type);
+
+int sdp_fragment_send(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, e_media_type media_type, bool just_checking);
+int sdp_fragment_on_fragment(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type);
+int sdp_fragment_on_status(sdp_peer *peer, const uint8_t *data, int data_len);
+
+void sdp_fragment_on_monitor();
+
+void sdp_fragment_init(char *_log_prefix);
+
+#endif
@@ -7,7 +7,7 @@
 #include <esp_log.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
-#include <esp32/rom/crc.h>
+#include "sdp_crc.h"
 #include <esp_adc/adc_oneshot.h>
 
 #include "sdp_def.h"
@@ -18,149 +18,376 @@ char *helpers_log_prefix;
 
 /* Helpers */
 
+/* How a section's argument is fetched from the variable argument list */
+typedef enum e_builder_arg
+{
+    BUILDER_ARG_INT,
+    BUILDER_ARG_LONG,
+    BUILDER_ARG_LONG_LONG,
+    BUILDER_ARG_DOUBLE,
+    BUILDER_ARG_POINTER
+} e_builder_arg;
+
+/**
+ * @brief Find out the argument type of the conversion in a format section
+ * Reads past flags, width, precision and length modifiers to the conversion character.
+ */
+static e_builder_arg get_arg_type(const char *section, int section_length)
+{
+    int longs = 0;
+    for (const char *c = memchr(section, '%', section_length) + 1; c < section + section_length; c++)
+    {
+        switch (*c)
+        {
+        case 'l':
+            longs++;
+            break;
+        case 'j':
+        case 'q':
+            longs = 2;
+            break;
+        case 's':
+        case 'p':
+            return BUILDER_ARG_POINTER;
+        case 'f':
+        case 'F':
+        case 'e':
+        case 'E':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            return BUILDER_ARG_DOUBLE;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'x':
+        case 'X':
+        case 'o':
+        case 'c':
+            return longs > 1 ? BUILDER_ARG_LONG_LONG : (longs == 1 ? BUILDER_ARG_LONG : BUILDER_ARG_INT);
+        default:
+            break;
+        }
+    }
+    return BUILDER_ARG_INT;
+}
+
+/**
+ * @brief Append bytes to the payload, if they fit. The length is counted regardless.
+ */
+static void builder_put(sdp_message_builder *builder, const void *data, int data_length)
+{
+    int offset = builder->payload_offset + builder->length;
+    if (builder->buffer != NULL && offset + data_length <= builder->capacity)
+    {
+        memcpy(builder->buffer + offset, data, data_length);
+    }
+    builder->length += data_length;
+}
+
+/**
+ * @brief Initialize a message builder over a buffer
+ * A builder with a NULL buffer and 0 capacity only measures, the resulting 
+ * builder->length is then the length of the payload.
+ *
+ * @param builder The builder
+ * @param buffer The buffer to build the message in
+ * @param capacity The size of the buffer, including any preamble slot
+ * @param reserve_preamble If set, the first SDP_PREAMBLE_LENGTH bytes are left for sdp_builder_finish()
+ */
+void sdp_builder_init(sdp_message_builder *builder, uint8_t *buffer, int capacity, bool reserve_preamble)
+{
+    builder->buffer = buffer;
+    builder->capacity = capacity;
+    builder->payload_offset = reserve_preamble ? SDP_PREAMBLE_LENGTH : 0;
+    builder->length = 0;
+    builder->error = 0;
+}
+
+/**
+ * @brief Append to a message using the same format as add_to_message, see it for the format.
+ * Can be called several times on the same builder.
+ *
+ * @param builder The builder
+ * @param format A format string where "|" indicates where null-separation is wanted and creates a section.
+ * @return int The length of the payload so far, or a negative SDP_ERR_* on failure.
+ */
+int sdp_builder_add(sdp_message_builder *builder, const char *format, ...)
+{
+    va_list arg;
+    va_start(arg, format);
+    int retval = sdp_builder_vadd(builder, format, arg);
+    va_end(arg);
+    return retval;
+}
+
+int sdp_builder_vadd(sdp_message_builder *builder, const char *format, va_list args)
+{
+    va_list arg;
+    char section_format[SDP_BUILDER_MAX_SECTION_LEN + 1];
+    const uint8_t null_byte = 0;
+
+    if (builder->error)
+    {
+        return -builder->error;
+    }
+    va_copy(arg, args);
+    const char *section = format;
+    while (section != NULL)
+    {
+        const char *section_end = strchr(section, '|');
+        int section_length = section_end ? section_end - section : strlen(section);
+
+        if (memchr(section, '%', section_length) == NULL)
+        {
+            // No formatting, the section is the value
+            builder_put(builder, section, section_length);
+        }
+        else if (section_length >= 2 && section[0] == '%' && section[1] == 'b')
+        {
+            // Handle fixed length byte arrays "%b", which must have a length of 1 to 7 digits
+            if (section_length < 3 || section_length > 9)
+            {
+                ESP_LOGE(helpers_log_prefix, "Bad byte parameter, len %i in format string: %s", section_length - 2, format);
+                builder->error = SDP_ERR_PARSING_FAILED;
+                break;
+            }
+            memcpy(section_format, section + 2, section_length - 2);
+            section_format[section_length - 2] = 0;
+            builder_put(builder, va_arg(arg, void *), atoi(section_format));
+        }
+        else
+        {
+            if (section_length > SDP_BUILDER_MAX_SECTION_LEN)
+            {
+                ESP_LOGE(helpers_log_prefix, "Section longer than %i characters in format string: %s", 
+                         SDP_BUILDER_MAX_SECTION_LEN, format);
+                builder->error = SDP_ERR_PARSING_FAILED;
+                break;
+            }
+            memcpy(section_format, section, section_length);
+            section_format[section_length] = 0;
+
+            // Format straight into the buffer
+            int offset = builder->payload_offset + builder->length;
+            int room = (builder->buffer != NULL && offset < builder->capacity) ? builder->capacity - offset : 0;
+            char *dest = room > 0 ? (char *)builder->buffer + offset : NULL;
+            int value_length;
+            switch (get_arg_type(section, section_length))
+            {
+            case BUILDER_ARG_LONG:
+                value_length = snprintf(dest, room, section_format, va_arg(arg, long));
+                break;
+            case BUILDER_ARG_LONG_LONG:
+                value_length = snprintf(dest, room, section_format, va_arg(arg, long long));
+                break;
+            case BUILDER_ARG_DOUBLE:
+                value_length = snprintf(dest, room, section_format, va_arg(arg, double));
+                break;
+            case BUILDER_ARG_POINTER:
+                value_length = snprintf(dest, room, section_format, va_arg(arg, void *));
+                break;
+            default:
+                value_length = snprintf(dest, room, section_format, va_arg(arg, int));
+                break;
+            }
+            if (value_length < 0)
+            {
+                builder->error = SDP_ERR_PARSING_FAILED;
+                break;
+            }
+            builder->length += value_length;
+        }
+        builder_put(builder, &null_byte, 1);
+        section = section_end ? section_end + 1 : NULL;
+    }
+    va_end(arg);
+    return builder->error ? -builder->error : builder->length;
+}
+
+/**
+ * @brief Finish the message, writing the preamble into its slot if one was reserved
+ *
+ * @param builder The builder
+ * @param work_type The type of work, used if a preamble slot was reserved
+ * @param conversation_id The conversation id, used if a preamble slot was reserved
+ * @return int The total length of the message, including any preamble, or a negative SDP_ERR_* on failure.
+ */
+int sdp_builder_finish(sdp_message_builder *builder, e_work_type work_type, uint16_t conversation_id)
+{
+    if (builder->error)
+    {
+        return -builder->error;
+    }
+    int total_length = builder->payload_offset + builder->length;
+    if (builder->buffer == NULL || total_length > builder->capacity)
+    {
+        ESP_LOGE(helpers_log_prefix, "Message of %i bytes doesn't fit the %i byte buffer.", total_length, builder->capacity);
+        return -SDP_ERR_MESSAGE_TOO_LONG;
+    }
+    if (builder->payload_offset > 0)
+    {
+        sdp_write_preamble(builder->buffer, work_type, conversation_id, builder->length);
+    }
+    ESP_LOG_BUFFER_HEXDUMP(helpers_log_prefix, builder->buffer, total_length, ESP_LOG_DEBUG);
+    return total_length;
+}
+
 /**
  * @brief A simple way to, using format strings, build a message.
  * However; as the result will have to be null-terminated, and we cannot put nulls in that string.
  * Instead, the pipe-symbol "|" is used to indicate the null-terminated sections.
  * Only one format is allowed per section: "%i Mhz|%s" is allowed. "%i Mhz, %i watts|%s" is not.
  * Integers can be passed as is. An additional format type is %b, which denotes a
- * IMPORTANT: Do not send floating point values, format them ahead and send them as null-terminated strings.
- * This is because of how variadic functions promotes and handles these data types.
+ * fixed length byte array, for example %b6 for a mac address.
+ * The argument type is taken from the format, so 64-bit integers needs the right length modifier (PRIu64).
+ * 
+ * NOTE: This allocates the message, use a sdp_message_builder to avoid that.
  *
  * @param message A pointer to a pointer to the message structure, memory will be allocated to it.
  * @param format A format string where "|" indicates where null-separation is wanted and creates a section.
  * @param arg A list of arguments supplying data for the format.
  * @return int Length of message
- *
- * @note An evolution would be to identify the number of format strings in each "|"-section to enable full support of format.
- * Unclear when that woud be needed, though, perhaps if compiling error texts.
  */
 int add_to_message(uint8_t **message, const char *format, ...)
 {
-
     va_list arg;
+    sdp_message_builder builder;
+
+    // Measure first, so that the message can be allocated once
+    sdp_builder_init(&builder, NULL, 0, false);
+    va_start(arg, format);
+    int message_length = sdp_builder_vadd(&builder, format, arg);
+    va_end(arg);
+    if (message_length < 0)
+    {
+        return message_length;
+    }
+
+    *message = heap_caps_malloc(message_length, MALLOC_CAP_8BIT);
+    if (*message == NULL)
+    {
+        ESP_LOGE(helpers_log_prefix, "Alloc failed.");
+        return -SDP_ERR_OUT_OF_MEMORY;
+    }
+    sdp_builder_init(&builder, *message, message_length, false);
     va_start(arg, format);
+    sdp_builder_vadd(&builder, format, arg);
+    va_end(arg);
 
-    int format_len = strlen(format);
+    return sdp_builder_finish(&builder, 0, 0);
+}
 
-    char *loc_format = heap_caps_malloc(format_len + 1, MALLOC_CAP_8BIT);
-    strcpy(loc_format, format);
-    ESP_LOGD(helpers_log_prefix, "Format string %s len %i", loc_format, format_len);
+/* Bytes copied by sdp_iovec_gather() and bytes sent, to tell how much copying sending causes */
+uint32_t iovec_gathered_bytes = 0;
+uint32_t iovec_sent_bytes = 0;
 
-    int break_count = 1;
-    /* Make a pass to count pipes and replace them with nulls */
-    for (int i = 0; i < format_len; i++)
+/**
+ * @brief The total length of a list of segments
+ */
+int sdp_iovec_length(const sdp_iovec_t *iov, int iovcnt)
+{
+    int length = 0;
+    for (int i = 0; i < iovcnt; i++)
     {
-        if ((int)(loc_format[i]) == 124)
-        {
-            loc_format[i] = 0;
-            break_count++;
-        }
+        length += iov[i].length;
     }
-    // Ensure null-termination (alloc is 1 longer than format len)
-    ESP_LOGD(helpers_log_prefix, "format_len %i", format_len);
-    loc_format[format_len] = 0;
-    /* Now we know that our format array needs to be break_count long, allocate it */
-    char **format_array = heap_caps_malloc(break_count * sizeof(char *), MALLOC_CAP_8BIT);
+    return length;
+}
 
-    format_array[0] = loc_format;
-    int format_count = 1;
-    for (int j = 0; j < format_len; j++)
+/**
+ * @brief Gather a list of segments into one buffer
+ * Media should only do this where the driver needs a single buffer.
+ *
+ * @param dest The buffer
+ * @param capacity The size of the buffer
+ * @param iov The segments
+ * @param iovcnt The number of segments
+ * @return int The number of bytes gathered, -SDP_ERR_MESSAGE_TOO_LONG if they don't fit.
+ */
+int sdp_iovec_gather(uint8_t *dest, int capacity, const sdp_iovec_t *iov, int iovcnt)
+{
+    int length = sdp_iovec_length(iov, iovcnt);
+    if (length > capacity)
     {
-        if ((int)(loc_format[j]) == 0)
-        {
-
-            format_array[format_count] = (char *)(loc_format + j + 1);
-            format_count++;
-        }
+        return -SDP_ERR_MESSAGE_TOO_LONG;
     }
-    int curr_pos = 0;
-    size_t new_length = 0;
-    char *value_str = NULL;
-    int value_length = 0;
-    /* Now loop all formats, and put the message together, reallocating when enlarging */
-    char *curr_format;
-    for (int k = 0; k < format_count; k++)
-    {
-        curr_format = (char *)(format_array[k]);
-        // Is there any formatting at all in the format string?
-        if (strchr(curr_format, '%') != NULL)
-        {
-            // Fetch the next parameter.
-            void *value = va_arg(arg, void *);
-            // Handle fixed length byte arrays "%b"
-            if (curr_format[1] == 'b')
-            {
-                int n = 2;
-                while (((int)(curr_format[n]) != 0) && (n < 10))
-                {
-                    n++;
-                }
-                if (n > 9 || n < 3)
-                {
-                    ESP_LOGE(helpers_log_prefix, "Bad byte parameter on location %i, len %i in format string: %s", k, n - 2, curr_format);
-                    new_length = -SDP_ERR_PARSING_FAILED;
-                    goto cleanup;
-                }
-                ESP_LOGD(helpers_log_prefix, "Found null value at %i in %s", n, curr_format);
-                value_length = atoi((char *)&(curr_format[2]));
-                ESP_LOGD(helpers_log_prefix, "value_length parsed %i", value_length);
-                value_str = malloc(value_length);
-                memcpy(value_str, (void *)value, value_length);
-            }
-            else
-            {
-                // Used sprintf formatting
-                value_length = asprintf(&value_str, curr_format, (void *)value);
-
-                /*double test = 0;
-                memcpy(&test, value, 8);
+    for (int i = 0; i < iovcnt; i++)
+    {
+        memcpy(dest, iov[i].base, iov[i].length);
+        dest += iov[i].length;
+    }
+    iovec_gathered_bytes += length;
+    return length;
+}
 
-                ESP_LOGI(helpers_log_prefix, "Formatted value = %f with %s, into %s", test, curr_format, value_str);*/
-            }
-        }
-        else
+/**
+ * @brief Describe a part of a list of segments as a new list of segments, nothing is copied
+ *
+ * @param dest The new segments
+ * @param dest_max The room in dest
+ * @param iov The segments
+ * @param iovcnt The number of segments
+ * @param offset Where the part begins
+ * @param length The length of the part
+ * @return int The number of segments in dest, -SDP_ERR_INVALID_PARAM if the part is outside the segments or dest is too small
+ */
+int sdp_iovec_slice(sdp_iovec_t *dest, int dest_max, const sdp_iovec_t *iov, int iovcnt, int offset, int length)
+{
+    int count = 0;
+    for (int i = 0; (i < iovcnt) && (length > 0); i++)
+    {
+        if (offset >= iov[i].length)
         {
-            // If the format string doesn't start with a %-character, just use the format for value
-            // TODO: Checking if it *contains* a %-character should be more flexible
-            value_length = strlen(curr_format);
-            value_str = malloc(value_length);
-            strncpy(value_str, curr_format, value_length);
+            offset -= iov[i].length;
+            continue;
         }
-        new_length += value_length + 1;
-
-        // TODO: See if realloc has any significant performance impact, if so an allocations strategy might be useful
-
-        if (k == 0)
+        if (count == dest_max)
         {
-            *message = heap_caps_malloc(new_length, MALLOC_CAP_8BIT);
+            return -SDP_ERR_INVALID_PARAM;
         }
-        else
+        int part_length = iov[i].length - offset;
+        if (part_length > length)
         {
-            *message = heap_caps_realloc(*message, new_length, MALLOC_CAP_8BIT);
+            part_length = length;
         }
+        dest[count].base = (const uint8_t *)iov[i].base + offset;
+        dest[count].length = part_length;
+        count++;
+        length -= part_length;
+        offset = 0;
+    }
+    return length > 0 ? -SDP_ERR_INVALID_PARAM : count;
+}
 
-        if (*message == NULL)
-        {
-            ESP_LOGE(helpers_log_prefix, "(Re)alloc failed.");
-            new_length = -SDP_ERR_OUT_OF_MEMORY;
-            goto cleanup;
-        };
-        memcpy((*message) + curr_pos, value_str, value_length);
-
-        (*message)[new_length - 1] = (uint8_t)0x00;
-        ESP_LOGD(helpers_log_prefix, "Message: %s, value_str: %s, new_length: %i.", (char *)*message, value_str, (int)new_length);
-        free(value_str);
-        value_str = NULL;
-        curr_pos = new_length;
-    }
-    ESP_LOG_BUFFER_HEXDUMP(helpers_log_prefix, (char *)*message, new_length, ESP_LOG_DEBUG);
-cleanup:
-    va_end(arg);
-    free(value_str);
-    free(loc_format);
-    free(format_array);
-    return new_length;
+/**
+ * @brief Continue a frame CRC (see sdp_crc.c) over a list of segments
+ */
+uint32_t sdp_iovec_crc32(uint32_t crc, const sdp_iovec_t *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+    {
+        crc = sdp_crc32(crc, iov[i].base, iov[i].length);
+    }
+    return crc;
+}
+
+/**
+ * @brief Count bytes that was handed to a media driver
+ */
+void sdp_iovec_count_sent(int sent_bytes)
+{
+    iovec_sent_bytes += sent_bytes;
+}
+
+/**
+ * @brief Get the number of bytes gathered and sent so far
+ */
+void sdp_iovec_get_stats(uint32_t *gathered_bytes, uint32_t *sent_bytes)
+{
+    *gathered_bytes = iovec_gathered_bytes;
+    *sent_bytes = iovec_sent_bytes;
 }
 
 void sdp_blink_led(gpio_num_t gpio_num, uint16_t time_on, uint16_t time_off, uint16_t times)
@@ -224,7 +451,7 @@ uint32_t calc_relation_id(sdp_mac_address *mac_1, sdp_mac_address *mac_2) {
         memcpy(tmp_crc_data+SDP_MAC_ADDR_LEN, mac_2, SDP_MAC_ADDR_LEN);
         // TODO: Why big endian? Change to little endian everywhere unless BLE have other ideas
 
-        uint32_t relation_id = crc32_be(0, tmp_crc_data, SDP_MAC_ADDR_LEN * 2);
+        uint32_t relation_id = sdp_crc32(0, tmp_crc_data, SDP_MAC_ADDR_LEN * 2);
         free(tmp_crc_data);
         return relation_id;
 }
@@ -245,6 +472,7 @@ void log_peer_info(char *_log_prefix, sdp_peer *peer)
     ESP_LOGI(_log_prefix, "Relation id:           %lu", peer->relation_id);
     ESP_LOGI(_log_prefix, "Protocol version:      %i", peer->protocol_version);
     ESP_LOGI(_log_prefix, "Next availability:     %lli", peer->next_availability);
+    ESP_LOGI(_log_prefix, "Expired work items:    %"PRIu32, peer->expired_count);
     ESP_LOGI(_log_prefix, "Handle:                %i", peer->peer_handle);
 }
 
@@ -12,13 +12,52 @@
 #ifndef _SDP_HELPERS_H_
 #define _SDP_HELPERS_H_
 
+#include <stdarg.h>
 #include "sdp_def.h"
 #include "driver/gpio.h"
 
 void sdp_blink_led(gpio_num_t gpio_num, uint16_t time_on, uint16_t time_off, uint16_t times);
 
+/* The longest "|"-section in a builder format that contains a %-format */
+#define SDP_BUILDER_MAX_SECTION_LEN 32
+
+/**
+ * @brief Builds a message in place in a caller-provided buffer
+ * Unlike add_to_message, nothing is allocated. If the builder reserves a preamble slot, 
+ * sdp_builder_finish() writes the preamble in front of the payload, so the 
+ * buffer can be sent as is.
+ */
+typedef struct sdp_message_builder
+{
+    /* The buffer, beginning with the preamble slot if one is reserved */
+    uint8_t *buffer;
+    /* The size of the buffer */
+    int capacity;
+    /* Where the payload starts in the buffer, SDP_PREAMBLE_LENGTH or 0 */
+    int payload_offset;
+    /* The length of the payload, keeps counting even if it doesn't fit the buffer */
+    int length;
+    /* The first error (a positive SDP_ERR_*), 0 if none */
+    int error;
+} sdp_message_builder;
+
+void sdp_builder_init(sdp_message_builder *builder, uint8_t *buffer, int capacity, bool reserve_preamble);
+int sdp_builder_add(sdp_message_builder *builder, const char *format, ...);
+int sdp_builder_vadd(sdp_message_builder *builder, const char *format, va_list args);
+int sdp_builder_finish(sdp_message_builder *builder, e_work_type work_type, uint16_t conversation_id);
+
 int add_to_message(uint8_t **message, const char *format, ...);
 
+int sdp_iovec_length(const sdp_iovec_t *iov, int iovcnt);
+int sdp_iovec_gather(uint8_t *dest, int capacity, const sdp_iovec_t *iov, int iovcnt);
+int sdp_iovec_slice(sdp_iovec_t *dest, int dest_max, const sdp_iovec_t *iov, int iovcnt, int offset, int length);
+uint32_t sdp_iovec_crc32(uint32_t crc, const sdp_iovec_t *iov, int iovcnt);
+void sdp_iovec_get_stats(uint32_t *gathered_bytes, uint32_t *sent_bytes);
+void sdp_iovec_count_sent(int sent_bytes);
+
+void sdp_write_preamble(uint8_t *message, e_work_type work_type, uint16_t conversation_id, int data_length);
+void sdp_write_preamble_v(uint8_t *preamble, e_work_type work_type, uint16_t conversation_id, 
+                          const sdp_iovec_t *payload, int iovcnt);
 void *sdp_add_preamble(e_work_type work_type, uint16_t conversation_id, const void *data, int data_length);
 
 void log_peer_info(char * _log_prefix, sdp_peer *peer);
@@ -0,0 +1,170 @@
+/**
+ * @file sdp_link.c
+ * @author Nicklas Borjesson
+ * @brief The link estimator, estimating round-trip time, goodput and loss of a media to a peer
+ * All estimates are exponentially weighted moving averages, so they follow changes of the link:
+ * - The round-trip time and its variation are smoothed like TCP does (RFC 6298). However, the variation
+ *   is measured from the fitted delivery time of each length, as longer frames are not jitter.
+ * - The delivery time is fitted as latency + length / goodput, from moving averages of the lengths,
+ *   the delivery times, and their products. If the frames have been about as long, the latency cannot
+ *   be told from the goodput, and all of the time is taken as proportional to the length.
+ * - The loss rate is the moving average of the outcomes, 1 for a loss, 0 for a success.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_link.h"
+
+#include <math.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+/* The weight of a new delivery time in the moving averages (RFC 6298 alpha) */
+#define LINK_GAIN 0.125f
+/* The weight of a new outcome in the loss rate, as a shift, slower as losses are rarer than delivery times */
+#define LINK_LOSS_SHIFT 5
+/* The delivery times needed before predicting */
+#define LINK_MIN_SAMPLES 4
+/* Below this variance of the lengths (bytes^2), the latency is not fitted */
+#define LINK_MIN_LENGTH_VARIANCE 16.0f
+/* Above this loss rate, the expected number of tries is not meaningful anyway */
+#define LINK_MAX_LOSS_RATE 0.9f
+
+static void link_fit(const sdp_link_estimate *link, float *latency, float *time_per_byte);
+
+/**
+ * @brief Add the time it took to deliver a frame, from starting to send it until it was acknowledged
+ * @param length The length of the frame in bytes
+ * @param delivery_time The time in microseconds
+ */
+void sdp_link_on_delivery(sdp_link_estimate *link, int length, uint32_t delivery_time)
+{
+    float x = (float)length;
+    float t = (float)delivery_time;
+    if (link->samples == 0)
+    {
+        link->srtt = delivery_time;
+        link->rttvar = delivery_time / 2;
+        link->mean_length = x;
+        link->mean_time = t;
+        link->mean_length_sq = x * x;
+        link->mean_length_time = x * t;
+    }
+    else
+    {
+        float latency, time_per_byte;
+        link_fit(link, &latency, &time_per_byte);
+        float deviation = fabsf(t - (latency + time_per_byte * x));
+        link->rttvar = link->rttvar - (link->rttvar >> 2) + (uint32_t)(deviation / 4);
+        link->srtt = (uint32_t)(link->srtt + (((int64_t)delivery_time - link->srtt) >> 3));
+        link->mean_length += (x - link->mean_length) * LINK_GAIN;
+        link->mean_time += (t - link->mean_time) * LINK_GAIN;
+        link->mean_length_sq += (x * x - link->mean_length_sq) * LINK_GAIN;
+        link->mean_length_time += (x * t - link->mean_length_time) * LINK_GAIN;
+    }
+    if (link->samples < UINT8_MAX)
+    {
+        link->samples++;
+    }
+}
+
+/**
+ * @brief Note that a frame is sent, for medias that are told about its delivery later
+ * Must be called before sending, as the acknowledgement may arrive before the send returns.
+ */
+void sdp_link_on_send(sdp_link_estimate *link, int length)
+{
+    link->send_time = (uint32_t)esp_timer_get_time();
+    link->send_length = length > UINT16_MAX ? UINT16_MAX : length;
+}
+
+/**
+ * @brief The frame noted by sdp_link_on_send() was delivered, or not
+ * Only one frame is timed at the time, later frames overwrite the send time.
+ */
+void sdp_link_on_send_done(sdp_link_estimate *link, bool delivered)
+{
+    if (delivered && (link->send_length > 0))
+    {
+        sdp_link_on_delivery(link, link->send_length, (uint32_t)esp_timer_get_time() - link->send_time);
+    }
+    link->send_length = 0;
+}
+
+/**
+ * @brief Add an outcome of a send or a receive to the loss rate
+ */
+void sdp_link_on_outcome(sdp_link_estimate *link, bool lost)
+{
+    int32_t target = lost ? UINT16_MAX : 0;
+    link->loss_rate = (uint16_t)(link->loss_rate + ((target - (int32_t)link->loss_rate) >> LINK_LOSS_SHIFT));
+}
+
+float sdp_link_loss_rate(const sdp_link_estimate *link)
+{
+    return (float)link->loss_rate / UINT16_MAX;
+}
+
+/**
+ * @brief Fit the delivery time as latency + length * time per byte
+ */
+static void link_fit(const sdp_link_estimate *link, float *latency, float *time_per_byte)
+{
+    float variance = link->mean_length_sq - link->mean_length * link->mean_length;
+    float covariance = link->mean_length_time - link->mean_length * link->mean_time;
+    if ((variance > LINK_MIN_LENGTH_VARIANCE) && (covariance > 0))
+    {
+        *time_per_byte = covariance / variance;
+        *latency = link->mean_time - *time_per_byte * link->mean_length;
+        if (*latency >= 0)
+        {
+            return;
+        }
+    }
+    *latency = 0;
+    *time_per_byte = link->mean_length > 0 ? link->mean_time / link->mean_length : 0;
+}
+
+/**
+ * @brief The estimated goodput in bytes/s, 0 if not known
+ */
+uint32_t sdp_link_goodput(const sdp_link_estimate *link)
+{
+    float latency, time_per_byte;
+    if (link->samples == 0)
+    {
+        return 0;
+    }
+    link_fit(link, &latency, &time_per_byte);
+    return time_per_byte > 0 ? (uint32_t)(1000000 / time_per_byte) : 0;
+}
+
+/**
+ * @brief Predict how long it would take to deliver a frame, including resending lost frames
+ * The time of one try is divided by the chance of it succeeding, and the round-trip time variation is
+ * added, so that a media with more jitter is not preferred when the times are close.
+ * @param length The length of the frame in bytes
+ * @return int64_t The time in microseconds, -1 if there are too few delivery times to tell
+ */
+int64_t sdp_link_predict_delivery_time(const sdp_link_estimate *link, int length)
+{
+    if (link->samples < LINK_MIN_SAMPLES)
+    {
+        return -1;
+    }
+    float latency, time_per_byte;
+    link_fit(link, &latency, &time_per_byte);
+    float loss_rate = sdp_link_loss_rate(link);
+    if (loss_rate > LINK_MAX_LOSS_RATE)
+    {
+        loss_rate = LINK_MAX_LOSS_RATE;
+    }
+    return (int64_t)((latency + time_per_byte * length) / (1 - loss_rate)) + link->rttvar;
+}
+
+void sdp_link_log(char *log_prefix, const char *media_name, const sdp_link_estimate *link)
+{
+    ESP_LOGI(log_prefix, "  %s - srtt: %"PRIu32" us, rttvar: %"PRIu32" us, goodput: %"PRIu32" byte/s, loss: %.3f, samples: %u",
+             media_name, link->srtt, link->rttvar, sdp_link_goodput(link), sdp_link_loss_rate(link), link->samples);
+}
@@ -0,0 +1,31 @@
+/**
+ * @file sdp_link.h
+ * @author Nicklas Borjesson
+ * @brief The link estimator, estimating round-trip time, goodput and loss of a media to a peer
+ * It is fed by the medias with the delivery times of frames and the outcomes of sends and receives,
+ * and predicts how long a frame of a given length would take to deliver, see select_media().
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_LINK_H_
+#define _SDP_LINK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdp_def.h"
+
+void sdp_link_on_delivery(sdp_link_estimate *link, int length, uint32_t delivery_time);
+void sdp_link_on_send(sdp_link_estimate *link, int length);
+void sdp_link_on_send_done(sdp_link_estimate *link, bool delivered);
+void sdp_link_on_outcome(sdp_link_estimate *link, bool lost);
+
+float sdp_link_loss_rate(const sdp_link_estimate *link);
+uint32_t sdp_link_goodput(const sdp_link_estimate *link);
+int64_t sdp_link_predict_delivery_time(const sdp_link_estimate *link, int length);
+
+void sdp_link_log(char *log_prefix, const char *media_name, const sdp_link_estimate *link);
+
+#endif
@@ -2,8 +2,10 @@
 
 #include <string.h>
 #include <esp_log.h>
+#include <freertos/semphr.h>
 
 #include "sdp_peer.h"
+#include "sdp_registry.h"
 #include "sdkconfig.h"
 
 
@@ -23,87 +25,129 @@ struct sdp_peers_t sdp_peers;
 /* The log prefix for all logging */
 char *mesh_log_prefix;
 
-struct sdp_peer *
-sdp_mesh_find_peer_by_name(const sdp_peer_name name)
+/**
+ * Readers of the peers (lookups and loops over the list) never wait. Changes to the list are serialized 
+ * by a semaphore, and a deleted peer is only freed once there has been a moment without readers, 
+ * as any reader after that cannot have found it. Until then, it is kept among the retired peers.
+ * Read sections must be short, as they hold back freeing. Anything that uses a peer for longer, 
+ * like queued items and sends, takes a reference in the section (see sdp_mesh_peer_ref()), and a
+ * retired peer is not freed until its references are released either.
+ */
+SemaphoreHandle_t x_peer_write_semaphore = NULL;
+/* The number of readers in a read section */
+static uint32_t peer_readers = 0;
+/* Deleted peers that may still be used, linked by retired_next */
+static sdp_peer *retired_peers = NULL;
+static int retired_count = 0;
+
+/**
+ * @brief Begin using peers, a peer found in the section is not freed until it has ended
+ * Never blocks, so it can be used in callbacks, see sdp_mesh_read_end().
+ * Do not send or wait in the section, take a reference with sdp_mesh_peer_ref() and end it first.
+ */
+void sdp_mesh_read_begin()
 {
-    struct sdp_peer *peer;
+    __atomic_fetch_add(&peer_readers, 1, __ATOMIC_SEQ_CST);
+}
+
+void sdp_mesh_read_end()
+{
+    __atomic_fetch_sub(&peer_readers, 1, __ATOMIC_RELEASE);
+}
 
-    SLIST_FOREACH(peer, &sdp_peers, next)
+/**
+ * @brief Keep a peer from being freed after the read section it was found in has ended
+ * Must be called in a read section, or while holding another reference. NULL is ignored.
+ * Never blocks, release the reference with sdp_mesh_peer_unref().
+ */
+void sdp_mesh_peer_ref(sdp_peer *peer)
+{
+    if (peer != NULL)
     {
-        if (strcmp(peer->name, name) == 0)
-        {
-            return peer;
-        }
+        __atomic_fetch_add(&peer->ref_count, 1, __ATOMIC_SEQ_CST);
     }
-
-    return NULL;
 }
 
-struct sdp_peer *
-sdp_mesh_find_peer_by_handle(__int16_t peer_handle)
+void sdp_mesh_peer_unref(sdp_peer *peer)
 {
-    struct sdp_peer *peer;
+    if (peer != NULL)
+    {
+        __atomic_fetch_sub(&peer->ref_count, 1, __ATOMIC_RELEASE);
+    }
+}
 
-    SLIST_FOREACH(peer, &sdp_peers, next)
+/**
+ * @brief Free the retired peers that are no longer referenced, if there are no readers.
+ * The write semaphore must be held. Never waits, the rest are tried again on the next change or monitor.
+ */
+static void free_retired_peers()
+{
+    if ((retired_peers == NULL) || (__atomic_load_n(&peer_readers, __ATOMIC_SEQ_CST) != 0))
+    {
+        return;
+    }
+    sdp_peer **link = &retired_peers;
+    while (*link != NULL)
     {
-        ESP_LOGI(mesh_log_prefix, "sdp_peer_find_handle %i, %i ", peer->peer_handle, peer_handle);
-        if (peer->peer_handle == peer_handle)
+        sdp_peer *peer = *link;
+        if (__atomic_load_n(&peer->ref_count, __ATOMIC_ACQUIRE) == 0)
+        {
+            *link = peer->retired_next;
+            free(peer);
+            retired_count--;
+        }
+        else
         {
-            return peer;
+            link = &peer->retired_next;
         }
     }
+}
+
+/* The lookups below use the registry indexes and do not log, as they are made for every frame */
+
+struct sdp_peer *
+sdp_mesh_find_peer_by_name(const sdp_peer_name name)
+{
+    return sdp_registry_find_by_name(name);
+}
 
-    return NULL;
+struct sdp_peer *
+sdp_mesh_find_peer_by_handle(__int16_t peer_handle)
+{
+    return sdp_registry_find_by_handle((uint16_t)peer_handle);
 }
 
 struct sdp_peer *
 sdp_mesh_find_peer_by_base_mac_address(sdp_mac_address mac_address)
 {
-    struct sdp_peer *peer;
+    return sdp_registry_find_by_mac_address(mac_address);
+}
 
-    SLIST_FOREACH(peer, &sdp_peers, next)
-    {
-        
-        if (memcmp(peer->base_mac_address, mac_address, SDP_MAC_ADDR_LEN) == 0)
-        {   
-        ESP_LOGI(mesh_log_prefix, "sdp_mesh_find_peer_by_base_mac_address found:");
-            ESP_LOG_BUFFER_HEX(mesh_log_prefix, mac_address, SDP_MAC_ADDR_LEN);           
-            return peer;
-        }
-    }
-    ESP_LOGI(mesh_log_prefix, "sdp_mesh_find_peer_by_base_mac_address NOT found:");
-    ESP_LOG_BUFFER_HEX(mesh_log_prefix, mac_address, SDP_MAC_ADDR_LEN);
-    return NULL;
+struct sdp_peer *
+sdp_mesh_find_peer_by_relation_id(uint32_t relation_id)
+{
+    return sdp_registry_find_by_relation_id(relation_id);
 }
 
 #ifdef CONFIG_SDP_LOAD_I2C
 struct sdp_peer *
 sdp_mesh_find_peer_by_i2c_address(uint8_t i2c_address)
 {
-    struct sdp_peer *peer;
-
-    ESP_LOGI(mesh_log_prefix, "sdp_mesh_find_peer_by_i2c_address: %hhu", i2c_address);
-
-    SLIST_FOREACH(peer, &sdp_peers, next)
-    {
-
-        if (peer->i2c_address == i2c_address)
-        {
-            return peer;
-        }
-    }
-
-    return NULL;
+    return sdp_registry_find_by_i2c_address(i2c_address);
 }
 #endif
 int sdp_mesh_delete_peer(uint16_t peer_handle)
 {
     struct sdp_peer *peer;
-    int rc;
 
+    if (xSemaphoreTake(x_peer_write_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return -SDP_ERR_SEMAPHORE;
+    }
     peer = sdp_mesh_find_peer_by_handle(peer_handle);
     if (peer == NULL)
     {
+        xSemaphoreGive(x_peer_write_semaphore);
         return SDP_ERR_PEER_NOT_FOUND;
     }
 
@@ -115,9 +159,16 @@ int sdp_mesh_delete_peer(uint16_t peer_handle)
     }
 #endif
 
+    sdp_registry_remove(peer);
+    /* Readers that are at the peer can still follow its next pointer */
     SLIST_REMOVE(&sdp_peers, peer, sdp_peer, next);
 
-    free(peer);
+    peer->retired_next = retired_peers;
+    retired_peers = peer;
+    retired_count++;
+    free_retired_peers();
+
+    xSemaphoreGive(x_peer_write_semaphore);
 
     return 0;
 }
@@ -129,19 +180,27 @@ int sdp_mesh_peer_add(sdp_peer_name name)
 
     ESP_LOGI(mesh_log_prefix, "sdp_mesh_peer_add() - adding SDP peer, name: %s", name);
 
+    if (xSemaphoreTake(x_peer_write_semaphore, portMAX_DELAY) != pdTRUE)
+    {
+        return -SDP_ERR_SEMAPHORE;
+    }
+    free_retired_peers();
+
     /* TODO: Make sure the peer name is unique*/
     peer = sdp_mesh_find_peer_by_name(name);
     if (peer != NULL)
     {
+        xSemaphoreGive(x_peer_write_semaphore);
         return -SDP_ERR_PEER_EXISTS;
     }
 
     peer = malloc(sizeof(sdp_peer));
     if (peer == NULL)
     {
+        xSemaphoreGive(x_peer_write_semaphore);
         ESP_LOGE(mesh_log_prefix, "sdp_mesh_peer_add() - Out of memory!");
         /* Out of memory. */
-        return SDP_ERR_OUT_OF_MEMORY;
+        return -SDP_ERR_OUT_OF_MEMORY;
     }
     memset(peer, 0, sizeof *peer);
     peer->peer_handle = _peer_handle_incrementor_++;
@@ -152,7 +211,17 @@ int sdp_mesh_peer_add(sdp_peer_name name)
 
     sdp_peer_init_peer(peer);
 
-    SLIST_INSERT_HEAD(&sdp_peers, peer, next);
+    if (sdp_registry_add(peer) != 0)
+    {
+        xSemaphoreGive(x_peer_write_semaphore);
+        free(peer);
+        return -SDP_ERR_OUT_OF_MEMORY;
+    }
+    /* Like SLIST_INSERT_HEAD, but the peer is complete before readers can see it */
+    SLIST_NEXT(peer, next) = SLIST_FIRST(&sdp_peers);
+    __atomic_store_n(&SLIST_FIRST(&sdp_peers), peer, __ATOMIC_RELEASE);
+
+    xSemaphoreGive(x_peer_write_semaphore);
 
     ESP_LOGI(mesh_log_prefix, "sdp_mesh_peer_add() - Peer added: %s", peer->name);
 
@@ -205,6 +274,7 @@ sdp_peer *sdp_add_init_new_peer(sdp_peer_name peer_name, const sdp_mac_address m
     if (peer != NULL)
     {
         memcpy(peer->base_mac_address, mac_address, SDP_MAC_ADDR_LEN);
+        sdp_registry_update(peer);
         peer->supported_media_types = media_type;
         init_supported_media_types(peer);
 
@@ -250,6 +320,7 @@ sdp_peer *sdp_add_init_new_peer_i2c(sdp_peer_name peer_name, const uint8_t i2c_a
     if (peer != NULL)
     {
         peer->i2c_address = i2c_address;
+        sdp_registry_update(peer);
         peer->supported_media_types = SDP_MT_I2C;
     }
     else
@@ -277,17 +348,42 @@ sdp_peer *add_peer_by_i2c_address(sdp_peer_name peer_name, uint8_t i2c_address)
 
 #endif
 
+/**
+ * @brief The list of peers, loop it in a read section (see sdp_mesh_read_begin())
+ */
 struct sdp_peers_t * get_peer_list() {
     return &sdp_peers;
 }
 
+void sdp_mesh_on_monitor()
+{
+    sdp_registry_on_monitor();
+    if (xSemaphoreTake(x_peer_write_semaphore, 0) == pdTRUE)
+    {
+        free_retired_peers();
+        if (retired_count > 0)
+        {
+            ESP_LOGW(mesh_log_prefix, "%i deleted peers are waiting for readers or references to finish before being freed.", retired_count);
+        }
+        xSemaphoreGive(x_peer_write_semaphore);
+    }
+}
+
 int sdp_mesh_init(char *_log_prefix)
 {
 
     mesh_log_prefix = _log_prefix;
 
+    x_peer_write_semaphore = xSemaphoreCreateMutex();
+    if (x_peer_write_semaphore == NULL)
+    {
+        ESP_LOGE(mesh_log_prefix, "Failed creating the peer write semaphore!");
+        return -SDP_ERR_SEMAPHORE;
+    }
+
     /* Free memory first in case this function gets called more than once. */
 
+    sdp_registry_init(mesh_log_prefix);
     sdp_peer_init(mesh_log_prefix);
 
     return 0;
@@ -22,12 +22,19 @@ int sdp_mesh_delete_peer(uint16_t peer_handle);
 int sdp_mesh_peer_add(sdp_peer_name name);
 
 int sdp_mesh_init(char *_log_prefix);
+void sdp_mesh_on_monitor();
+
+void sdp_mesh_read_begin();
+void sdp_mesh_read_end();
+void sdp_mesh_peer_ref(sdp_peer *peer);
+void sdp_mesh_peer_unref(sdp_peer *peer);
 
 struct sdp_peers_t * get_peer_list();
 
 struct sdp_peer *sdp_mesh_find_peer_by_name(const sdp_peer_name name);
 struct sdp_peer *sdp_mesh_find_peer_by_handle(__int16_t peer_handle);
 struct sdp_peer *sdp_mesh_find_peer_by_i2c_address(uint8_t i2c_address);
+struct sdp_peer *sdp_mesh_find_peer_by_relation_id(uint32_t relation_id);
 
 sdp_peer *add_peer_by_mac_address(sdp_peer_name peer_name, const sdp_mac_address mac_address, e_media_type media_type);
 #ifdef CONFIG_SDP_LOAD_I2C
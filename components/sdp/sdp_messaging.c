@@ -16,17 +16,22 @@
  */
 #include "sdp_messaging.h"
 #include <esp_log.h>
-#include <esp32/rom/crc.h>
 
 #include "string.h"
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <esp_timer.h>
 
 #include "sdp_mesh.h"
 #include "sdp_helpers.h"
+#include "sdp_crc.h"
+#include "sdp_trace.h"
 #include "orchestration/orchestration.h"
 #include "sdp_worker.h"
+#include "sdp_pool.h"
+#include "sdp_send.h"
+#include "sdp_fragment.h"
 
 #include "sdkconfig.h"
 
@@ -53,8 +58,23 @@ filter_callback *on_filter_data_cb = NULL;
 
 work_callback *on_priority_cb;
 
-SLIST_HEAD(conversation_list, conversation_list_item)
-conversation_l;
+/* Conversation table slot states */
+#define CONVERSATION_EMPTY 0
+#define CONVERSATION_USED 1
+#define CONVERSATION_DELETED 2
+
+/* How many slots are checked for expired conversations on each insert */
+#define CONVERSATION_PRUNE_STEPS 4
+
+/* The handle used for conversations without a peer */
+#define CONVERSATION_NO_PEER UINT16_MAX
+
+/* The conversations, an open-addressing hash table with linear probing */
+struct conversation_list_item conversations[CONFIG_SDP_CONVERSATION_TABLE_SIZE];
+/* The number of used slots */
+int conversation_count = 0;
+/* Where the incremental pruning of expired conversations continues */
+int conversation_prune_cursor = 0;
 
 /* The last created conversation id */
 uint16_t last_conversation_id = 0;
@@ -68,10 +88,47 @@ SemaphoreHandle_t x_conversation_list_semaphore;
 /* Forward declarations*/
 int sdp_send_message(struct sdp_peer *peer, void *data, int data_length);
 
+/**
+ * @brief Write a preamble for a payload that is kept in separate segments
+ * 
+ * @param preamble Where to write the SDP_PREAMBLE_LENGTH bytes of the preamble
+ * @param work_type The type of work
+ * @param conversation_id The conversation id
+ * @param payload The segments of the data following the preamble
+ * @param iovcnt The number of segments
+ */
+void sdp_write_preamble_v(uint8_t *preamble, e_work_type work_type, uint16_t conversation_id, 
+                          const sdp_iovec_t *payload, int iovcnt)
+{
+    preamble[SDP_CRC_LENGTH] = (uint8_t)work_type;
+    /* Low byte first, as handle_incoming() reads it */
+    preamble[SDP_CRC_LENGTH + 1] = (uint8_t)(conversation_id & 0xFF);
+    preamble[SDP_CRC_LENGTH + 2] = (uint8_t)(conversation_id >> 8);
+    // Calc crc on the entire message, continuing over the payload segments
+    uint32_t crc32 = sdp_crc32(0, preamble + SDP_CRC_LENGTH, SDP_PREAMBLE_LENGTH - SDP_CRC_LENGTH);
+    crc32 = sdp_iovec_crc32(crc32, payload, iovcnt);
+    // Put it first in the message
+    memcpy(preamble, &crc32, SDP_CRC_LENGTH);
+}
+
+/**
+ * @brief Write the preamble with crc32 of the data, work type and conversation into the start of a message
+ * The data is expected to already be in place, directly after the SDP_PREAMBLE_LENGTH bytes of the preamble.
+ * @param message The message, beginning with room for the preamble
+ * @param work_type The type of work
+ * @param conversation_id The conversation id
+ * @param data_length The length of the data after the preamble
+ */
+void sdp_write_preamble(uint8_t *message, e_work_type work_type, uint16_t conversation_id, int data_length)
+{
+    sdp_iovec_t payload = {.base = message + SDP_PREAMBLE_LENGTH, .length = data_length};
+    sdp_write_preamble_v(message, work_type, conversation_id, &payload, 1);
+}
+
 /**
  * @brief Create a complete message structure by adding a preamble with crc32 of the data, work type and conversation 
  * NOTE: This makes it possible to free() the original data memory. This could be a good idea if its a large amount.
- * TODO: This should probably be called create message or something like that.
+ * To avoid the copy, build the message with a sdp_message_builder that reserves the preamble.
  * @param work_type The type of work
  * @param conversation_id The conversation id
  * @param data The data to be sent
@@ -81,129 +138,353 @@ int sdp_send_message(struct sdp_peer *peer, void *data, int data_length);
 
 void *sdp_add_preamble(e_work_type work_type, uint16_t conversation_id, const void *data, int data_length)
 {
-    char *preambled_data = malloc(data_length + SDP_PREAMBLE_LENGTH);
-
-    preambled_data[SDP_CRC_LENGTH] = (uint8_t)work_type;
-    preambled_data[SDP_CRC_LENGTH + 1] = (uint8_t)(&conversation_id)[0];
-    preambled_data[SDP_CRC_LENGTH + 2] = (uint8_t)(&conversation_id)[1];
+    uint8_t *preambled_data = malloc(data_length + SDP_PREAMBLE_LENGTH);
+    if (preambled_data == NULL)
+    {
+        return NULL;
+    }
     memcpy(preambled_data + SDP_PREAMBLE_LENGTH, data, (size_t)data_length);
-    // Calc crc on the entire message
-    unsigned int crc32 = crc32_be(0, (uint8_t *)preambled_data + SDP_CRC_LENGTH, 
-        data_length + SDP_PREAMBLE_LENGTH - SDP_CRC_LENGTH);
-    // Put it first in the message
-    memcpy(preambled_data, &crc32, SDP_CRC_LENGTH);
+    sdp_write_preamble(preambled_data, work_type, conversation_id, data_length);
 
     return preambled_data;
 }
 
+/* SWAR (SIMD within a register) constants, 0x0101.. and 0x8080.. in a machine word */
+#define SWAR_ONES ((size_t)-1 / 0xFF)
+#define SWAR_HIGHS (SWAR_ONES * 0x80)
+
+/**
+ * @brief Find the next null byte in data[from..end)
+ * Words without any null byte in them are skipped a word at a time.
+ * @return int The index of the null byte, or end if there are none.
+ */
+static inline int find_null(const char *data, int from, int end)
+{
+    /* Step to a word boundary */
+    while ((from < end) && (((uintptr_t)(data + from) & (sizeof(size_t) - 1)) != 0))
+    {
+        if (data[from] == 0)
+        {
+            return from;
+        }
+        from++;
+    }
+    /* A word has a zero byte if subtracting one from every byte borrows into a high bit that wasn't set */
+    size_t word;
+    while (from + (int)sizeof(size_t) <= end)
+    {
+        memcpy(&word, data + from, sizeof(size_t));
+        if (((word - SWAR_ONES) & ~word & SWAR_HIGHS) != 0)
+        {
+            break;
+        }
+        from += sizeof(size_t);
+    }
+    while ((from < end) && (data[from] != 0))
+    {
+        from++;
+    }
+    return from;
+}
+
+/**
+ * @brief Split the raw data of a queue item into its null-terminated parts
+ * This is done in one pass. The part pointers are kept inside the work item for up to
+ * SDP_INLINE_PART_COUNT parts, longer messages get a pooled array (see sdp_pool.c).
+ * @param queue_item The queue item
+ */
 void parse_message(work_queue_item_t *queue_item)
 {
+    char *data = queue_item->raw_data;
     /* Check that the data ends with a NULL value to avoid having to
     check later (there should always be one there) */
-    if (queue_item->raw_data[queue_item->raw_data_length - 1] != 0)
+    if (data[queue_item->raw_data_length - 1] != 0)
     {
         ESP_LOGW(messaging_log_prefix, "WARNING: The data doesn't end with a NULL value, setting it forcefully!");
-        queue_item->raw_data[queue_item->raw_data_length - 1] = 0;
+        data[queue_item->raw_data_length - 1] = 0;
     }
-    // Count the parts to only need to allocate the array once
-    // TODO: Suppose this loop doesn't take long but it would be interesting not having to do it.
-    // TODO: Since we seem to have to make this pass, can we do something else here?
-    int nullcount = 0;
-    for (int i = 0; i < queue_item->raw_data_length; i++)
+
+    int part_capacity = SDP_INLINE_PART_COUNT;
+    queue_item->parts = queue_item->inline_parts;
+    // The first byte is always the beginning of a part
+    queue_item->parts[0] = data;
+    queue_item->partcount = 1;
+
+    // Set pointers after every null, avoiding the last one which ends everything
+    int end = queue_item->raw_data_length - 1;
+    int pos = find_null(data, 0, end);
+    while (pos < end)
     {
-        if (queue_item->raw_data[i] == 0)
+        if ((queue_item->partcount == part_capacity) && !sdp_grow_parts(queue_item, &part_capacity))
         {
-            nullcount++;
+            ESP_LOGE(messaging_log_prefix, "Out of memory splitting message, only the first %i parts are available.", queue_item->partcount);
+            break;
         }
+        queue_item->parts[queue_item->partcount] = &(data[pos + 1]);
+        queue_item->partcount++;
+        pos = find_null(data, pos + 1, end);
     }
-    queue_item->parts = heap_caps_malloc(nullcount * sizeof(int32_t), MALLOC_CAP_32BIT);
-    // The first byte is always the beginning of a part
+}
 
-    queue_item->parts[0] = queue_item->raw_data;
-    queue_item->partcount = 1;
-    // Loop the data and set pointers, avoiding the last one which ends everything
-    for (int j = 0; j < queue_item->raw_data_length - 1; j++)
+static inline uint16_t conversation_peer_handle(sdp_peer *peer)
+{
+    return peer != NULL ? peer->peer_handle : CONVERSATION_NO_PEER;
+}
+
+/**
+ * @brief The home slot of a conversation in the table (Knuth multiplicative hash)
+ */
+static inline int conversation_home(uint16_t peer_handle, uint16_t conversation_id)
+{
+    uint32_t key = ((uint32_t)peer_handle << 16) | conversation_id;
+    return (key * 2654435761u) % CONFIG_SDP_CONVERSATION_TABLE_SIZE;
+}
+
+/**
+ * @brief Find the slot of a conversation, the semaphore must be held.
+ * @return int The slot, -1 if not found
+ */
+static int conversation_find_slot(uint16_t peer_handle, uint16_t conversation_id)
+{
+    int slot = conversation_home(peer_handle, conversation_id);
+    for (int i = 0; i < CONFIG_SDP_CONVERSATION_TABLE_SIZE; i++)
     {
+        struct conversation_list_item *curr_conversation = &conversations[slot];
+        if (curr_conversation->state == CONVERSATION_EMPTY)
+        {
+            return -1;
+        }
+        if ((curr_conversation->state == CONVERSATION_USED) &&
+            (curr_conversation->conversation_id == conversation_id) &&
+            (curr_conversation->peer_handle == peer_handle))
+        {
+            return slot;
+        }
+        slot = (slot + 1) % CONFIG_SDP_CONVERSATION_TABLE_SIZE;
+    }
+    return -1;
+}
 
-        if (queue_item->raw_data[j] == 0)
+/**
+ * @brief Remove the conversation in a slot, the semaphore must be held.
+ * Entries are never moved, so pointers to other conversations stay valid.
+ */
+static void conversation_remove_slot(int slot)
+{
+    sdp_mesh_peer_unref(conversations[slot].peer);
+    conversations[slot].peer = NULL;
+    conversations[slot].state = CONVERSATION_DELETED;
+    conversation_count--;
+    /* Deleted slots right before an empty one are not part of any probe sequence, empty them */
+    if (conversations[(slot + 1) % CONFIG_SDP_CONVERSATION_TABLE_SIZE].state == CONVERSATION_EMPTY)
+    {
+        while (conversations[slot].state == CONVERSATION_DELETED)
         {
-            queue_item->parts[queue_item->partcount] = &(queue_item->raw_data[j + 1]);
-            queue_item->partcount++;
+            conversations[slot].state = CONVERSATION_EMPTY;
+            slot = (slot + CONFIG_SDP_CONVERSATION_TABLE_SIZE - 1) % CONFIG_SDP_CONVERSATION_TABLE_SIZE;
         }
     }
 }
 
+/**
+ * @brief Remove expired conversations from a number of slots, continuing where the last call stopped.
+ * The semaphore must be held.
+ */
+static void conversation_prune(int64_t now, int steps)
+{
+    for (int i = 0; i < steps; i++)
+    {
+        struct conversation_list_item *curr_conversation = &conversations[conversation_prune_cursor];
+        if ((curr_conversation->state == CONVERSATION_USED) && (curr_conversation->deadline < now))
+        {
+            ESP_LOGD(messaging_log_prefix, "Conversation %hu (%s) expired.", 
+                     curr_conversation->conversation_id, curr_conversation->reason);
+            conversation_remove_slot(conversation_prune_cursor);
+        }
+        conversation_prune_cursor = (conversation_prune_cursor + 1) % CONFIG_SDP_CONVERSATION_TABLE_SIZE;
+    }
+}
+
 /**
  * @brief Add a new conversation
+ * If the conversation already exists (like when a peer replies to a conversation 
+ * we started), it is kept as is, only its deadline is extended.
  *
  * @param peer The peer we are conversing with
  * @param reason The reason for the conversation
  * @param conversation_id if < 0, it is a new conversation we initiated locally.
- * @return int
+ * @return int The conversation id, negative on failure.
  */
 int safe_add_conversation(sdp_peer *peer, const char *reason, int conversation_id)
 {
-    /* Create a conversation list item to keep track */
-
-    struct conversation_list_item *new_item = malloc(sizeof(struct conversation_list_item));
-    new_item->peer = peer;
-    new_item->local = (conversation_id < 0);
-    new_item->reason = malloc(strlen(reason));
-    strcpy(new_item->reason, reason);
+    int retval;
+    uint16_t peer_handle = conversation_peer_handle(peer);
 
     /* Some things needs to be thread-safe */
-    if (pdTRUE == xSemaphoreTake(x_conversation_list_semaphore, portMAX_DELAY))
+    if (pdTRUE != xSemaphoreTake(x_conversation_list_semaphore, portMAX_DELAY))
+    {
+        ESP_LOGE(messaging_log_prefix, "Error: Couldn't get semaphore to add to conversation table!");
+        return -SDP_ERR_SEMAPHORE;
+    }
+    int64_t now = esp_timer_get_time();
+    /* If the table is full, look through all of it before giving up */
+    conversation_prune(now, conversation_count < CONFIG_SDP_CONVERSATION_TABLE_SIZE ? 
+                                CONVERSATION_PRUNE_STEPS : CONFIG_SDP_CONVERSATION_TABLE_SIZE);
+
+    bool local = (conversation_id < 0);
+    if (local)
     {
-        if (new_item->local)
+        // This is a conversation we initiated, skip ids that are still in use with this peer
+        do
         {
-            // This is a conversation we initiated
-            new_item->conversation_id = last_conversation_id++;
+            conversation_id = last_conversation_id++;
+        } while (conversation_find_slot(peer_handle, conversation_id) >= 0);
+    }
+
+    int slot = conversation_home(peer_handle, conversation_id);
+    int free_slot = -1;
+    struct conversation_list_item *curr_conversation = NULL;
+    for (int i = 0; i < CONFIG_SDP_CONVERSATION_TABLE_SIZE; i++)
+    {
+        curr_conversation = &conversations[slot];
+        if (curr_conversation->state == CONVERSATION_USED)
+        {
+            if ((curr_conversation->conversation_id == conversation_id) &&
+                (curr_conversation->peer_handle == peer_handle))
+            {
+                break;
+            }
         }
         else
         {
-            // Initiated by the other peer
-            new_item->conversation_id = conversation_id;
+            if (free_slot < 0)
+            {
+                free_slot = slot;
+            }
+            if (curr_conversation->state == CONVERSATION_EMPTY)
+            {
+                break;
+            }
         }
+        curr_conversation = NULL;
+        slot = (slot + 1) % CONFIG_SDP_CONVERSATION_TABLE_SIZE;
+    }
 
-        SLIST_INSERT_HEAD(&conversation_l, new_item, items);
-        xSemaphoreGive(x_conversation_list_semaphore);
-        return new_item->conversation_id;
+    if (curr_conversation == NULL || curr_conversation->state != CONVERSATION_USED)
+    {
+        if (free_slot < 0)
+        {
+            ESP_LOGE(messaging_log_prefix, "Error: The conversation table is full (%i conversations)!", conversation_count);
+            xSemaphoreGive(x_conversation_list_semaphore);
+            return -SDP_ERR_CONV_QUEUE_FULL;
+        }
+        curr_conversation = &conversations[free_slot];
+        curr_conversation->conversation_id = conversation_id;
+        curr_conversation->peer_handle = peer_handle;
+        /* The conversation keeps the peer until it is removed */
+        sdp_mesh_peer_ref(peer);
+        curr_conversation->peer = peer;
+        curr_conversation->local = local;
+        strlcpy(curr_conversation->reason, reason, SDP_CONVERSATION_REASON_LEN);
+        curr_conversation->state = CONVERSATION_USED;
+        conversation_count++;
     }
-    else
+    curr_conversation->deadline = now + ((int64_t)CONFIG_SDP_CONVERSATION_TIMEOUT_MS * 1000);
+    retval = curr_conversation->conversation_id;
+
+    xSemaphoreGive(x_conversation_list_semaphore);
+    return retval;
+}
+
+/**
+ * @brief Tells if handle_incoming() would reject the frame because the work queue is full
+ * Media with receipts use this to answer with a negative receipt, so that the sender backs off and resends.
+ */
+bool sdp_frame_refused(const uint8_t *data, int data_len)
+{
+    if (data_len <= SDP_PREAMBLE_LENGTH)
     {
-        ESP_LOGE(messaging_log_prefix, "Error: Couldn't get semaphore to add to conversation queue!");
-        return -SDP_ERR_SEMAPHORE;
+        return false;
+    }
+    switch (data[4])
+    {
+    case REQUEST:
+    case REPLY:
+    case DATA:
+        return sdp_work_queue_full();
+    default:
+        return false;
     }
 }
 
-int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type)
+/**
+ * @brief Queue an incoming message for the workers, it is freed if the queue is full
+ */
+static int queue_work_item(work_queue_item_t *new_item)
 {
-    ESP_LOGI(messaging_log_prefix, "<< Payload length: %i, call count %i, CRC32: %"PRIu32".", data_len, callcount++,
-             crc32_be(0, data, data_len));
+    esp_err_t rc = sdp_safe_add_work_queue(new_item);
+    if (rc != ESP_OK)
+    {
+        ESP_LOGE(messaging_log_prefix, "<< Error: Could not queue the message (work type %u, conv.id %u), error %i.",
+                 new_item->work_type, new_item->conversation_id, rc);
+        sdp_free_work_item(new_item);
+        return rc;
+    }
+    return 0;
+}
 
-    ESP_LOG_BUFFER_HEXDUMP(messaging_log_prefix, data, data_len, ESP_LOG_INFO);
+int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type)
+{
+    /* The CRC is taken from the preamble, it has been checked by the media if it needs to */
+    uint32_t crc32 = data_len >= SDP_CRC_LENGTH ? sdp_frame_crc(data) : 0;
+    SDP_TRACE(SDP_TRACE_RX, peer, media_type, data_len, crc32);
+    callcount++;
+    SDP_FRAME_LOGI(messaging_log_prefix, "<< Payload length: %i, call count %i, CRC32: %"PRIu32".", data_len, callcount, crc32);
+    SDP_FRAME_HEXDUMP(messaging_log_prefix, data, data_len);
+
+    /* Fragments are reassembled before they become work items, the complete frame comes back here */
+    if ((data_len > SDP_PREAMBLE_LENGTH) && (data[4] == FRAGMENT))
+    {
+        return sdp_fragment_on_fragment(peer, data, data_len, media_type);
+    }
+    if ((data_len > SDP_PREAMBLE_LENGTH) && (data[4] == FRAGMENT_STATUS))
+    {
+        return sdp_fragment_on_status(peer, data, data_len);
+    }
 
     work_queue_item_t *new_item;
 
     if (data_len > SDP_PREAMBLE_LENGTH)
     {
-        // TODO: Change malloc to something more optimized?
-        new_item = malloc(sizeof(work_queue_item_t));
-        new_item->crc32 = (uint32_t)data[0];
+        /* The work item and its data are taken from the pools, see sdp_pool.c */
+        new_item = sdp_alloc_work_item(data_len - SDP_PREAMBLE_LENGTH);
+        if (new_item == NULL)
+        {
+            ESP_LOGE(messaging_log_prefix, "<< Error: Out of memory, could not allocate a work item for %i bytes.", data_len);
+            return SDP_ERR_OUT_OF_MEMORY;
+        }
+        new_item->crc32 = crc32;
         new_item->work_type = (uint8_t)data[4];
-        new_item->conversation_id = (uint16_t)data[5];
-        new_item->raw_data_length = data_len - SDP_PREAMBLE_LENGTH;
-        new_item->raw_data = malloc(new_item->raw_data_length);
+        new_item->conversation_id = (uint16_t)data[5] | ((uint16_t)data[6] << 8);
         memcpy(new_item->raw_data, &(data[SDP_PREAMBLE_LENGTH]), new_item->raw_data_length);
 
         new_item->media_type = media_type;
+        /* The item may outlive the receiver's read section, it is released by sdp_free_work_item() */
+        sdp_mesh_peer_ref(peer);
         new_item->peer = peer;
+        new_item->received_at = esp_timer_get_time();
+        /* A request is answered to the peer, and the reply is of no use after the peer has gone to sleep.
+        Other work is still worth doing, so it is not given a deadline. */
+        if (new_item->work_type == REQUEST)
+        {
+            new_item->stamp.deadline = sdp_orchestration_deadline(peer);
+        }
         parse_message(new_item);
 
         // Save the conversation
         safe_add_conversation(peer, "external", new_item->conversation_id);
 
-        ESP_LOGI(messaging_log_prefix, "<< Message info : Work type: %u, Conv.id: %u, Media type: %u,Data len: %u, Message parts: %i.",
+        ESP_LOGI(messaging_log_prefix, "<< Message info : Work type: %u, Conv.id: %u, Media type: %u,Data len: %"PRIu32", Message parts: %i.",
                  new_item->work_type, new_item->conversation_id,
                  new_item->media_type, new_item->raw_data_length, new_item->partcount);
     }
@@ -226,17 +507,18 @@ int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_t
             if (on_filter_request_cb(new_item) == 0)
             {
                 // Add the request to the work queue
-                sdp_safe_add_work_queue(new_item);
+                return queue_work_item(new_item);
             }
             else
             {
                 ESP_LOGE(messaging_log_prefix, "<< SDP messaging: on_filter_request_cb returned a nonzero value, request not added to queue!");
+                sdp_free_work_item(new_item);
                 return SDP_ERR_MESSAGE_FILTERED;
             }
         }
         else
         {
-            sdp_safe_add_work_queue(new_item);
+            return queue_work_item(new_item);
         }
         break;
     case REPLY:
@@ -246,17 +528,18 @@ int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_t
             if (on_filter_reply_cb(new_item) == 0)
             {
                 // Add the request to the work queue
-                sdp_safe_add_work_queue(new_item);
+                return queue_work_item(new_item);
             }
             else
             {
                 ESP_LOGE(messaging_log_prefix, "<< SDP messaging: on_filter_request_cb returned a nonzero value, request not added to queue!");
+                sdp_free_work_item(new_item);
                 return SDP_ERR_MESSAGE_FILTERED;
             }
         }
         else
         {
-            sdp_safe_add_work_queue(new_item);
+            return queue_work_item(new_item);
         }
         break;
     case DATA:
@@ -266,17 +549,18 @@ int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_t
             if (on_filter_data_cb(new_item) == 0)
             {
                 // Add the request to the work queue
-                sdp_safe_add_work_queue(new_item);
+                return queue_work_item(new_item);
             }
             else
             {
                 ESP_LOGE(messaging_log_prefix, "<< SDP messaging: on_filter_data_cb returned a nonzero value, request not added to queue!");
+                sdp_free_work_item(new_item);
                 return SDP_ERR_MESSAGE_FILTERED;
             }
         }
         else
         {
-            sdp_safe_add_work_queue(new_item);
+            return queue_work_item(new_item);
         }
         break;
 
@@ -299,7 +583,7 @@ int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_t
                 }
             }
         }
-
+        sdp_free_work_item(new_item);
         break;
     case ORCHESTRATION:
         if (strcmp(new_item->parts[0], "WHEN") == 0)
@@ -311,45 +595,51 @@ int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_t
         {
             sdp_orchestration_parse_next_message(new_item);
         }
+        sdp_free_work_item(new_item);
         break;
 
     case PRIORITY:
         /* This is likely to be some kind of problem report or alarm,
         immidiately respond with CRC32 to tell the
         reporter that the information has reached the controller. */
-        // TODO: Consider if the response perhaps whould be nonblocking (perhaps this is not needed if all media have queues)
-        sdp_send_message(new_item->peer, &(new_item->crc32), 2);
+        // This is called from the receiving context, so it must neither wait for the radio nor the heap.
+        // sdp_send_ack() does neither, if the acknowledgement can't be queued right away it is dropped.
+        sdp_send_ack(new_item->peer, &(new_item->crc32), 2);
 
-        /* Do NOT add the work item to the queue, it will be immidiately adressed in the callback */
+        /* Do NOT add the work item to the normal queue, the priority worker preempts it */
 
         if (on_priority_cb != NULL)
         {
-            ESP_LOGW(messaging_log_prefix, "<< SDP Calling on_priority_callback!");
-
-            on_priority_cb(new_item);
+            ESP_LOGW(messaging_log_prefix, "<< SDP Queueing for on_priority_callback!");
+            /* The priority worker returns the item to the pool when the callback is done */
+            esp_err_t rc = sdp_safe_add_priority_queue(new_item);
+            if (rc != ESP_OK)
+            {
+                ESP_LOGE(messaging_log_prefix, "<< Error: Could not queue the priority message (conv.id %u), error %i.",
+                         new_item->conversation_id, rc);
+                sdp_free_work_item(new_item);
+                return rc;
+            }
         }
         else
         {
             ESP_LOGE(messaging_log_prefix, "<< ERROR: SDP on_priority callback is not assigned, assigning to normal handling!");
-            sdp_safe_add_work_queue(new_item);
+            return queue_work_item(new_item);
         }
         break;
     case QOS:
         // Don't do much here, usually
+        sdp_free_work_item(new_item);
         break;
 
     default:
         ESP_LOGE(messaging_log_prefix, "<< ERROR: Invalid work type (%i)!", new_item->work_type);
+        sdp_free_work_item(new_item);
         return 1;
     }
     return 0;
 }
 
-// TODO: The following is inactivated for two reasons:
-// 1. I don't properly understand how *declare* the sdp_peers list in a way that can be share using the extern keyword
-// 1. FIX: This has now been understood, see mesh.h for the new solution
-// 2. This might not be how to broadcast as it is not thread safe if a peer disconnects and the memory is freed, we will crash
-#if 0
 /**
  * @brief Send a message to one or more peers
  *
@@ -360,15 +650,37 @@ int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_t
  * @param data_length The length of the data in bytes
  * @return int A negative return value will mean a failure of the operation
  * TODO: Handle partial failure, for example if one peripheral doesn't answer.
+ * NOTE: Sending may take seconds, so the peers are referenced in a read section and sent to after it,
+ * a peer that is deleted meanwhile is not freed under us, and deleting is not held up.
  */
 int broadcast_message(uint16_t conversation_id,
                       enum e_work_type work_type, void *data, int data_length)
 {
+    /* There are never more peers than fit in the registry */
+    struct sdp_peer **peers = malloc(sizeof(struct sdp_peer *) * CONFIG_SDP_PEER_REGISTRY_SIZE);
     struct sdp_peer *curr_peer;
     int total = 0, errors = 0;
     int ret;
-    SLIST_FOREACH(curr_peer, &sdp_peers, next)
+    if (peers == NULL)
+    {
+        ESP_LOGE(messaging_log_prefix, "Error: broadcast_message: Out of memory!");
+        return -SDP_ERR_OUT_OF_MEMORY;
+    }
+    sdp_mesh_read_begin();
+    SLIST_FOREACH(curr_peer, get_peer_list(), next)
+    {
+        if (total == CONFIG_SDP_PEER_REGISTRY_SIZE)
+        {
+            break;
+        }
+        sdp_mesh_peer_ref(curr_peer);
+        peers[total++] = curr_peer;
+    }
+    sdp_mesh_read_end();
+
+    for (int i = 0; i < total; i++)
     {
+        curr_peer = peers[i];
         ret = sdp_send_message(curr_peer, data, data_length);
         if (ret < 0)
         {
@@ -379,9 +691,9 @@ int broadcast_message(uint16_t conversation_id,
         {
             ESP_LOGI(messaging_log_prefix, "Sent a message to peer: %s Code: %i", curr_peer->name, ret);
         }
-
-        total++;
+        sdp_mesh_peer_unref(curr_peer);
     }
+    free(peers);
 
     if (total == 0)
     {
@@ -406,30 +718,45 @@ int broadcast_message(uint16_t conversation_id,
     }
 }
 
-#endif
-
 
 
 /**
- * @brief Sends to a specified peer
+ * @brief Log the segments of an outgoing frame, if per-frame logging is enabled
+ */
+static void log_segments(const sdp_iovec_t *iov, int iovcnt)
+{
+    for (int i = 0; i < iovcnt; i++)
+    {
+        SDP_FRAME_HEXDUMP(messaging_log_prefix, iov[i].base, iov[i].length);
+    }
+}
 
+/**
+ * @brief Sends a frame, given as segments, to a specified peer using a specific media type
+ * The segments are only gathered into one buffer by the media, if it needs that.
  */
-int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_length, e_media_type media_type, bool just_checking)
+int sdp_send_message_media_type_v(struct sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, e_media_type media_type, bool just_checking)
 {
     // Should this function also be put in a separate file? Perhaps along with other #ifs? To simplify and clean up this one?
     int rc = 0;
     int result = ESP_FAIL;
+    int data_length = sdp_iovec_length(iov, iovcnt);
     
 
     sdp_media_types host_supported_media_types = get_host_supported_media_types();
 
-    ESP_LOGI(messaging_log_prefix, ">> sdp_send_message_media_type called, media type: %hhu ", media_type);
+    SDP_FRAME_LOGI(messaging_log_prefix, ">> sdp_send_message_media_type called, media type: %hhu, %i bytes in %i segments.", media_type, data_length, iovcnt);
 
     if (!(host_supported_media_types & media_type)) {
         ESP_LOGE(messaging_log_prefix, ">> sdp_send_message_media_type called, media type %hhu not supported, available are %hhu", media_type, host_supported_media_types);
         return -SDP_ERR_NOT_SUPPORTED;
     }
 
+    if (data_length > sdp_fragment_mtu(media_type))
+    {
+        return sdp_fragment_send(peer, iov, iovcnt, media_type, just_checking);
+    }
+
 #ifdef CONFIG_SDP_LOAD_BLE
 
     // TODO; The BLE-connection handle stuff feels like it needs to be reworked. 
@@ -438,7 +765,7 @@ int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_leng
     // Send message using BLE
     if (media_type == SDP_MT_BLE)
     {
-        rc = ble_send_message(peer->ble_conn_handle, data, data_length);
+        rc = ble_send_message_v(peer->ble_conn_handle, iov, iovcnt);
         if (rc == 0)
         {
             result = SDP_MT_BLE;
@@ -446,7 +773,7 @@ int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_leng
         else
         {
             report_ble_connection_error(peer->ble_conn_handle, rc);
-            result = -SDP_MT_BLE
+            result = -SDP_MT_BLE;
 
         }
     }
@@ -456,13 +783,15 @@ int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_leng
     if (media_type == SDP_MT_ESPNOW)
     {
         if (!just_checking) {
-            ESP_LOGI(messaging_log_prefix, ">> ESP-NOW sending to: ");
-            ESP_LOG_BUFFER_HEX(messaging_log_prefix, peer->base_mac_address, SDP_MAC_ADDR_LEN);
-            ESP_LOGI(messaging_log_prefix, ">> Data (including 4 bytes preamble): ");
-            ESP_LOG_BUFFER_HEXDUMP(messaging_log_prefix, data, data_length, ESP_LOG_INFO);
+            SDP_FRAME_LOGI(messaging_log_prefix, ">> ESP-NOW sending to: ");
+            SDP_FRAME_HEX(messaging_log_prefix, peer->base_mac_address, SDP_MAC_ADDR_LEN);
+            SDP_FRAME_LOGI(messaging_log_prefix, ">> Data (including 4 bytes preamble): ");
+            log_segments(iov, iovcnt);
    
         }
-        rc = espnow_send_message(peer->base_mac_address, data, data_length, just_checking);
+        /* The send callback tells when it was delivered */
+        sdp_link_on_send(&peer->espnow_stats.link, data_length);
+        rc = espnow_send_message_v(peer->base_mac_address, iov, iovcnt, just_checking);
         if (rc == 0)
         {
             result = SDP_MT_ESPNOW;
@@ -484,12 +813,12 @@ int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_leng
 
     if (media_type == SDP_MT_LoRa)
     {
-        ESP_LOGI(messaging_log_prefix, ">> LoRa sending to: ");
-        ESP_LOG_BUFFER_HEX(messaging_log_prefix, peer->base_mac_address, SDP_MAC_ADDR_LEN);
-        ESP_LOGI(messaging_log_prefix, ">> Data (including 4 bytes preamble): ");
-        ESP_LOG_BUFFER_HEXDUMP(messaging_log_prefix, data, data_length, ESP_LOG_INFO);
+        SDP_FRAME_LOGI(messaging_log_prefix, ">> LoRa sending to: ");
+        SDP_FRAME_HEX(messaging_log_prefix, peer->base_mac_address, SDP_MAC_ADDR_LEN);
+        SDP_FRAME_LOGI(messaging_log_prefix, ">> Data (including 4 bytes preamble): ");
+        log_segments(iov, iovcnt);
 
-        rc = lora_safe_add_work_queue(peer, data, data_length, just_checking);
+        rc = lora_safe_add_work_queue_v(peer, iov, iovcnt, just_checking);
         if (rc == 0)
         {
             result = SDP_MT_LoRa;
@@ -506,11 +835,11 @@ int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_leng
 
     if (media_type == SDP_MT_I2C)
     {
-        ESP_LOGI(messaging_log_prefix, ">> I2C sending to I2C host: %hhu ", peer->i2c_address);
-        ESP_LOGI(messaging_log_prefix, ">> Data (including 4 bytes preamble): ");
-        ESP_LOG_BUFFER_HEXDUMP(messaging_log_prefix, data, data_length, ESP_LOG_INFO);
+        SDP_FRAME_LOGI(messaging_log_prefix, ">> I2C sending to I2C host: %hhu ", peer->i2c_address);
+        SDP_FRAME_LOGI(messaging_log_prefix, ">> Data (including 4 bytes preamble): ");
+        log_segments(iov, iovcnt);
 
-        rc = i2c_safe_add_work_queue(peer, data, data_length, just_checking);
+        rc = i2c_safe_add_work_queue_v(peer, iov, iovcnt, just_checking);
         if (rc == 0)
         {
             result = SDP_MT_I2C;
@@ -523,26 +852,40 @@ int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_leng
         }
     }
 #endif
+    /* LoRa and I2C frames are only queued here, their workers trace them when they are sent */
+    if ((!just_checking) && ((media_type == SDP_MT_BLE) || (media_type == SDP_MT_ESPNOW)))
+    {
+        SDP_TRACE(result > 0 ? SDP_TRACE_TX : SDP_TRACE_TX_FAIL, peer, media_type, data_length, sdp_frame_crc(iov[0].base));
+    }
     return result;
 }
 
 /**
- * @brief Sends to a specified peer
+ * @brief Sends a frame to a specified peer using a specific media type
+ */
+int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_length, e_media_type media_type, bool just_checking)
+{
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return sdp_send_message_media_type_v(peer, &iov, 1, media_type, just_checking);
+}
 
+/**
+ * @brief Sends to a specified peer, the frame is given as segments that are gathered by the media if needed
+ * Blocks through retries, see sdp_send_async() for a non-blocking alternative.
  */
-int sdp_send_message(struct sdp_peer *peer, void *data, int data_length)
+int sdp_send_message_v(struct sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt)
 {
 
     int rc = ESP_FAIL;
     int retries = 0;
-    e_media_type preferred = SDP_MT_NONE;
+    int data_length = sdp_iovec_length(iov, iovcnt);
     ESP_LOGI(messaging_log_prefix, ">> peer->supported_media_types: %hhx ", peer->supported_media_types);
 
     do
     {
         // For each try, we need to reevalue what media we are selecting.
         e_media_type selected_media_type = select_media(peer, data_length);
-        rc = sdp_send_message_media_type(peer, data, data_length, selected_media_type, false);
+        rc = sdp_send_message_media_type_v(peer, iov, iovcnt, selected_media_type, false);
         if (rc < 0)
         {
             if (retries < 4) {
@@ -558,29 +901,55 @@ int sdp_send_message(struct sdp_peer *peer, void *data, int data_length)
 
     return rc;
 }
+
+/**
+ * @brief Sends to a specified peer
+
+ */
+int sdp_send_message(struct sdp_peer *peer, void *data, int data_length)
+{
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return sdp_send_message_v(peer, &iov, 1);
+}
 /**
  * @brief Replies to the sender in the queue item
- * Automatically adds the correct SDP preamble, data is
+ * Automatically adds the correct SDP preamble. 
+ * The reply is sent asynchronously, failures after it is queued are only logged.
  *
  * @param queue_item
  * @param work_type
  * @param data
  * @param data_length
- * @return int
+ * @return int SDP_OK if the reply was queued, a negative error otherwise
  */
 int sdp_reply(work_queue_item_t queue_item, enum e_work_type work_type, const void *data, int data_length)
 {
-    int retval = SDP_OK;
-    // Add preamble with all SDP specifics in a new data
-    void *new_data = sdp_add_preamble(work_type, queue_item.conversation_id, data, data_length);
+    // The preamble with all SDP specifics is sent as a separate segment, so the data isn't copied
+    uint8_t preamble[SDP_PREAMBLE_LENGTH];
+    sdp_iovec_t iov[2] = {{.base = preamble, .length = SDP_PREAMBLE_LENGTH},
+                          {.base = data, .length = data_length}};
+    sdp_write_preamble_v(preamble, work_type, queue_item.conversation_id, &iov[1], 1);
 
     ESP_LOGD(messaging_log_prefix, ">> In sdp reply.");
-    retval = sdp_send_message(queue_item.peer, new_data, data_length + SDP_PREAMBLE_LENGTH);
-    free(new_data);
-    return retval;
+    return sdp_send_async_v(queue_item.peer, iov, 2, NULL, NULL, NULL);
 }
+
+/**
+ * @brief Removes a conversation if its first message finally failed to be sent
+ */
+static void on_conversation_sent(sdp_peer *peer, int result, void *cb_arg)
+{
+    if (result < 0)
+    {
+        uint16_t conversation_id = (uint16_t)(uintptr_t)cb_arg;
+        ESP_LOGE(messaging_log_prefix, "Error %i in communication, removing conversation %hu.", result, conversation_id);
+        end_conversation(peer, conversation_id);
+    }
+}
+
 /**
  * @brief Start a new conversation
+ * The message is sent asynchronously, if sending it finally fails, the conversation is removed.
  *
  * @param peer The peer
  * @param work_type The type of work
@@ -593,40 +962,33 @@ int start_conversation(sdp_peer *peer, enum e_work_type work_type,
                        const char *reason, const void *data, int data_length)
 {
     int retval = -SDP_ERR_SEND_FAIL;
+    if (peer == NULL)
+    {
+        /* See the definition of broadcast_message for information */
+        return -SDP_ERR_NOT_SUPPORTED;
+    }
     // Create and add a new conversation item and add to queue
     int new_conversation_id = safe_add_conversation(peer, reason, -1);
     if (new_conversation_id >= 0) //
     {
-        // Add preamble including all SDP specifics in a new data
-        void *new_data = sdp_add_preamble(work_type, new_conversation_id, data, data_length);
-        if (peer == NULL)
-        {
-            retval = SDP_ERR_NOT_SUPPORTED;
-            /* See definition for information
-            retval = broadcast_message(new_conversation_id, work_type,
-                                        new_data, data_length + SDP_PREAMBLE_LENGTH);
-            */
-        }
-        else
-        {
-            retval = sdp_send_message(peer, new_data, data_length + SDP_PREAMBLE_LENGTH);
-        }
-        free(new_data);
+        // The preamble including all SDP specifics is sent as a separate segment
+        uint8_t preamble[SDP_PREAMBLE_LENGTH];
+        sdp_iovec_t iov[2] = {{.base = preamble, .length = SDP_PREAMBLE_LENGTH},
+                              {.base = data, .length = data_length}};
+        sdp_write_preamble_v(preamble, work_type, new_conversation_id, &iov[1], 1);
+        retval = sdp_send_async_v(peer, iov, 2, &on_conversation_sent, (void *)(uintptr_t)new_conversation_id, NULL);
 
         if (retval < 0)
         {
-            if (retval == -SDP_WARN_NO_PEERS)
-            {
-                ESP_LOGW(messaging_log_prefix, "Removing conversation, no peers");
-            }
-            else
-            {
-                ESP_LOGE(messaging_log_prefix, "Error %i in communication, removing conversation.", retval);
-            }
+            ESP_LOGE(messaging_log_prefix, "Error %i in communication, removing conversation.", retval);
             /* The communication failed, remove the conversation*/
-            end_conversation(new_conversation_id);
+            end_conversation(peer, new_conversation_id);
             retval = -SDP_ERR_SEND_FAIL;
         }
+        else
+        {
+            retval = new_conversation_id;
+        }
     }
     else
     {
@@ -638,34 +1000,61 @@ int start_conversation(sdp_peer *peer, enum e_work_type work_type,
     return retval;
 }
 
-int end_conversation(uint16_t conversation_id)
+/**
+ * @brief End a conversation, removing it from the conversation table
+ *
+ * @param peer The peer of the conversation
+ * @param conversation_id The conversation id
+ * @return int SDP_OK, or SDP_ERR_CONV_QUEUE if it wasn't found
+ */
+int end_conversation(sdp_peer *peer, uint16_t conversation_id)
 {
-    struct conversation_list_item *curr_conversation;
-    SLIST_FOREACH(curr_conversation, &conversation_l, items)
+    int retval = SDP_ERR_CONV_QUEUE;
+    if (pdTRUE != xSemaphoreTake(x_conversation_list_semaphore, portMAX_DELAY))
     {
-        if (curr_conversation->conversation_id == conversation_id)
-        {
-            SLIST_REMOVE(&conversation_l, curr_conversation, conversation_list_item, items);
-            free(curr_conversation->reason);
-            free(curr_conversation);
-            return SDP_OK;
-        }
+        ESP_LOGE(messaging_log_prefix, "Error: Couldn't get semaphore to end a conversation!");
+        return -SDP_ERR_SEMAPHORE;
     }
-    return SDP_ERR_CONV_QUEUE;
+    int slot = conversation_find_slot(conversation_peer_handle(peer), conversation_id);
+    if (slot >= 0)
+    {
+        conversation_remove_slot(slot);
+        retval = SDP_OK;
+    }
+    xSemaphoreGive(x_conversation_list_semaphore);
+    return retval;
 }
 
+/**
+ * @brief Find a conversation
+ * NOTE: The returned conversation is valid until it is ended or expires.
+ *
+ * @param peer The peer of the conversation
+ * @param conversation_id The conversation id
+ * @return struct conversation_list_item* The conversation, NULL if not found or expired
+ */
 struct conversation_list_item *find_conversation(sdp_peer *peer, uint16_t conversation_id)
 {
-    struct conversation_list_item *curr_conversation;
-    SLIST_FOREACH(curr_conversation, &conversation_l, items)
+    struct conversation_list_item *retval = NULL;
+    if (pdTRUE != xSemaphoreTake(x_conversation_list_semaphore, portMAX_DELAY))
     {
-        if ((curr_conversation->conversation_id == conversation_id) &&
-            (curr_conversation->peer->peer_handle == peer->peer_handle))
+        ESP_LOGE(messaging_log_prefix, "Error: Couldn't get semaphore to find a conversation!");
+        return NULL;
+    }
+    int slot = conversation_find_slot(conversation_peer_handle(peer), conversation_id);
+    if (slot >= 0)
+    {
+        if (conversations[slot].deadline < esp_timer_get_time())
+        {
+            conversation_remove_slot(slot);
+        }
+        else
         {
-            return curr_conversation;
+            retval = &conversations[slot];
         }
     }
-    return NULL;
+    xSemaphoreGive(x_conversation_list_semaphore);
+    return retval;
 }
 
 void sdp_init_messaging(char *_log_prefix, work_callback *priority_cb)
@@ -679,6 +1068,8 @@ void sdp_init_messaging(char *_log_prefix, work_callback *priority_cb)
     /* Create a queue semaphore to ensure thread safety */
     x_conversation_list_semaphore = xSemaphoreCreateMutex();
 
-    /* Conversation list initialisation */
-    SLIST_INIT(&conversation_l);
+    /* Conversation table initialisation */
+    memset(conversations, 0, sizeof(conversations));
+    conversation_count = 0;
+    conversation_prune_cursor = 0;
 }
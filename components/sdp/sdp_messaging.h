@@ -1,29 +1,36 @@
 #ifndef _SDP_MESSAGING_H_
 #define _SDP_MESSAGING_H_
 
-#include <sys/queue.h> 
 #include "stdint.h"
 
 #include "sdp_def.h"
 #include "sdp_peer.h"
 
+/* The maximum length of a conversation reason, including the null terminator */
+#define SDP_CONVERSATION_REASON_LEN 24
+
 /**
- * @brief The peer's list of conversations.
+ * @brief A conversation in the conversation table.
+ * The table is keyed by peer handle and conversation id, entries expire after 
+ * CONFIG_SDP_CONVERSATION_TIMEOUT_MS if they are not ended before that.
  */
 
 struct conversation_list_item
 {
     /* The conversation it belongs to */
-    uint8_t conversation_id; 
-    /* The reason for the conversation */ 
-    char *reason;
-    /* A pointer to the peer object */
+    uint16_t conversation_id; 
+    /* The handle of the peer, together with the conversation id this is the key */
+    uint16_t peer_handle;
+    /* The reason for the conversation (stored inline, longer reasons are truncated) */ 
+    char reason[SDP_CONVERSATION_REASON_LEN];
+    /* The peer object, referenced until the conversation is removed, so it stays valid even if the peer is deleted */
     sdp_peer *peer;         
      /* Is it local? I.e. is this conversation*/
     bool local;     
-           
-    SLIST_ENTRY(conversation_list_item)
-    items;
+    /* The slot state in the table, empty, used or deleted */
+    uint8_t state;
+    /* When the conversation expires (esp_timer_get_time()-microseconds) */
+    int64_t deadline;
 };
 
 
@@ -37,16 +44,17 @@ extern filter_callback *on_filter_data_cb;
 void parse_message(work_queue_item_t *queue_item);
 
 int handle_incoming(sdp_peer *peer, const  uint8_t *data, int data_len, e_media_type media_type);
+bool sdp_frame_refused(const uint8_t *data, int data_len);
 
-/* See definition
 int broadcast_message(uint16_t conversation_id,
                       enum e_work_type work_type, void *data, int data_length);
-*/
 int start_conversation(sdp_peer *peer, e_work_type work_type,
                        const char *reason, const void *data, int data_length);
-int end_conversation(uint16_t conversation_id);
+int end_conversation(sdp_peer *peer, uint16_t conversation_id);
 int sdp_send_message_media_type(struct sdp_peer *peer, void *data, int data_length, e_media_type media_type, bool just_checking);
 int sdp_send_message(struct sdp_peer *peer, void *data, int data_length);
+int sdp_send_message_media_type_v(struct sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, e_media_type media_type, bool just_checking);
+int sdp_send_message_v(struct sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt);
 
 
 
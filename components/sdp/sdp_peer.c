@@ -3,13 +3,14 @@
 
 #include <string.h>
 #include <esp_log.h>
-#include <esp32/rom/crc.h>
+#include <esp_timer.h>
 
 #include <esp_attr.h>
 
 #include "sdp_helpers.h"
 #include "sdp_messaging.h"
 #include "sdp_mesh.h"
+#include "sdp_registry.h"
 
 #ifdef CONFIG_SDP_LOAD_I2C
 #include "i2c/i2c_peer.h"
@@ -21,46 +22,50 @@
 #ifdef CONFIG_SDP_LOAD_ESP_NOW
 #include "espnow/espnow_peer.h"
 #endif
-char *peer_log_prefix;
 
+/* Upper bound of a HI-message: fixed fields, their separators and the host name */
+#define HI_MESSAGE_MAX_LENGTH (40 + CONFIG_SDP_PEER_NAME_LEN)
 
-struct relation {
-    uint32_t relation_id;
-    sdp_mac_address mac_address;
-    #ifdef CONFIG_SDP_LOAD_I2C
-    uint8_t i2c_address;
-    #endif
-};
-
-float add_to_failure_rate_history(struct sdp_peer_media_stats *stats, float rate) {
-    // Calc average of the current history + rate, start with summarizing
-    float sum = 0;
-    for (int i=0; i< FAILURE_RATE_HISTORY_LENGTH; i++) {
-        sum+= stats->failure_rate_history[i];
-        ESP_LOGD(peer_log_prefix, "FRH history %i: fr: %f", i, stats->failure_rate_history[i]);
-    }   
-    sum+=rate;
-    // Move the array one step to the left
-    memmove((void *)(stats->failure_rate_history), (void *)(stats->failure_rate_history) + sizeof(float),  sizeof(float)* (FAILURE_RATE_HISTORY_LENGTH - 1));
-    stats->failure_rate_history[FAILURE_RATE_HISTORY_LENGTH -1] = rate;
+char *peer_log_prefix;
 
-    ESP_LOGD(peer_log_prefix, "FRH avg %f", (float)(sum/(FAILURE_RATE_HISTORY_LENGTH + 1)));
 
-    return sum/(FAILURE_RATE_HISTORY_LENGTH + 1);
+/**
+ * @brief Forget the selected medias, so that they are scored again when next sent to
+ */
+void sdp_peer_invalidate_media_selection(sdp_peer *peer)
+{
+    memset(peer->media_selection, SDP_MT_NONE, SDP_MEDIA_SIZE_CLASSES);
 }
 
-
 /**
- * @brief  This is an an array with all relations 
- * It has two uses:
- * 1. Faster way to lookup the mac address than looping peers (discern where a communication is relevant)
- * 2. Stores relevant peers relations ids and their mac adresses in RTC, 
- *    making it possible to reconnect after deep sleep
- * 3. We doesn't have to use the peer list when sending and receiving data
- * 
+ * @brief Count a send or receive outcome of a media, use SDP_STATS_INC()
+ * The outcome is added to the loss rate of the link estimate. A failure may change what media is best, 
+ * so the selections are forgotten. Successes are not forgotten until SDP_STATS_WINDOW outcomes.
  */
-RTC_DATA_ATTR struct relation relations[SDP_MAX_PEERS];
-RTC_DATA_ATTR uint8_t rel_end = 0;
+void sdp_peer_stats_event(sdp_peer *peer, struct sdp_peer_media_stats *stats, uint16_t *counter)
+{
+    if (*counter < UINT16_MAX)
+    {
+        (*counter)++;
+    }
+    bool lost = (counter == &stats->send_failures) || (counter == &stats->receive_failures);
+    sdp_link_on_outcome(&stats->link, lost);
+
+    bool changed = lost;
+    if (stats->send_successes + stats->receive_successes + stats->send_failures + stats->receive_failures >= SDP_STATS_WINDOW)
+    {
+        stats->send_successes = 0;
+        stats->send_failures = 0;
+        stats->receive_successes = 0;
+        stats->receive_failures = 0;
+        changed = true;
+    }
+    if (changed)
+    {
+        sdp_peer_invalidate_media_selection(peer);
+    }
+}
+
 
 sdp_peer sdp_host = {};
 
@@ -100,6 +105,7 @@ int sdp_peer_send_hi_message(sdp_peer *peer, bool is_reply) {
 
         peer->relation_id = calc_relation_id(&peer->base_mac_address, &sdp_host.base_mac_address);
         free(tmp_crc_data);
+        sdp_registry_update(peer);
     }
 
     add_relation(peer->base_mac_address, peer->relation_id
@@ -113,17 +119,18 @@ int sdp_peer_send_hi_message(sdp_peer *peer, bool is_reply) {
     uint8_t i2c_address = 0;
     #endif   
     
-    uint8_t *hi_msg = NULL;
-    int hi_length = add_to_message(&hi_msg, strcat(fmt_str, "|%u|%u|%s|%hhu|%u|%hhu|%b6"), 
+    uint8_t hi_msg[SDP_PREAMBLE_LENGTH + HI_MESSAGE_MAX_LENGTH];
+    sdp_message_builder builder;
+    sdp_builder_init(&builder, hi_msg, sizeof(hi_msg), true);
+    sdp_builder_add(&builder, strcat(fmt_str, "|%u|%u|%s|%hhu|%"PRIu32"|%hhu|%b6"), 
         pv, pvm, sdp_host.name, get_host_supported_media_types(), peer->relation_id, i2c_address,sdp_host.base_mac_address);
+    int hi_length = sdp_builder_finish(&builder, HANDSHAKE, 0);
     if (hi_length > 0) {
-        void *new_data = sdp_add_preamble(HANDSHAKE, 0, hi_msg, hi_length);
-        retval = sdp_send_message(peer, new_data, hi_length+ SDP_PREAMBLE_LENGTH);
+        retval = sdp_send_message(peer, hi_msg, hi_length);
     } else {
         // Returning the negative of the return value as that denotes an error.
         retval = -hi_length;
     }
-    free(hi_msg);
     return retval;
 }
 
@@ -152,6 +159,7 @@ int sdp_peer_inform(work_queue_item_t *queue_item) {
 
     /* Set supported media types*/
     queue_item->peer->supported_media_types = (uint8_t)atoi(queue_item->parts[4]);
+    sdp_peer_invalidate_media_selection(queue_item->peer);
     queue_item->peer->relation_id = atoi(queue_item->parts[5]);
     #ifdef CONFIG_SDP_LOAD_I2C
     queue_item->peer->i2c_address = atoi(queue_item->parts[6]);
@@ -164,6 +172,8 @@ int sdp_peer_inform(work_queue_item_t *queue_item) {
         // TODO: sdp_mesh and sdp_pee
 
     }  
+    /* Until now, lookups has found the peer by its old keys */
+    sdp_registry_update(queue_item->peer);
     init_supported_media_types(queue_item->peer);
     ESP_LOGI(peer_log_prefix, "<< Initiated all supported media types");
 
@@ -180,82 +190,149 @@ int sdp_peer_inform(work_queue_item_t *queue_item) {
 }
 
 
+float sdp_helper_calc_suitability(int bitrate, int min_offset, int base_offset, float multiplier)
+{
+    float retval = min_offset - ((bitrate - base_offset) * multiplier);
+    if (retval < -50) {
+        retval = -50;
+    }
+    return retval;
+}
 /**
- * @brief Find the relation id through the mac address.
- * (without having to loop all peers) 
- * @param relation_id The relation id to investigate
- * @return sdp_mac_address* 
+ * @brief The size class of data, see SDP_MEDIA_SIZE_CLASSES
  */
-sdp_mac_address *relation_id_to_mac_address(uint32_t relation_id) {
-    int rel_idx = 0;
-    while (rel_idx <= rel_end) {
-        if (relations[rel_idx].relation_id == relation_id) {
-            return &(relations[rel_idx].mac_address);
-        }
-        rel_idx++;
+static inline int media_size_class(int data_length)
+{
+    int size_class = 0;
+    while ((size_class < SDP_MEDIA_SIZE_CLASSES - 1) && (data_length > (16 << size_class)))
+    {
+        size_class++;
     }
-    ESP_LOGI(peer_log_prefix, "Relation %lu not found.", relation_id);
-    return NULL;
+    return size_class;
 }
 
-bool add_relation(sdp_mac_address mac_address, uint32_t relation_id
-    #ifdef CONFIG_SDP_LOAD_I2C
-    , uint8_t i2c_address
-    #endif
-    ) {
-    /* Is it already there? */
-    int rel_idx = 0;
-    while (rel_idx <= rel_end) {
-        if (memcmp(relations[rel_idx].mac_address, mac_address, SDP_MAC_ADDR_LEN) == 0) {
-            return false;
-        }
-        rel_idx++;
-    }
-    if (rel_end >= SDP_MAX_PEERS) {
-        ESP_LOGE(peer_log_prefix, "!!! Relations are added that cannot be accommodated, this is likely an attack! !!!");
-        // TODO: This needs to be reported to monitoring
-        // TODO: Monitoring should detect slow (but pointless) and fast adding of peers (similar RSSI:s indicate the same source, too). 
-        return false;
-    } else {
-        
-        relations[rel_end].relation_id = relation_id;
-        memcpy(relations[rel_end].mac_address, mac_address, SDP_MAC_ADDR_LEN);
-        #ifdef CONFIG_SDP_LOAD_I2C
-        relations[rel_end].i2c_address = i2c_address;
-        #endif
-        ESP_LOGI(peer_log_prefix, "Relation added at %hhu", rel_end);
-        rel_end++;
-        
-        return true;
+/**
+ * @brief Keep the score of a media, for monitoring
+ */
+static void record_score(struct sdp_peer_media_stats *stats, float score)
+{
+    stats->last_score = (score + stats->last_score) / 2;
+    stats->last_score_time = (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+/**
+ * @brief The statistics of a media, NULL if it has none
+ */
+static struct sdp_peer_media_stats *media_stats(struct sdp_peer *peer, e_media_type media_type)
+{
+    switch (media_type)
+    {
+#ifdef CONFIG_SDP_LOAD_I2C
+    case SDP_MT_I2C:
+        return &peer->i2c_stats;
+#endif
+#ifdef CONFIG_SDP_LOAD_ESP_NOW
+    case SDP_MT_ESPNOW:
+        return &peer->espnow_stats;
+#endif
+#ifdef CONFIG_SDP_LOAD_LORA
+    case SDP_MT_LoRa:
+        return &peer->lora_stats;
+#endif
+    default:
+        return NULL;
     }
 }
 
-float sdp_helper_calc_suitability(int bitrate, int min_offset, int base_offset, float multiplier)
+/**
+ * @brief Select the media predicted to deliver the data first, see sdp_link_predict_delivery_time()
+ * Only the selected media gets delivery times, so the prediction does not wait for all medias to have link 
+ * estimates, it is made over those that have them. Instead, until a media has SDP_MEDIA_PROBE_SAMPLES delivery 
+ * times, every SDP_MEDIA_PROBE_INTERVAL:th selection probes it, that is, selects it so that its link is measured.
+ * @param probing Set if the selection is a probe, it should not be kept
+ * @return e_media_type SDP_MT_NONE if no media has a link estimate, or if one of them never will (like BLE)
+ */
+static e_media_type select_media_by_prediction(struct sdp_peer *peer, sdp_media_types media_types, int data_length, 
+                                               bool *probing)
 {
-    float retval = min_offset - ((bitrate - base_offset) * multiplier);
-    if (retval < -50) {
-        retval = -50;
+    e_media_type top_media_type = SDP_MT_NONE;
+    e_media_type probe_media_type = SDP_MT_NONE;
+    uint8_t probe_samples = SDP_MEDIA_PROBE_SAMPLES;
+    int64_t top_time = INT64_MAX;
+    *probing = false;
+    for (e_media_type curr_media_type = 1; curr_media_type < SDP_MT_ANY; curr_media_type = curr_media_type * 2)
+    {
+        if (!(media_types & curr_media_type))
+        {
+            continue;
+        }
+        struct sdp_peer_media_stats *stats = media_stats(peer, curr_media_type);
+        if (stats == NULL)
+        {
+            return SDP_MT_NONE;
+        }
+        int64_t curr_time = sdp_link_predict_delivery_time(&stats->link, data_length);
+        if ((curr_time >= 0) && (curr_time < top_time))
+        {
+            top_time = curr_time;
+            top_media_type = curr_media_type;
+        }
+        else if (stats->link.samples < probe_samples)
+        {
+            /* Probe the media with the fewest delivery times first */
+            probe_samples = stats->link.samples;
+            probe_media_type = curr_media_type;
+        }
     }
-    return retval;
+    if ((top_media_type != SDP_MT_NONE) && (probe_media_type != SDP_MT_NONE) && 
+        (++peer->media_probe_count % SDP_MEDIA_PROBE_INTERVAL == 0))
+    {
+        ESP_LOGD(peer_log_prefix, "Peer %s - probing media type %hhu, it has %hhu delivery times.", 
+                 peer->name, probe_media_type, probe_samples);
+        *probing = true;
+        return probe_media_type;
+    }
+    return top_media_type;
 }
+
 /**
- * @brief
- *
+ * @brief Select the best media to send data to a peer with
+ * When the link of a media has been estimated, the one predicted to deliver the data first is selected, 
+ * and the medias with few delivery times are probed now and then, see select_media_by_prediction(). 
+ * Until then, the medias are scored by their suitability for the length and their loss rate.
+ * The selection is kept for the size class of the data, until an outcome changes the statistics
+ * (see sdp_peer_stats_event()), so the medias are not scored for every frame. Probes are not kept.
  * @param peer
  * @param data_length
  * @return e_media_type
  */
 e_media_type select_media(struct sdp_peer *peer, int data_length)
 {
+    int size_class = media_size_class(data_length);
+    e_media_type selected_media_type = peer->media_selection[size_class];
+    if (selected_media_type != SDP_MT_NONE)
+    {
+        return selected_media_type;
+    }
 
-    // Loop media types and find the highest scoring
+    sdp_media_types host_supported_media_types = get_host_supported_media_types();
+    bool probing;
+    selected_media_type = select_media_by_prediction(peer, host_supported_media_types & peer->supported_media_types, 
+                                                     data_length, &probing);
+    if (selected_media_type != SDP_MT_NONE)
+    {
+        if (!probing)
+        {
+            peer->media_selection[size_class] = selected_media_type;
+        }
+        return selected_media_type;
+    }
 
-    // TODO: If this is slow, perhaps we could have a short-lived selection cache?
+    // Loop media types and find the highest scoring
 
     e_media_type top_media_type = 0;
     float top_score  = 0;
     float curr_score = 0;
-    sdp_media_types host_supported_media_types = get_host_supported_media_types();
     for (e_media_type curr_media_type = 1; curr_media_type < SDP_MT_ANY; curr_media_type = curr_media_type * 2)
     {
         if (!(host_supported_media_types & curr_media_type)) {
@@ -275,6 +352,7 @@ e_media_type select_media(struct sdp_peer *peer, int data_length)
             if (curr_media_type == SDP_MT_I2C)
             {
                 curr_score = i2c_score_peer(peer, data_length);
+                record_score(&peer->i2c_stats, curr_score);
             }
 #endif
 #ifdef CONFIG_SDP_LOAD_ESP_NOW
@@ -282,6 +360,7 @@ e_media_type select_media(struct sdp_peer *peer, int data_length)
             if (curr_media_type == SDP_MT_ESPNOW)
             {
                 curr_score = espnow_score_peer(peer, data_length);
+                record_score(&peer->espnow_stats, curr_score);
             }
 
 #endif
@@ -289,6 +368,7 @@ e_media_type select_media(struct sdp_peer *peer, int data_length)
             if (curr_media_type == SDP_MT_LoRa)
             {
                 curr_score = lora_score_peer(peer, data_length);
+                record_score(&peer->lora_stats, curr_score);
             }
 #endif
 
@@ -301,6 +381,7 @@ e_media_type select_media(struct sdp_peer *peer, int data_length)
         // TODO: Warn if we are forced to use an obviously unsuitable media (or fail if we go below minimum scores)
         // For example if someone wants to send a video stream and the only available connection is LoRa.
     }
+    peer->media_selection[size_class] = top_media_type;
 
     return top_media_type;
 }
@@ -6,20 +6,17 @@
 #include <stdint.h>
 
 #include "sdp_def.h"
+#include "sdp_relations.h"
+#include "sdp_link.h"
 
 /* The host details */
 extern sdp_peer sdp_host;
 
-sdp_mac_address *relation_id_to_mac_address(uint32_t relation_id);
-bool add_relation(sdp_mac_address mac_address, uint32_t relation_id
-    #ifdef CONFIG_SDP_LOAD_I2C
-    , uint8_t i2c_address
-    #endif
-); 
+void sdp_peer_stats_event(sdp_peer *peer, struct sdp_peer_media_stats *stats, uint16_t *counter);
+void sdp_peer_invalidate_media_selection(sdp_peer *peer);
 
-// TODO: Add add_external_relation - to add a relation between two external peers
-
-float add_to_failure_rate_history(struct sdp_peer_media_stats *stats, float rate);
+/* Count a send or receive outcome, like SDP_STATS_INC(peer, espnow, send_failures) */
+#define SDP_STATS_INC(peer, media, counter) sdp_peer_stats_event((peer), &(peer)->media##_stats, &(peer)->media##_stats.counter)
 
 int sdp_peer_send_hi_message(sdp_peer *peer, bool is_reply);
 int sdp_peer_inform(work_queue_item_t *queue_item);
@@ -0,0 +1,274 @@
+/**
+ * @file sdp_pool.c
+ * @author Nicklas Borjesson
+ * @brief Fixed-capacity block pools for work items and receive buffers
+ * Every incoming frame needs a work item and a copy of its data. Under bursty traffic,
+ * doing that with malloc/free fragments the heap, so they are instead taken from
+ * statically allocated pools, sized in menuconfig. The heap is only used as a fallback.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_pool.h"
+#include "sdp_mesh.h"
+
+#include <string.h>
+#include <esp_log.h>
+
+/* The log prefix for all logging */
+char *pool_log_prefix = NULL;
+
+/* The storage of the pools */
+static uint8_t work_item_storage[CONFIG_SDP_WORK_ITEM_POOL_SIZE * SDP_POOL_ALIGN(sizeof(work_queue_item_t))]
+    __attribute__((aligned(SDP_POOL_ALIGNMENT)));
+static uint8_t receive_buffer_storage[CONFIG_SDP_RECEIVE_BUFFER_POOL_SIZE * SDP_POOL_ALIGN(CONFIG_SDP_RECEIVE_BUFFER_SIZE)]
+    __attribute__((aligned(SDP_POOL_ALIGNMENT)));
+
+static uint8_t parts_storage[CONFIG_SDP_PARTS_POOL_SIZE * SDP_POOL_ALIGN(SDP_POOLED_PART_COUNT * sizeof(char *))]
+    __attribute__((aligned(SDP_POOL_ALIGNMENT)));
+
+sdp_pool_t work_item_pool;
+sdp_pool_t receive_buffer_pool;
+sdp_pool_t parts_pool;
+
+/**
+ * @brief Initialize a pool over a caller-provided buffer
+ *
+ * @param pool The pool
+ * @param name A name used when logging
+ * @param storage Buffer of at least block_count * SDP_POOL_ALIGN(block_size) bytes, aligned to SDP_POOL_ALIGNMENT
+ * @param block_size The size of each block
+ * @param block_count The number of blocks
+ */
+void sdp_pool_create(sdp_pool_t *pool, const char *name, void *storage, size_t block_size, uint16_t block_count)
+{
+    pool->name = name;
+    pool->storage = storage;
+    pool->block_size = SDP_POOL_ALIGN(block_size < sizeof(void *) ? sizeof(void *) : block_size);
+    pool->block_count = block_count;
+    pool->in_use = 0;
+    pool->peak = 0;
+    pool->exhausted = 0;
+    portMUX_INITIALIZE(&pool->lock);
+
+    /* Chain all blocks into the free list, the first block first */
+    pool->free_list = NULL;
+    for (int i = block_count - 1; i >= 0; i--)
+    {
+        void *block = pool->storage + (i * pool->block_size);
+        *(void **)block = pool->free_list;
+        pool->free_list = block;
+    }
+}
+
+/**
+ * @brief Take a block from the pool
+ *
+ * @param pool The pool
+ * @return void* A block, or NULL if the pool is exhausted.
+ */
+void *sdp_pool_alloc(sdp_pool_t *pool)
+{
+    void *block;
+    portENTER_CRITICAL_SAFE(&pool->lock);
+    block = pool->free_list;
+    if (block != NULL)
+    {
+        pool->free_list = *(void **)block;
+        pool->in_use++;
+        if (pool->in_use > pool->peak)
+        {
+            pool->peak = pool->in_use;
+        }
+    }
+    else
+    {
+        pool->exhausted++;
+    }
+    portEXIT_CRITICAL_SAFE(&pool->lock);
+    return block;
+}
+
+/**
+ * @brief Return a block to the pool
+ *
+ * @param pool The pool
+ * @param block A block previously returned by sdp_pool_alloc() on the same pool
+ */
+void sdp_pool_free(sdp_pool_t *pool, void *block)
+{
+    portENTER_CRITICAL_SAFE(&pool->lock);
+    *(void **)block = pool->free_list;
+    pool->free_list = block;
+    pool->in_use--;
+    portEXIT_CRITICAL_SAFE(&pool->lock);
+}
+
+/**
+ * @brief Tells if a pointer was handed out by the pool (as opposed to the heap fallback)
+ */
+bool sdp_pool_owns(const sdp_pool_t *pool, const void *block)
+{
+    return ((const uint8_t *)block >= pool->storage) &&
+           ((const uint8_t *)block < pool->storage + (pool->block_size * pool->block_count));
+}
+
+/**
+ * @brief Allocate a work item and a buffer for its raw data
+ * Both are taken from the pools if possible, raw data that doesn't fit
+ * a receive buffer, or an exhausted pool, will cause a heap allocation.
+ * Free using sdp_free_work_item().
+ *
+ * @param raw_data_length The length of the raw data
+ * @return work_queue_item_t* The work item, NULL if out of memory.
+ */
+work_queue_item_t *sdp_alloc_work_item(uint32_t raw_data_length)
+{
+    work_queue_item_t *new_item = sdp_pool_alloc(&work_item_pool);
+    if (new_item == NULL)
+    {
+        new_item = malloc(sizeof(work_queue_item_t));
+        if (new_item == NULL)
+        {
+            return NULL;
+        }
+    }
+    memset(new_item, 0, sizeof(work_queue_item_t));
+
+    if (raw_data_length <= CONFIG_SDP_RECEIVE_BUFFER_SIZE)
+    {
+        new_item->raw_data = sdp_pool_alloc(&receive_buffer_pool);
+    }
+    if (new_item->raw_data == NULL)
+    {
+        new_item->raw_data = malloc(raw_data_length);
+        if (new_item->raw_data == NULL)
+        {
+            sdp_free_work_item(new_item);
+            return NULL;
+        }
+    }
+    new_item->raw_data_length = raw_data_length;
+    /* Pooled items are reused, no deadline unless one is set */
+    new_item->stamp.deadline = 0;
+    return new_item;
+}
+
+static void free_parts(work_queue_item_t *queue_item)
+{
+    if (queue_item->parts == queue_item->inline_parts)
+    {
+        return;
+    }
+    if (sdp_pool_owns(&parts_pool, queue_item->parts))
+    {
+        sdp_pool_free(&parts_pool, queue_item->parts);
+    }
+    else
+    {
+        free(queue_item->parts);
+    }
+}
+
+/**
+ * @brief Make room for more part pointers in a work item
+ * The parts are first kept inline in the work item, then in a pooled array,
+ * and only messages with more than SDP_POOLED_PART_COUNT parts use the heap.
+ *
+ * @param queue_item The work item, the existing part pointers are kept
+ * @param part_capacity The current capacity, updated with the new one
+ * @return true If there is now more room
+ * @return false If out of memory, the work item is left untouched
+ */
+bool sdp_grow_parts(work_queue_item_t *queue_item, int *part_capacity)
+{
+    char **new_parts = NULL;
+    int new_capacity = *part_capacity * 2;
+    if (new_capacity <= SDP_POOLED_PART_COUNT)
+    {
+        new_capacity = SDP_POOLED_PART_COUNT;
+        new_parts = sdp_pool_alloc(&parts_pool);
+    }
+    if (new_parts == NULL)
+    {
+        new_parts = malloc(new_capacity * sizeof(char *));
+        if (new_parts == NULL)
+        {
+            return false;
+        }
+    }
+    memcpy(new_parts, queue_item->parts, queue_item->partcount * sizeof(char *));
+    free_parts(queue_item);
+    queue_item->parts = new_parts;
+    *part_capacity = new_capacity;
+    return true;
+}
+
+/**
+ * @brief Free a work item allocated by sdp_alloc_work_item(), including its data and parts, and release its peer
+ */
+void sdp_free_work_item(work_queue_item_t *queue_item)
+{
+    if (queue_item == NULL)
+    {
+        return;
+    }
+    free_parts(queue_item);
+    sdp_mesh_peer_unref(queue_item->peer);
+
+    if (sdp_pool_owns(&receive_buffer_pool, queue_item->raw_data))
+    {
+        sdp_pool_free(&receive_buffer_pool, queue_item->raw_data);
+    }
+    else
+    {
+        free(queue_item->raw_data);
+    }
+
+    if (sdp_pool_owns(&work_item_pool, queue_item))
+    {
+        sdp_pool_free(&work_item_pool, queue_item);
+    }
+    else
+    {
+        free(queue_item);
+    }
+}
+
+static void log_pool(sdp_pool_t *pool)
+{
+    if (pool->exhausted > 0)
+    {
+        ESP_LOGW(pool_log_prefix, "Pool %s: %hu of %hu blocks in use, peak %hu, exhausted %"PRIu32" times (heap was used).",
+                 pool->name, pool->in_use, pool->block_count, pool->peak, pool->exhausted);
+    }
+    else
+    {
+        ESP_LOGI(pool_log_prefix, "Pool %s: %hu of %hu blocks in use, peak %hu.",
+                 pool->name, pool->in_use, pool->block_count, pool->peak);
+    }
+}
+
+void sdp_pool_on_monitor()
+{
+    if (pool_log_prefix)
+    {
+        log_pool(&work_item_pool);
+        log_pool(&receive_buffer_pool);
+        log_pool(&parts_pool);
+    }
+}
+
+void sdp_pool_init(char *_log_prefix)
+{
+    pool_log_prefix = _log_prefix;
+    sdp_pool_create(&work_item_pool, "work items", work_item_storage,
+                    sizeof(work_queue_item_t), CONFIG_SDP_WORK_ITEM_POOL_SIZE);
+    sdp_pool_create(&receive_buffer_pool, "receive buffers", receive_buffer_storage,
+                    CONFIG_SDP_RECEIVE_BUFFER_SIZE, CONFIG_SDP_RECEIVE_BUFFER_POOL_SIZE);
+    sdp_pool_create(&parts_pool, "parts arrays", parts_storage,
+                    SDP_POOLED_PART_COUNT * sizeof(char *), CONFIG_SDP_PARTS_POOL_SIZE);
+    ESP_LOGI(pool_log_prefix, "Pools initiated, %i work items and %i receive buffers of %i bytes.",
+             CONFIG_SDP_WORK_ITEM_POOL_SIZE, CONFIG_SDP_RECEIVE_BUFFER_POOL_SIZE, CONFIG_SDP_RECEIVE_BUFFER_SIZE);
+}
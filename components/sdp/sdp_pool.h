@@ -0,0 +1,66 @@
+/**
+ * @file sdp_pool.h
+ * @author Nicklas Borjesson
+ * @brief Fixed-capacity block pools
+ * These are used instead of malloc/free on the hot receive path, where bursty traffic
+ * would otherwise fragment the heap. If a pool runs dry, callers fall back to the heap.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_POOL_H_
+#define _SDP_POOL_H_
+
+#include <freertos/FreeRTOS.h>
+
+#include "sdp_def.h"
+
+/* Pool blocks are aligned to this many bytes */
+#define SDP_POOL_ALIGNMENT 8
+/* Round a size up to the pool alignment */
+#define SDP_POOL_ALIGN(size) (((size) + SDP_POOL_ALIGNMENT - 1) & ~(SDP_POOL_ALIGNMENT - 1))
+
+/**
+ * @brief A pool of equally sized blocks carved out of a static buffer
+ * Free blocks are kept in an intrusive singly linked list, so allocation and freeing is O(1).
+ */
+typedef struct sdp_pool
+{
+    /* The name of the pool, used when logging */
+    const char *name;
+    /* The memory that the blocks are carved from */
+    uint8_t *storage;
+    /* The size of each block in bytes (aligned) */
+    size_t block_size;
+    /* The number of blocks in the pool */
+    uint16_t block_count;
+    /* The first free block, each free block begins with a pointer to the next */
+    void *free_list;
+    /* Number of blocks currently handed out */
+    uint16_t in_use;
+    /* The highest number of blocks handed out at the same time */
+    uint16_t peak;
+    /* Number of times the pool was empty when asked for a block */
+    uint32_t exhausted;
+    /* The pools are used from radio callbacks on both cores, so a spinlock is used rather than a mutex */
+    portMUX_TYPE lock;
+} sdp_pool_t;
+
+void sdp_pool_create(sdp_pool_t *pool, const char *name, void *storage, size_t block_size, uint16_t block_count);
+void *sdp_pool_alloc(sdp_pool_t *pool);
+void sdp_pool_free(sdp_pool_t *pool, void *block);
+bool sdp_pool_owns(const sdp_pool_t *pool, const void *block);
+
+/* The number of part pointers in a pooled parts array */
+#define SDP_POOLED_PART_COUNT 32
+
+work_queue_item_t *sdp_alloc_work_item(uint32_t raw_data_length);
+bool sdp_grow_parts(work_queue_item_t *queue_item, int *part_capacity);
+void sdp_free_work_item(work_queue_item_t *queue_item);
+
+void sdp_pool_on_monitor();
+
+void sdp_pool_init(char *_log_prefix);
+
+#endif
@@ -0,0 +1,435 @@
+/**
+ * @file sdp_registry.c
+ * @author Nicklas Borjesson
+ * @brief The peer registry, hash indexes over the peers by handle, MAC address, name, relation id and I2C address
+ * Each registered peer has an entry holding a copy of the keys it is indexed by. The indexes are open-addressing
+ * hash tables with linear probing of entry numbers, and lookups compare against the copies. So a peer whose
+ * keys are being changed is still found by its old keys until sdp_registry_update() has moved it.
+ * Writers are serialized by a spinlock, readers never wait for it. Instead they use a sequence counter
+ * (a seqlock), that is odd while an index is being written, and retry if it changed during their lookup.
+ * Keys that are not set (a zero relation id or I2C address, an all-zero MAC address, an empty name) are not
+ * indexed, many peers share them and they would only make long probe sequences. Looking them up finds nothing.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_registry.h"
+
+#include <string.h>
+#include <freertos/FreeRTOS.h>
+#include <esp_log.h>
+
+/* Each index has twice the slots of the registry, so probe sequences stay short */
+#define REGISTRY_INDEX_SIZE (CONFIG_SDP_PEER_REGISTRY_SIZE * 2)
+
+/* Index slots that hold no entry, deleted slots must be probed past */
+#define REGISTRY_SLOT_EMPTY UINT16_MAX
+#define REGISTRY_SLOT_DELETED (UINT16_MAX - 1)
+
+/* The log prefix for all logging */
+char *registry_log_prefix = NULL;
+
+typedef enum e_registry_index
+{
+    INDEX_HANDLE,
+    INDEX_MAC_ADDRESS,
+    INDEX_NAME,
+    INDEX_RELATION_ID,
+#ifdef CONFIG_SDP_LOAD_I2C
+    INDEX_I2C_ADDRESS,
+#endif
+    INDEX_COUNT
+} e_registry_index;
+
+/**
+ * @brief A registered peer, and the keys it is currently indexed by
+ */
+typedef struct registry_entry
+{
+    /* The peer, NULL if the entry is free */
+    sdp_peer *peer;
+    uint16_t peer_handle;
+    sdp_mac_address mac_address;
+    uint32_t relation_id;
+    uint8_t i2c_address;
+    sdp_peer_name name;
+} registry_entry;
+
+static registry_entry entries[CONFIG_SDP_PEER_REGISTRY_SIZE];
+static uint16_t indexes[INDEX_COUNT][REGISTRY_INDEX_SIZE];
+static int entry_count = 0;
+
+static portMUX_TYPE registry_lock = portMUX_INITIALIZER_UNLOCKED;
+/* Incremented before and after each change of the indexes, readers retry if it is odd or has changed */
+static uint32_t registry_sequence = 0;
+
+static inline void registry_write_begin()
+{
+    portENTER_CRITICAL_SAFE(&registry_lock);
+    __atomic_fetch_add(&registry_sequence, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void registry_write_end()
+{
+    __atomic_fetch_add(&registry_sequence, 1, __ATOMIC_RELEASE);
+    portEXIT_CRITICAL_SAFE(&registry_lock);
+}
+
+/**
+ * @brief The length in bytes of a key, names are compared up to their terminator
+ */
+static size_t key_length(e_registry_index index, const void *key)
+{
+    switch (index)
+    {
+    case INDEX_HANDLE:
+        return sizeof(uint16_t);
+    case INDEX_MAC_ADDRESS:
+        return SDP_MAC_ADDR_LEN;
+    case INDEX_NAME:
+        return strnlen((const char *)key, CONFIG_SDP_PEER_NAME_LEN);
+    case INDEX_RELATION_ID:
+        return sizeof(uint32_t);
+#ifdef CONFIG_SDP_LOAD_I2C
+    case INDEX_I2C_ADDRESS:
+        return sizeof(uint8_t);
+#endif
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief The copy of a key in an entry
+ */
+static const void *entry_key(e_registry_index index, const registry_entry *entry)
+{
+    switch (index)
+    {
+    case INDEX_HANDLE:
+        return &entry->peer_handle;
+    case INDEX_MAC_ADDRESS:
+        return entry->mac_address;
+    case INDEX_NAME:
+        return entry->name;
+    case INDEX_RELATION_ID:
+        return &entry->relation_id;
+#ifdef CONFIG_SDP_LOAD_I2C
+    case INDEX_I2C_ADDRESS:
+        return &entry->i2c_address;
+#endif
+    default:
+        return NULL;
+    }
+}
+
+/**
+ * @brief The home slot of a key in an index (FNV-1a)
+ */
+static int key_home(e_registry_index index, const void *key)
+{
+    const uint8_t *data = key;
+    size_t length = key_length(index, key);
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ data[i]) * 16777619u;
+    }
+    return hash % REGISTRY_INDEX_SIZE;
+}
+
+/**
+ * @brief If a key is set, unset keys are not indexed. The handle is always set.
+ */
+static bool key_is_set(e_registry_index index, const void *key)
+{
+    const uint8_t *data = key;
+    switch (index)
+    {
+    case INDEX_HANDLE:
+        return true;
+    case INDEX_NAME:
+        return data[0] != '\0';
+    default:
+        for (size_t i = 0; i < key_length(index, key); i++)
+        {
+            if (data[i] != 0)
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+}
+
+static bool key_equals(e_registry_index index, const registry_entry *entry, const void *key)
+{
+    if (index == INDEX_NAME)
+    {
+        return strncmp(entry->name, key, CONFIG_SDP_PEER_NAME_LEN) == 0;
+    }
+    return memcmp(entry_key(index, entry), key, key_length(index, key)) == 0;
+}
+
+/**
+ * @brief Find the peer with a key, in a read section of the sequence counter.
+ * The entries may be changing while they are read, so the result is only used if the counter is unchanged.
+ */
+static sdp_peer *index_find(e_registry_index index, const void *key)
+{
+    if (!key_is_set(index, key))
+    {
+        return NULL;
+    }
+    int slot = key_home(index, key);
+    for (int i = 0; i < REGISTRY_INDEX_SIZE; i++)
+    {
+        uint16_t entry_no = indexes[index][slot];
+        if (entry_no == REGISTRY_SLOT_EMPTY)
+        {
+            break;
+        }
+        if ((entry_no < CONFIG_SDP_PEER_REGISTRY_SIZE) && key_equals(index, &entries[entry_no], key))
+        {
+            return entries[entry_no].peer;
+        }
+        slot = (slot + 1) % REGISTRY_INDEX_SIZE;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Index an entry by its copy of a key, the lock must be held.
+ * Several peers may share a key (peers with the same name, for example), then the first one is found.
+ */
+static void index_insert(e_registry_index index, uint16_t entry_no)
+{
+    if (!key_is_set(index, entry_key(index, &entries[entry_no])))
+    {
+        return;
+    }
+    int slot = key_home(index, entry_key(index, &entries[entry_no]));
+    /* There are never more entries than half the slots, so there is always room */
+    while (indexes[index][slot] < REGISTRY_SLOT_DELETED)
+    {
+        slot = (slot + 1) % REGISTRY_INDEX_SIZE;
+    }
+    indexes[index][slot] = entry_no;
+}
+
+/**
+ * @brief Remove an entry from an index, using its copy of the key, the lock must be held.
+ */
+static void index_remove(e_registry_index index, uint16_t entry_no)
+{
+    if (!key_is_set(index, entry_key(index, &entries[entry_no])))
+    {
+        return;
+    }
+    int slot = key_home(index, entry_key(index, &entries[entry_no]));
+    for (int i = 0; i < REGISTRY_INDEX_SIZE; i++)
+    {
+        if (indexes[index][slot] == REGISTRY_SLOT_EMPTY)
+        {
+            return;
+        }
+        if (indexes[index][slot] == entry_no)
+        {
+            break;
+        }
+        slot = (slot + 1) % REGISTRY_INDEX_SIZE;
+    }
+    indexes[index][slot] = REGISTRY_SLOT_DELETED;
+    /* If it ended a probe sequence, the deleted slots before it can be emptied */
+    if (indexes[index][(slot + 1) % REGISTRY_INDEX_SIZE] == REGISTRY_SLOT_EMPTY)
+    {
+        while (indexes[index][slot] == REGISTRY_SLOT_DELETED)
+        {
+            indexes[index][slot] = REGISTRY_SLOT_EMPTY;
+            slot = (slot + REGISTRY_INDEX_SIZE - 1) % REGISTRY_INDEX_SIZE;
+        }
+    }
+}
+
+/**
+ * @brief Copy the keys of the peer into its entry
+ */
+static void entry_copy_keys(registry_entry *entry, sdp_peer *peer)
+{
+    entry->peer_handle = peer->peer_handle;
+    memcpy(entry->mac_address, peer->base_mac_address, SDP_MAC_ADDR_LEN);
+    entry->relation_id = peer->relation_id;
+#ifdef CONFIG_SDP_LOAD_I2C
+    entry->i2c_address = peer->i2c_address;
+#endif
+    memcpy(entry->name, peer->name, CONFIG_SDP_PEER_NAME_LEN);
+    entry->name[CONFIG_SDP_PEER_NAME_LEN - 1] = '\0';
+}
+
+/**
+ * @brief Add a peer to the registry
+ * @return int 0 if added, -SDP_ERR_OUT_OF_MEMORY if the registry is full
+ */
+int sdp_registry_add(sdp_peer *peer)
+{
+    int rc = -SDP_ERR_OUT_OF_MEMORY;
+    registry_write_begin();
+    for (uint16_t entry_no = 0; entry_no < CONFIG_SDP_PEER_REGISTRY_SIZE; entry_no++)
+    {
+        if (entries[entry_no].peer == NULL)
+        {
+            entries[entry_no].peer = peer;
+            entry_copy_keys(&entries[entry_no], peer);
+            for (e_registry_index index = 0; index < INDEX_COUNT; index++)
+            {
+                index_insert(index, entry_no);
+            }
+            entry_count++;
+            rc = 0;
+            break;
+        }
+    }
+    registry_write_end();
+    if (rc != 0)
+    {
+        ESP_LOGE(registry_log_prefix, "The registry is full, cannot add %s (CONFIG_SDP_PEER_REGISTRY_SIZE=%i).",
+                 peer->name, CONFIG_SDP_PEER_REGISTRY_SIZE);
+    }
+    return rc;
+}
+
+/**
+ * @brief The entry of a peer, found by its handle as that never changes, the lock must be held.
+ */
+static int entry_of(sdp_peer *peer)
+{
+    int slot = key_home(INDEX_HANDLE, &peer->peer_handle);
+    for (int i = 0; i < REGISTRY_INDEX_SIZE; i++)
+    {
+        uint16_t entry_no = indexes[INDEX_HANDLE][slot];
+        if (entry_no == REGISTRY_SLOT_EMPTY)
+        {
+            break;
+        }
+        if ((entry_no != REGISTRY_SLOT_DELETED) && (entries[entry_no].peer == peer))
+        {
+            return entry_no;
+        }
+        slot = (slot + 1) % REGISTRY_INDEX_SIZE;
+    }
+    return -1;
+}
+
+/**
+ * @brief Remove a peer from the registry, it can not be found after this
+ */
+void sdp_registry_remove(sdp_peer *peer)
+{
+    registry_write_begin();
+    int entry_no = entry_of(peer);
+    if (entry_no >= 0)
+    {
+        for (e_registry_index index = 0; index < INDEX_COUNT; index++)
+        {
+            index_remove(index, entry_no);
+        }
+        entries[entry_no].peer = NULL;
+        entry_count--;
+    }
+    registry_write_end();
+}
+
+/**
+ * @brief Re-index a peer after its MAC address, name, relation id or I2C address has been changed
+ * The peer is found by its old keys until this is done, and by its new ones after, never neither.
+ */
+void sdp_registry_update(sdp_peer *peer)
+{
+    registry_write_begin();
+    int entry_no = entry_of(peer);
+    if (entry_no >= 0)
+    {
+        for (e_registry_index index = INDEX_HANDLE + 1; index < INDEX_COUNT; index++)
+        {
+            index_remove(index, entry_no);
+        }
+        entry_copy_keys(&entries[entry_no], peer);
+        for (e_registry_index index = INDEX_HANDLE + 1; index < INDEX_COUNT; index++)
+        {
+            index_insert(index, entry_no);
+        }
+    }
+    registry_write_end();
+}
+
+/**
+ * @brief Look up a peer without taking the lock
+ * The writer holds a spinlock, so it can only be interrupted by the other core and the retries are short.
+ */
+static sdp_peer *registry_find(e_registry_index index, const void *key)
+{
+    sdp_peer *peer;
+    uint32_t sequence;
+    do
+    {
+        sequence = __atomic_load_n(&registry_sequence, __ATOMIC_ACQUIRE);
+        peer = index_find(index, key);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((sequence & 1) || (__atomic_load_n(&registry_sequence, __ATOMIC_RELAXED) != sequence));
+    return peer;
+}
+
+sdp_peer *sdp_registry_find_by_handle(uint16_t peer_handle)
+{
+    return registry_find(INDEX_HANDLE, &peer_handle);
+}
+
+sdp_peer *sdp_registry_find_by_mac_address(const sdp_mac_address mac_address)
+{
+    return registry_find(INDEX_MAC_ADDRESS, mac_address);
+}
+
+sdp_peer *sdp_registry_find_by_name(const char *name)
+{
+    return registry_find(INDEX_NAME, name);
+}
+
+sdp_peer *sdp_registry_find_by_relation_id(uint32_t relation_id)
+{
+    return registry_find(INDEX_RELATION_ID, &relation_id);
+}
+
+#ifdef CONFIG_SDP_LOAD_I2C
+sdp_peer *sdp_registry_find_by_i2c_address(uint8_t i2c_address)
+{
+    return registry_find(INDEX_I2C_ADDRESS, &i2c_address);
+}
+#endif
+
+int sdp_registry_count()
+{
+    return entry_count;
+}
+
+void sdp_registry_on_monitor()
+{
+    if (entry_count > (CONFIG_SDP_PEER_REGISTRY_SIZE * 3) / 4)
+    {
+        ESP_LOGW(registry_log_prefix, "Peer registry: %i of %i entries used, consider increasing CONFIG_SDP_PEER_REGISTRY_SIZE.",
+                 entry_count, CONFIG_SDP_PEER_REGISTRY_SIZE);
+    }
+    else
+    {
+        ESP_LOGI(registry_log_prefix, "Peer registry: %i of %i entries used.", entry_count, CONFIG_SDP_PEER_REGISTRY_SIZE);
+    }
+}
+
+void sdp_registry_init(char *_log_prefix)
+{
+    registry_log_prefix = _log_prefix;
+    memset(entries, 0, sizeof(entries));
+    memset(indexes, 0xff, sizeof(indexes));
+    entry_count = 0;
+}
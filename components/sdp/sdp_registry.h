@@ -0,0 +1,34 @@
+/**
+ * @file sdp_registry.h
+ * @author Nicklas Borjesson
+ * @brief The peer registry, hash indexes over the peers by handle, MAC address, name, relation id and I2C address
+ * Peers are looked up on every received frame, also from the WiFi task, so the lookups do not loop the peer list
+ * and do not log.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_REGISTRY_H_
+#define _SDP_REGISTRY_H_
+
+#include "sdp_def.h"
+
+int sdp_registry_add(sdp_peer *peer);
+void sdp_registry_remove(sdp_peer *peer);
+void sdp_registry_update(sdp_peer *peer);
+
+sdp_peer *sdp_registry_find_by_handle(uint16_t peer_handle);
+sdp_peer *sdp_registry_find_by_mac_address(const sdp_mac_address mac_address);
+sdp_peer *sdp_registry_find_by_name(const char *name);
+sdp_peer *sdp_registry_find_by_relation_id(uint32_t relation_id);
+#ifdef CONFIG_SDP_LOAD_I2C
+sdp_peer *sdp_registry_find_by_i2c_address(uint8_t i2c_address);
+#endif
+
+int sdp_registry_count();
+void sdp_registry_on_monitor();
+
+void sdp_registry_init(char *_log_prefix);
+
+#endif
@@ -0,0 +1,376 @@
+/**
+ * @file sdp_relations.c
+ * @author Nicklas Borjesson
+ * @brief The relations between this peer and others, resolving relation ids to MAC addresses
+ * LoRa frames that are not MAC-addressed start with a relation id, so it is resolved for every such frame.
+ * The relations are kept in two tiers, each with an open-addressing hash index from relation id to relation:
+ * 1. RTC memory, that survives deep sleep.
+ * 2. When that is full, NVS. This tier is loaded into the heap when it is needed after waking up.
+ * Relations are never removed, and a relation is complete before it is indexed, so lookups need no lock.
+ * The NVS tier is cleared on a cold boot, like the RTC memory is. As it is only needed after deep sleep,
+ * added relations are written to NVS in batches, by the monitor and by sdp_relations_save() before sleeping.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_relations.h"
+
+#include <string.h>
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <nvs.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+/* The index of each tier has twice the slots of the tier, so probe sequences stay short */
+#define RTC_RELATION_INDEX_SIZE (CONFIG_SDP_RTC_RELATIONS * 2)
+#define NVS_RELATION_INDEX_SIZE (CONFIG_SDP_NVS_RELATIONS * 2)
+
+#define RELATIONS_NVS_NAMESPACE "sdp"
+#define RELATIONS_NVS_KEY "relations"
+
+/* The log prefix for all logging */
+char *relations_log_prefix;
+
+struct relation {
+    uint32_t relation_id;
+    sdp_mac_address mac_address;
+    #ifdef CONFIG_SDP_LOAD_I2C
+    uint8_t i2c_address;
+    #endif
+};
+
+/**
+ * @brief A tier of relations, and its index
+ * The index holds relation numbers + 1, 0 is an empty slot.
+ */
+typedef struct relation_tier {
+    struct relation *relations;
+    uint16_t *index;
+    int index_size;
+    int capacity;
+    /* The number of relations, kept with the tier */
+    uint16_t *count;
+} relation_tier;
+
+/* The RTC tier: 12 bytes for each relation, and 4 bytes for it in the index */
+RTC_DATA_ATTR struct relation relations[CONFIG_SDP_RTC_RELATIONS];
+RTC_DATA_ATTR uint16_t relation_index[RTC_RELATION_INDEX_SIZE];
+RTC_DATA_ATTR uint16_t rel_end = 0;
+
+static relation_tier rtc_tier = {
+    .relations = relations,
+    .index = relation_index,
+    .index_size = RTC_RELATION_INDEX_SIZE,
+    .capacity = CONFIG_SDP_RTC_RELATIONS,
+    .count = &rel_end};
+
+#if CONFIG_SDP_NVS_RELATIONS > 0
+/* The NVS tier, its index is NULL until it has been loaded */
+static uint16_t nvs_rel_end = 0;
+/* Relations have been added to the NVS tier since it was last saved */
+static bool nvs_tier_dirty = false;
+static relation_tier nvs_tier = {
+    .relations = NULL,
+    .index = NULL,
+    .index_size = NVS_RELATION_INDEX_SIZE,
+    .capacity = CONFIG_SDP_NVS_RELATIONS,
+    .count = &nvs_rel_end};
+#endif
+
+/* Serializes adding relations */
+SemaphoreHandle_t x_relations_semaphore = NULL;
+
+/**
+ * @brief The home slot of a relation id, which is a crc32 already (Knuth multiplicative hash)
+ */
+static inline int relation_home(uint32_t relation_id, int index_size)
+{
+    return (relation_id * 2654435761u) % index_size;
+}
+
+static struct relation *tier_find(relation_tier *tier, uint32_t relation_id)
+{
+    uint16_t *index = __atomic_load_n(&tier->index, __ATOMIC_ACQUIRE);
+    if (index == NULL)
+    {
+        return NULL;
+    }
+    int slot = relation_home(relation_id, tier->index_size);
+    for (int i = 0; i < tier->index_size; i++)
+    {
+        uint16_t relation_no = __atomic_load_n(&index[slot], __ATOMIC_ACQUIRE);
+        if (relation_no == 0)
+        {
+            break;
+        }
+        if (tier->relations[relation_no - 1].relation_id == relation_id)
+        {
+            return &tier->relations[relation_no - 1];
+        }
+        slot = (slot + 1) % tier->index_size;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Index a relation that has been written, the semaphore must be held.
+ */
+static void tier_index(relation_tier *tier, uint16_t relation_no)
+{
+    int slot = relation_home(tier->relations[relation_no].relation_id, tier->index_size);
+    while (tier->index[slot] != 0)
+    {
+        slot = (slot + 1) % tier->index_size;
+    }
+    __atomic_store_n(&tier->index[slot], relation_no + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Is there a relation with a MAC address in the tier?
+ * Only used when adding relations, so it loops the tier rather than having another index.
+ */
+static bool tier_has_mac_address(relation_tier *tier, sdp_mac_address mac_address)
+{
+    if (tier->index == NULL)
+    {
+        return false;
+    }
+    for (int i = 0; i < *tier->count; i++)
+    {
+        if (memcmp(tier->relations[i].mac_address, mac_address, SDP_MAC_ADDR_LEN) == 0)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void tier_add(relation_tier *tier, sdp_mac_address mac_address, uint32_t relation_id
+    #ifdef CONFIG_SDP_LOAD_I2C
+    , uint8_t i2c_address
+    #endif
+    )
+{
+    uint16_t relation_no = *tier->count;
+    tier->relations[relation_no].relation_id = relation_id;
+    memcpy(tier->relations[relation_no].mac_address, mac_address, SDP_MAC_ADDR_LEN);
+    #ifdef CONFIG_SDP_LOAD_I2C
+    tier->relations[relation_no].i2c_address = i2c_address;
+    #endif
+    tier_index(tier, relation_no);
+    (*tier->count)++;
+}
+
+#if CONFIG_SDP_NVS_RELATIONS > 0
+
+/**
+ * @brief Load the NVS tier into the heap, the semaphore must be held (or during init).
+ */
+static void nvs_tier_load()
+{
+    if (nvs_tier.index != NULL)
+    {
+        return;
+    }
+    nvs_tier.relations = malloc(sizeof(struct relation) * CONFIG_SDP_NVS_RELATIONS);
+    uint16_t *index = calloc(NVS_RELATION_INDEX_SIZE, sizeof(uint16_t));
+    if ((nvs_tier.relations == NULL) || (index == NULL))
+    {
+        ESP_LOGE(relations_log_prefix, "Out of memory loading the relations in NVS!");
+        free(nvs_tier.relations);
+        nvs_tier.relations = NULL;
+        free(index);
+        return;
+    }
+    nvs_rel_end = 0;
+    /* Readers may use the tier from here, it is indexed as it is loaded */
+    __atomic_store_n(&nvs_tier.index, index, __ATOMIC_RELEASE);
+
+    nvs_handle_t handle;
+    if (nvs_open(RELATIONS_NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK)
+    {
+        size_t length = sizeof(struct relation) * CONFIG_SDP_NVS_RELATIONS;
+        esp_err_t rc = nvs_get_blob(handle, RELATIONS_NVS_KEY, nvs_tier.relations, &length);
+        nvs_close(handle);
+        if ((rc == ESP_OK) && (length % sizeof(struct relation) == 0))
+        {
+            for (uint16_t relation_no = 0; relation_no < length / sizeof(struct relation); relation_no++)
+            {
+                tier_index(&nvs_tier, relation_no);
+                nvs_rel_end++;
+            }
+        }
+        else if (rc != ESP_ERR_NVS_NOT_FOUND)
+        {
+            ESP_LOGW(relations_log_prefix, "Could not load the relations in NVS (%i, %u bytes), ignoring them.", rc, (unsigned int)length);
+        }
+    }
+    ESP_LOGI(relations_log_prefix, "Loaded %hu relations from NVS.", nvs_rel_end);
+}
+
+/**
+ * @brief Write the NVS tier back to NVS, the semaphore must be held.
+ * It stays dirty if it fails, so that it is tried again.
+ */
+static void nvs_tier_save()
+{
+    nvs_handle_t handle;
+    esp_err_t rc = nvs_open(RELATIONS_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (rc == ESP_OK)
+    {
+        rc = nvs_set_blob(handle, RELATIONS_NVS_KEY, nvs_tier.relations, sizeof(struct relation) * nvs_rel_end);
+        if (rc == ESP_OK)
+        {
+            rc = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (rc == ESP_OK)
+    {
+        nvs_tier_dirty = false;
+    }
+    else
+    {
+        ESP_LOGE(relations_log_prefix, "Failed to store the relations in NVS, they will be lost on sleep (%i).", rc);
+    }
+}
+
+/**
+ * @brief Remove the relations of an earlier boot from NVS
+ */
+static void nvs_tier_clear()
+{
+    nvs_handle_t handle;
+    if (nvs_open(RELATIONS_NVS_NAMESPACE, NVS_READWRITE, &handle) == ESP_OK)
+    {
+        if (nvs_erase_key(handle, RELATIONS_NVS_KEY) == ESP_OK)
+        {
+            nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+}
+#endif
+
+/**
+ * @brief Find the mac address of a relation id, without having to loop all peers
+ * @param relation_id The relation id to investigate
+ * @return sdp_mac_address* The address, or NULL if there is no such relation
+ */
+sdp_mac_address *relation_id_to_mac_address(uint32_t relation_id) {
+    struct relation *relation = tier_find(&rtc_tier, relation_id);
+    #if CONFIG_SDP_NVS_RELATIONS > 0
+    if (relation == NULL) {
+        relation = tier_find(&nvs_tier, relation_id);
+    }
+    #endif
+    if (relation == NULL) {
+        ESP_LOGD(relations_log_prefix, "Relation %"PRIu32" not found.", relation_id);
+        return NULL;
+    }
+    return &(relation->mac_address);
+}
+
+bool add_relation(sdp_mac_address mac_address, uint32_t relation_id
+    #ifdef CONFIG_SDP_LOAD_I2C
+    , uint8_t i2c_address
+    #endif
+    ) {
+    if (xSemaphoreTake(x_relations_semaphore, portMAX_DELAY) != pdTRUE) {
+        return false;
+    }
+    bool added = false;
+    /* Is it already there? */
+    if (tier_has_mac_address(&rtc_tier, mac_address)) {
+        goto finish;
+    }
+    if (rel_end < CONFIG_SDP_RTC_RELATIONS) {
+        tier_add(&rtc_tier, mac_address, relation_id
+        #ifdef CONFIG_SDP_LOAD_I2C
+        , i2c_address
+        #endif
+        );
+        ESP_LOGI(relations_log_prefix, "Relation added at %hu", rel_end - 1);
+        added = true;
+        goto finish;
+    }
+    #if CONFIG_SDP_NVS_RELATIONS > 0
+    nvs_tier_load();
+    if (tier_has_mac_address(&nvs_tier, mac_address)) {
+        goto finish;
+    }
+    if ((nvs_tier.index != NULL) && (nvs_rel_end < CONFIG_SDP_NVS_RELATIONS)) {
+        tier_add(&nvs_tier, mac_address, relation_id
+        #ifdef CONFIG_SDP_LOAD_I2C
+        , i2c_address
+        #endif
+        );
+        nvs_tier_dirty = true;
+        ESP_LOGI(relations_log_prefix, "Relation added at %hu in NVS", nvs_rel_end - 1);
+        added = true;
+        goto finish;
+    }
+    #endif
+    ESP_LOGE(relations_log_prefix, "!!! Relations are added that cannot be accommodated, this is likely an attack! !!!");
+    // TODO: This needs to be reported to monitoring
+    // TODO: Monitoring should detect slow (but pointless) and fast adding of peers (similar RSSI:s indicate the same source, too).
+finish:
+    xSemaphoreGive(x_relations_semaphore);
+    return added;
+}
+
+/**
+ * @brief Write the relations that has been added to NVS since the last time, call before going to sleep
+ */
+void sdp_relations_save() {
+    #if CONFIG_SDP_NVS_RELATIONS > 0
+    if (!nvs_tier_dirty) {
+        return;
+    }
+    if (xSemaphoreTake(x_relations_semaphore, portMAX_DELAY) == pdTRUE) {
+        if (nvs_tier_dirty) {
+            nvs_tier_save();
+            ESP_LOGI(relations_log_prefix, "Saved %hu relations to NVS.", nvs_rel_end);
+        }
+        xSemaphoreGive(x_relations_semaphore);
+    }
+    #endif
+}
+
+int sdp_relations_count() {
+    #if CONFIG_SDP_NVS_RELATIONS > 0
+    return rel_end + nvs_rel_end;
+    #else
+    return rel_end;
+    #endif
+}
+
+void sdp_relations_on_monitor() {
+    sdp_relations_save();
+    #if CONFIG_SDP_NVS_RELATIONS > 0
+    ESP_LOGI(relations_log_prefix, "Relations: %hu of %i in RTC memory, %hu of %i in NVS.",
+        rel_end, CONFIG_SDP_RTC_RELATIONS, nvs_rel_end, CONFIG_SDP_NVS_RELATIONS);
+    #else
+    ESP_LOGI(relations_log_prefix, "Relations: %hu of %i in RTC memory.", rel_end, CONFIG_SDP_RTC_RELATIONS);
+    #endif
+}
+
+/**
+ * @brief Initialize the relations, NVS must have been initialized
+ */
+void sdp_relations_init(char *_log_prefix) {
+    relations_log_prefix = _log_prefix;
+    x_relations_semaphore = xSemaphoreCreateMutex();
+    #if CONFIG_SDP_NVS_RELATIONS > 0
+    if (rel_end == 0) {
+        /* A cold boot, or no relations yet, either way the NVS tier is from an earlier boot */
+        nvs_tier_clear();
+    } else if (rel_end == CONFIG_SDP_RTC_RELATIONS) {
+        /* LoRa may need the NVS tier as soon as it starts receiving */
+        nvs_tier_load();
+    }
+    #endif
+    ESP_LOGI(relations_log_prefix, "Relations: %hu in RTC memory.", rel_end);
+}
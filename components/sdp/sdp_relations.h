@@ -0,0 +1,37 @@
+/**
+ * @file sdp_relations.h
+ * @author Nicklas Borjesson
+ * @brief The relations between this peer and others, resolving relation ids to MAC addresses
+ * The relations are kept in RTC memory, so they survive deep sleep. When it is full, further relations
+ * are kept in NVS.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_RELATIONS_H_
+#define _SDP_RELATIONS_H_
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "sdp_def.h"
+
+sdp_mac_address *relation_id_to_mac_address(uint32_t relation_id);
+bool add_relation(sdp_mac_address mac_address, uint32_t relation_id
+    #ifdef CONFIG_SDP_LOAD_I2C
+    , uint8_t i2c_address
+    #endif
+);
+
+// TODO: Add add_external_relation - to add a relation between two external peers
+
+void sdp_relations_save();
+int sdp_relations_count();
+void sdp_relations_on_monitor();
+
+void sdp_relations_init(char *_log_prefix);
+
+#endif
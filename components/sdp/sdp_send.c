@@ -0,0 +1,490 @@
+/**
+ * @file sdp_send.c
+ * @author Nicklas Borjesson
+ * @brief Asynchronous sending through per-media transmit queues
+ * A frame is copied into a transmit item and queued on the media that select_media() picks.
+ * ESP-NOW and BLE have their own transmit queues here, while LoRa and I2C frames are put on
+ * their existing work queues, as their radios/busses must only be used from those workers.
+ * Failed frames are retried on a newly selected media up to SDP_SEND_ATTEMPTS times,
+ * after which the completion callback and handle are told about the outcome.
+ * Acknowledgements are taken from a few reserved slots instead of the heap, and are queued without waiting,
+ * as they are sent from the receiving context. If no slot is free or a queue is full, the acknowledgement is dropped.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_send.h"
+
+#include <string.h>
+#include <esp_log.h>
+
+#include "sdp_work_queue.h"
+#include "sdp_messaging.h"
+#include "sdp_peer.h"
+#include "sdp_mesh.h"
+#include "sdp_helpers.h"
+#include "sdp_pool.h"
+#include "sdp_fragment.h"
+#include "orchestration/orchestration.h"
+
+#ifdef CONFIG_SDP_LOAD_LORA
+#include "lora/lora_worker.h"
+#endif
+#ifdef CONFIG_SDP_LOAD_I2C
+#include "i2c/i2c_worker.h"
+#endif
+
+/* The log prefix for all logging */
+char *send_log_prefix = NULL;
+
+/* Statistics, counted from the senders and the transmit workers on both cores */
+uint32_t send_queued_count = 0;
+uint32_t send_retry_count = 0;
+uint32_t send_failed_count = 0;
+uint32_t send_ack_dropped_count = 0;
+
+/* The reserved acknowledgement slots, a transmit item and its frame followed by room for a media queue item */
+#define ACK_SLOT_MEDIA_ITEM_OFFSET SDP_POOL_ALIGN(sizeof(sdp_tx_item_t) + SDP_SEND_ACK_MAX_LENGTH)
+#define ACK_SLOT_SIZE (ACK_SLOT_MEDIA_ITEM_OFFSET + SDP_SEND_ACK_MEDIA_ITEM_SIZE)
+static uint8_t ack_slot_storage[SDP_SEND_ACK_SLOT_COUNT * SDP_POOL_ALIGN(ACK_SLOT_SIZE)]
+    __attribute__((aligned(SDP_POOL_ALIGNMENT)));
+sdp_pool_t ack_slot_pool;
+
+static work_stamp_t *tx_item_stamp(sdp_tx_item_t *tx_item)
+{
+    return &tx_item->stamp;
+}
+
+/* The work type is in the preamble of the frame */
+static int tx_item_type(sdp_tx_item_t *tx_item)
+{
+    return tx_item->data_length > 4 ? tx_item->data[4] : 0;
+}
+
+/* Frames that must be fragmented have their own queue, as sending them waits for the receiver */
+queue_context fragment_tx_queue_context;
+
+STAILQ_HEAD(fragment_tx_q, sdp_tx_item)
+fragment_tx_q;
+
+sdp_tx_item_t *fragment_tx_first_queueitem()
+{
+    return STAILQ_FIRST(&fragment_tx_q);
+}
+
+void fragment_tx_remove_first_queue_item()
+{
+    STAILQ_REMOVE_HEAD(&fragment_tx_q, items);
+}
+
+void fragment_tx_insert_tail(sdp_tx_item_t *new_item)
+{
+    STAILQ_INSERT_TAIL(&fragment_tx_q, new_item, items);
+}
+
+#ifdef CONFIG_SDP_LOAD_ESP_NOW
+queue_context espnow_tx_queue_context;
+
+STAILQ_HEAD(espnow_tx_q, sdp_tx_item)
+espnow_tx_q;
+
+sdp_tx_item_t *espnow_tx_first_queueitem()
+{
+    return STAILQ_FIRST(&espnow_tx_q);
+}
+
+void espnow_tx_remove_first_queue_item()
+{
+    STAILQ_REMOVE_HEAD(&espnow_tx_q, items);
+}
+
+void espnow_tx_insert_tail(sdp_tx_item_t *new_item)
+{
+    STAILQ_INSERT_TAIL(&espnow_tx_q, new_item, items);
+}
+#endif
+
+#ifdef CONFIG_SDP_LOAD_BLE
+queue_context ble_tx_queue_context;
+
+STAILQ_HEAD(ble_tx_q, sdp_tx_item)
+ble_tx_q;
+
+sdp_tx_item_t *ble_tx_first_queueitem()
+{
+    return STAILQ_FIRST(&ble_tx_q);
+}
+
+void ble_tx_remove_first_queue_item()
+{
+    STAILQ_REMOVE_HEAD(&ble_tx_q, items);
+}
+
+void ble_tx_insert_tail(sdp_tx_item_t *new_item)
+{
+    STAILQ_INSERT_TAIL(&ble_tx_q, new_item, items);
+}
+#endif
+
+/**
+ * @brief Select a media for the frame and put it on that media's transmit queue
+ * @return int SDP_OK if queued, a negative error otherwise
+ */
+static int dispatch(sdp_tx_item_t *tx_item)
+{
+    esp_err_t rc = ESP_FAIL;
+    /* Acknowledgements are sent from the receiving context, which must not wait */
+    bool ack = sdp_pool_owns(&ack_slot_pool, tx_item);
+    tx_item->media_type = select_media(tx_item->peer, tx_item->data_length);
+    tx_item->attempts++;
+
+    if ((tx_item->media_type > 0) && (tx_item->data_length > sdp_fragment_mtu(tx_item->media_type)))
+    {
+        if (ack)
+        {
+            /* Sending fragments waits for the receiver, an acknowledgement that does not fit is dropped */
+            return -SDP_ERR_MESSAGE_TOO_LONG;
+        }
+        rc = safe_add_work_queue(&fragment_tx_queue_context, tx_item);
+        return rc == ESP_OK ? SDP_OK : -SDP_ERR_SEND_FAIL;
+    }
+
+    switch (tx_item->media_type)
+    {
+#ifdef CONFIG_SDP_LOAD_ESP_NOW
+    case SDP_MT_ESPNOW:
+        rc = ack ? safe_add_work_queue_no_wait(&espnow_tx_queue_context, tx_item)
+                 : safe_add_work_queue(&espnow_tx_queue_context, tx_item);
+        break;
+#endif
+#ifdef CONFIG_SDP_LOAD_BLE
+    case SDP_MT_BLE:
+        rc = ack ? safe_add_work_queue_no_wait(&ble_tx_queue_context, tx_item)
+                 : safe_add_work_queue(&ble_tx_queue_context, tx_item);
+        break;
+#endif
+#ifdef CONFIG_SDP_LOAD_LORA
+    case SDP_MT_LoRa:
+        rc = lora_safe_add_tx_item(tx_item);
+        break;
+#endif
+#ifdef CONFIG_SDP_LOAD_I2C
+    case SDP_MT_I2C:
+        rc = i2c_safe_add_tx_item(tx_item);
+        break;
+#endif
+    default:
+        ESP_LOGE(send_log_prefix, ">> No usable media for peer %s (selected %hhu).",
+                 tx_item->peer->name, tx_item->media_type);
+        return -SDP_ERR_NOT_SUPPORTED;
+    }
+    return rc == ESP_OK ? SDP_OK : -SDP_ERR_SEND_FAIL;
+}
+
+/**
+ * @brief Allocate a transmit item with room for the frame after it
+ * @param ack If set, a reserved acknowledgement slot is used, and NULL returned if none is free or the frame does not fit
+ */
+static sdp_tx_item_t *alloc_tx_item(int data_length, bool ack)
+{
+    if (ack)
+    {
+        return data_length <= SDP_SEND_ACK_MAX_LENGTH ? sdp_pool_alloc(&ack_slot_pool) : NULL;
+    }
+    return malloc(sizeof(sdp_tx_item_t) + data_length);
+}
+
+/**
+ * @brief The room for a media queue item in the slot of an acknowledgement
+ * LoRa and I2C wrap transmit items in their own queue items, which for acknowledgements must not be allocated.
+ * The room is reused when the acknowledgement is retried, so the media must be done with its queue item before 
+ * calling sdp_send_complete().
+ * @return void* The room, SDP_SEND_ACK_MEDIA_ITEM_SIZE bytes, or NULL if the item is not an acknowledgement
+ */
+void *sdp_send_ack_media_item(sdp_tx_item_t *tx_item)
+{
+    if (!sdp_pool_owns(&ack_slot_pool, tx_item))
+    {
+        return NULL;
+    }
+    return (uint8_t *)tx_item + ACK_SLOT_MEDIA_ITEM_OFFSET;
+}
+
+static void free_tx_item(sdp_tx_item_t *tx_item)
+{
+    sdp_mesh_peer_unref(tx_item->peer);
+    if (sdp_pool_owns(&ack_slot_pool, tx_item))
+    {
+        sdp_pool_free(&ack_slot_pool, tx_item);
+    }
+    else
+    {
+        free(tx_item);
+    }
+}
+
+/**
+ * @brief Report the outcome of a frame and free it
+ */
+static void report(sdp_tx_item_t *tx_item, int result)
+{
+    if (result < 0)
+    {
+        __atomic_fetch_add(&send_failed_count, 1, __ATOMIC_RELAXED);
+    }
+    if (tx_item->on_sent_cb != NULL)
+    {
+        tx_item->on_sent_cb(tx_item->peer, result, tx_item->cb_arg);
+    }
+    if (tx_item->handle != NULL)
+    {
+        tx_item->handle->result = result;
+        xSemaphoreGive(tx_item->handle->done);
+    }
+    free_tx_item(tx_item);
+}
+
+/**
+ * @brief Called by the transmit workers when they are done with a frame
+ * A failed frame is retried on a newly selected media if it has attempts left.
+ *
+ * @param tx_item The frame
+ * @param result The media type used if successful, a negative value on failure
+ */
+void sdp_send_complete(sdp_tx_item_t *tx_item, int result)
+{
+    if ((result < 0) && (tx_item->attempts < SDP_SEND_ATTEMPTS))
+    {
+        ESP_LOGI(send_log_prefix, ">> Send failed; retrying %i more times ", SDP_SEND_ATTEMPTS - tx_item->attempts);
+        __atomic_fetch_add(&send_retry_count, 1, __ATOMIC_RELAXED);
+        result = dispatch(tx_item);
+        if (result == SDP_OK)
+        {
+            return;
+        }
+    }
+    else if (result < 0)
+    {
+        ESP_LOGE(send_log_prefix, ">> Send failed, will not retry any more.");
+    }
+    report(tx_item, result);
+}
+
+/**
+ * @brief Called by the transmit workers for a frame that has passed its deadline, it is not sent nor retried
+ */
+void sdp_send_expired(sdp_tx_item_t *tx_item)
+{
+    ESP_LOGW(send_log_prefix, ">> Not sending to %s, the deadline has passed.", tx_item->peer->name);
+    __atomic_fetch_add(&tx_item->peer->expired_count, 1, __ATOMIC_RELAXED);
+    report(tx_item, -SDP_ERR_EXPIRED);
+}
+
+/**
+ * @brief Transmit queue worker callback for media where sending is a direct call (ESP-NOW and BLE),
+ * and for frames that are fragmented
+ */
+static void tx_do_on_work_cb(sdp_tx_item_t *tx_item)
+{
+    int rc = sdp_send_message_media_type(tx_item->peer, tx_item->data, tx_item->data_length,
+                                         tx_item->media_type, false);
+    sdp_send_complete(tx_item, rc);
+}
+
+/**
+ * @brief Initialize a handle before passing it to sdp_send_async()
+ */
+void sdp_send_handle_init(sdp_send_handle_t *handle)
+{
+    handle->done = xSemaphoreCreateBinaryStatic(&handle->done_buffer);
+    handle->result = 0;
+}
+
+/**
+ * @brief Wait for a send to complete
+ * NOTE: If this times out, the handle must still be kept valid until the send completes.
+ *
+ * @param handle The handle given to sdp_send_async()
+ * @param timeout How long to wait, in ticks
+ * @return int The media type used if successful, a negative value on failure or timeout
+ */
+int sdp_send_wait(sdp_send_handle_t *handle, TickType_t timeout)
+{
+    if (xSemaphoreTake(handle->done, timeout) != pdTRUE)
+    {
+        ESP_LOGW(send_log_prefix, ">> Timed out waiting for a send to complete.");
+        return -SDP_ERR_SEND_FAIL;
+    }
+    return handle->result;
+}
+
+static int queue_frame(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt,
+                       send_callback *on_sent_cb, void *cb_arg, sdp_send_handle_t *handle, bool ack)
+{
+    int data_length = sdp_iovec_length(iov, iovcnt);
+    if (peer == NULL || data_length <= 0)
+    {
+        return -SDP_ERR_INVALID_PARAM;
+    }
+    /* The frame is stored right after the item, so a single allocation is needed */
+    sdp_tx_item_t *tx_item = alloc_tx_item(data_length, ack);
+    if (tx_item == NULL)
+    {
+        if (ack)
+        {
+            __atomic_fetch_add(&send_ack_dropped_count, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            ESP_LOGE(send_log_prefix, ">> Out of memory, could not queue %i bytes.", data_length);
+        }
+        return -SDP_ERR_OUT_OF_MEMORY;
+    }
+    /* The caller may only have the peer in a read section, the item keeps it until it is freed */
+    sdp_mesh_peer_ref(peer);
+    tx_item->peer = peer;
+    tx_item->data = (uint8_t *)(tx_item + 1);
+    tx_item->data_length = sdp_iovec_gather(tx_item->data, data_length, iov, iovcnt);
+    tx_item->attempts = 0;
+    tx_item->on_sent_cb = on_sent_cb;
+    tx_item->cb_arg = cb_arg;
+    tx_item->handle = handle;
+    /* Not worth sending after the peer, or we, have gone to sleep */
+    tx_item->stamp.deadline = sdp_orchestration_deadline(peer);
+
+    int rc = dispatch(tx_item);
+    if (rc != SDP_OK)
+    {
+        if (ack)
+        {
+            __atomic_fetch_add(&send_ack_dropped_count, 1, __ATOMIC_RELAXED);
+        }
+        else
+        {
+            __atomic_fetch_add(&send_failed_count, 1, __ATOMIC_RELAXED);
+        }
+        free_tx_item(tx_item);
+        return rc;
+    }
+    __atomic_fetch_add(&send_queued_count, 1, __ATOMIC_RELAXED);
+    return SDP_OK;
+}
+
+/**
+ * @brief Send a frame, given as segments, without waiting for it to be sent
+ * The segments are gathered into the transmit item, so they can be freed directly after the call.
+ * If queueing fails, the error is returned and neither the callback nor the handle are used.
+ *
+ * @param peer The peer
+ * @param iov The segments of the frame, including the preamble
+ * @param iovcnt The number of segments
+ * @param on_sent_cb Optional, called from the transmit worker when the frame is sent or has failed
+ * @param cb_arg Passed to on_sent_cb
+ * @param handle Optional, initialized with sdp_send_handle_init(), signalled when the frame is sent or has failed
+ * @return int SDP_OK if the frame was queued, a negative error otherwise
+ */
+int sdp_send_async_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt,
+                     send_callback *on_sent_cb, void *cb_arg, sdp_send_handle_t *handle)
+{
+    return queue_frame(peer, iov, iovcnt, on_sent_cb, cb_arg, handle, false);
+}
+
+/**
+ * @brief Send a short acknowledgement from a reserved slot, without waiting
+ * This neither allocates nor waits for a queue, so it can be called from the receiving context.
+ * If no slot is free, or the queue of the selected media is full or busy, the acknowledgement is dropped.
+ * Nor is it fragmented, if it is longer than the MTU of the selected media it is dropped.
+ *
+ * @return int SDP_OK if the frame was queued, a negative error if it was dropped
+ */
+int sdp_send_ack(sdp_peer *peer, const void *data, int data_length)
+{
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return sdp_send_ack_v(peer, &iov, 1);
+}
+
+/**
+ * @brief Send an acknowledgement given as segments, like a fragment status, see sdp_send_ack()
+ */
+int sdp_send_ack_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt)
+{
+    return queue_frame(peer, iov, iovcnt, NULL, NULL, NULL, true);
+}
+
+/**
+ * @brief Send a frame without waiting for it to be sent, see sdp_send_async_v()
+ */
+int sdp_send_async(sdp_peer *peer, const void *data, int data_length,
+                   send_callback *on_sent_cb, void *cb_arg, sdp_send_handle_t *handle)
+{
+    sdp_iovec_t iov = {.base = data, .length = data_length};
+    return sdp_send_async_v(peer, &iov, 1, on_sent_cb, cb_arg, handle);
+}
+
+void sdp_send_on_monitor()
+{
+    if (send_log_prefix)
+    {
+        uint32_t gathered_bytes, sent_bytes;
+        sdp_iovec_get_stats(&gathered_bytes, &sent_bytes);
+        ESP_LOGI(send_log_prefix, "Sending: %"PRIu32" frames queued, %"PRIu32" retries, %"PRIu32" failed, %"PRIu32" acknowledgements dropped.",
+                 send_queued_count, send_retry_count, send_failed_count, send_ack_dropped_count);
+        ESP_LOGI(send_log_prefix, "Sending: %"PRIu32" bytes copied for %"PRIu32" bytes sent.", gathered_bytes, sent_bytes);
+        work_queue_on_monitor(&fragment_tx_queue_context);
+#ifdef CONFIG_SDP_LOAD_ESP_NOW
+        work_queue_on_monitor(&espnow_tx_queue_context);
+#endif
+#ifdef CONFIG_SDP_LOAD_BLE
+        work_queue_on_monitor(&ble_tx_queue_context);
+#endif
+    }
+}
+
+void sdp_send_init(char *_log_prefix)
+{
+    send_log_prefix = _log_prefix;
+    sdp_pool_create(&ack_slot_pool, "ack slots", ack_slot_storage, ACK_SLOT_SIZE, SDP_SEND_ACK_SLOT_COUNT);
+    STAILQ_INIT(&fragment_tx_q);
+    fragment_tx_queue_context.first_queue_item_cb = &fragment_tx_first_queueitem;
+    fragment_tx_queue_context.remove_first_queueitem_cb = &fragment_tx_remove_first_queue_item;
+    fragment_tx_queue_context.insert_tail_cb = &fragment_tx_insert_tail;
+    fragment_tx_queue_context.on_work_cb = &tx_do_on_work_cb;
+    fragment_tx_queue_context.item_stamp_cb = (item_stamp *)&tx_item_stamp;
+    fragment_tx_queue_context.item_type_cb = (item_type *)&tx_item_type;
+    fragment_tx_queue_context.on_expired_cb = (work_callback *)&sdp_send_expired;
+    fragment_tx_queue_context.max_task_count = 1;
+    fragment_tx_queue_context.multitasking = false;
+    fragment_tx_queue_context.watchdog_timeout = CONFIG_SDP_RECEIPT_TIMEOUT_MS;
+    init_work_queue(&fragment_tx_queue_context, _log_prefix, "Fragment TX Queue");
+#ifdef CONFIG_SDP_LOAD_ESP_NOW
+    STAILQ_INIT(&espnow_tx_q);
+    espnow_tx_queue_context.first_queue_item_cb = &espnow_tx_first_queueitem;
+    espnow_tx_queue_context.remove_first_queueitem_cb = &espnow_tx_remove_first_queue_item;
+    espnow_tx_queue_context.insert_tail_cb = &espnow_tx_insert_tail;
+    espnow_tx_queue_context.on_work_cb = &tx_do_on_work_cb;
+    espnow_tx_queue_context.item_stamp_cb = (item_stamp *)&tx_item_stamp;
+    espnow_tx_queue_context.item_type_cb = (item_type *)&tx_item_type;
+    espnow_tx_queue_context.on_expired_cb = (work_callback *)&sdp_send_expired;
+    espnow_tx_queue_context.max_task_count = 1;
+    espnow_tx_queue_context.ring_size = CONFIG_SDP_QUEUE_RING_SIZE;
+    espnow_tx_queue_context.multitasking = false;
+    espnow_tx_queue_context.watchdog_timeout = CONFIG_SDP_RECEIPT_TIMEOUT_MS;
+    init_work_queue(&espnow_tx_queue_context, _log_prefix, "ESP-NOW TX Queue");
+#endif
+#ifdef CONFIG_SDP_LOAD_BLE
+    STAILQ_INIT(&ble_tx_q);
+    ble_tx_queue_context.first_queue_item_cb = &ble_tx_first_queueitem;
+    ble_tx_queue_context.remove_first_queueitem_cb = &ble_tx_remove_first_queue_item;
+    ble_tx_queue_context.insert_tail_cb = &ble_tx_insert_tail;
+    ble_tx_queue_context.on_work_cb = &tx_do_on_work_cb;
+    ble_tx_queue_context.item_stamp_cb = (item_stamp *)&tx_item_stamp;
+    ble_tx_queue_context.item_type_cb = (item_type *)&tx_item_type;
+    ble_tx_queue_context.on_expired_cb = (work_callback *)&sdp_send_expired;
+    ble_tx_queue_context.max_task_count = 1;
+    ble_tx_queue_context.ring_size = CONFIG_SDP_QUEUE_RING_SIZE;
+    ble_tx_queue_context.multitasking = false;
+    ble_tx_queue_context.watchdog_timeout = CONFIG_SDP_RECEIPT_TIMEOUT_MS;
+    init_work_queue(&ble_tx_queue_context, _log_prefix, "BLE TX Queue");
+#endif
+}
@@ -0,0 +1,98 @@
+/**
+ * @file sdp_send.h
+ * @author Nicklas Borjesson
+ * @brief Asynchronous sending through per-media transmit queues
+ * sdp_send_async() puts a frame on the transmit queue of the selected media and returns immediately.
+ * The outcome is reported through a callback and/or a handle that can be waited on.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_SEND_H_
+#define _SDP_SEND_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <sys/queue.h>
+
+#include "sdp_def.h"
+#include "sdp_fragment.h"
+
+/* How many times a frame is tried (re-selecting media each time) before failing */
+#define SDP_SEND_ATTEMPTS 4
+
+/* The number of transmit slots reserved for acknowledgements, and how long those may be, 
+fragment statuses are acknowledgements too */
+#define SDP_SEND_ACK_SLOT_COUNT 4
+#define SDP_SEND_ACK_MAX_LENGTH SDP_FRAGMENT_STATUS_MAX_LENGTH
+/* Room in an acknowledgement slot for the queue item of a media that wraps transmit items (LoRa and I2C) */
+#define SDP_SEND_ACK_MEDIA_ITEM_SIZE 96
+
+/**
+ * @brief Called when a frame has been sent, or has finally failed
+ * @param peer The peer
+ * @param result The media type used if successful, a negative value on failure
+ * @param cb_arg The argument given to sdp_send_async()
+ */
+typedef void(send_callback)(sdp_peer *peer, int result, void *cb_arg);
+
+/**
+ * @brief A handle that can be waited on until a frame is sent, or has failed
+ * It is owned by the caller, and must be waited on before it goes out of scope.
+ */
+typedef struct sdp_send_handle
+{
+    /* Given when the send has completed */
+    SemaphoreHandle_t done;
+    /* The memory of the semaphore, so that no allocation is needed */
+    StaticSemaphore_t done_buffer;
+    /* The result, see send_callback */
+    int result;
+} sdp_send_handle_t;
+
+/**
+ * @brief A frame on its way through a transmit queue
+ */
+typedef struct sdp_tx_item
+{
+    /* The peer */
+    sdp_peer *peer;
+    /* The frame, preamble included. Stored right after the item. */
+    uint8_t *data;
+    /* The length of the frame */
+    uint32_t data_length;
+    /* The media it is queued on */
+    e_media_type media_type;
+    /* The number of attempts so far */
+    uint8_t attempts;
+    /* Optional completion callback, and its argument */
+    send_callback *on_sent_cb;
+    void *cb_arg;
+    /* Optional handle to signal */
+    sdp_send_handle_t *handle;
+    /* When it was queued and taken from the queue */
+    work_stamp_t stamp;
+    /* Queue reference */
+    STAILQ_ENTRY(sdp_tx_item)
+    items;
+} sdp_tx_item_t;
+
+void sdp_send_handle_init(sdp_send_handle_t *handle);
+int sdp_send_wait(sdp_send_handle_t *handle, TickType_t timeout);
+
+int sdp_send_async(sdp_peer *peer, const void *data, int data_length,
+                   send_callback *on_sent_cb, void *cb_arg, sdp_send_handle_t *handle);
+int sdp_send_async_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt,
+                     send_callback *on_sent_cb, void *cb_arg, sdp_send_handle_t *handle);
+int sdp_send_ack(sdp_peer *peer, const void *data, int data_length);
+int sdp_send_ack_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt);
+void *sdp_send_ack_media_item(sdp_tx_item_t *tx_item);
+void sdp_send_complete(sdp_tx_item_t *tx_item, int result);
+void sdp_send_expired(sdp_tx_item_t *tx_item);
+
+void sdp_send_on_monitor();
+
+void sdp_send_init(char *_log_prefix);
+
+#endif
@@ -0,0 +1,337 @@
+/**
+ * @file sdp_snapshot.c
+ * @author Nicklas Borjesson
+ * @brief A snapshot of the peers, taken before deep sleep and restored after waking up
+ * The snapshot holds what is otherwise learned from HI-messages and media scoring: names, MAC addresses,
+ * supported media types, protocol versions, relation ids, availability, the media scores and link estimates.
+ * It is kept in RTC memory if it fits, otherwise in NVS. Either way, its header is in RTC memory,
+ * so it is only used after a deep sleep, never after a reset or a power cycle.
+ * The header has a version, the size of a record and a CRC over the header and the records,
+ * anything else (like a snapshot from another firmware) is ignored.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_snapshot.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <esp_log.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <nvs.h>
+
+#include "sdp_def.h"
+#include "sdp_mesh.h"
+#include "sdp_registry.h"
+#include "sdp_crc.h"
+
+/* Change this when the meaning of a record changes (a changed size is detected anyway) */
+#define PEER_SNAPSHOT_VERSION 2
+#define PEER_SNAPSHOT_MAGIC 0x53445053
+
+#define SNAPSHOT_NVS_NAMESPACE "sdp"
+#define SNAPSHOT_NVS_KEY "peers"
+
+/* The log prefix for all logging */
+char *snapshot_log_prefix;
+
+/* What is kept of the statistics of a media, the counters start over after waking up */
+struct media_snapshot {
+    float last_score;
+    uint32_t theoretical_speed;
+    sdp_link_estimate link;
+};
+
+struct peer_snapshot {
+    uint64_t next_availability;
+    uint32_t relation_id;
+    sdp_mac_address base_mac_address;
+    sdp_media_types supported_media_types;
+    uint8_t protocol_version;
+    uint8_t min_protocol_version;
+    uint8_t state;
+    #ifdef CONFIG_SDP_LOAD_I2C
+    uint8_t i2c_address;
+    #endif
+    sdp_peer_name name;
+    #ifdef CONFIG_SDP_LOAD_ESP_NOW
+    struct media_snapshot espnow;
+    #endif
+    #ifdef CONFIG_SDP_LOAD_LORA
+    struct media_snapshot lora;
+    #endif
+    #ifdef CONFIG_SDP_LOAD_I2C
+    struct media_snapshot i2c;
+    #endif
+};
+
+struct snapshot_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t record_size;
+    uint16_t count;
+    /* If the records are in NVS rather than in RTC memory */
+    uint16_t in_nvs;
+    /* Over the fields above and the records, must be last */
+    uint32_t crc;
+};
+
+#define SNAPSHOT_RTC_RECORDS (CONFIG_SDP_PEER_SNAPSHOT_RTC_SIZE / sizeof(struct peer_snapshot))
+
+RTC_DATA_ATTR struct snapshot_header snapshot_header;
+#if CONFIG_SDP_PEER_SNAPSHOT_RTC_SIZE > 0
+RTC_DATA_ATTR struct peer_snapshot rtc_snapshot[SNAPSHOT_RTC_RECORDS];
+#else
+static struct peer_snapshot *rtc_snapshot = NULL;
+#endif
+
+static uint32_t snapshot_crc(struct peer_snapshot *records, int count)
+{
+    uint32_t crc = sdp_crc32(0, &snapshot_header, offsetof(struct snapshot_header, crc));
+    return sdp_crc32(crc, records, sizeof(struct peer_snapshot) * count);
+}
+
+static void save_media(struct media_snapshot *media, struct sdp_peer_media_stats *stats)
+{
+    media->last_score = stats->last_score;
+    media->theoretical_speed = stats->theoretical_speed;
+    media->link = stats->link;
+}
+
+/**
+ * The score time is left at zero, as the time since boot restarts, so the peer will be scored again when monitored.
+ * No frame sent before sleeping is awaiting its acknowledgement.
+ */
+static void restore_media(struct sdp_peer_media_stats *stats, struct media_snapshot *media)
+{
+    stats->last_score = media->last_score;
+    stats->theoretical_speed = media->theoretical_speed;
+    stats->link = media->link;
+    stats->link.send_length = 0;
+}
+
+static void save_peer(struct peer_snapshot *record, sdp_peer *peer)
+{
+    memset(record, 0, sizeof(struct peer_snapshot));
+    record->next_availability = peer->next_availability;
+    record->relation_id = peer->relation_id;
+    memcpy(record->base_mac_address, peer->base_mac_address, SDP_MAC_ADDR_LEN);
+    record->supported_media_types = peer->supported_media_types;
+    record->protocol_version = peer->protocol_version;
+    record->min_protocol_version = peer->min_protocol_version;
+    record->state = (uint8_t)peer->state;
+    strncpy(record->name, peer->name, CONFIG_SDP_PEER_NAME_LEN - 1);
+    #ifdef CONFIG_SDP_LOAD_I2C
+    record->i2c_address = peer->i2c_address;
+    save_media(&record->i2c, &peer->i2c_stats);
+    #endif
+    #ifdef CONFIG_SDP_LOAD_ESP_NOW
+    save_media(&record->espnow, &peer->espnow_stats);
+    #endif
+    #ifdef CONFIG_SDP_LOAD_LORA
+    save_media(&record->lora, &peer->lora_stats);
+    #endif
+}
+
+static bool restore_peer(struct peer_snapshot *record)
+{
+    int peer_handle = sdp_mesh_peer_add(record->name);
+    if (peer_handle < 0)
+    {
+        /* Most likely, it has already said hello */
+        ESP_LOGW(snapshot_log_prefix, "Could not restore the peer %s (%i).", record->name, peer_handle);
+        return false;
+    }
+    sdp_peer *peer = sdp_mesh_find_peer_by_handle(peer_handle);
+    if (peer == NULL)
+    {
+        return false;
+    }
+    peer->next_availability = record->next_availability;
+    peer->relation_id = record->relation_id;
+    memcpy(peer->base_mac_address, record->base_mac_address, SDP_MAC_ADDR_LEN);
+    peer->supported_media_types = record->supported_media_types;
+    peer->protocol_version = record->protocol_version;
+    peer->min_protocol_version = record->min_protocol_version;
+    peer->state = (e_peer_state)record->state;
+    #ifdef CONFIG_SDP_LOAD_I2C
+    peer->i2c_address = record->i2c_address;
+    restore_media(&peer->i2c_stats, &record->i2c);
+    #endif
+    #ifdef CONFIG_SDP_LOAD_ESP_NOW
+    restore_media(&peer->espnow_stats, &record->espnow);
+    #endif
+    #ifdef CONFIG_SDP_LOAD_LORA
+    restore_media(&peer->lora_stats, &record->lora);
+    #endif
+    /* Until now, lookups has found the peer by its name and handle only */
+    sdp_registry_update(peer);
+    init_supported_media_types(peer);
+    return true;
+}
+
+static bool nvs_save(struct peer_snapshot *records, int count)
+{
+    nvs_handle_t handle;
+    esp_err_t rc = nvs_open(SNAPSHOT_NVS_NAMESPACE, NVS_READWRITE, &handle);
+    if (rc == ESP_OK)
+    {
+        rc = nvs_set_blob(handle, SNAPSHOT_NVS_KEY, records, sizeof(struct peer_snapshot) * count);
+        if (rc == ESP_OK)
+        {
+            rc = nvs_commit(handle);
+        }
+        nvs_close(handle);
+    }
+    if (rc != ESP_OK)
+    {
+        ESP_LOGE(snapshot_log_prefix, "Failed to store the peer snapshot in NVS (%i).", rc);
+        return false;
+    }
+    return true;
+}
+
+static struct peer_snapshot *nvs_load(int count)
+{
+    size_t length = sizeof(struct peer_snapshot) * count;
+    struct peer_snapshot *records = malloc(length);
+    if (records == NULL)
+    {
+        ESP_LOGE(snapshot_log_prefix, "Out of memory loading the peer snapshot from NVS!");
+        return NULL;
+    }
+    nvs_handle_t handle;
+    esp_err_t rc = nvs_open(SNAPSHOT_NVS_NAMESPACE, NVS_READONLY, &handle);
+    if (rc == ESP_OK)
+    {
+        rc = nvs_get_blob(handle, SNAPSHOT_NVS_KEY, records, &length);
+        nvs_close(handle);
+    }
+    if ((rc != ESP_OK) || (length != sizeof(struct peer_snapshot) * count))
+    {
+        ESP_LOGW(snapshot_log_prefix, "Could not load the peer snapshot from NVS (%i, %u bytes).", rc, (unsigned int)length);
+        free(records);
+        return NULL;
+    }
+    return records;
+}
+
+/**
+ * @brief Take a snapshot of the peers, call just before going to deep sleep
+ */
+void sdp_snapshot_save()
+{
+    int64_t starttime = esp_timer_get_time();
+    snapshot_header.magic = 0;
+
+    int capacity = sdp_registry_count();
+    if (capacity == 0)
+    {
+        return;
+    }
+    struct peer_snapshot *records = rtc_snapshot;
+    bool in_nvs = capacity > SNAPSHOT_RTC_RECORDS;
+    if (in_nvs)
+    {
+        records = malloc(sizeof(struct peer_snapshot) * capacity);
+        if (records == NULL)
+        {
+            ESP_LOGE(snapshot_log_prefix, "Out of memory taking a snapshot of the peers, they will be lost on sleep!");
+            return;
+        }
+    }
+
+    int count = 0;
+    sdp_peer *peer;
+    sdp_mesh_read_begin();
+    SLIST_FOREACH(peer, get_peer_list(), next)
+    {
+        if (count == capacity)
+        {
+            break;
+        }
+        save_peer(&records[count++], peer);
+    }
+    sdp_mesh_read_end();
+
+    if (in_nvs && !nvs_save(records, count))
+    {
+        free(records);
+        return;
+    }
+
+    snapshot_header.version = PEER_SNAPSHOT_VERSION;
+    snapshot_header.record_size = sizeof(struct peer_snapshot);
+    snapshot_header.count = count;
+    snapshot_header.in_nvs = in_nvs;
+    snapshot_header.magic = PEER_SNAPSHOT_MAGIC;
+    snapshot_header.crc = snapshot_crc(records, count);
+    if (in_nvs)
+    {
+        free(records);
+    }
+    ESP_LOGI(snapshot_log_prefix, "Took a snapshot of %i peers (%u bytes in %s) in %lli us.", count,
+             (unsigned int)(sizeof(struct peer_snapshot) * count), in_nvs ? "NVS" : "RTC memory", esp_timer_get_time() - starttime);
+}
+
+/**
+ * @brief Restore the peers of the snapshot taken before sleeping
+ * Call after waking up, when the medias have been initialized, as the peers are added to them.
+ * @return int The number of restored peers
+ */
+int sdp_snapshot_restore()
+{
+    if ((snapshot_header.magic != PEER_SNAPSHOT_MAGIC) || (snapshot_header.version != PEER_SNAPSHOT_VERSION) ||
+        (snapshot_header.record_size != sizeof(struct peer_snapshot)))
+    {
+        ESP_LOGI(snapshot_log_prefix, "No peer snapshot to restore.");
+        return 0;
+    }
+    struct peer_snapshot *records = rtc_snapshot;
+    if (snapshot_header.in_nvs)
+    {
+        records = nvs_load(snapshot_header.count);
+    }
+    else if (snapshot_header.count > SNAPSHOT_RTC_RECORDS)
+    {
+        records = NULL;
+    }
+    bool valid = (records != NULL) && (snapshot_crc(records, snapshot_header.count) == snapshot_header.crc);
+    /* Never restore the same snapshot twice */
+    snapshot_header.magic = 0;
+    if (!valid)
+    {
+        ESP_LOGE(snapshot_log_prefix, "The peer snapshot could not be loaded or has an invalid CRC, ignoring it.");
+        if (snapshot_header.in_nvs)
+        {
+            free(records);
+        }
+        return 0;
+    }
+
+    int restored = 0;
+    /* Peers are added first in the list, so backwards keeps their order */
+    for (int i = snapshot_header.count - 1; i >= 0; i--)
+    {
+        if (restore_peer(&records[i]))
+        {
+            restored++;
+        }
+    }
+
+    if (snapshot_header.in_nvs)
+    {
+        free(records);
+    }
+    ESP_LOGI(snapshot_log_prefix, "Restored %i of %hu peers from the snapshot, %lli us after waking up.",
+             restored, snapshot_header.count, esp_timer_get_time());
+    return restored;
+}
+
+void sdp_snapshot_init(char *_log_prefix)
+{
+    snapshot_log_prefix = _log_prefix;
+}
@@ -0,0 +1,25 @@
+/**
+ * @file sdp_snapshot.h
+ * @author Nicklas Borjesson
+ * @brief A snapshot of the peers, taken before deep sleep and restored after waking up
+ * Without it, only the relations survive sleep, and every peer would have to be greeted
+ * and scored again before the first message could be sent.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_SNAPSHOT_H_
+#define _SDP_SNAPSHOT_H_
+
+#include "sdkconfig.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+void sdp_snapshot_save();
+int sdp_snapshot_restore();
+
+void sdp_snapshot_init(char *_log_prefix);
+
+#endif
@@ -0,0 +1,158 @@
+/**
+ * @file sdp_task.c
+ * @author Nicklas Borjesson
+ * @brief Creation of SDP tasks with statically allocated stacks and TCBs
+ * The workers used to allocate 8 KB stacks from the heap when started, which after many wake cycles
+ * is the main source of heap fragmentation. Now the stacks are carved from a static arena, sized
+ * in menuconfig, and the peak stack usage of each task is reported so that the sizes can be tuned.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_task.h"
+
+#include <string.h>
+#include <esp_log.h>
+
+/* FreeRTOS fills new stacks with this, what is left of it has never been used */
+#define SDP_TASK_STACK_FILL_BYTE 0xa5
+
+/* Stacks in the arena are aligned to this many bytes */
+#define SDP_TASK_STACK_ALIGNMENT 16
+
+/* The log prefix for all logging */
+char *task_log_prefix = NULL;
+
+/**
+ * @brief A task started by SDP
+ */
+typedef struct sdp_task_slot
+{
+    char name[configMAX_TASK_NAME_LEN];
+    TaskHandle_t task_handle;
+    /* The stack, NULL if it was allocated on the heap */
+    StackType_t *stack;
+    uint32_t stack_size;
+    StaticTask_t tcb;
+} sdp_task_slot;
+
+static StackType_t stack_arena[SDP_TASK_STACK_TOTAL / sizeof(StackType_t)] __attribute__((aligned(SDP_TASK_STACK_ALIGNMENT)));
+/* Stacks are handed out from the start of the arena, SDP tasks are created once per boot so they are never returned */
+static size_t stack_arena_used = 0;
+
+static sdp_task_slot task_slots[SDP_TASK_COUNT];
+static int task_slot_count = 0;
+
+static portMUX_TYPE task_lock = portMUX_INITIALIZER_UNLOCKED;
+
+/**
+ * @brief Create a task pinned to a core, with its stack and TCB taken from the static arena
+ * Works like xTaskCreatePinnedToCore(), which is used if the arena has no room left.
+ * @return BaseType_t pdPASS if the task was created
+ */
+BaseType_t sdp_task_create(TaskFunction_t task_function, const char *name, uint32_t stack_size, void *arg,
+                           UBaseType_t priority, TaskHandle_t *task_handle, BaseType_t core)
+{
+    sdp_task_slot *slot = NULL;
+    StackType_t *stack = NULL;
+    uint32_t aligned_size = (stack_size + SDP_TASK_STACK_ALIGNMENT - 1) & ~(SDP_TASK_STACK_ALIGNMENT - 1);
+
+    portENTER_CRITICAL_SAFE(&task_lock);
+    if (task_slot_count < SDP_TASK_COUNT)
+    {
+        slot = &task_slots[task_slot_count++];
+        if (stack_arena_used + aligned_size <= sizeof(stack_arena))
+        {
+            stack = (StackType_t *)((uint8_t *)stack_arena + stack_arena_used);
+            stack_arena_used += aligned_size;
+        }
+    }
+    portEXIT_CRITICAL_SAFE(&task_lock);
+
+    if (stack != NULL)
+    {
+        strlcpy(slot->name, name, sizeof(slot->name));
+        slot->stack = stack;
+        slot->stack_size = stack_size;
+        slot->task_handle = xTaskCreateStaticPinnedToCore(task_function, name, stack_size, arg, priority,
+                                                          stack, &slot->tcb, core);
+        if (task_handle != NULL)
+        {
+            *task_handle = slot->task_handle;
+        }
+        return slot->task_handle != NULL ? pdPASS : pdFAIL;
+    }
+    ESP_LOGW(task_log_prefix, "No static stack left for %s (%"PRIu32" bytes), using the heap. Increase the stack sizes in menuconfig.",
+             name, stack_size);
+    TaskHandle_t heap_handle = NULL;
+    BaseType_t rc = xTaskCreatePinnedToCore(task_function, name, stack_size, arg, priority, &heap_handle, core);
+    if (task_handle != NULL)
+    {
+        *task_handle = heap_handle;
+    }
+    if (slot != NULL)
+    {
+        strlcpy(slot->name, name, sizeof(slot->name));
+        slot->stack = NULL;
+        slot->stack_size = stack_size;
+        slot->task_handle = heap_handle;
+    }
+    return rc;
+}
+
+/**
+ * @brief The number of stack bytes that a task has never used
+ * Measured directly on the static stack, so it is safe also after the task has ended.
+ */
+static uint32_t stack_unused(sdp_task_slot *slot)
+{
+    const uint8_t *bottom = (const uint8_t *)slot->stack;
+    uint32_t unused = 0;
+    while ((unused < slot->stack_size) && (bottom[unused] == SDP_TASK_STACK_FILL_BYTE))
+    {
+        unused++;
+    }
+    return unused;
+}
+
+/**
+ * @brief Log the reserved stack and the peak usage of each SDP task
+ */
+void sdp_task_report()
+{
+    if (task_log_prefix == NULL)
+    {
+        return;
+    }
+    uint32_t total_reserved = 0;
+    uint32_t total_peak = 0;
+    for (int i = 0; i < task_slot_count; i++)
+    {
+        sdp_task_slot *slot = &task_slots[i];
+        if (slot->stack == NULL)
+        {
+            /* A heap stack may be gone with its task, so it is not inspected */
+            ESP_LOGI(task_log_prefix, "Task %-16s: %6"PRIu32" bytes of stack on the heap.", slot->name, slot->stack_size);
+            continue;
+        }
+        uint32_t peak = slot->stack_size - stack_unused(slot);
+        total_reserved += slot->stack_size;
+        total_peak += peak;
+        ESP_LOGI(task_log_prefix, "Task %-16s: %6"PRIu32" bytes of stack, peak use %6"PRIu32" (%"PRIu32"%%).",
+                 slot->name, slot->stack_size, peak, (peak * 100) / slot->stack_size);
+    }
+    ESP_LOGI(task_log_prefix, "Tasks: %i created, %"PRIu32" of %u bytes of static stack reserved, peak use %"PRIu32" bytes.",
+             task_slot_count, total_reserved, (unsigned int)sizeof(stack_arena), total_peak);
+}
+
+void sdp_task_on_monitor()
+{
+    sdp_task_report();
+}
+
+void sdp_task_init(char *_log_prefix)
+{
+    task_log_prefix = _log_prefix;
+    ESP_LOGI(task_log_prefix, "Task stacks: %i tasks, %u bytes reserved.", SDP_TASK_COUNT, (unsigned int)sizeof(stack_arena));
+}
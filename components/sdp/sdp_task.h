@@ -0,0 +1,65 @@
+/**
+ * @file sdp_task.h
+ * @author Nicklas Borjesson
+ * @brief Creation of SDP tasks with statically allocated stacks and TCBs
+ * All tasks that SDP starts take their stack and TCB from a static arena, sized at compile time,
+ * so that they do not fragment the heap. If the arena is too small, the heap is used as a fallback.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_TASK_H_
+#define _SDP_TASK_H_
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include "sdp_def.h"
+
+/* The queue worker tasks: the pool, the priority worker and the fragment sender, and one per loaded media */
+#define SDP_TASK_QUEUE_WORKER_COUNT (CONFIG_SDP_WORKER_POOL_SIZE + 2 + SDP_TASK_ESPNOW_COUNT + SDP_TASK_BLE_COUNT + \
+                                     SDP_TASK_LORA_COUNT + SDP_TASK_I2C_COUNT + SDP_TASK_UMTS_COUNT)
+
+#ifdef CONFIG_SDP_LOAD_ESP_NOW
+#define SDP_TASK_ESPNOW_COUNT 1
+#else
+#define SDP_TASK_ESPNOW_COUNT 0
+#endif
+#ifdef CONFIG_SDP_LOAD_BLE
+#define SDP_TASK_BLE_COUNT 1
+#else
+#define SDP_TASK_BLE_COUNT 0
+#endif
+#ifdef CONFIG_SDP_LOAD_LORA
+#define SDP_TASK_LORA_COUNT 1
+#else
+#define SDP_TASK_LORA_COUNT 0
+#endif
+#ifdef CONFIG_SDP_LOAD_I2C
+#define SDP_TASK_I2C_COUNT 1
+#else
+#define SDP_TASK_I2C_COUNT 0
+#endif
+#ifdef CONFIG_SDP_LOAD_UMTS
+#define SDP_TASK_UMTS_COUNT 1
+/* The GSM main task, that sets up the modem */
+#define SDP_TASK_GSM_STACK_SIZE CONFIG_SDP_GSM_TASK_STACK_SIZE
+#else
+#define SDP_TASK_UMTS_COUNT 0
+#define SDP_TASK_GSM_STACK_SIZE 0
+#endif
+
+/* The number of tasks, and the bytes of stack, reserved for SDP */
+#define SDP_TASK_COUNT (SDP_TASK_QUEUE_WORKER_COUNT + SDP_TASK_UMTS_COUNT)
+#define SDP_TASK_STACK_TOTAL (SDP_TASK_QUEUE_WORKER_COUNT * CONFIG_SDP_WORKER_STACK_SIZE + SDP_TASK_GSM_STACK_SIZE)
+
+BaseType_t sdp_task_create(TaskFunction_t task_function, const char *name, uint32_t stack_size, void *arg,
+                           UBaseType_t priority, TaskHandle_t *task_handle, BaseType_t core);
+
+void sdp_task_report();
+void sdp_task_on_monitor();
+
+void sdp_task_init(char *_log_prefix);
+
+#endif
@@ -0,0 +1,159 @@
+/**
+ * @file sdp_trace.c
+ * @author Nicklas Borjesson
+ * @brief Binary tracing of frames
+ * Logging (and especially hex dumping) every frame from inside the radio callbacks takes far more
+ * time than handling the frame. Instead, a fixed-size record is written into a ring that is
+ * decoded by the monitor. Writing a record never blocks: a slot is claimed with an atomic increment,
+ * and if the monitor is too slow, the oldest records are overwritten and counted as lost.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#include "sdp_trace.h"
+
+#include <string.h>
+#include <esp_timer.h>
+
+#if (CONFIG_SDP_TRACE_RING_SIZE & (CONFIG_SDP_TRACE_RING_SIZE - 1)) != 0
+#error "CONFIG_SDP_TRACE_RING_SIZE must be a power of two."
+#endif
+
+/* The log prefix for all logging */
+char *trace_log_prefix = NULL;
+
+static sdp_trace_record_t trace_ring[CONFIG_SDP_TRACE_RING_SIZE];
+/* The index of the next record to write, only ever increases */
+static uint32_t trace_head = 0;
+/* Where the monitor is in the ring */
+static uint32_t trace_monitor_cursor = 0;
+static uint32_t trace_lost_count = 0;
+
+/**
+ * @brief Write a trace record, use the SDP_TRACE macro so that it is compiled out if tracing is disabled
+ * This is safe to call from any task or core.
+ *
+ * @param event What happened
+ * @param peer The peer, may be NULL
+ * @param media_type The media type
+ * @param length The length of the frame
+ * @param crc32 The CRC of the frame
+ */
+void sdp_trace_write(e_sdp_trace_event event, const sdp_peer *peer, e_media_type media_type, int length, uint32_t crc32)
+{
+    uint32_t index = __atomic_fetch_add(&trace_head, 1, __ATOMIC_RELAXED);
+    sdp_trace_record_t *record = &trace_ring[index & (CONFIG_SDP_TRACE_RING_SIZE - 1)];
+
+    /* Readers skip the record until its sequence is set again */
+    __atomic_store_n(&record->sequence, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    record->timestamp = (uint32_t)esp_timer_get_time();
+    record->crc32 = crc32;
+    record->peer_handle = peer != NULL ? peer->peer_handle : UINT16_MAX;
+    /* Fragmented frames may be longer than a record can tell */
+    record->length = length > UINT16_MAX ? UINT16_MAX : (uint16_t)length;
+    record->event = (uint8_t)event;
+    record->media_type = (uint8_t)media_type;
+    __atomic_store_n(&record->sequence, index + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief Copy the records written since the cursor
+ * Records that have been overwritten, or are being written, are skipped and counted as lost.
+ *
+ * @param records Where to copy the records
+ * @param max_count How many records there is room for
+ * @param cursor In: the index to read from (start with 0), out: the index to read from next time
+ * @param lost Incremented with the number of records that could not be read
+ * @return int The number of copied records
+ */
+int sdp_trace_read(sdp_trace_record_t *records, int max_count, uint32_t *cursor, uint32_t *lost)
+{
+    uint32_t head = __atomic_load_n(&trace_head, __ATOMIC_ACQUIRE);
+    uint32_t index = *cursor;
+    int count = 0;
+
+    if (head - index > CONFIG_SDP_TRACE_RING_SIZE)
+    {
+        *lost += head - index - CONFIG_SDP_TRACE_RING_SIZE;
+        index = head - CONFIG_SDP_TRACE_RING_SIZE;
+    }
+    while ((index != head) && (count < max_count))
+    {
+        sdp_trace_record_t *record = &trace_ring[index & (CONFIG_SDP_TRACE_RING_SIZE - 1)];
+        if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) == index + 1)
+        {
+            records[count] = *record;
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            /* If it changed while copying, it was overwritten */
+            if (__atomic_load_n(&record->sequence, __ATOMIC_RELAXED) == index + 1)
+            {
+                count++;
+            }
+            else
+            {
+                (*lost)++;
+            }
+        }
+        else
+        {
+            (*lost)++;
+        }
+        index++;
+    }
+    *cursor = index;
+    return count;
+}
+
+static const char *trace_event_name(uint8_t event)
+{
+    switch (event)
+    {
+    case SDP_TRACE_RX:
+        return "RX";
+    case SDP_TRACE_TX:
+        return "TX";
+    case SDP_TRACE_TX_FAIL:
+        return "TX failed";
+    case SDP_TRACE_RX_BAD_CRC:
+        return "RX bad CRC";
+    case SDP_TRACE_BAD_RECEIPT:
+        return "Bad receipt";
+    default:
+        return "Unknown";
+    }
+}
+
+/* How many records the monitor decodes at a time */
+#define TRACE_MONITOR_BATCH 16
+
+void sdp_trace_on_monitor()
+{
+    if (trace_log_prefix == NULL)
+    {
+        return;
+    }
+    sdp_trace_record_t records[TRACE_MONITOR_BATCH];
+    int count;
+    do
+    {
+        count = sdp_trace_read(records, TRACE_MONITOR_BATCH, &trace_monitor_cursor, &trace_lost_count);
+        for (int i = 0; i < count; i++)
+        {
+            ESP_LOGI(trace_log_prefix, "Trace %"PRIu32" at %"PRIu32" us: %s, peer %hu, media %hhu, %hu bytes, CRC32 %"PRIu32".",
+                     records[i].sequence - 1, records[i].timestamp, trace_event_name(records[i].event),
+                     records[i].peer_handle, records[i].media_type, records[i].length, records[i].crc32);
+        }
+    } while (count == TRACE_MONITOR_BATCH);
+
+    if (trace_lost_count > 0)
+    {
+        ESP_LOGW(trace_log_prefix, "Trace: %"PRIu32" records were lost, consider a larger trace ring.", trace_lost_count);
+    }
+}
+
+void sdp_trace_init(char *_log_prefix)
+{
+    trace_log_prefix = _log_prefix;
+}
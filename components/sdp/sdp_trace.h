@@ -0,0 +1,88 @@
+/**
+ * @file sdp_trace.h
+ * @author Nicklas Borjesson
+ * @brief Binary tracing of frames, and per-frame logging
+ * The send and receive paths write compact trace records into a fixed-size ring instead of logging,
+ * the ring is decoded later by the monitor. Per-frame logging, like hex dumps, is compiled out
+ * unless its level is raised in menuconfig.
+ *
+ * @copyright Copyright (c) 2023
+ *
+ */
+
+#ifndef _SDP_TRACE_H_
+#define _SDP_TRACE_H_
+
+#include <esp_log.h>
+
+#include "sdp_def.h"
+
+/**
+ * @brief The traced events
+ */
+typedef enum e_sdp_trace_event
+{
+    /* A frame was received */
+    SDP_TRACE_RX = 1,
+    /* A frame was sent */
+    SDP_TRACE_TX = 2,
+    /* Sending a frame failed */
+    SDP_TRACE_TX_FAIL = 3,
+    /* A received frame failed the CRC check */
+    SDP_TRACE_RX_BAD_CRC = 4,
+    /* The receipt of a sent frame was negative or had the wrong CRC */
+    SDP_TRACE_BAD_RECEIPT = 5
+} e_sdp_trace_event;
+
+/**
+ * @brief A trace record
+ */
+typedef struct sdp_trace_record
+{
+    /* The index of the record + 1, 0 while it is being written */
+    uint32_t sequence;
+    /* When it happened, in microseconds since boot (wraps after ~71 minutes) */
+    uint32_t timestamp;
+    /* The CRC of the frame */
+    uint32_t crc32;
+    /* The peer handle, UINT16_MAX if there is no peer */
+    uint16_t peer_handle;
+    /* The length of the frame */
+    uint16_t length;
+    /* An e_sdp_trace_event */
+    uint8_t event;
+    /* The media type */
+    uint8_t media_type;
+} sdp_trace_record_t;
+
+#ifdef CONFIG_SDP_TRACE
+#define SDP_TRACE(event, peer, media_type, length, crc32) sdp_trace_write(event, peer, media_type, length, crc32)
+#else
+#define SDP_TRACE(event, peer, media_type, length, crc32) ((void)0)
+#endif
+
+void sdp_trace_write(e_sdp_trace_event event, const sdp_peer *peer, e_media_type media_type, int length, uint32_t crc32);
+int sdp_trace_read(sdp_trace_record_t *records, int max_count, uint32_t *cursor, uint32_t *lost);
+
+/* Per-frame logging, arguments are not evaluated when compiled out. The levels are those of esp_log_level_t. */
+#if CONFIG_SDP_FRAME_LOG_LEVEL >= 3
+#define SDP_FRAME_LOGI(tag, format, ...) ESP_LOGI(tag, format, ##__VA_ARGS__)
+#define SDP_FRAME_HEX(tag, buffer, length) ESP_LOG_BUFFER_HEX(tag, buffer, length)
+#define SDP_FRAME_HEXDUMP(tag, buffer, length) ESP_LOG_BUFFER_HEXDUMP(tag, buffer, length, ESP_LOG_INFO)
+#else
+#define SDP_FRAME_LOGI(tag, format, ...) ((void)0)
+#define SDP_FRAME_HEX(tag, buffer, length) ((void)0)
+#define SDP_FRAME_HEXDUMP(tag, buffer, length) ((void)0)
+#endif
+
+#if CONFIG_SDP_FRAME_LOG_LEVEL >= 4
+#define SDP_FRAME_LOGD(tag, format, ...) ESP_LOGD(tag, format, ##__VA_ARGS__)
+#else
+#define SDP_FRAME_LOGD(tag, format, ...) ((void)0)
+#endif
+
+void sdp_trace_on_monitor();
+
+void sdp_trace_init(char *_log_prefix);
+
+#endif
@@ -11,54 +11,827 @@
 
 #include "sdp_work_queue.h"
 #include "sdp_def.h"
+#include "sdp_task.h"
 #include "esp_task_wdt.h"
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <string.h>
 
 /* The log prefix for all logging */
 char *spd_work_queue_log_prefix;
 
-esp_err_t safe_add_work_queue(queue_context *q_context, void *new_item)
+/**
+ * @brief A worker in the pool of a multitasking queue
+ */
+typedef struct pool_worker
 {
-    if (q_context->shutdown)
+    queue_context *q_context;
+    TaskHandle_t task_handle;
+    /* The core the worker is pinned to, it takes work from that core's deque first */
+    int core;
+    /* Set while the worker is waiting for work */
+    bool idle;
+    /* Statistics */
+    uint32_t wakeup_count;
+    int64_t idle_time;
+} pool_worker;
+
+typedef struct deque_entry
+{
+    void *item;
+    /* When it was queued, for aging and the wait statistics */
+    int64_t queued_at;
+} deque_entry;
+
+/**
+ * @brief A bounded ring of work items, there is one per core and priority level
+ * Items are always taken oldest first; workers prefer their own core's rings, and steal from the other core's.
+ * A steal also takes the oldest item, not the newest as in a classic work-stealing deque. The items are
+ * messages rather than subtasks, so arrival order and the aging of the oldest item matter more than locality.
+ */
+typedef struct worker_deque
+{
+    deque_entry entries[CONFIG_SDP_WORKER_DEQUE_SIZE];
+    uint16_t head;
+    uint16_t count;
+} worker_deque;
+
+/**
+ * @brief Statistics of a priority level
+ */
+typedef struct level_stats
+{
+    uint32_t dispatch_count;
+    /* Taken before items of a higher level because they had waited too long */
+    uint32_t aged_count;
+    int64_t wait_total;
+    int64_t wait_max;
+} level_stats;
+
+/**
+ * @brief The worker pool of a multitasking queue
+ */
+typedef struct worker_pool
+{
+    /* Protects the deques, the idle flags and the statistics */
+    portMUX_TYPE lock;
+    worker_deque deques[SDP_WORK_LEVEL_COUNT][portNUM_PROCESSORS];
+    pool_worker *workers;
+    int worker_count;
+    /* Items in the deques */
+    uint32_t queued_count;
+    /* Statistics */
+    uint32_t steal_count;
+    uint32_t overflow_count;
+    level_stats levels[SDP_WORK_LEVEL_COUNT];
+} worker_pool;
+
+/* Latency histograms have log2 buckets, the first is below SDP_LATENCY_BASE_US, the last is everything above half a second */
+#define SDP_LATENCY_BASE_US 32
+#define SDP_LATENCY_BUCKETS 16
+
+typedef struct latency_histogram
+{
+    uint32_t buckets[SDP_LATENCY_BUCKETS];
+    uint32_t count;
+    uint32_t max;
+} latency_histogram;
+
+/**
+ * @brief How long items of a work type waited in the queue, and how long on_work_cb took
+ */
+typedef struct work_type_stats
+{
+    latency_histogram wait;
+    latency_histogram service;
+} work_type_stats;
+
+typedef struct work_queue_stats
+{
+    work_type_stats types[SDP_WORK_TYPE_COUNT];
+    /* When the histograms were last reset */
+    int64_t since;
+} work_queue_stats;
+
+/**
+ * @brief A cell of the ring, the sequence tells producers and the consumer whose turn it is
+ */
+typedef struct ring_cell
+{
+    uint32_t sequence;
+    void *item;
+} ring_cell;
+
+/**
+ * @brief A lock-free multi-producer ring, an alternative to the STAILQ callbacks
+ * Producers claim a cell by moving the tail with a compare-and-swap, so they never wait for a lock,
+ * which matters as they include the WiFi and NimBLE tasks. Consumers take turns under a spinlock,
+ * usually there is only the worker.
+ */
+typedef struct mpsc_ring
+{
+    uint32_t mask;
+    /* The next cell to fill, shared by the producers */
+    uint32_t tail;
+    /* The next cell to take, only touched by the consumer holding the lock */
+    uint32_t head;
+    portMUX_TYPE consumer_lock;
+    ring_cell cells[];
+} mpsc_ring;
+
+static void configure_watchdog(queue_context *q_context)
+{
+    // Adjust the watchdog, connections can take a long time sometimes.
+    const esp_task_wdt_config_t watchdog_config = {
+        .timeout_ms = (q_context->watchdog_timeout + 10),
+        .idle_core_mask = (1 << portNUM_PROCESSORS) - 1,    // Bitmask of all cores
+        .trigger_panic = false
+    };
+    esp_task_wdt_deinit();
+    esp_task_wdt_init(&watchdog_config);
+}
+
+/**
+ * @brief Find an idle worker, preferably on the given core, and mark it as busy so that it is woken only once.
+ * Must be called with the pool lock held.
+ */
+static pool_worker *claim_idle_worker(worker_pool *pool, int core)
+{
+    pool_worker *found = NULL;
+    for (int i = 0; i < pool->worker_count; i++)
     {
-        ESP_LOGE(spd_work_queue_log_prefix, "The queue is shut down.");
-        return SDP_ERR_SEMAPHORE;
+        if (pool->workers[i].idle)
+        {
+            found = &pool->workers[i];
+            if (found->core == core)
+            {
+                break;
+            }
+        }
     }
-    else if (pdTRUE == xSemaphoreTake(q_context->__x_queue_semaphore, portMAX_DELAY))
+    if (found != NULL)
     {
-        /* As the worker takes the queue from the head, and we want a LIFO, add the item to the tail */
-        q_context->insert_tail_cb(new_item);
-        xSemaphoreGive(q_context->__x_queue_semaphore);
+        found->idle = false;
     }
-    else
+    return found;
+}
+
+/**
+ * @brief The level an item is handled at: its own level, raised by one for every CONFIG_SDP_WORK_AGING_MS it has waited
+ */
+static int effective_level(int level, const deque_entry *entry, int64_t now)
+{
+#if CONFIG_SDP_WORK_AGING_MS > 0
+    return level + (int)((now - entry->queued_at) / (CONFIG_SDP_WORK_AGING_MS * 1000LL));
+#else
+    return level;
+#endif
+}
+
+/**
+ * @brief Take the next item: the oldest item of the highest (effective) level, preferably from the worker's own core.
+ * Must be called with the pool lock held.
+ */
+static void *pool_take(worker_pool *pool, int core, int64_t now)
+{
+    worker_deque *best = NULL;
+    int best_level = 0;
+    int best_effective = -1;
+    /* The highest level that has items, if the item taken is of a lower level it was aged */
+    int highest_level = -1;
+    for (int level = SDP_WORK_LEVEL_COUNT - 1; level >= 0; level--)
+    {
+        for (int i = 0; i < portNUM_PROCESSORS; i++)
+        {
+            worker_deque *deque = &pool->deques[level][(core + i) % portNUM_PROCESSORS];
+            if (deque->count > 0)
+            {
+                if (highest_level < 0)
+                {
+                    highest_level = level;
+                }
+                /* Strictly greater, so that on a tie the higher level and the own core wins */
+                int effective = effective_level(level, &deque->entries[deque->head], now);
+                if (effective > best_effective)
+                {
+                    best = deque;
+                    best_level = level;
+                    best_effective = effective;
+                }
+            }
+        }
+    }
+    if (best == NULL)
+    {
+        return NULL;
+    }
+    deque_entry *entry = &best->entries[best->head];
+    best->head = (best->head + 1) % CONFIG_SDP_WORKER_DEQUE_SIZE;
+    best->count--;
+    pool->queued_count--;
+
+    if (best != &pool->deques[best_level][core])
+    {
+        pool->steal_count++;
+    }
+    level_stats *stats = &pool->levels[best_level];
+    /* The time was read before taking the lock, the item may have been queued after that */
+    int64_t wait = now > entry->queued_at ? now - entry->queued_at : 0;
+    stats->dispatch_count++;
+    stats->wait_total += wait;
+    if (wait > stats->wait_max)
+    {
+        stats->wait_max = wait;
+    }
+    if (best_level < highest_level)
+    {
+        stats->aged_count++;
+    }
+    return entry->item;
+}
+
+static mpsc_ring *ring_create(uint size)
+{
+    mpsc_ring *ring = calloc(1, sizeof(mpsc_ring) + size * sizeof(ring_cell));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+    ring->mask = size - 1;
+    for (uint i = 0; i < size; i++)
+    {
+        ring->cells[i].sequence = i;
+    }
+    portMUX_INITIALIZE(&ring->consumer_lock);
+    return ring;
+}
+
+/**
+ * @brief Add an item to the ring, without locking
+ * @return false if the ring is full
+ */
+static bool ring_push(mpsc_ring *ring, void *item)
+{
+    uint32_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    ring_cell *cell;
+    for (;;)
+    {
+        cell = &ring->cells[pos & ring->mask];
+        int32_t diff = (int32_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            /* The cell is free, claim it unless another producer was first */
+            if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            /* The consumer has not taken the item a lap ago */
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+        }
+    }
+    cell->item = item;
+    /* Publishes the item to the consumer */
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @brief Take the oldest item from the ring, NULL if it is empty
+ */
+static void *ring_pop(mpsc_ring *ring)
+{
+    void *item = NULL;
+    portENTER_CRITICAL_SAFE(&ring->consumer_lock);
+    uint32_t pos = ring->head;
+    ring_cell *cell = &ring->cells[pos & ring->mask];
+    /* Empty, or a producer has claimed the cell but not yet filled it */
+    if ((int32_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + 1)) == 0)
+    {
+        item = cell->item;
+        /* Hands the cell to the producers of the next lap */
+        __atomic_store_n(&cell->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+        ring->head = pos + 1;
+    }
+    portEXIT_CRITICAL_SAFE(&ring->consumer_lock);
+    return item;
+}
+
+/**
+ * @brief Add an item to the tail of the queue's own list, or its ring
+ * @param no_wait If set, the list is only added to if its semaphore is free right away
+ */
+static esp_err_t insert_item(queue_context *q_context, void *new_item, bool no_wait)
+{
+    if (q_context->__ring != NULL)
     {
-        ESP_LOGE(spd_work_queue_log_prefix, "Couldn't get semaphore to add to work queue!");
+        if (!ring_push(q_context->__ring, new_item))
+        {
+            return SDP_ERR_QUEUE_FULL;
+        }
+        return ESP_OK;
+    }
+    if (pdTRUE != xSemaphoreTake(q_context->__x_queue_semaphore, no_wait ? 0 : portMAX_DELAY))
+    {
+        if (!no_wait)
+        {
+            ESP_LOGE(spd_work_queue_log_prefix, "Couldn't get semaphore to add to work queue!");
+        }
         return SDP_ERR_SEMAPHORE;
     }
+    /* As the worker takes the queue from the head, and we want a LIFO, add the item to the tail */
+    q_context->insert_tail_cb(new_item);
+    xSemaphoreGive(q_context->__x_queue_semaphore);
     return ESP_OK;
 }
 
-void *safe_get_head_work_item(queue_context *q_context)
+/**
+ * @brief Add an item to the deque of its level on the calling core (or the other, if full), and wake an idle worker.
+ * If all deques of the level are full, the item is put on the queue itself, where the workers look when the deques are empty.
+ */
+static esp_err_t pool_add(queue_context *q_context, void *new_item, int level, bool no_wait)
 {
-    if (pdTRUE == xSemaphoreTake(q_context->__x_queue_semaphore, portMAX_DELAY))
+    worker_pool *pool = q_context->__pool;
+    int core = xPortGetCoreID();
+    int64_t now = esp_timer_get_time();
+    bool queued = false;
+    pool_worker *to_wake = NULL;
+
+    if (level < 0)
+    {
+        level = 0;
+    }
+    else if (level >= SDP_WORK_LEVEL_COUNT)
+    {
+        level = SDP_WORK_LEVEL_COUNT - 1;
+    }
+
+    portENTER_CRITICAL_SAFE(&pool->lock);
+    for (int i = 0; (i < portNUM_PROCESSORS) && !queued; i++)
+    {
+        worker_deque *deque = &pool->deques[level][(core + i) % portNUM_PROCESSORS];
+        if (deque->count < CONFIG_SDP_WORKER_DEQUE_SIZE)
+        {
+            deque_entry *entry = &deque->entries[(deque->head + deque->count) % CONFIG_SDP_WORKER_DEQUE_SIZE];
+            entry->item = new_item;
+            entry->queued_at = now;
+            deque->count++;
+            pool->queued_count++;
+            queued = true;
+        }
+    }
+    if (queued)
+    {
+        to_wake = claim_idle_worker(pool, core);
+    }
+    portEXIT_CRITICAL_SAFE(&pool->lock);
+
+    if (!queued)
+    {
+        esp_err_t rc = insert_item(q_context, new_item, no_wait);
+        if (rc != ESP_OK)
+        {
+            return rc;
+        }
+        portENTER_CRITICAL_SAFE(&pool->lock);
+        pool->overflow_count++;
+        to_wake = claim_idle_worker(pool, core);
+        portEXIT_CRITICAL_SAFE(&pool->lock);
+    }
+    if (to_wake != NULL)
+    {
+        xTaskNotifyGive(to_wake->task_handle);
+    }
+    return ESP_OK;
+}
+
+/**
+ * @brief Wake the worker task, it sleeps when it has nothing to do
+ * Wakeups are counted, so one given before the worker has started waiting is not lost.
+ */
+void wake_work_queue(queue_context *q_context)
+{
+    if (q_context->__pool != NULL)
+    {
+        for (int i = 0; i < q_context->__pool->worker_count; i++)
+        {
+            xTaskNotifyGive(q_context->__pool->workers[i].task_handle);
+        }
+    }
+    else if (q_context->worker_task_handle != NULL)
+    {
+        xTaskNotifyGive(q_context->worker_task_handle);
+    }
+}
+
+/**
+ * @brief Remove the oldest item of the lowest level from the deques, to make room. Must be called with the pool lock held.
+ */
+static void *pool_take_oldest(worker_pool *pool)
+{
+    for (int level = 0; level < SDP_WORK_LEVEL_COUNT; level++)
+    {
+        worker_deque *oldest = NULL;
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            worker_deque *deque = &pool->deques[level][core];
+            if ((deque->count > 0) &&
+                ((oldest == NULL) || (deque->entries[deque->head].queued_at < oldest->entries[oldest->head].queued_at)))
+            {
+                oldest = deque;
+            }
+        }
+        if (oldest != NULL)
+        {
+            void *item = oldest->entries[oldest->head].item;
+            oldest->head = (oldest->head + 1) % CONFIG_SDP_WORKER_DEQUE_SIZE;
+            oldest->count--;
+            pool->queued_count--;
+            return item;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Replace a queued item that has the same key as the new item. Must be called with the pool lock held.
+ * @return void* The replaced item, NULL if there was none
+ */
+static void *pool_replace(worker_pool *pool, item_key *item_key_cb, void *new_item)
+{
+    uint32_t key = item_key_cb(new_item);
+    for (int level = 0; level < SDP_WORK_LEVEL_COUNT; level++)
+    {
+        for (int core = 0; core < portNUM_PROCESSORS; core++)
+        {
+            worker_deque *deque = &pool->deques[level][core];
+            for (int i = 0; i < deque->count; i++)
+            {
+                deque_entry *entry = &deque->entries[(deque->head + i) % CONFIG_SDP_WORKER_DEQUE_SIZE];
+                if (item_key_cb(entry->item) == key)
+                {
+                    /* The new item takes the place (and the waiting time) of the old */
+                    void *old_item = entry->item;
+                    entry->item = new_item;
+                    return old_item;
+                }
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Take the head of the queue's own list, without giving back its place
+ */
+static void *take_head(queue_context *q_context)
+{
+    void *curr_work = NULL;
+    if (q_context->__ring != NULL)
+    {
+        curr_work = ring_pop(q_context->__ring);
+        if (curr_work != NULL)
+        {
+            __atomic_fetch_sub(&q_context->item_count, 1, __ATOMIC_RELAXED);
+        }
+    }
+    else if (pdTRUE == xSemaphoreTake(q_context->__x_queue_semaphore, portMAX_DELAY))
     {
         /* Pull the first item from the work queue */
-        void *curr_work = q_context->first_queue_item_cb();
+        curr_work = q_context->first_queue_item_cb();
 
         /* Immidiate deletion from the head of the queue */
         if (curr_work != NULL)
         {
             q_context->remove_first_queueitem_cb();
+            __atomic_fetch_sub(&q_context->item_count, 1, __ATOMIC_RELAXED);
         }
         xSemaphoreGive(q_context->__x_queue_semaphore);
-        return curr_work;
     }
     else
     {
         ESP_LOGE(spd_work_queue_log_prefix, "Error: Couldn't get semaphore to access work queue!");
-        return NULL;
     }
+    return curr_work;
+}
+
+/**
+ * @brief Give back the place of an item that has left a bounded queue
+ */
+static void release_place(queue_context *q_context)
+{
+    if (q_context->__x_slots_semaphore != NULL)
+    {
+        xSemaphoreGive(q_context->__x_slots_semaphore);
+    }
+}
+
+/* Returned by reserve_place() when the new item replaced a queued one */
+#define SDP_WARN_ITEM_COALESCED (-1)
+
+/**
+ * @brief Make room for a new item in a bounded queue, according to its policy
+ * @return esp_err_t ESP_OK if there is room, SDP_ERR_QUEUE_FULL if the item is rejected,
+ * SDP_WARN_ITEM_COALESCED if it replaced a queued item and must not be added
+ * @param no_wait If set, SDP_QUEUE_BLOCK does not wait for room, like SDP_QUEUE_DROP_NEWEST
+ */
+static esp_err_t reserve_place(queue_context *q_context, void *new_item, bool no_wait)
+{
+    TickType_t wait = 0;
+    if ((q_context->full_policy == SDP_QUEUE_BLOCK) && !no_wait && (xTaskGetCurrentTaskHandle() != q_context->worker_task_handle))
+    {
+        /* The worker can't wait for itself to make room */
+        wait = q_context->block_timeout;
+    }
+    if (xSemaphoreTake(q_context->__x_slots_semaphore, wait) == pdTRUE)
+    {
+        return ESP_OK;
+    }
+
+    void *dropped = NULL;
+    worker_pool *pool = q_context->__pool;
+    if (q_context->full_policy == SDP_QUEUE_DROP_OLDEST)
+    {
+        /* The new item takes over the place of the dropped one */
+        if (pool != NULL)
+        {
+            portENTER_CRITICAL_SAFE(&pool->lock);
+            dropped = pool_take_oldest(pool);
+            portEXIT_CRITICAL_SAFE(&pool->lock);
+            if (dropped != NULL)
+            {
+                __atomic_fetch_sub(&q_context->item_count, 1, __ATOMIC_RELAXED);
+            }
+        }
+        if (dropped == NULL)
+        {
+            dropped = take_head(q_context);
+        }
+    }
+    else if ((q_context->full_policy == SDP_QUEUE_COALESCE) && (pool != NULL))
+    {
+        portENTER_CRITICAL_SAFE(&pool->lock);
+        dropped = pool_replace(pool, q_context->item_key_cb, new_item);
+        portEXIT_CRITICAL_SAFE(&pool->lock);
+        if (dropped != NULL)
+        {
+            q_context->drop_item_cb(dropped);
+            __atomic_fetch_add(&q_context->dropped_count, 1, __ATOMIC_RELAXED);
+            return SDP_WARN_ITEM_COALESCED;
+        }
+    }
+
+    if (dropped != NULL)
+    {
+        q_context->drop_item_cb(dropped);
+        __atomic_fetch_add(&q_context->dropped_count, 1, __ATOMIC_RELAXED);
+        return ESP_OK;
+    }
+    /* The workers may have made room meanwhile */
+    if (xSemaphoreTake(q_context->__x_slots_semaphore, 0) == pdTRUE)
+    {
+        return ESP_OK;
+    }
+    __atomic_fetch_add(&q_context->rejected_count, 1, __ATOMIC_RELAXED);
+    return SDP_ERR_QUEUE_FULL;
+}
+
+static void max_u32(uint32_t *max, uint32_t value)
+{
+    uint32_t curr = __atomic_load_n(max, __ATOMIC_RELAXED);
+    while ((value > curr) && !__atomic_compare_exchange_n(max, &curr, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+}
+
+/**
+ * @brief Count a latency in its bucket, without locking, as the workers of a pool may do this at the same time
+ */
+static void record_latency(latency_histogram *histogram, int64_t latency)
+{
+    uint32_t us = latency > 0 ? (latency < UINT32_MAX ? (uint32_t)latency : UINT32_MAX) : 0;
+    int bucket = us < SDP_LATENCY_BASE_US ? 0 : 32 - __builtin_clz(us / SDP_LATENCY_BASE_US);
+    if (bucket >= SDP_LATENCY_BUCKETS)
+    {
+        bucket = SDP_LATENCY_BUCKETS - 1;
+    }
+    __atomic_fetch_add(&histogram->buckets[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    max_u32(&histogram->max, us);
+}
+
+/**
+ * @brief The upper bound (us) of the bucket that holds the given share (in percent) of the latencies
+ */
+static uint32_t latency_percentile(latency_histogram *histogram, int percent)
+{
+    uint32_t target = (histogram->count * percent + 99) / 100;
+    uint32_t sum = 0;
+    for (int bucket = 0; bucket < SDP_LATENCY_BUCKETS - 1; bucket++)
+    {
+        sum += histogram->buckets[bucket];
+        if (sum >= target)
+        {
+            return SDP_LATENCY_BASE_US << bucket;
+        }
+    }
+    return histogram->max;
+}
+
+/**
+ * @brief Stamp an item and hand it to on_work_cb, keeping the latency statistics
+ * The item may be freed by the callback, so it is not touched afterwards.
+ */
+static void run_work_item(queue_context *q_context, void *curr_work)
+{
+    if (q_context->item_stamp_cb == NULL)
+    {
+        q_context->on_work_cb(curr_work);
+        return;
+    }
+    work_stamp_t *stamp = q_context->item_stamp_cb(curr_work);
+    int64_t started = esp_timer_get_time();
+    stamp->dequeued_at = started;
+    if ((stamp->deadline > 0) && (started > stamp->deadline) && (q_context->on_expired_cb != NULL))
+    {
+        /* The receiver, or we, will be asleep before it is done */
+        __atomic_fetch_add(&q_context->expired_count, 1, __ATOMIC_RELAXED);
+        q_context->on_expired_cb(curr_work);
+        return;
+    }
+    work_queue_stats *stats = q_context->__stats;
+    if (stats == NULL)
+    {
+        q_context->on_work_cb(curr_work);
+        return;
+    }
+    int type = q_context->item_type_cb != NULL ? q_context->item_type_cb(curr_work) : 0;
+    if ((type < 0) || (type >= SDP_WORK_TYPE_COUNT))
+    {
+        type = 0;
+    }
+    int64_t wait = started - stamp->queued_at;
+    record_latency(&stats->types[type].wait, wait);
+
+    q_context->on_work_cb(curr_work);
+
+    int64_t service = esp_timer_get_time() - started;
+    record_latency(&stats->types[type].service, service);
+    max_u32(&q_context->latency_max, (uint32_t)(wait + service));
+}
+
+/**
+ * @brief Log the latency histograms, and reset them if so configured
+ */
+static void report_latency(queue_context *q_context)
+{
+    work_queue_stats *stats = q_context->__stats;
+    if (stats == NULL)
+    {
+        return;
+    }
+    ESP_LOGI(spd_work_queue_log_prefix, "%s: latency in the last %lli ms (longest ever %"PRIu32" us):",
+             q_context->worker_task_name, (esp_timer_get_time() - stats->since) / 1000, q_context->latency_max);
+    for (int type = 0; type < SDP_WORK_TYPE_COUNT; type++)
+    {
+        work_type_stats *type_stats = &stats->types[type];
+        if (type_stats->wait.count == 0)
+        {
+            continue;
+        }
+        ESP_LOGI(spd_work_queue_log_prefix, "  type %i: %"PRIu32" items, wait p50 <%"PRIu32" p90 <%"PRIu32" p99 <%"PRIu32" max %"PRIu32" us, "
+                 "work p50 <%"PRIu32" p90 <%"PRIu32" p99 <%"PRIu32" max %"PRIu32" us.", type, type_stats->wait.count,
+                 latency_percentile(&type_stats->wait, 50), latency_percentile(&type_stats->wait, 90),
+                 latency_percentile(&type_stats->wait, 99), type_stats->wait.max,
+                 latency_percentile(&type_stats->service, 50), latency_percentile(&type_stats->service, 90),
+                 latency_percentile(&type_stats->service, 99), type_stats->service.max);
+    }
+#if CONFIG_SDP_WORK_QUEUE_STATS_RESET
+    /* Items being handled right now may be counted in either period */
+    memset(stats->types, 0, sizeof(stats->types));
+    stats->since = esp_timer_get_time();
+#endif
+}
+
+/**
+ * @brief Add an item to the queue, making room according to the policy of a bounded queue
+ * @param no_wait If set, the item is rejected rather than waiting for room or for the queue's semaphore
+ */
+static esp_err_t add_work_item(queue_context *q_context, void *new_item, int level, bool no_wait)
+{
+    if (q_context->shutdown)
+    {
+        ESP_LOGE(spd_work_queue_log_prefix, "The queue is shut down.");
+        return SDP_ERR_SEMAPHORE;
+    }
+    if (q_context->item_stamp_cb != NULL)
+    {
+        q_context->item_stamp_cb(new_item)->queued_at = esp_timer_get_time();
+    }
+    if (q_context->__x_slots_semaphore != NULL)
+    {
+        esp_err_t rc = reserve_place(q_context, new_item, no_wait);
+        if (rc == SDP_WARN_ITEM_COALESCED)
+        {
+            return ESP_OK;
+        }
+        if (rc != ESP_OK)
+        {
+            ESP_LOGW(spd_work_queue_log_prefix, "%s is full (%u items), the item was rejected.",
+                     q_context->worker_task_name, q_context->capacity);
+            return rc;
+        }
+    }
+    /* Counted before it is added, so that it never goes below zero when a worker takes it */
+    uint32_t count = __atomic_add_fetch(&q_context->item_count, 1, __ATOMIC_RELAXED);
+    if (count > q_context->peak_count)
+    {
+        q_context->peak_count = count;
+    }
+
+    esp_err_t rc = ESP_OK;
+    if (q_context->__pool != NULL)
+    {
+        rc = pool_add(q_context, new_item, level, no_wait);
+    }
+    else
+    {
+        rc = insert_item(q_context, new_item, no_wait);
+        if (rc == ESP_OK)
+        {
+            wake_work_queue(q_context);
+        }
+    }
+    if (rc == SDP_ERR_QUEUE_FULL)
+    {
+        /* The ring was full, this only happens to a pool queue with more items than the deques and the ring can hold */
+        __atomic_fetch_add(&q_context->rejected_count, 1, __ATOMIC_RELAXED);
+        ESP_LOGW(spd_work_queue_log_prefix, "The ring of %s is full, the item was rejected.", q_context->worker_task_name);
+    }
+    else if ((rc == SDP_ERR_SEMAPHORE) && no_wait)
+    {
+        /* Another task was adding or taking an item right then */
+        __atomic_fetch_add(&q_context->rejected_count, 1, __ATOMIC_RELAXED);
+    }
+    if (rc != ESP_OK)
+    {
+        __atomic_fetch_sub(&q_context->item_count, 1, __ATOMIC_RELAXED);
+        release_place(q_context);
+    }
+    return rc;
+}
+
+/**
+ * @brief Add an item to a multitasking queue at a given priority level, overriding item_level_cb
+ * Other queues have only one level, there this is the same as safe_add_work_queue().
+ * @param level 0 (lowest) to SDP_WORK_LEVEL_COUNT - 1
+ */
+esp_err_t safe_add_work_queue_level(queue_context *q_context, void *new_item, int level)
+{
+    return add_work_item(q_context, new_item, level, false);
+}
+
+/**
+ * @brief Add an item to the queue
+ * @return esp_err_t ESP_OK, SDP_ERR_QUEUE_FULL if the queue is bounded and the item was rejected, or SDP_ERR_SEMAPHORE
+ */
+esp_err_t safe_add_work_queue(queue_context *q_context, void *new_item)
+{
+    return add_work_item(q_context, new_item, q_context->item_level_cb != NULL ? q_context->item_level_cb(new_item) : 0, false);
+}
+
+/**
+ * @brief Add an item to the queue without ever waiting, for callers that must not block, like receive callbacks
+ * A full queue rejects the item even if its policy is SDP_QUEUE_BLOCK, and so does a queue whose semaphore is taken.
+ * @return esp_err_t ESP_OK, SDP_ERR_QUEUE_FULL if the item was rejected, or SDP_ERR_SEMAPHORE if the queue was busy
+ */
+esp_err_t safe_add_work_queue_no_wait(queue_context *q_context, void *new_item)
+{
+    return add_work_item(q_context, new_item, q_context->item_level_cb != NULL ? q_context->item_level_cb(new_item) : 0, true);
+}
+
+void *safe_get_head_work_item(queue_context *q_context)
+{
+    void *curr_work = take_head(q_context);
+    if (curr_work != NULL)
+    {
+        release_place(q_context);
+    }
+    return curr_work;
+}
+
+/**
+ * @brief The number of items in the queue
+ */
+uint32_t work_queue_count(queue_context *q_context)
+{
+    return __atomic_load_n(&q_context->item_count, __ATOMIC_RELAXED);
 }
 
 void alter_task_count(queue_context *q_context, int change)
@@ -80,6 +853,11 @@ void set_queue_blocked(queue_context *q_context, bool blocked)
     {
         q_context->blocked = blocked;
         xSemaphoreGive(q_context->__x_task_state_semaphore);
+        if (!blocked)
+        {
+            /* Items may have been queued while blocked */
+            wake_work_queue(q_context);
+        }
     }
     else
     {
@@ -87,6 +865,14 @@ void set_queue_blocked(queue_context *q_context, bool blocked)
     }
 }
 
+/**
+ * @brief Make the worker task shut down
+ */
+void shutdown_work_queue(queue_context *q_context)
+{
+    q_context->shutdown = true;
+    wake_work_queue(q_context);
+}
 
 static void sdp_worker(queue_context *q_context)
 {
@@ -99,19 +885,14 @@ static void sdp_worker(queue_context *q_context)
      ESP_LOGI(spd_work_queue_log_prefix, "watchdog_timeout: %i seconds", q_context->watchdog_timeout);
     ESP_LOGI(spd_work_queue_log_prefix, "---------------------------");
 
-    // Adjust the watchdog, connections can take a long time sometimes.
-    const esp_task_wdt_config_t watchdog_config = {
-        .timeout_ms = (q_context->watchdog_timeout + 10),
-        .idle_core_mask = (1 << portNUM_PROCESSORS) - 1,    // Bitmask of all cores
-        .trigger_panic = false
-    };
-    esp_task_wdt_deinit();
-    esp_task_wdt_init(&watchdog_config);
+    configure_watchdog(q_context);
 
     void *curr_work = NULL;
+    q_context->started_at = esp_timer_get_time();
 
     for (;;)
     {
+        curr_work = NULL;
         // Are we shutting down?
         if (q_context->shutdown)
         {
@@ -120,46 +901,13 @@ static void sdp_worker(queue_context *q_context)
         // First check so that the queue isn't blocked
         if (!q_context->blocked)
         {
-            // Use separate tasks
-            if (q_context->multitasking)
+            // Check if there is anything to do
+            curr_work = safe_get_head_work_item(q_context);
+            if (curr_work != NULL)
             {
-                // Check that we don't have a maximum number of tasks
-                if (q_context->max_task_count == 0 ||
-                    // Or if we do, that we don't exceed it
-                    (q_context->max_task_count > 0 && (q_context->task_count < q_context->max_task_count)))
-                {
-                    // Check if there is anything to do
-                    curr_work = safe_get_head_work_item(q_context);
-                    if (curr_work != NULL)
-                    {
-                        ESP_LOGI(spd_work_queue_log_prefix, ">> Running multitasking callback on_work. Worker address %p", q_context->on_work_cb);
-                        char taskname[50] = "\0";
-                        sprintf(taskname, "%s_worker_%d", spd_work_queue_log_prefix, q_context->task_count + 1);
-                        /* To avoid congestion on Core 0, we act on non-immidiate requests on Core 1 (APP) */
-                        TaskHandle_t th;
-                        alter_task_count(q_context, 1);
-                        int rc = xTaskCreatePinnedToCore((TaskFunction_t)q_context->on_work_cb, taskname, 8192, curr_work, 8, &th, 1);
-                        if (rc != pdPASS)
-                        {
-                            ESP_LOGE(spd_work_queue_log_prefix, ">> Failed creating work task, returned: %i (see projdefs.h)", rc);
-                            alter_task_count(q_context, -1);
-                        }
-                        else
-                        {
-                            ESP_LOGI(spd_work_queue_log_prefix, ">> Created task: %s, taskhandle: %i, taskcount: %i", taskname, (int)th, q_context->task_count);
-                        }
-                    }
-                }
-            }
-            else
-            {
-                // Check if there is anything to do
-                curr_work = safe_get_head_work_item(q_context);
-                if (curr_work != NULL)
-                {
-                    ESP_LOGI(spd_work_queue_log_prefix, ">> Running single task callback on_work. Worker address %p, work address %p.", (void *)(q_context->on_work_cb), (void *)(curr_work));
-                    q_context->on_work_cb(curr_work);
-                }
+                q_context->dispatch_count++;
+                ESP_LOGI(spd_work_queue_log_prefix, ">> Running single task callback on_work. Worker address %p, work address %p.", (void *)(q_context->on_work_cb), (void *)(curr_work));
+                run_work_item(q_context, curr_work);
             }
         }
         
@@ -168,9 +916,16 @@ static void sdp_worker(queue_context *q_context)
         {
             q_context->on_poll_cb(q_context);
         }
-        vTaskDelay(1);
-        // TODO: Use event loop to wait instead?
-        
+        /* If there was nothing to do, sleep until woken, or until the next poll if there is a poll callback */
+        if (curr_work == NULL)
+        {
+            int64_t idle_start = esp_timer_get_time();
+            if (ulTaskNotifyTake(pdTRUE, q_context->on_poll_cb != NULL ? 1 : portMAX_DELAY) > 0)
+            {
+                q_context->wakeup_count++;
+            }
+            q_context->idle_time += esp_timer_get_time() - idle_start;
+        }
     }
     ESP_LOGI(spd_work_queue_log_prefix, "Worker task %s shut down, deleting task.", q_context->worker_task_name);
     free(q_context->__x_queue_semaphore);
@@ -181,6 +936,111 @@ static void sdp_worker(queue_context *q_context)
     vTaskDelete(NULL);
 }
 
+/**
+ * @brief A worker of the pool, takes items from the deques until shut down.
+ */
+static void pool_worker_task(pool_worker *worker)
+{
+    queue_context *q_context = worker->q_context;
+    worker_pool *pool = q_context->__pool;
+
+    for (;;)
+    {
+        if (q_context->shutdown)
+        {
+            break;
+        }
+        void *curr_work = NULL;
+        int64_t now = esp_timer_get_time();
+        /* Taking an item and becoming idle is done under the lock, so that an item added in between is not missed */
+        portENTER_CRITICAL_SAFE(&pool->lock);
+        if (!q_context->blocked)
+        {
+            curr_work = pool_take(pool, worker->core, now);
+        }
+        worker->idle = (curr_work == NULL);
+        portEXIT_CRITICAL_SAFE(&pool->lock);
+        if (curr_work != NULL)
+        {
+            __atomic_fetch_sub(&q_context->item_count, 1, __ATOMIC_RELAXED);
+            release_place(q_context);
+        }
+
+        if ((curr_work == NULL) && !q_context->blocked)
+        {
+            /* Items that did not fit in the deques */
+            curr_work = safe_get_head_work_item(q_context);
+            if (curr_work != NULL)
+            {
+                worker->idle = false;
+            }
+        }
+        if (curr_work != NULL)
+        {
+            __atomic_fetch_add(&q_context->dispatch_count, 1, __ATOMIC_RELAXED);
+            alter_task_count(q_context, 1);
+            run_work_item(q_context, curr_work);
+            alter_task_count(q_context, -1);
+        }
+        else
+        {
+            int64_t idle_start = esp_timer_get_time();
+            if (ulTaskNotifyTake(pdTRUE, portMAX_DELAY) > 0)
+            {
+                worker->wakeup_count++;
+            }
+            worker->idle_time += esp_timer_get_time() - idle_start;
+        }
+    }
+    ESP_LOGI(spd_work_queue_log_prefix, "Pool worker of %s on core %i shut down, deleting task.", q_context->worker_task_name, worker->core);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief Create the worker pool of a multitasking queue, the workers are spread over the cores
+ */
+static esp_err_t init_worker_pool(queue_context *q_context)
+{
+    worker_pool *pool = calloc(1, sizeof(worker_pool));
+    int worker_count = q_context->max_task_count > 0 ? q_context->max_task_count : CONFIG_SDP_WORKER_POOL_SIZE;
+    if (pool != NULL)
+    {
+        pool->workers = calloc(worker_count, sizeof(pool_worker));
+    }
+    if ((pool == NULL) || (pool->workers == NULL))
+    {
+        ESP_LOGE(spd_work_queue_log_prefix, "Failed allocating the worker pool of %s.", q_context->worker_task_name);
+        free(pool);
+        return SDP_ERR_OUT_OF_MEMORY;
+    }
+    portMUX_INITIALIZE(&pool->lock);
+    q_context->__pool = pool;
+
+    for (int i = 0; i < worker_count; i++)
+    {
+        pool_worker *worker = &pool->workers[i];
+        worker->q_context = q_context;
+        worker->core = i % portNUM_PROCESSORS;
+        char taskname[50] = "\0";
+        sprintf(taskname, "%s_worker_%d", spd_work_queue_log_prefix, i + 1);
+        int rc = sdp_task_create((TaskFunction_t)pool_worker_task, taskname, CONFIG_SDP_WORKER_STACK_SIZE, worker,
+                                         q_context->task_priority, &worker->task_handle, worker->core);
+        if (rc != pdPASS)
+        {
+            ESP_LOGE(spd_work_queue_log_prefix, "Failed creating pool worker %i, returned: %i (see projdefs.h)", i + 1, rc);
+            break;
+        }
+        /* Counted after it is created, so that wake_work_queue() never sees a worker without a task */
+        pool->worker_count++;
+    }
+    if (pool->worker_count == 0)
+    {
+        return SDP_ERR_INIT_FAIL;
+    }
+    ESP_LOGI(spd_work_queue_log_prefix, "Created %i pool workers for %s.", pool->worker_count, q_context->worker_task_name);
+    return ESP_OK;
+}
+
 esp_err_t init_work_queue(queue_context *q_context, char *_log_prefix, const char *queue_name)
 {
     spd_work_queue_log_prefix = _log_prefix;
@@ -202,6 +1062,54 @@ esp_err_t init_work_queue(queue_context *q_context, char *_log_prefix, const cha
     // Reset task count (unsafely as this must be the only initiator)
     q_context->task_count = 0;
 
+#if CONFIG_SDP_WORK_QUEUE_STATS
+    if (q_context->item_stamp_cb != NULL)
+    {
+        q_context->__stats = calloc(1, sizeof(work_queue_stats));
+        if (q_context->__stats == NULL)
+        {
+            ESP_LOGE(spd_work_queue_log_prefix, "Failed allocating the latency statistics of %s.", queue_name);
+            return SDP_ERR_OUT_OF_MEMORY;
+        }
+        q_context->__stats->since = esp_timer_get_time();
+    }
+#endif
+
+    if (q_context->ring_size > 0)
+    {
+        uint size = 1;
+        while (size < q_context->ring_size)
+        {
+            size <<= 1;
+        }
+        q_context->__ring = ring_create(size);
+        if (q_context->__ring == NULL)
+        {
+            ESP_LOGE(spd_work_queue_log_prefix, "Failed allocating the ring of %s.", queue_name);
+            return SDP_ERR_OUT_OF_MEMORY;
+        }
+        q_context->ring_size = size;
+        /* All items of a single worker queue are in the ring, so it can't hold more than that */
+        if (!q_context->multitasking && ((q_context->capacity == 0) || (q_context->capacity > size)))
+        {
+            q_context->capacity = size;
+        }
+        ESP_LOGI(spd_work_queue_log_prefix, "The %s queue uses a lock-free ring of %u items.", queue_name, size);
+    }
+
+    if (q_context->capacity > 0)
+    {
+        if (((q_context->full_policy == SDP_QUEUE_DROP_OLDEST) && (q_context->drop_item_cb == NULL)) ||
+            ((q_context->full_policy == SDP_QUEUE_COALESCE) &&
+             ((q_context->drop_item_cb == NULL) || (q_context->item_key_cb == NULL) || !q_context->multitasking)))
+        {
+            ESP_LOGE(spd_work_queue_log_prefix, "The %s queue lacks what its full policy (%i) needs, it will reject items when full instead.",
+                     queue_name, q_context->full_policy);
+            q_context->full_policy = SDP_QUEUE_DROP_NEWEST;
+        }
+        q_context->__x_slots_semaphore = xSemaphoreCreateCounting(q_context->capacity, q_context->capacity);
+    }
+
     /* Create the xTask name. */
     strcpy(q_context->worker_task_name, "\0");
     strcpy(q_context->worker_task_name, queue_name);
@@ -209,15 +1117,28 @@ esp_err_t init_work_queue(queue_context *q_context, char *_log_prefix, const cha
 
     /** Register the worker task.
      *
-     * We are running it on Core 0, or PRO as it is called
+     * Unless told otherwise, we are running it on Core 0, or PRO as it is called
      * traditionally (cores are basically the same now)
      * Feels more reasonable to focus on comms on 0 and
      * applications on 1, traditionally called APP
-     * TODO: Should we try to allocate these tasks statically using xTaskCreateStatic or/and xTaskCreateRestrictedStatic?
+     * The stack and TCB are statically allocated, see sdp_task.c.
      */
 
-    ESP_LOGI(spd_work_queue_log_prefix, "Register the worker task. Name: %s", q_context->worker_task_name);
-    int rc = xTaskCreatePinnedToCore((TaskFunction_t)sdp_worker, q_context->worker_task_name, 8192, (void *)(q_context), 8, q_context->worker_task_handle, 0);
+    if (q_context->task_priority == 0)
+    {
+        q_context->task_priority = SDP_WORKER_TASK_PRIORITY;
+    }
+    if (q_context->multitasking)
+    {
+        /* A multitasking queue has no worker task of its own, items are passed directly to the pool */
+        configure_watchdog(q_context);
+        q_context->started_at = esp_timer_get_time();
+        return init_worker_pool(q_context);
+    }
+    ESP_LOGI(spd_work_queue_log_prefix, "Register the worker task. Name: %s, priority %u, core %i.", 
+             q_context->worker_task_name, q_context->task_priority, q_context->task_core);
+    int rc = sdp_task_create((TaskFunction_t)sdp_worker, q_context->worker_task_name, CONFIG_SDP_WORKER_STACK_SIZE, (void *)(q_context), 
+                             q_context->task_priority, &q_context->worker_task_handle, q_context->task_core);
     if (rc != pdPASS)
     {
         ESP_LOGE(spd_work_queue_log_prefix, "Failed creating worker task, returned: %i (see projdefs.h)", rc);
@@ -230,13 +1151,72 @@ esp_err_t init_work_queue(queue_context *q_context, char *_log_prefix, const cha
 
 /**
  * @brief Cleanup after a queue item is handled, typically not called directly
- * @param q_context The actur
- * @param queue_item A queue item to free.
+ * The work callbacks run on pooled workers (or the worker task), so there is no task to delete;
+ * the worker goes back to the pool when the callback returns.
+ * @param q_context The queue
  */
 void cleanup_queue_task(queue_context *q_context)
 {
-    ESP_LOGI(spd_work_queue_log_prefix, "Cleaning up tasks.");
-    alter_task_count(q_context, -1);
-    vTaskDelete(NULL);
+}
 
-}
\ No newline at end of file
+/**
+ * @brief Log the statistics of a queue: how much work it has dispatched and how idle its worker is
+ */
+void work_queue_on_monitor(queue_context *q_context)
+{
+    int64_t running_time = esp_timer_get_time() - q_context->started_at;
+    if ((q_context->started_at == 0) || (running_time <= 0))
+    {
+        return;
+    }
+    if (q_context->expired_count > 0)
+    {
+        ESP_LOGW(spd_work_queue_log_prefix, "%s: %"PRIu32" items expired before they were handled.",
+                 q_context->worker_task_name, q_context->expired_count);
+    }
+    if (q_context->capacity > 0)
+    {
+        ESP_LOGI(spd_work_queue_log_prefix, "%s: %"PRIu32" items queued (peak %"PRIu32", capacity %u), %"PRIu32" rejected, %"PRIu32" dropped.",
+                 q_context->worker_task_name, work_queue_count(q_context), q_context->peak_count, q_context->capacity,
+                 q_context->rejected_count, q_context->dropped_count);
+    }
+    report_latency(q_context);
+    worker_pool *pool = q_context->__pool;
+    if (pool != NULL)
+    {
+        /* The idle time is summed over the workers, so the idle share is that of the whole pool */
+        uint32_t wakeup_count = 0;
+        int64_t idle_time = 0;
+        for (int i = 0; i < pool->worker_count; i++)
+        {
+            wakeup_count += pool->workers[i].wakeup_count;
+            idle_time += pool->workers[i].idle_time;
+        }
+        ESP_LOGI(spd_work_queue_log_prefix, "%s: %"PRIu32" items dispatched by %i workers, %"PRIu32" wakeups, idle %lli%% of the time.",
+                 q_context->worker_task_name, q_context->dispatch_count, pool->worker_count, wakeup_count,
+                 (idle_time * 100) / (running_time * pool->worker_count));
+        ESP_LOGI(spd_work_queue_log_prefix, "%s: %"PRIu32" items stolen between cores, %"PRIu32" did not fit in the deques, %u workers busy.",
+                 q_context->worker_task_name, pool->steal_count, pool->overflow_count, q_context->task_count);
+        for (int level = SDP_WORK_LEVEL_COUNT - 1; level >= 0; level--)
+        {
+            portENTER_CRITICAL_SAFE(&pool->lock);
+            level_stats stats = pool->levels[level];
+            int depth = 0;
+            for (int core = 0; core < portNUM_PROCESSORS; core++)
+            {
+                depth += pool->deques[level][core].count;
+            }
+            portEXIT_CRITICAL_SAFE(&pool->lock);
+            if ((stats.dispatch_count > 0) || (depth > 0))
+            {
+                ESP_LOGI(spd_work_queue_log_prefix, "%s level %i: %i queued, %"PRIu32" dispatched (%"PRIu32" aged), wait avg %lli us, max %lli us.",
+                         q_context->worker_task_name, level, depth, stats.dispatch_count, stats.aged_count,
+                         stats.dispatch_count > 0 ? stats.wait_total / stats.dispatch_count : 0LL, stats.wait_max);
+            }
+        }
+        return;
+    }
+    ESP_LOGI(spd_work_queue_log_prefix, "%s: %"PRIu32" items dispatched, %"PRIu32" wakeups, idle %lli%% of the time.",
+             q_context->worker_task_name, q_context->dispatch_count, q_context->wakeup_count,
+             (q_context->idle_time * 100) / running_time);
+}
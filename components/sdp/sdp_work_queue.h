@@ -34,6 +34,37 @@ typedef void(insert_tail)(void *new_item);
 
 typedef void(poll_callback)(void *q_context);
 
+typedef int(item_level)(void *item);
+
+typedef void(drop_item)(void *item);
+
+typedef uint32_t(item_key)(void *item);
+
+typedef work_stamp_t *(item_stamp)(void *item);
+
+typedef int(item_type)(void *item);
+
+/**
+ * @brief What a bounded queue does with a new item when it is full
+ */
+typedef enum e_queue_full_policy
+{
+    /* Reject the new item */
+    SDP_QUEUE_DROP_NEWEST = 0,
+    /* Wait up to block_timeout for room, then reject. The worker itself never waits. Keep the timeout short if fed from a receiving context. */
+    SDP_QUEUE_BLOCK = 1,
+    /* Drop the oldest item of the lowest level to make room */
+    SDP_QUEUE_DROP_OLDEST = 2,
+    /* Replace a queued item with the same key (see item_key_cb), otherwise reject. Only multitasking queues. */
+    SDP_QUEUE_COALESCE = 3
+} e_queue_full_policy;
+
+/* The FreeRTOS priority of worker tasks, unless the queue context says otherwise */
+#define SDP_WORKER_TASK_PRIORITY 8
+
+/* The number of priority levels of a multitasking queue, 0 is the lowest */
+#define SDP_WORK_LEVEL_COUNT 4
+
 typedef struct queue_context
 {
   /* Queue management callbacks, needed because of the difficulties in passing queues as pointers */
@@ -44,22 +75,53 @@ typedef struct queue_context
   /* Mandatory callback that handles incoming work items */
   work_callback *on_work_cb;
 
-  /* Optional callback that is called each poll period. T
+  /* If set, items are queued in a lock-free ring of this many items (rounded up to a power of two),
+  and the queue management callbacks are only needed for compatibility. Producers never wait for a lock. */
+  uint ring_size;
+
+  /* Optional callback that returns the priority level of an item, 0 to SDP_WORK_LEVEL_COUNT - 1.
+  Only multitasking queues have levels, without the callback all items have level 0. */
+  item_level *item_level_cb;
+
+  /* The most items that can be queued (0 = unbounded), and what happens when it is full */
+  uint capacity;
+  e_queue_full_policy full_policy;
+  /* How long SDP_QUEUE_BLOCK waits for room */
+  TickType_t block_timeout;
+  /* Frees an item dropped or replaced by the policy, needed for SDP_QUEUE_DROP_OLDEST and SDP_QUEUE_COALESCE */
+  drop_item *drop_item_cb;
+  /* The key that SDP_QUEUE_COALESCE compares, like the peer and the conversation */
+  item_key *item_key_cb;
+
+  /* Optional callback that returns where in an item the queue stamps when it was queued and taken.
+  With it, the queue keeps histograms of the time items wait and the time on_work_cb takes. */
+  item_stamp *item_stamp_cb;
+  /* Optional callback that returns the work type of an item (see e_work_type), the histograms are kept per type */
+  item_type *item_type_cb;
+  /* Optional callback that is given items whose deadline (see work_stamp_t) has passed, instead of on_work_cb.
+  It must free the item. Without it, deadlines are ignored. */
+  work_callback *on_expired_cb;
+
+  /* Optional callback that is called each poll period (every tick while idle). 
+  Without it, the worker sleeps until an item is added.
   Note: This is run in the queue task, and might conflict with multitasking. */
   poll_callback *on_poll_cb;
-  /* Max number of concurrent tasks. (0 = unlimited) */
+  /* The number of pooled workers of a multitasking queue (0 = CONFIG_SDP_WORKER_POOL_SIZE) */
   uint max_task_count;
-  /* Current number of running tasks */
+  /* Current number of busy workers */
   uint task_count;
-  /* Create separate tasks for each work. 
-  Do not do this if the functionality isn't thread safe. 
-  Also, what is gained in isolation, might be lost in performance. */
+  /* Handle work in parallel, on a pool of workers on both cores. 
+  Do not do this if the functionality isn't thread safe. */
   bool multitasking;
 
   /* Worker task */
   TaskHandle_t worker_task_handle;
   /* Worker task name*/
   char worker_task_name[50];
+  /* The FreeRTOS priority of the worker task, 0 means SDP_WORKER_TASK_PRIORITY */
+  UBaseType_t task_priority;
+  /* The core the worker task is pinned to */
+  BaseType_t task_core;
 
   /* If set, the queue will not process any items */
   bool blocked;
@@ -69,20 +131,46 @@ typedef struct queue_context
   /* Watchdog timeout in seconds */
   int watchdog_timeout;
 
+  /* Statistics, maintained by the worker task */
+  uint32_t dispatch_count;  // Items handed to on_work_cb
+  uint32_t wakeup_count;    // Times the worker woke up from waiting
+  int64_t idle_time;        // Microseconds spent waiting for work
+  int64_t started_at;       // When the worker task started
+  uint32_t item_count;      // Items currently queued
+  uint32_t peak_count;      // The most items that has been queued
+  uint32_t rejected_count;  // Items rejected because the queue was full
+  uint32_t dropped_count;   // Queued items dropped or replaced to make room
+  uint32_t latency_max;     // The longest wait and handling of an item (us), never reset
+  uint32_t expired_count;   // Items that had passed their deadline when taken
+
   /* Internal semaphores managed by the queue implementation - Do not set. */
   SemaphoreHandle_t __x_queue_semaphore;      // Thread-safe the queue
   SemaphoreHandle_t __x_task_state_semaphore; // Thread-safe the tasks
+  struct worker_pool *__pool;                 // The workers of a multitasking queue
+  SemaphoreHandle_t __x_slots_semaphore;      // Counts the free places of a bounded queue
+  struct mpsc_ring *__ring;                   // The ring, if ring_size is set
+  struct work_queue_stats *__stats;           // Latency histograms, if item_stamp_cb is set
 
 } queue_context;
 
 
 
 esp_err_t safe_add_work_queue(queue_context *q_context, void *new_item);
+esp_err_t safe_add_work_queue_level(queue_context *q_context, void *new_item, int level);
+esp_err_t safe_add_work_queue_no_wait(queue_context *q_context, void *new_item);
 
 esp_err_t init_work_queue(queue_context *q_context, char *_log_prefix, const char *queue_name);
 
 void set_queue_blocked(queue_context *q_context, bool blocked);
 
+void wake_work_queue(queue_context *q_context);
+
+void shutdown_work_queue(queue_context *q_context);
+
 void cleanup_queue_task(queue_context *q_context);
 
+uint32_t work_queue_count(queue_context *q_context);
+
+void work_queue_on_monitor(queue_context *q_context);
+
 #endif
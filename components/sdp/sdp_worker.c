@@ -13,10 +13,10 @@
 #include <sys/queue.h>
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <string.h>
 #include "sdp_work_queue.h"
-
-#define SDP_QUEUE_PROBLEM_COUNT 3
+#include "sdp_pool.h"
 
 
 // The queue context
@@ -42,6 +42,73 @@ void sdp_insert_tail(work_queue_item_t *new_item)
     STAILQ_INSERT_TAIL(&sdp_work_q, new_item, items);
 }
 
+/**
+ * @brief The priority level of a work item in the SDP queue
+ * Requests are handled before replies, and replies before data, so that a flood of data does not delay them.
+ * Orchestration is normally handled when received, and priority messages on their own queue,
+ * but if they end up here, they go first.
+ */
+static int sdp_work_item_level(work_queue_item_t *queue_item)
+{
+    switch (queue_item->work_type)
+    {
+    case PRIORITY:
+    case ORCHESTRATION:
+        return 3;
+    case REQUEST:
+    case HANDSHAKE:
+        return 2;
+    case REPLY:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @brief Messages in the same conversation with the same peer coalesce when the queue is full
+ */
+static uint32_t sdp_work_item_key(work_queue_item_t *queue_item)
+{
+    uint32_t peer_handle = queue_item->peer != NULL ? queue_item->peer->peer_handle : 0;
+    return (peer_handle << 16) | queue_item->conversation_id;
+}
+
+/**
+ * @brief Tells if a new message would be rejected because the work queue is full
+ * Lets the media answer with a negative receipt before the message is even parsed.
+ */
+bool sdp_work_queue_full()
+{
+    return (sdp_queue_context.capacity > 0) &&
+           (sdp_queue_context.full_policy == SDP_QUEUE_DROP_NEWEST) &&
+           (work_queue_count(&sdp_queue_context) >= sdp_queue_context.capacity);
+}
+
+static work_stamp_t *sdp_work_item_stamp(work_queue_item_t *queue_item)
+{
+    return &queue_item->stamp;
+}
+
+static int sdp_work_item_type(work_queue_item_t *queue_item)
+{
+    return queue_item->work_type;
+}
+
+/**
+ * @brief Skip an item that has passed its deadline, the peer has, or we have, gone to sleep
+ */
+static void sdp_work_item_expired(work_queue_item_t *queue_item)
+{
+    ESP_LOGW(sdp_worker_log_prefix, "Skipping an expired item, work type %u, conversation %u.",
+             queue_item->work_type, queue_item->conversation_id);
+    if (queue_item->peer != NULL)
+    {
+        __atomic_fetch_add(&queue_item->peer->expired_count, 1, __ATOMIC_RELAXED);
+    }
+    sdp_free_work_item(queue_item);
+}
+
 esp_err_t sdp_safe_add_work_queue(work_queue_item_t *new_item)
 {
     return safe_add_work_queue(&sdp_queue_context, new_item);
@@ -49,12 +116,7 @@ esp_err_t sdp_safe_add_work_queue(work_queue_item_t *new_item)
 
 void sdp_cleanup_queue_task(work_queue_item_t *queue_item)
 {
-    if (queue_item != NULL)
-    {
-        free(queue_item->parts);
-        free(queue_item->raw_data);
-        free(queue_item);
-    }
+    sdp_free_work_item(queue_item);
     cleanup_queue_task(&sdp_queue_context);
 }
 
@@ -63,23 +125,71 @@ void sdp_set_queue_blocked(bool blocked)
     set_queue_blocked(&sdp_queue_context, blocked);
 }
 
+/* The priority queue, PRIORITY messages are handled here instead of in the receiving context */
+queue_context sdp_priority_queue_context;
+
+STAILQ_HEAD(sdp_priority_q, work_queue_item)
+sdp_priority_q;
+
+/* Latency statistics of the priority queue, from the arrival of the frame to the end of the callback */
+uint32_t priority_count = 0;
+int64_t priority_latency_total = 0;
+int64_t priority_latency_max = 0;
+
+struct work_queue_item_t *sdp_priority_first_queueitem()
+{
+    return STAILQ_FIRST(&sdp_priority_q);
+}
+
+void sdp_priority_remove_first_queue_item()
+{
+    STAILQ_REMOVE_HEAD(&sdp_priority_q, items);
+}
+void sdp_priority_insert_tail(work_queue_item_t *new_item)
+{
+    STAILQ_INSERT_TAIL(&sdp_priority_q, new_item, items);
+}
+
+esp_err_t sdp_safe_add_priority_queue(work_queue_item_t *new_item)
+{
+    return safe_add_work_queue(&sdp_priority_queue_context, new_item);
+}
+
+/**
+ * @brief The priority worker calls the priority callback, and then frees the item
+ */
+static void sdp_priority_do_on_work_cb(work_queue_item_t *queue_item)
+{
+    on_priority_cb(queue_item);
+
+    int64_t latency = esp_timer_get_time() - queue_item->received_at;
+    priority_count++;
+    priority_latency_total += latency;
+    if (latency > priority_latency_max)
+    {
+        priority_latency_max = latency;
+    }
+    sdp_free_work_item(queue_item);
+}
+
 
 void sdp_worker_on_monitor() {
     // TODO: Looking at the log prefix isn't the best method to see if the queue is running.
     if (sdp_worker_log_prefix) {
 
-        struct work_queue_item *curr_item;
-        struct work_queue_item *tmp_curr_item;
-        uint16_t itemcount = 0;
-        ESP_LOGI(sdp_worker_log_prefix, "in sdp_worker_on_monitor");
-        STAILQ_FOREACH_SAFE(curr_item, &sdp_work_q, items, tmp_curr_item) {
-            itemcount++;
-        }
-        
-        if (itemcount > SDP_QUEUE_PROBLEM_COUNT) {
-            ESP_LOGW(sdp_worker_log_prefix, "SDP Worker queue has %i items which indicates there is a problem!", itemcount);
+        uint32_t itemcount = work_queue_count(&sdp_queue_context);
+        if ((sdp_queue_context.capacity > 0) && (itemcount * 4 >= sdp_queue_context.capacity * 3)) {
+            ESP_LOGW(sdp_worker_log_prefix, "SDP Worker queue has %"PRIu32" of %u items which indicates there is a problem!", 
+                itemcount, sdp_queue_context.capacity);
         } else {
-            ESP_LOGI(sdp_worker_log_prefix, "SDP Worker queue has %i items.", itemcount);
+            ESP_LOGI(sdp_worker_log_prefix, "SDP Worker queue has %"PRIu32" items.", itemcount);
+        }
+        work_queue_on_monitor(&sdp_queue_context);
+        work_queue_on_monitor(&sdp_priority_queue_context);
+        if (priority_count > 0)
+        {
+            ESP_LOGI(sdp_worker_log_prefix, "SDP Priority queue has handled %"PRIu32" messages, latency avg %lli us, max %lli us.",
+                     priority_count, priority_latency_total / priority_count, priority_latency_max);
         }
     }
 
@@ -88,8 +198,9 @@ void sdp_worker_on_monitor() {
 
 void sdp_shutdown_worker()
 {
-    ESP_LOGI(sdp_worker_log_prefix, "Telling main sdp worker to shut down.");
-    sdp_queue_context.shutdown = true;
+    ESP_LOGI(sdp_worker_log_prefix, "Telling main sdp worker and priority worker to shut down.");
+    shutdown_work_queue(&sdp_queue_context);
+    shutdown_work_queue(&sdp_priority_queue_context);
 }
 
 esp_err_t sdp_init_worker(work_callback *work_cb, char *_log_prefix)
@@ -102,10 +213,35 @@ esp_err_t sdp_init_worker(work_callback *work_cb, char *_log_prefix)
     sdp_queue_context.remove_first_queueitem_cb = &sdp_remove_first_queue_item;
     sdp_queue_context.insert_tail_cb = &sdp_insert_tail;
     sdp_queue_context.on_work_cb = work_cb,
+    sdp_queue_context.item_level_cb = (item_level *)&sdp_work_item_level;
+    sdp_queue_context.capacity = CONFIG_SDP_WORK_QUEUE_CAPACITY;
+    sdp_queue_context.full_policy = CONFIG_SDP_WORK_QUEUE_FULL_POLICY;
+    sdp_queue_context.drop_item_cb = (drop_item *)&sdp_free_work_item;
+    sdp_queue_context.item_key_cb = (item_key *)&sdp_work_item_key;
+    sdp_queue_context.item_stamp_cb = (item_stamp *)&sdp_work_item_stamp;
+    sdp_queue_context.item_type_cb = (item_type *)&sdp_work_item_type;
+    sdp_queue_context.on_expired_cb = (work_callback *)&sdp_work_item_expired;
+    sdp_queue_context.ring_size = CONFIG_SDP_QUEUE_RING_SIZE;
     sdp_queue_context.max_task_count = 0;
     sdp_queue_context.multitasking = true;
     sdp_queue_context.watchdog_timeout = 20000;
     init_work_queue(&sdp_queue_context, _log_prefix, "SDP Queue");
 
+    /* The priority queue handles one message at a time, on a task that preempts the normal work */
+    STAILQ_INIT(&sdp_priority_q);
+    sdp_priority_queue_context.first_queue_item_cb = &sdp_priority_first_queueitem;
+    sdp_priority_queue_context.remove_first_queueitem_cb = &sdp_priority_remove_first_queue_item;
+    sdp_priority_queue_context.insert_tail_cb = &sdp_priority_insert_tail;
+    sdp_priority_queue_context.on_work_cb = &sdp_priority_do_on_work_cb;
+    sdp_priority_queue_context.item_stamp_cb = (item_stamp *)&sdp_work_item_stamp;
+    sdp_priority_queue_context.item_type_cb = (item_type *)&sdp_work_item_type;
+    sdp_priority_queue_context.ring_size = CONFIG_SDP_QUEUE_RING_SIZE;
+    sdp_priority_queue_context.max_task_count = 1;
+    sdp_priority_queue_context.multitasking = false;
+    sdp_priority_queue_context.watchdog_timeout = 20000;
+    sdp_priority_queue_context.task_priority = CONFIG_SDP_PRIORITY_WORKER_TASK_PRIORITY;
+    sdp_priority_queue_context.task_core = CONFIG_SDP_PRIORITY_WORKER_CORE;
+    init_work_queue(&sdp_priority_queue_context, _log_prefix, "SDP Priority Queue");
+
     return ESP_OK;
 }
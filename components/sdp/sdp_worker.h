@@ -23,6 +23,8 @@
 
 
 esp_err_t sdp_safe_add_work_queue(work_queue_item_t *new_item);
+bool sdp_work_queue_full();
+esp_err_t sdp_safe_add_priority_queue(work_queue_item_t *new_item);
 void sdp_cleanup_queue_task(work_queue_item_t *queue_item);
 
 void sdp_set_queue_blocked(bool blocked);
@@ -10,6 +10,8 @@
 
 #include "sleep.h"
 #include "../sdp_def.h"
+#include "../sdp_snapshot.h"
+#include "../sdp_relations.h"
 #include <sdp.h>
 #include "esp_err.h"
 #include "esp_sleep.h"
@@ -42,6 +44,10 @@ void goto_sleep_for_microseconds(uint64_t microsecs)
     wake_time+= esp_timer_get_time();
     /* Set the sleep time just before going to sleep. */
     last_sleep_time = get_time_since_start();
+    /* Keep the peers, so that they do not have to be greeted and scored again */
+    sdp_snapshot_save();
+    /* The relations in NVS are written in batches, so the last ones may not have been */
+    sdp_relations_save();
     if (esp_sleep_enable_timer_wakeup(microsecs) == ESP_OK)
     {
 
@@ -115,7 +115,7 @@ bool do_on_data(work_queue_item_t *queue_item)
         lv_label_set_text_fmt(vberth, queue_item->parts[1]);
 
         /* Always end the conversations if this is expeced to be the last response */
-        end_conversation(queue_item->conversation_id);
+        end_conversation(queue_item->peer, queue_item->conversation_id);
         
     } else
     if (strcmp(conversation->reason, "sensors") == 0)
@@ -127,7 +127,7 @@ bool do_on_data(work_queue_item_t *queue_item)
         } else {
             lv_label_set_text_fmt(vberth, "Temperature %s °C", queue_item->parts[0]);
         }   
-        end_conversation(queue_item->conversation_id);
+        end_conversation(queue_item->peer, queue_item->conversation_id);
         
         
     } else
@@ -139,13 +139,13 @@ bool do_on_data(work_queue_item_t *queue_item)
         ESP_LOGI(app_log_prefix, "Had an external message");
         // TODO: Send on using MQTT
         gsm_safe_add_work_queue(queue_item);
-        end_conversation(queue_item->conversation_id);
+        end_conversation(queue_item->peer, queue_item->conversation_id);
         return true;
     }
     else if (strcmp(conversation->reason, "env_central") == 0)
     {
         // TODO: Send on using MQTT
-        end_conversation(queue_item->conversation_id);
+        end_conversation(queue_item->peer, queue_item->conversation_id);
     }
 
     return false;
@@ -0,0 +1,78 @@
+/**
+ * @file bench_crc.c
+ * @brief Reports how fast the host sdp_crc32() is, in MB/s, compared to a bit at a time CRC
+ * The lengths are those of a short frame, a full ESP-NOW frame, and a reassembled 64 KiB frame.
+ * On target, sdp_crc32() is the ROM crc32_be(), this only measures the host implementation.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_random.h>
+
+#include "sdp_crc.h"
+
+#define BUFFER_LENGTH (64 * 1024)
+/* Bytes to checksum at each length, so every length takes about as long */
+#define BYTES_PER_LENGTH (64 * 1024 * 1024)
+
+static uint8_t buffer[BUFFER_LENGTH];
+/* The CRCs are kept here, so that computing them can not be left out */
+static volatile uint32_t crc_sink;
+
+static uint32_t bitwise_crc32(uint32_t crc, const void *data, size_t length)
+{
+    const uint8_t *buf = data;
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= (uint32_t)*buf++ << 24;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+        }
+    }
+    return ~crc;
+}
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief The MB/s of a CRC function at a length
+ */
+static double measure(uint32_t (*crc32)(uint32_t, const void *, size_t), int length, int bytes)
+{
+    uint32_t crc = 0;
+    int rounds = bytes / length;
+    int64_t started = now_ns();
+    for (int i = 0; i < rounds; i++)
+    {
+        crc = crc32(crc, buffer, length);
+    }
+    int64_t elapsed = now_ns() - started;
+    crc_sink = crc;
+    return (double)rounds * length * 1000.0 / elapsed;
+}
+
+int main()
+{
+    for (int i = 0; i < BUFFER_LENGTH; i++)
+    {
+        buffer[i] = (uint8_t)esp_random();
+    }
+    const int lengths[] = {32, 250, BUFFER_LENGTH};
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        double table = measure(sdp_crc32, lengths[i], BYTES_PER_LENGTH);
+        double bitwise = measure(bitwise_crc32, lengths[i], BYTES_PER_LENGTH / 16);
+        printf("%6i bytes: sdp_crc32 %7.1f MB/s, bit at a time %6.1f MB/s, %4.1f times faster.\n", lengths[i],
+               table, bitwise, table / bitwise);
+    }
+    return 0;
+}
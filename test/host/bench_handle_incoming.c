@@ -0,0 +1,304 @@
+/**
+ * @file bench_handle_incoming.c
+ * @brief Reports the frames per second that handle_incoming() takes in, and the heap allocations per frame,
+ * before and after the work items and receive buffers came from the pools of sdp_pool.c.
+ * "Before" is the receive path of the first version of sdp_messaging.c, copied below without its logging:
+ * a malloc for the work item, its data, its parts array, its conversation and the reason of that.
+ * "After" is handle_incoming() as it is, with the work queue and the rest of the component replaced by
+ * stand-ins. In both, the work item is freed as soon as it is queued, as if a worker had handled it.
+ *
+ * Checks that the pooled path allocates nothing for frames that fit the receive buffers, and that
+ * every frame is queued with all its parts.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+#include <time.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <esp_log.h>
+
+#include "sdp_messaging.h"
+#include "sdp_mesh.h"
+#include "sdp_pool.h"
+#include "sdp_crc.h"
+
+#define FRAMES 1000000
+/* The conversations that the frames belong to, few enough for the conversation table */
+#define CONVERSATIONS 8
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Allocation counting, see the Makefile */
+
+void *__real_malloc(size_t size);
+
+static uint32_t malloc_count = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+/* Stand-ins for the rest of the component */
+
+static uint32_t queued_count = 0;
+static int queued_parts = 0;
+
+esp_err_t sdp_safe_add_work_queue(work_queue_item_t *new_item)
+{
+    queued_count++;
+    queued_parts = new_item->partcount;
+    sdp_free_work_item(new_item);
+    return ESP_OK;
+}
+
+esp_err_t sdp_safe_add_priority_queue(work_queue_item_t *new_item)
+{
+    sdp_free_work_item(new_item);
+    return ESP_OK;
+}
+
+int sdp_fragment_on_fragment(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type)
+{
+    return 0;
+}
+
+int sdp_fragment_on_status(sdp_peer *peer, const uint8_t *data, int data_len)
+{
+    return 0;
+}
+
+int sdp_send_ack(sdp_peer *peer, const void *data, int data_length)
+{
+    return 0;
+}
+
+int64_t sdp_orchestration_deadline(sdp_peer *peer)
+{
+    return 0;
+}
+
+int sdp_orchestration_send_next_message(work_queue_item_t *queue_item)
+{
+    return 0;
+}
+
+void sdp_orchestration_parse_next_message(work_queue_item_t *queue_item)
+{
+}
+
+int sdp_peer_send_hi_message(sdp_peer *peer, bool is_reply)
+{
+    return 0;
+}
+
+int sdp_peer_inform(work_queue_item_t *queue_item)
+{
+    return 0;
+}
+
+void sdp_peer_init_peer(sdp_peer *peer)
+{
+}
+
+void sdp_peer_init(char *_log_prefix)
+{
+}
+
+/* The receive path before the pools, from the first version of sdp_messaging.c */
+
+struct baseline_conversation
+{
+    SLIST_ENTRY(baseline_conversation) items;
+    sdp_peer *peer;
+    uint16_t conversation_id;
+    bool local;
+    char *reason;
+};
+
+static SLIST_HEAD(baseline_conversations_t, baseline_conversation) baseline_conversations;
+static SemaphoreHandle_t baseline_semaphore;
+
+static void baseline_parse_message(work_queue_item_t *queue_item)
+{
+    if (queue_item->raw_data[queue_item->raw_data_length - 1] != 0)
+    {
+        queue_item->raw_data[queue_item->raw_data_length - 1] = 0;
+    }
+    int nullcount = 0;
+    for (int i = 0; i < queue_item->raw_data_length; i++)
+    {
+        if (queue_item->raw_data[i] == 0)
+        {
+            nullcount++;
+        }
+    }
+    queue_item->parts = malloc(nullcount * sizeof(char *));
+    queue_item->parts[0] = queue_item->raw_data;
+    queue_item->partcount = 1;
+    for (int j = 0; j < queue_item->raw_data_length - 1; j++)
+    {
+        if (queue_item->raw_data[j] == 0)
+        {
+            queue_item->parts[queue_item->partcount] = &(queue_item->raw_data[j + 1]);
+            queue_item->partcount++;
+        }
+    }
+}
+
+static void baseline_add_conversation(sdp_peer *peer, const char *reason, int conversation_id)
+{
+    struct baseline_conversation *new_item = malloc(sizeof(struct baseline_conversation));
+    new_item->peer = peer;
+    new_item->local = (conversation_id < 0);
+    /* It was strlen(reason) then, which wrote the terminator past the end */
+    new_item->reason = malloc(strlen(reason) + 1);
+    strcpy(new_item->reason, reason);
+    xSemaphoreTake(baseline_semaphore, portMAX_DELAY);
+    new_item->conversation_id = conversation_id;
+    SLIST_INSERT_HEAD(&baseline_conversations, new_item, items);
+    xSemaphoreGive(baseline_semaphore);
+}
+
+/**
+ * @brief Ends the conversations, the first version kept them until they were ended
+ */
+static void baseline_end_conversations()
+{
+    while (!SLIST_EMPTY(&baseline_conversations))
+    {
+        struct baseline_conversation *conversation = SLIST_FIRST(&baseline_conversations);
+        SLIST_REMOVE_HEAD(&baseline_conversations, items);
+        free(conversation->reason);
+        free(conversation);
+    }
+}
+
+static void baseline_free_work_item(work_queue_item_t *queue_item)
+{
+    free(queue_item->parts);
+    free(queue_item->raw_data);
+    free(queue_item);
+}
+
+static int baseline_handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type)
+{
+    /* The CRC was computed for the log line, whether it was logged or not */
+    uint32_t crc32 = sdp_crc32(0, data, data_len);
+    if (data_len <= SDP_PREAMBLE_LENGTH)
+    {
+        return SDP_ERR_MESSAGE_TOO_SHORT;
+    }
+    work_queue_item_t *new_item = malloc(sizeof(work_queue_item_t));
+    new_item->crc32 = crc32;
+    new_item->work_type = (uint8_t)data[4];
+    new_item->conversation_id = (uint16_t)data[5];
+    new_item->raw_data_length = data_len - SDP_PREAMBLE_LENGTH;
+    new_item->raw_data = malloc(new_item->raw_data_length);
+    memcpy(new_item->raw_data, &(data[SDP_PREAMBLE_LENGTH]), new_item->raw_data_length);
+    new_item->media_type = media_type;
+    new_item->peer = peer;
+    baseline_parse_message(new_item);
+    baseline_add_conversation(peer, "external", new_item->conversation_id);
+
+    queued_count++;
+    queued_parts = new_item->partcount;
+    baseline_free_work_item(new_item);
+    return 0;
+}
+
+/* The benchmark */
+
+typedef int handler(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type);
+
+static sdp_peer *peer;
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Make a DATA frame of a number of parts, each part_length long with its terminator
+ */
+static int make_frame(uint8_t *frame, int parts, int part_length)
+{
+    int length = SDP_PREAMBLE_LENGTH;
+    memset(frame, 0, SDP_PREAMBLE_LENGTH);
+    frame[4] = DATA;
+    for (int i = 0; i < parts; i++)
+    {
+        memset(frame + length, 'a' + i % 26, part_length - 1);
+        frame[length + part_length - 1] = 0;
+        length += part_length;
+    }
+    return length;
+}
+
+static void measure(const char *name, handler *handle, uint8_t *frame, int length, int parts)
+{
+    queued_count = 0;
+    uint32_t mallocs_before = malloc_count;
+    int64_t started = now_ns();
+    for (int i = 0; i < FRAMES; i++)
+    {
+        frame[5] = (uint8_t)(i % CONVERSATIONS);
+        handle(peer, frame, length, SDP_MT_ESPNOW);
+        if ((handle == baseline_handle_incoming) && ((i % CONVERSATIONS) == CONVERSATIONS - 1))
+        {
+            baseline_end_conversations();
+        }
+    }
+    int64_t elapsed = now_ns() - started;
+    double mallocs = (double)(malloc_count - mallocs_before) / FRAMES;
+    printf("  %-7s %8.0f frames/s, %.2f allocations per frame.\n", name, FRAMES * 1e9 / elapsed, mallocs);
+    CHECK(queued_count == FRAMES, "%s, %" PRIu32 " of %i frames were queued.", name, queued_count, FRAMES);
+    CHECK(queued_parts == parts, "%s, a frame was split into %i parts, not %i.", name, queued_parts, parts);
+    if (handle == handle_incoming)
+    {
+        CHECK(mallocs == 0, "%s, %.2f allocations were made for each frame.", name, mallocs);
+    }
+}
+
+static void run(int parts, int part_length)
+{
+    uint8_t frame[CONFIG_SDP_RECEIVE_BUFFER_SIZE + SDP_PREAMBLE_LENGTH];
+    int length = make_frame(frame, parts, part_length);
+    printf("%3i bytes in %2i parts:\n", length, parts);
+    measure("Before", baseline_handle_incoming, frame, length, parts);
+    measure("After", handle_incoming, frame, length, parts);
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    sdp_pool_init("Pool");
+    sdp_init_messaging("Messaging", NULL);
+    baseline_semaphore = xSemaphoreCreateMutex();
+    SLIST_INIT(&baseline_conversations);
+    sdp_peer_name name = "sender";
+    peer = sdp_mesh_find_peer_by_handle(sdp_mesh_peer_add(name));
+
+    /* A short reading, and a frame that needs a pooled parts array */
+    run(3, 8);
+    run(16, 12);
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
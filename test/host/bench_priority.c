@@ -0,0 +1,249 @@
+/**
+ * @file bench_priority.c
+ * @brief Reports the latency of PRIORITY messages while the normal work queue is saturated, see sdp_worker.c
+ * A producer task keeps handing DATA frames to handle_incoming() faster than the workers of the normal
+ * queue can handle them, so the queue stays full and frames are refused. Every few milliseconds it also
+ * hands over a PRIORITY frame, which goes to the priority worker. The latency is from the arrival of
+ * the frame to the start of the priority callback, and is compared to the wait of the DATA frames.
+ *
+ * On the host, tasks are threads of the same priority, so the priority worker does not preempt the
+ * normal workers as it does on the device, it only has its own queue. The latencies are upper bounds.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "sdp_messaging.h"
+#include "sdp_worker.h"
+#include "sdp_mesh.h"
+#include "sdp_pool.h"
+#include "sdp_task.h"
+#include "sdp_work_queue.h"
+
+#define RUN_MS 2000
+/* The work of each DATA frame, busy waiting */
+#define DATA_WORK_US 500
+#define PRIORITY_INTERVAL_US 5000
+#define MAX_PRIORITY_FRAMES (RUN_MS * 1000 / PRIORITY_INTERVAL_US + 16)
+#define FRAME_LENGTH 32
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Stand-ins for the rest of the component */
+
+int sdp_fragment_on_fragment(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type media_type)
+{
+    return 0;
+}
+
+int sdp_fragment_on_status(sdp_peer *peer, const uint8_t *data, int data_len)
+{
+    return 0;
+}
+
+/* The normal queue, see sdp_worker.c */
+extern queue_context sdp_queue_context;
+
+static uint32_t ack_count = 0;
+
+int sdp_send_ack(sdp_peer *peer, const void *data, int data_length)
+{
+    __atomic_add_fetch(&ack_count, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+int64_t sdp_orchestration_deadline(sdp_peer *peer)
+{
+    return 0;
+}
+
+int sdp_orchestration_send_next_message(work_queue_item_t *queue_item)
+{
+    return 0;
+}
+
+void sdp_orchestration_parse_next_message(work_queue_item_t *queue_item)
+{
+}
+
+int sdp_peer_send_hi_message(sdp_peer *peer, bool is_reply)
+{
+    return 0;
+}
+
+int sdp_peer_inform(work_queue_item_t *queue_item)
+{
+    return 0;
+}
+
+void sdp_peer_init_peer(sdp_peer *peer)
+{
+}
+
+void sdp_peer_init(char *_log_prefix)
+{
+}
+
+/* sdp_task.c keeps static stacks, on the host a task is a thread */
+BaseType_t sdp_task_create(TaskFunction_t task_function, const char *name, uint32_t stack_size, void *arg,
+                           UBaseType_t priority, TaskHandle_t *task_handle, BaseType_t core)
+{
+    return xTaskCreatePinnedToCore(task_function, name, stack_size, arg, priority, task_handle, core);
+}
+
+/* The work */
+
+static volatile bool running = true;
+static uint32_t data_handled = 0;
+static int64_t data_wait_total = 0;
+static int64_t data_wait_max = 0;
+
+static uint32_t priority_handled = 0;
+static int64_t priority_latencies[MAX_PRIORITY_FRAMES];
+
+static void busy_wait_us(int64_t us)
+{
+    int64_t until = esp_timer_get_time() + us;
+    while (esp_timer_get_time() < until)
+    {
+    }
+}
+
+/**
+ * @brief The work callback of the normal queue, as an application would have it
+ */
+static void on_data_work(void *work_item)
+{
+    work_queue_item_t *queue_item = work_item;
+    int64_t wait = esp_timer_get_time() - queue_item->received_at;
+    busy_wait_us(DATA_WORK_US);
+    /* The statistics are only written by the workers, under a lock of their own */
+    static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+    portENTER_CRITICAL(&stats_lock);
+    data_handled++;
+    data_wait_total += wait;
+    data_wait_max = wait > data_wait_max ? wait : data_wait_max;
+    portEXIT_CRITICAL(&stats_lock);
+    sdp_cleanup_queue_task(queue_item);
+}
+
+/**
+ * @brief The priority callback, the priority worker frees the item
+ */
+static void on_priority(void *work_item)
+{
+    work_queue_item_t *queue_item = work_item;
+    if (priority_handled < MAX_PRIORITY_FRAMES)
+    {
+        priority_latencies[priority_handled] = esp_timer_get_time() - queue_item->received_at;
+    }
+    priority_handled++;
+}
+
+static int compare_latencies(const void *a, const void *b)
+{
+    int64_t difference = *(const int64_t *)a - *(const int64_t *)b;
+    return difference < 0 ? -1 : (difference > 0 ? 1 : 0);
+}
+
+static void make_frame(uint8_t *frame, e_work_type work_type)
+{
+    memset(frame, 0, FRAME_LENGTH);
+    frame[4] = work_type;
+    memcpy(frame + SDP_PREAMBLE_LENGTH, "ALARM", 5);
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_NONE);
+    sdp_pool_init("Pool");
+    sdp_init_messaging("Messaging", &on_priority);
+    sdp_init_worker(&on_data_work, "Worker");
+    sdp_peer_name name = "sensor";
+    sdp_peer *peer = sdp_mesh_find_peer_by_handle(sdp_mesh_peer_add(name));
+
+    uint8_t data_frame[FRAME_LENGTH];
+    uint8_t priority_frame[FRAME_LENGTH];
+    make_frame(data_frame, DATA);
+    make_frame(priority_frame, PRIORITY);
+
+    uint32_t data_sent = 0;
+    uint32_t data_refused = 0;
+    uint32_t priority_sent = 0;
+    uint32_t depth_total = 0;
+    uint32_t samples = 0;
+    int64_t started = esp_timer_get_time();
+    int64_t next_priority = started + PRIORITY_INTERVAL_US;
+    int64_t now;
+    while ((now = esp_timer_get_time()) < started + RUN_MS * 1000LL)
+    {
+        if (now >= next_priority)
+        {
+            samples++;
+            depth_total += work_queue_count(&sdp_queue_context);
+            handle_incoming(peer, priority_frame, FRAME_LENGTH, SDP_MT_ESPNOW);
+            priority_sent++;
+            next_priority += PRIORITY_INTERVAL_US;
+        }
+        if (handle_incoming(peer, data_frame, FRAME_LENGTH, SDP_MT_ESPNOW) == 0)
+        {
+            data_sent++;
+        }
+        else
+        {
+            data_refused++;
+            taskYIELD();
+        }
+    }
+    /* Let the priority worker catch up */
+    vTaskDelay(100);
+    sdp_shutdown_worker();
+
+    int count = priority_handled < MAX_PRIORITY_FRAMES ? priority_handled : MAX_PRIORITY_FRAMES;
+    qsort(priority_latencies, count, sizeof(int64_t), compare_latencies);
+    int64_t priority_total = 0;
+    for (int i = 0; i < count; i++)
+    {
+        priority_total += priority_latencies[i];
+    }
+    printf("DATA: %" PRIu32 " queued, %" PRIu32 " refused, %.1f of %i queued on average at the PRIORITY frames.\n",
+           data_sent, data_refused, (double)depth_total / samples, CONFIG_SDP_WORK_QUEUE_CAPACITY);
+    printf("DATA wait: avg %lli us, max %lli us (%" PRIu32 " handled).\n",
+           data_handled > 0 ? data_wait_total / data_handled : 0, data_wait_max, data_handled);
+    if (count > 0)
+    {
+        printf("PRIORITY latency: avg %lli us, p50 %lli us, p99 %lli us, max %lli us (%i handled).\n",
+               priority_total / count, priority_latencies[count / 2], priority_latencies[count * 99 / 100],
+               priority_latencies[count - 1], count);
+    }
+
+    CHECK(priority_handled == priority_sent, "%" PRIu32 " of %" PRIu32 " PRIORITY frames were handled.",
+          priority_handled, priority_sent);
+    CHECK(ack_count == priority_sent, "%" PRIu32 " of %" PRIu32 " PRIORITY frames were acknowledged.", ack_count,
+          priority_sent);
+    /* Saturated, the queue refuses frames, and the workers have taken some when the producer gets to run */
+    CHECK((data_refused > 0) && (depth_total * 3 > samples * CONFIG_SDP_WORK_QUEUE_CAPACITY),
+          "The queue was not saturated, %.1f items on average.", (double)depth_total / samples);
+    CHECK((count > 0) && (data_handled > 0) && (priority_total / count < data_wait_total / data_handled),
+          "PRIORITY frames waited longer than DATA frames.");
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
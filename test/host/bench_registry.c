@@ -0,0 +1,187 @@
+/**
+ * @file bench_registry.c
+ * @brief Reports how many peers per second are looked up in the registry indexes, see sdp_registry.c,
+ * by MAC address, handle, name and relation id, at 32, 256 and 1024 peers. Looking up by MAC address
+ * is compared to looping the peer list, as sdp_mesh.c did before there was a registry.
+ * Every lookup is of a random registered peer, and each must find it.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_log.h>
+#include <esp_random.h>
+
+#include "sdp_mesh.h"
+#include "sdp_registry.h"
+
+/* Lookups at each count of peers, the linear scan gets a fraction of them */
+#define LOOKUPS 4000000
+#define LINEAR_LOOKUPS_DIVISOR 16
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* The parts of sdp_peer.c that sdp_mesh.c uses */
+
+void sdp_peer_init_peer(sdp_peer *peer)
+{
+}
+
+void sdp_peer_init(char *_log_prefix)
+{
+}
+
+/* The benchmark */
+
+typedef enum e_lookup
+{
+    LOOKUP_MAC_ADDRESS,
+    LOOKUP_HANDLE,
+    LOOKUP_NAME,
+    LOOKUP_RELATION_ID,
+    LOOKUP_LINEAR,
+    LOOKUP_COUNT
+} e_lookup;
+
+static const char *lookup_names[LOOKUP_COUNT] = {"MAC address", "handle", "name", "relation id", "linear"};
+
+static sdp_peer *peers[CONFIG_SDP_PEER_REGISTRY_SIZE];
+/* The random peers to look up, so that esp_random() is not measured */
+static uint16_t picks[LOOKUPS];
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Looping the peer list, like sdp_mesh_find_peer_by_base_mac_address() did, without its logging
+ */
+static sdp_peer *linear_find_by_mac_address(const sdp_mac_address mac_address)
+{
+    sdp_peer *peer;
+    SLIST_FOREACH(peer, get_peer_list(), next)
+    {
+        if (memcmp(peer->base_mac_address, mac_address, SDP_MAC_ADDR_LEN) == 0)
+        {
+            return peer;
+        }
+    }
+    return NULL;
+}
+
+static sdp_peer *find(e_lookup lookup, sdp_peer *peer)
+{
+    switch (lookup)
+    {
+    case LOOKUP_MAC_ADDRESS:
+        return sdp_mesh_find_peer_by_base_mac_address(peer->base_mac_address);
+    case LOOKUP_HANDLE:
+        return sdp_mesh_find_peer_by_handle(peer->peer_handle);
+    case LOOKUP_NAME:
+        return sdp_mesh_find_peer_by_name(peer->name);
+    case LOOKUP_RELATION_ID:
+        return sdp_mesh_find_peer_by_relation_id(peer->relation_id);
+    default:
+        return linear_find_by_mac_address(peer->base_mac_address);
+    }
+}
+
+static void add_peers(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        sdp_peer_name name;
+        snprintf(name, sizeof(name), "peer%i", i);
+        int handle = sdp_mesh_peer_add(name);
+        CHECK(handle >= 0, "Adding peer %i failed with %i.", i, handle);
+        peers[i] = sdp_mesh_find_peer_by_handle(handle);
+        if (peers[i] == NULL)
+        {
+            continue;
+        }
+        /* Real MAC addresses share their first three bytes, the manufacturer */
+        sdp_mac_address mac_address = {0x24, 0x6f, 0x28, 0x10, (uint8_t)(i >> 8), (uint8_t)i};
+        memcpy(peers[i]->base_mac_address, mac_address, SDP_MAC_ADDR_LEN);
+        peers[i]->relation_id = esp_random() | 1;
+        sdp_registry_update(peers[i]);
+    }
+}
+
+static void delete_peers(int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        if (peers[i] != NULL)
+        {
+            sdp_mesh_delete_peer(peers[i]->peer_handle);
+            peers[i] = NULL;
+        }
+    }
+    /* Frees the retired peers, there are no readers */
+    sdp_mesh_on_monitor();
+}
+
+/**
+ * @brief Millions of lookups per second
+ */
+static double measure(e_lookup lookup, int lookups)
+{
+    int found = 0;
+    sdp_mesh_read_begin();
+    int64_t started = now_ns();
+    for (int i = 0; i < lookups; i++)
+    {
+        sdp_peer *peer = peers[picks[i]];
+        found += find(lookup, peer) == peer;
+    }
+    int64_t elapsed = now_ns() - started;
+    sdp_mesh_read_end();
+    CHECK(found == lookups, "Looking up by %s found %i of %i peers.", lookup_names[lookup], found, lookups);
+    return lookups * 1000.0 / elapsed;
+}
+
+static void run(int count)
+{
+    add_peers(count);
+    CHECK(sdp_registry_count() == count, "%i peers are registered, not %i.", sdp_registry_count(), count);
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        picks[i] = esp_random() % count;
+    }
+    printf("%4i peers, millions of lookups per second:", count);
+    for (int lookup = 0; lookup < LOOKUP_COUNT; lookup++)
+    {
+        int lookups = lookup == LOOKUP_LINEAR ? LOOKUPS / LINEAR_LOOKUPS_DIVISOR : LOOKUPS;
+        printf(" %s %.1f%s", lookup_names[lookup], measure(lookup, lookups),
+               lookup == LOOKUP_COUNT - 1 ? ".\n" : ",");
+    }
+    delete_peers(count);
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    sdp_mesh_init("Mesh");
+    const int counts[] = {32, 256, 1024};
+    for (int i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        run(counts[i]);
+    }
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,484 @@
+/**
+ * @file bench_work_queue.c
+ * @brief Four producer tasks add to one work queue, with the lock-free ring and with the STAILQ callbacks
+ * The producers add with safe_add_work_queue_no_wait(), like the receive callbacks of the WiFi and NimBLE
+ * tasks, and retry an item that was rejected because the queue was full or, for the callbacks, busy.
+ * Both queues hold CONFIG_SDP_QUEUE_RING_SIZE items, the size of the ring.
+ *
+ * Reports the items per second through the queue and how long adding took, and checks that the worker
+ * got every item once, in the order each producer added them.
+ *
+ * Then bursts of 1, 10 and 100 items are added to a multitasking queue, on its pool of workers, like DATA
+ * frames arriving on core 0. Reports the items per second, the peak heap use (counted by wrapping malloc()
+ * and free(), see the Makefile), how many items were stolen by the workers of core 1, and the longest wait
+ * of each level. Last, a stream of the highest level is kept queued, and an item of the lowest level must
+ * still be handled as it ages, long before the stream ends.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <malloc.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+
+#include "sdp_work_queue.h"
+#include "sdp_task.h"
+
+#define PRODUCER_COUNT 4
+#define ITEMS_PER_PRODUCER 100000
+/* The adding time histogram has log2 buckets of nanoseconds */
+#define LATENCY_BUCKETS 32
+/* Items added to the pool at each burst size, in bursts of that size */
+#define POOL_ITEMS 20000
+/* The work each pool item takes, busy waiting */
+#define POOL_WORK_US 20
+/* Items of the pool queue, the burst and the stream take from these */
+#define POOL_ITEM_COUNT 128
+/* How long the highest level is kept queued, and how many of its items */
+#define STREAM_MS 2000
+#define STREAM_ITEMS 24
+/* An item has the highest level after (SDP_WORK_LEVEL_COUNT - 1) agings, and beats that level's items at the next */
+#define AGED_MAX_MS (SDP_WORK_LEVEL_COUNT * CONFIG_SDP_WORK_AGING_MS + 200)
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Memory, counted by wrapping malloc() and free() at link time, see the Makefile */
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static int64_t heap_in_use = 0;
+static int64_t heap_peak = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    if (ptr != NULL)
+    {
+        int64_t in_use = __atomic_add_fetch(&heap_in_use, (int64_t)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        int64_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+        while ((in_use > peak) &&
+               !__atomic_compare_exchange_n(&heap_peak, &peak, in_use, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+    return ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr != NULL)
+    {
+        __atomic_sub_fetch(&heap_in_use, (int64_t)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    }
+    __real_free(ptr);
+}
+
+/* sdp_task.c keeps static stacks, on the host a task is a thread */
+BaseType_t sdp_task_create(TaskFunction_t task_function, const char *name, uint32_t stack_size, void *arg,
+                           UBaseType_t priority, TaskHandle_t *task_handle, BaseType_t core)
+{
+    return xTaskCreatePinnedToCore(task_function, name, stack_size, arg, priority, task_handle, core);
+}
+
+typedef struct bench_item
+{
+    STAILQ_ENTRY(bench_item) items;
+    uint32_t producer;
+    uint32_t sequence;
+} bench_item;
+
+static bench_item items[PRODUCER_COUNT][ITEMS_PER_PRODUCER];
+
+/* The STAILQ callbacks, as in sdp_worker.c */
+
+STAILQ_HEAD(bench_q, bench_item)
+bench_q;
+
+static void *bench_first_queueitem()
+{
+    return STAILQ_FIRST(&bench_q);
+}
+
+static void bench_remove_first_queue_item()
+{
+    STAILQ_REMOVE_HEAD(&bench_q, items);
+}
+
+static void bench_insert_tail(void *new_item)
+{
+    STAILQ_INSERT_TAIL(&bench_q, (bench_item *)new_item, items);
+}
+
+/* The worker */
+
+static uint32_t next_sequence[PRODUCER_COUNT];
+static uint32_t received_count = 0;
+static uint32_t out_of_order_count = 0;
+static SemaphoreHandle_t all_received = NULL;
+
+static void on_work(void *work_item)
+{
+    bench_item *item = work_item;
+    if (item->sequence != next_sequence[item->producer])
+    {
+        out_of_order_count++;
+    }
+    next_sequence[item->producer] = item->sequence + 1;
+    if (++received_count == PRODUCER_COUNT * ITEMS_PER_PRODUCER)
+    {
+        xSemaphoreGive(all_received);
+    }
+}
+
+/* The producers */
+
+typedef struct producer
+{
+    queue_context *q_context;
+    uint32_t number;
+    uint32_t full_count;
+    uint32_t busy_count;
+    uint32_t latency[LATENCY_BUCKETS];
+    int64_t latency_max;
+    SemaphoreHandle_t done;
+} producer;
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void producer_task(void *arg)
+{
+    producer *self = arg;
+    for (uint32_t i = 0; i < ITEMS_PER_PRODUCER; i++)
+    {
+        bench_item *item = &items[self->number][i];
+        item->producer = self->number;
+        item->sequence = i;
+        for (;;)
+        {
+            int64_t started = now_ns();
+            esp_err_t rc = safe_add_work_queue_no_wait(self->q_context, item);
+            int64_t took = now_ns() - started;
+            int bucket = 0;
+            while ((bucket < LATENCY_BUCKETS - 1) && (took >> (bucket + 1)) > 0)
+            {
+                bucket++;
+            }
+            self->latency[bucket]++;
+            self->latency_max = took > self->latency_max ? took : self->latency_max;
+            if (rc == ESP_OK)
+            {
+                break;
+            }
+            if (rc == SDP_ERR_QUEUE_FULL)
+            {
+                self->full_count++;
+            }
+            else
+            {
+                self->busy_count++;
+            }
+            taskYIELD();
+        }
+    }
+    xSemaphoreGive(self->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief The upper bound of the bucket below which a share of the adds took
+ */
+static int64_t latency_percentile(const uint32_t *latency, uint64_t total, int per_mille)
+{
+    uint64_t sum = 0;
+    for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+    {
+        sum += latency[bucket];
+        if (sum * 1000 >= total * per_mille)
+        {
+            return 2LL << bucket;
+        }
+    }
+    return INT64_MAX;
+}
+
+static void run(const char *name, uint ring_size)
+{
+    queue_context q_context = {
+        .first_queue_item_cb = &bench_first_queueitem,
+        .remove_first_queueitem_cb = &bench_remove_first_queue_item,
+        .insert_tail_cb = &bench_insert_tail,
+        .on_work_cb = &on_work,
+        .ring_size = ring_size,
+        .capacity = CONFIG_SDP_QUEUE_RING_SIZE,
+        .full_policy = SDP_QUEUE_DROP_NEWEST,
+        .task_core = 0,
+    };
+    STAILQ_INIT(&bench_q);
+    memset(next_sequence, 0, sizeof(next_sequence));
+    received_count = 0;
+    out_of_order_count = 0;
+    CHECK(init_work_queue(&q_context, "Bench", name) == ESP_OK, "Initiating the %s queue failed.", name);
+
+    static producer producers[PRODUCER_COUNT];
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(PRODUCER_COUNT, 0);
+    int64_t started = now_ns();
+    for (int i = 0; i < PRODUCER_COUNT; i++)
+    {
+        memset(&producers[i], 0, sizeof(producer));
+        producers[i].q_context = &q_context;
+        producers[i].number = i;
+        producers[i].done = done;
+        xTaskCreatePinnedToCore(producer_task, "Producer", 4096, &producers[i], 10, NULL, i % portNUM_PROCESSORS);
+    }
+    for (int i = 0; i < PRODUCER_COUNT; i++)
+    {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    bool received = xSemaphoreTake(all_received, 10000) == pdTRUE;
+    int64_t elapsed = now_ns() - started;
+    shutdown_work_queue(&q_context);
+
+    uint32_t latency[LATENCY_BUCKETS] = {0};
+    uint64_t adds = 0;
+    uint32_t full_count = 0;
+    uint32_t busy_count = 0;
+    int64_t latency_max = 0;
+    for (int i = 0; i < PRODUCER_COUNT; i++)
+    {
+        for (int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        {
+            latency[bucket] += producers[i].latency[bucket];
+            adds += producers[i].latency[bucket];
+        }
+        full_count += producers[i].full_count;
+        busy_count += producers[i].busy_count;
+        latency_max = producers[i].latency_max > latency_max ? producers[i].latency_max : latency_max;
+    }
+    printf("%-8s %9.0f items/s, adding took p50 < %"PRId64" ns, p99 < %"PRId64" ns, max %"PRId64" ns, "
+           "%"PRIu32" rejected as full, %"PRIu32" as busy.\n",
+           name, (double)received_count * 1e9 / elapsed, latency_percentile(latency, adds, 500),
+           latency_percentile(latency, adds, 990), latency_max, full_count, busy_count);
+
+    CHECK(received, "The %s queue only passed %"PRIu32" items.", name, received_count);
+    CHECK(out_of_order_count == 0, "The %s queue passed %"PRIu32" items out of order.", name, out_of_order_count);
+    vSemaphoreDelete(done);
+    /* Let the worker shut down */
+    vTaskDelay(10);
+}
+
+/* The multitasking pool */
+
+typedef struct pool_item
+{
+    STAILQ_ENTRY(pool_item) items;
+    int level;
+    /* The core it was added on */
+    int core;
+    int64_t queued_at;
+} pool_item;
+
+static pool_item pool_items[POOL_ITEM_COUNT];
+static pool_item aged_item;
+
+STAILQ_HEAD(pool_q, pool_item)
+pool_q;
+
+static void *pool_first_queueitem()
+{
+    return STAILQ_FIRST(&pool_q);
+}
+
+static void pool_remove_first_queue_item()
+{
+    STAILQ_REMOVE_HEAD(&pool_q, items);
+}
+
+static void pool_insert_tail(void *new_item)
+{
+    STAILQ_INSERT_TAIL(&pool_q, (pool_item *)new_item, items);
+}
+
+static int pool_item_level(void *item)
+{
+    return ((pool_item *)item)->level;
+}
+
+static uint32_t pool_handled_count = 0;
+static uint32_t pool_expected_count = 0;
+static uint32_t pool_stolen_count = 0;
+static int64_t level_wait_max[SDP_WORK_LEVEL_COUNT];
+static int64_t aged_item_handled_at = 0;
+static SemaphoreHandle_t pool_drained = NULL;
+static queue_context *pool_context = NULL;
+/* While set, items of the highest level are added again when handled */
+static volatile bool streaming = false;
+static uint32_t streamed_count = 0;
+
+static void pool_add(queue_context *q_context, pool_item *item, int level);
+
+static void on_pool_work(void *work_item)
+{
+    pool_item *item = work_item;
+    int64_t started = esp_timer_get_time();
+    int64_t wait = started - item->queued_at;
+    int64_t max = __atomic_load_n(&level_wait_max[item->level], __ATOMIC_RELAXED);
+    while ((wait > max) && !__atomic_compare_exchange_n(&level_wait_max[item->level], &max, wait, false,
+                                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+    }
+    if (xPortGetCoreID() != item->core)
+    {
+        __atomic_add_fetch(&pool_stolen_count, 1, __ATOMIC_RELAXED);
+    }
+    while (esp_timer_get_time() - started < POOL_WORK_US)
+    {
+    }
+    if (item == &aged_item)
+    {
+        aged_item_handled_at = esp_timer_get_time();
+    }
+    if (__atomic_add_fetch(&pool_handled_count, 1, __ATOMIC_RELAXED) == pool_expected_count)
+    {
+        xSemaphoreGive(pool_drained);
+    }
+    if (streaming && (item != &aged_item))
+    {
+        /* Last, as another worker may take it at once */
+        __atomic_add_fetch(&streamed_count, 1, __ATOMIC_RELAXED);
+        pool_add(pool_context, item, item->level);
+    }
+}
+
+static void pool_add(queue_context *q_context, pool_item *item, int level)
+{
+    item->level = level;
+    item->core = xPortGetCoreID();
+    item->queued_at = esp_timer_get_time();
+    CHECK(safe_add_work_queue(q_context, item) == ESP_OK, "Adding to the pool failed.");
+}
+
+/**
+ * @brief Add bursts of items at all levels, waiting for each burst to be handled before the next
+ */
+static void run_pool_bursts(queue_context *q_context, int burst)
+{
+    int bursts = POOL_ITEMS / burst;
+    memset(level_wait_max, 0, sizeof(level_wait_max));
+    pool_stolen_count = 0;
+    int64_t heap_before = __atomic_load_n(&heap_in_use, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap_peak, heap_before, __ATOMIC_RELAXED);
+    bool drained = true;
+    int64_t started = now_ns();
+    for (int i = 0; (i < bursts) && drained; i++)
+    {
+        pool_handled_count = 0;
+        pool_expected_count = burst;
+        for (int j = 0; j < burst; j++)
+        {
+            pool_add(q_context, &pool_items[j], j % SDP_WORK_LEVEL_COUNT);
+        }
+        drained = xSemaphoreTake(pool_drained, 10000) == pdTRUE;
+    }
+    int64_t elapsed = now_ns() - started;
+    int64_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED) - heap_before;
+
+    printf("Bursts of %3i: %7.0f items/s, peak heap %"PRId64" bytes, %4.1f%% stolen, longest wait per level "
+           "%"PRId64"/%"PRId64"/%"PRId64"/%"PRId64" us.\n",
+           burst, (double)bursts * burst * 1e9 / elapsed, peak, pool_stolen_count * 100.0 / (bursts * burst),
+           level_wait_max[0], level_wait_max[1], level_wait_max[2], level_wait_max[3]);
+    CHECK(drained, "A burst of %i was not handled.", burst);
+    /* Nothing is allocated per item, nor per burst */
+    CHECK(peak == 0, "Bursts of %i used %"PRId64" bytes of heap.", burst, peak);
+}
+
+/**
+ * @brief Keep the highest level queued, the lowest level item must be taken when it has aged
+ * The items of the highest level are added again by the workers, so they are always queued.
+ */
+static void run_pool_aging(queue_context *q_context)
+{
+    pool_handled_count = 0;
+    pool_expected_count = UINT32_MAX;
+    aged_item_handled_at = 0;
+    streamed_count = 0;
+    streaming = true;
+    int64_t started = esp_timer_get_time();
+    for (int i = 0; i < STREAM_ITEMS; i++)
+    {
+        pool_add(q_context, &pool_items[i], SDP_WORK_LEVEL_COUNT - 1);
+    }
+    int64_t aged_item_added_at = esp_timer_get_time();
+    pool_add(q_context, &aged_item, 0);
+    vTaskDelay(STREAM_MS);
+    streaming = false;
+    /* Let the stream finish */
+    vTaskDelay(100);
+    int64_t waited = aged_item_handled_at > 0 ? (aged_item_handled_at - aged_item_added_at) / 1000 : -1;
+    printf("Aging: the lowest level waited %"PRId64" ms behind %i items of the highest level, that were "
+           "handled %"PRIu32" times in %"PRId64" ms.\n", waited, STREAM_ITEMS, streamed_count,
+           (esp_timer_get_time() - started) / 1000);
+    CHECK(aged_item_handled_at > 0, "The lowest level item was never handled.");
+    CHECK(waited < AGED_MAX_MS, "The lowest level item waited %"PRId64" ms.", waited);
+}
+
+static void run_pool()
+{
+    queue_context q_context = {
+        .first_queue_item_cb = &pool_first_queueitem,
+        .remove_first_queueitem_cb = &pool_remove_first_queue_item,
+        .insert_tail_cb = &pool_insert_tail,
+        .on_work_cb = &on_pool_work,
+        .item_level_cb = &pool_item_level,
+        .multitasking = true,
+    };
+    STAILQ_INIT(&pool_q);
+    pool_drained = xSemaphoreCreateBinary();
+    pool_context = &q_context;
+    CHECK(init_work_queue(&q_context, "Bench", "Pool") == ESP_OK, "Initiating the pool queue failed.");
+    printf("A pool of %i workers, on %i cores, items take %i us.\n", CONFIG_SDP_WORKER_POOL_SIZE,
+           portNUM_PROCESSORS, POOL_WORK_US);
+
+    const int bursts[] = {1, 10, 100};
+    for (int i = 0; i < sizeof(bursts) / sizeof(bursts[0]); i++)
+    {
+        run_pool_bursts(&q_context, bursts[i]);
+    }
+    run_pool_aging(&q_context);
+    shutdown_work_queue(&q_context);
+    vTaskDelay(10);
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    all_received = xSemaphoreCreateBinary();
+    printf("%i producers adding %i items each, to a queue of %i items.\n", PRODUCER_COUNT, ITEMS_PER_PRODUCER,
+           CONFIG_SDP_QUEUE_RING_SIZE);
+    run("Ring", CONFIG_SDP_QUEUE_RING_SIZE);
+    run("STAILQ", 0);
+    run_pool();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
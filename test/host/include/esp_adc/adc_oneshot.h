@@ -0,0 +1,2 @@
+#pragma once
+/* Nothing of the ADC is used on the host */
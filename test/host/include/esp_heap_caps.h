@@ -0,0 +1,7 @@
+#pragma once
+#include <stdlib.h>
+#include <stdint.h>
+
+#define MALLOC_CAP_8BIT (1 << 2)
+
+#define heap_caps_malloc(size, caps) malloc(size)
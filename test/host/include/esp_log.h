@@ -0,0 +1,39 @@
+/**
+ * @file esp_log.h
+ * @brief Logging to stdout, filtered by esp_log_level_set("*", level), which is ESP_LOG_WARN to begin with.
+ */
+#pragma once
+#include <stdio.h>
+#include <inttypes.h>
+
+typedef enum
+{
+    ESP_LOG_NONE,
+    ESP_LOG_ERROR,
+    ESP_LOG_WARN,
+    ESP_LOG_INFO,
+    ESP_LOG_DEBUG,
+    ESP_LOG_VERBOSE
+} esp_log_level_t;
+
+extern esp_log_level_t host_log_level;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level);
+
+#define ESP_LOG_LEVEL(level, tag, format, ...)                                      \
+    do                                                                              \
+    {                                                                               \
+        if ((level) <= host_log_level)                                              \
+        {                                                                           \
+            printf("%c %s: " format "\n", "NEWIDV"[level], (tag), ##__VA_ARGS__); \
+        }                                                                           \
+    } while (0)
+
+#define ESP_LOGE(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_ERROR, tag, format, ##__VA_ARGS__)
+#define ESP_LOGW(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_WARN, tag, format, ##__VA_ARGS__)
+#define ESP_LOGI(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_INFO, tag, format, ##__VA_ARGS__)
+#define ESP_LOGD(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_DEBUG, tag, format, ##__VA_ARGS__)
+#define ESP_LOGV(tag, format, ...) ESP_LOG_LEVEL(ESP_LOG_VERBOSE, tag, format, ##__VA_ARGS__)
+
+#define ESP_LOG_BUFFER_HEX(tag, buffer, length) ((void)(buffer))
+#define ESP_LOG_BUFFER_HEXDUMP(tag, buffer, length, level) ((void)(buffer))
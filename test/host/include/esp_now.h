@@ -0,0 +1,10 @@
+#pragma once
+#include <stdint.h>
+#include "esp_err.h"
+
+/* There is no ESP-NOW on the host, only the peer type that espnow_peer.h declares */
+typedef struct
+{
+    uint8_t peer_addr[6];
+    uint8_t channel;
+} esp_now_peer_info_t;
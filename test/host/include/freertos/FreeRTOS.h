@@ -0,0 +1,65 @@
+/**
+ * @file FreeRTOS.h
+ * @brief The parts of FreeRTOS the SDP component uses, on pthreads, see shim/freertos.c
+ * Ticks are milliseconds. A task runs on the core it was pinned to, other threads on core 0.
+ * Critical sections are spinlocks that the owning thread may take again, like on the ESP32.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include "esp_err.h"
+#include "esp_attr.h"
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+typedef uint8_t StackType_t;
+
+/* Static objects are allocated on the heap anyway, the buffers are not used */
+typedef struct
+{
+    void *unused;
+} StaticSemaphore_t;
+typedef struct
+{
+    void *unused;
+} StaticTask_t;
+
+typedef struct
+{
+    /* The thread that holds the lock, 0 when free */
+    volatile uintptr_t owner;
+    uint32_t count;
+} portMUX_TYPE;
+
+#define portMUX_INITIALIZER_UNLOCKED {.owner = 0, .count = 0}
+
+#define pdTRUE 1
+#define pdFALSE 0
+#define pdPASS pdTRUE
+#define pdFAIL pdFALSE
+
+#define configTICK_RATE_HZ 1000
+#define configMAX_PRIORITIES 25
+#define configMAX_TASK_NAME_LEN 16
+#define portMAX_DELAY 0xffffffffu
+#define portTICK_PERIOD_MS (1000 / configTICK_RATE_HZ)
+#define pdMS_TO_TICKS(ms) ((TickType_t)(ms))
+#define portNUM_PROCESSORS 2
+#define tskNO_AFFINITY 0x7fffffff
+#define configASSERT(x) ((x) ? (void)0 : abort())
+
+void vPortEnterCritical(portMUX_TYPE *mux);
+void vPortExitCritical(portMUX_TYPE *mux);
+BaseType_t xPortGetCoreID(void);
+
+#define portENTER_CRITICAL(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_ISR(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_ISR(mux) vPortExitCritical(mux)
+#define portENTER_CRITICAL_SAFE(mux) vPortEnterCritical(mux)
+#define portEXIT_CRITICAL_SAFE(mux) vPortExitCritical(mux)
+#define portMUX_INITIALIZE(mux) (*(mux) = (portMUX_TYPE)portMUX_INITIALIZER_UNLOCKED)
+#define spinlock_initialize(mux) portMUX_INITIALIZE(mux)
@@ -0,0 +1,52 @@
+/**
+ * @file sdkconfig.h
+ * @brief The configuration of the host build, the SDP options are those of the project sdkconfig
+ * except where noted.
+ */
+#pragma once
+
+#define CONFIG_IDF_TARGET_LINUX 1
+
+#define CONFIG_SDP_PEER_NAME_LEN 16
+#define CONFIG_SDP_PEER_NAME "Host"
+/* Short, so that lost status frames do not make the tests slow */
+#define CONFIG_SDP_RECEIPT_TIMEOUT_MS 5
+#define CONFIG_SDP_WORKER_POOL_SIZE 4
+#define CONFIG_SDP_WORKER_DEQUE_SIZE 16
+#define CONFIG_SDP_WORK_AGING_MS 200
+#define CONFIG_SDP_QUEUE_RING_SIZE 64
+#define CONFIG_SDP_WORK_QUEUE_CAPACITY 32
+#define CONFIG_SDP_WORK_QUEUE_DROP_NEWEST 1
+#define CONFIG_SDP_WORK_QUEUE_FULL_POLICY 0
+#define CONFIG_SDP_MEDIA_QUEUE_CAPACITY 16
+#define CONFIG_SDP_MEDIA_QUEUE_BLOCK_MS 20
+#define CONFIG_SDP_WORK_DEADLINES 1
+#define CONFIG_SDP_WORK_DEADLINE_MARGIN_MS 500
+#define CONFIG_SDP_WORK_QUEUE_STATS 1
+#define CONFIG_SDP_WORK_QUEUE_STATS_RESET 1
+#define CONFIG_SDP_WORKER_STACK_SIZE 8192
+#define CONFIG_SDP_GSM_TASK_STACK_SIZE 16384
+#define CONFIG_SDP_PRIORITY_WORKER_CORE 1
+#define CONFIG_SDP_PRIORITY_WORKER_TASK_PRIORITY 12
+/* A 64 KiB payload and its preamble */
+#define CONFIG_SDP_FRAGMENT_MAX_LENGTH 65543
+#define CONFIG_SDP_FRAGMENT_SLOTS 2
+#define CONFIG_SDP_FRAGMENT_TIMEOUT_MS 5000
+#define CONFIG_SDP_WORK_ITEM_POOL_SIZE 16
+#define CONFIG_SDP_RECEIVE_BUFFER_POOL_SIZE 8
+#define CONFIG_SDP_RECEIVE_BUFFER_SIZE 256
+#define CONFIG_SDP_PARTS_POOL_SIZE 4
+/* bench_registry registers up to 1024 peers */
+#ifndef CONFIG_SDP_PEER_REGISTRY_SIZE
+#define CONFIG_SDP_PEER_REGISTRY_SIZE 32
+#endif
+#define CONFIG_SDP_RTC_RELATIONS 32
+#define CONFIG_SDP_NVS_RELATIONS 256
+#define CONFIG_SDP_PEER_SNAPSHOT_RTC_SIZE 1024
+#define CONFIG_SDP_CONVERSATION_TABLE_SIZE 32
+#ifndef CONFIG_SDP_CONVERSATION_TIMEOUT_MS
+#define CONFIG_SDP_CONVERSATION_TIMEOUT_MS 30000
+#endif
+#define CONFIG_SDP_TRACE 1
+#define CONFIG_SDP_TRACE_RING_SIZE 128
+#define CONFIG_SDP_FRAME_LOG_LEVEL 2
@@ -0,0 +1,7 @@
+#pragma once
+#include_next <string.h>
+
+/* The ESP-IDF newlib has strlcpy(), glibc only since 2.38, see shim/esp.c */
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size);
+#endif
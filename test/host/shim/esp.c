@@ -0,0 +1,86 @@
+/**
+ * @file esp.c
+ * @brief The ESP-IDF functions the SDP component uses, on the host
+ */
+
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+#include <esp_task_wdt.h>
+#include <driver/gpio.h>
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+esp_log_level_t host_log_level = ESP_LOG_WARN;
+
+void esp_log_level_set(const char *tag, esp_log_level_t level)
+{
+    /* There are no per tag levels */
+    host_log_level = level;
+}
+
+int64_t esp_timer_get_time(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static pthread_mutex_t random_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t random_state = 0x853c49e6748fea9bULL;
+
+/**
+ * @brief Pseudo random, but the same sequence on every run, so that the tests are repeatable
+ */
+uint32_t esp_random(void)
+{
+    pthread_mutex_lock(&random_lock);
+    /* xorshift64* */
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    uint32_t value = (uint32_t)((random_state * 0x2545f4914f6cdd1dULL) >> 32);
+    pthread_mutex_unlock(&random_lock);
+    return value;
+}
+
+int gpio_get_level(gpio_num_t gpio_num)
+{
+    return 0;
+}
+
+esp_err_t gpio_set_level(gpio_num_t gpio_num, uint32_t level)
+{
+    return ESP_OK;
+}
+
+esp_err_t gpio_set_direction(gpio_num_t gpio_num, gpio_mode_t mode)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_init(const esp_task_wdt_config_t *config)
+{
+    return ESP_OK;
+}
+
+esp_err_t esp_task_wdt_deinit(void)
+{
+    return ESP_OK;
+}
+
+#if defined(__GLIBC__) && !__GLIBC_PREREQ(2, 38)
+size_t strlcpy(char *dst, const char *src, size_t size)
+{
+    size_t length = strlen(src);
+    if (size > 0)
+    {
+        size_t copied = length < size - 1 ? length : size - 1;
+        memcpy(dst, src, copied);
+        dst[copied] = 0;
+    }
+    return length;
+}
+#endif
@@ -0,0 +1,418 @@
+/**
+ * @file freertos.c
+ * @brief FreeRTOS on pthreads, enough of it to run the SDP component on the host
+ * Tasks are threads, semaphores and notifications are a mutex and a condition variable,
+ * and timeouts are in milliseconds of CLOCK_MONOTONIC.
+ */
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <string.h>
+#include <time.h>
+
+#define SEMAPHORE_MUTEX 0
+#define SEMAPHORE_COUNTING 1
+
+struct host_semaphore
+{
+    int type;
+    UBaseType_t count;
+    UBaseType_t max_count;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+struct host_task
+{
+    pthread_t thread;
+    TaskFunction_t task_code;
+    void *parameters;
+    char name[configMAX_TASK_NAME_LEN];
+    BaseType_t core_id;
+    uint32_t notification;
+    bool notified;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+static __thread struct host_task *current_task = NULL;
+
+/**
+ * @brief The absolute CLOCK_MONOTONIC time ticks from now
+ */
+static struct timespec deadline_after(TickType_t ticks)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += ticks / 1000;
+    deadline.tv_nsec += (long)(ticks % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return deadline;
+}
+
+/**
+ * @brief Wait on a condition, forever if ticks is portMAX_DELAY
+ * @return false if timed out
+ */
+static bool wait_for(pthread_cond_t *changed, pthread_mutex_t *lock, TickType_t ticks, const struct timespec *deadline)
+{
+    if (ticks == portMAX_DELAY)
+    {
+        pthread_cond_wait(changed, lock);
+        return true;
+    }
+    return pthread_cond_timedwait(changed, lock, deadline) != ETIMEDOUT;
+}
+
+static void init_cond(pthread_cond_t *changed)
+{
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(changed, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+/* Critical sections */
+
+void vPortEnterCritical(portMUX_TYPE *mux)
+{
+    uintptr_t self = (uintptr_t)pthread_self();
+    if (__atomic_load_n(&mux->owner, __ATOMIC_RELAXED) == self)
+    {
+        mux->count++;
+        return;
+    }
+    uintptr_t expected = 0;
+    while (!__atomic_compare_exchange_n(&mux->owner, &expected, self, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        expected = 0;
+        sched_yield();
+    }
+    mux->count = 1;
+}
+
+void vPortExitCritical(portMUX_TYPE *mux)
+{
+    configASSERT(mux->owner == (uintptr_t)pthread_self());
+    if (--mux->count == 0)
+    {
+        __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+    }
+}
+
+BaseType_t xPortGetCoreID(void)
+{
+    return current_task != NULL ? current_task->core_id : 0;
+}
+
+/* Semaphores */
+
+static SemaphoreHandle_t create_semaphore(int type, UBaseType_t max_count, UBaseType_t initial_count)
+{
+    struct host_semaphore *semaphore = malloc(sizeof(struct host_semaphore));
+    if (semaphore == NULL)
+    {
+        return NULL;
+    }
+    semaphore->type = type;
+    semaphore->count = initial_count;
+    semaphore->max_count = max_count;
+    pthread_mutex_init(&semaphore->lock, NULL);
+    init_cond(&semaphore->changed);
+    return semaphore;
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutex(void)
+{
+    return create_semaphore(SEMAPHORE_MUTEX, 1, 1);
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    return create_semaphore(SEMAPHORE_COUNTING, 1, 0);
+}
+
+SemaphoreHandle_t xSemaphoreCreateCounting(UBaseType_t max_count, UBaseType_t initial_count)
+{
+    return create_semaphore(SEMAPHORE_COUNTING, max_count, initial_count);
+}
+
+SemaphoreHandle_t xSemaphoreCreateMutexStatic(StaticSemaphore_t *buffer)
+{
+    return xSemaphoreCreateMutex();
+}
+
+SemaphoreHandle_t xSemaphoreCreateBinaryStatic(StaticSemaphore_t *buffer)
+{
+    return xSemaphoreCreateBinary();
+}
+
+SemaphoreHandle_t xSemaphoreCreateCountingStatic(UBaseType_t max_count, UBaseType_t initial_count,
+                                                 StaticSemaphore_t *buffer)
+{
+    return xSemaphoreCreateCounting(max_count, initial_count);
+}
+
+void vSemaphoreDelete(SemaphoreHandle_t semaphore)
+{
+    pthread_cond_destroy(&semaphore->changed);
+    pthread_mutex_destroy(&semaphore->lock);
+    free(semaphore);
+}
+
+BaseType_t xSemaphoreTake(SemaphoreHandle_t semaphore, TickType_t ticks_to_wait)
+{
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    BaseType_t result = pdTRUE;
+    pthread_mutex_lock(&semaphore->lock);
+    while (semaphore->count == 0)
+    {
+        if ((ticks_to_wait == 0) || !wait_for(&semaphore->changed, &semaphore->lock, ticks_to_wait, &deadline))
+        {
+            result = pdFALSE;
+            break;
+        }
+    }
+    if (result == pdTRUE)
+    {
+        semaphore->count--;
+    }
+    pthread_mutex_unlock(&semaphore->lock);
+    return result;
+}
+
+BaseType_t xSemaphoreGive(SemaphoreHandle_t semaphore)
+{
+    BaseType_t result = pdFALSE;
+    pthread_mutex_lock(&semaphore->lock);
+    if (semaphore->count < semaphore->max_count)
+    {
+        semaphore->count++;
+        pthread_cond_signal(&semaphore->changed);
+        result = pdTRUE;
+    }
+    pthread_mutex_unlock(&semaphore->lock);
+    return result;
+}
+
+BaseType_t xSemaphoreGiveFromISR(SemaphoreHandle_t semaphore, BaseType_t *higher_priority_task_woken)
+{
+    if (higher_priority_task_woken != NULL)
+    {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    return xSemaphoreGive(semaphore);
+}
+
+UBaseType_t uxSemaphoreGetCount(SemaphoreHandle_t semaphore)
+{
+    pthread_mutex_lock(&semaphore->lock);
+    UBaseType_t count = semaphore->count;
+    pthread_mutex_unlock(&semaphore->lock);
+    return count;
+}
+
+/* Tasks */
+
+static struct host_task *new_task(const char *name, BaseType_t core_id)
+{
+    struct host_task *task = calloc(1, sizeof(struct host_task));
+    if (task == NULL)
+    {
+        return NULL;
+    }
+    strncpy(task->name, name, configMAX_TASK_NAME_LEN - 1);
+    task->core_id = (core_id == tskNO_AFFINITY) ? 0 : core_id;
+    pthread_mutex_init(&task->lock, NULL);
+    init_cond(&task->changed);
+    return task;
+}
+
+static void *run_task(void *arg)
+{
+    current_task = arg;
+    current_task->task_code(current_task->parameters);
+    return NULL;
+}
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                                   UBaseType_t priority, TaskHandle_t *created_task, BaseType_t core_id)
+{
+    struct host_task *task = new_task(name, core_id);
+    if (task == NULL)
+    {
+        return pdFAIL;
+    }
+    task->task_code = task_code;
+    task->parameters = parameters;
+    if (created_task != NULL)
+    {
+        *created_task = task;
+    }
+    if (pthread_create(&task->thread, NULL, run_task, task) != 0)
+    {
+        free(task);
+        return pdFAIL;
+    }
+    pthread_detach(task->thread);
+    return pdPASS;
+}
+
+BaseType_t xTaskCreate(TaskFunction_t task_code, const char *name, uint32_t stack_depth, void *parameters,
+                       UBaseType_t priority, TaskHandle_t *created_task)
+{
+    return xTaskCreatePinnedToCore(task_code, name, stack_depth, parameters, priority, created_task, tskNO_AFFINITY);
+}
+
+void vTaskDelete(TaskHandle_t task)
+{
+    configASSERT((task == NULL) || (task == current_task));
+    pthread_exit(NULL);
+}
+
+void vTaskDelay(TickType_t ticks)
+{
+    struct timespec delay = {.tv_sec = ticks / 1000, .tv_nsec = (long)(ticks % 1000) * 1000000L};
+    if (ticks == 0)
+    {
+        sched_yield();
+        return;
+    }
+    while (nanosleep(&delay, &delay) != 0)
+    {
+    }
+}
+
+TickType_t xTaskGetTickCount(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (TickType_t)(now.tv_sec * 1000 + now.tv_nsec / 1000000L);
+}
+
+TaskHandle_t xTaskGetCurrentTaskHandle(void)
+{
+    /* Threads that were not created as tasks, like main(), become tasks when they first need to be one */
+    if (current_task == NULL)
+    {
+        current_task = new_task("main", 0);
+        current_task->thread = pthread_self();
+    }
+    return current_task;
+}
+
+char *pcTaskGetName(TaskHandle_t task)
+{
+    return (task != NULL ? task : xTaskGetCurrentTaskHandle())->name;
+}
+
+UBaseType_t uxTaskGetStackHighWaterMark(TaskHandle_t task)
+{
+    return 0;
+}
+
+/* Notifications */
+
+uint32_t ulTaskNotifyTake(BaseType_t clear_on_exit, TickType_t ticks_to_wait)
+{
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    pthread_mutex_lock(&task->lock);
+    while ((task->notification == 0) && (ticks_to_wait != 0) &&
+           wait_for(&task->changed, &task->lock, ticks_to_wait, &deadline))
+    {
+    }
+    uint32_t value = task->notification;
+    if (value != 0)
+    {
+        task->notification = clear_on_exit ? 0 : value - 1;
+    }
+    task->notified = false;
+    pthread_mutex_unlock(&task->lock);
+    return value;
+}
+
+BaseType_t xTaskNotify(TaskHandle_t task, uint32_t value, eNotifyAction action)
+{
+    BaseType_t result = pdPASS;
+    pthread_mutex_lock(&task->lock);
+    switch (action)
+    {
+    case eSetBits:
+        task->notification |= value;
+        break;
+    case eIncrement:
+        task->notification++;
+        break;
+    case eSetValueWithOverwrite:
+        task->notification = value;
+        break;
+    case eSetValueWithoutOverwrite:
+        if (task->notified)
+        {
+            result = pdFAIL;
+        }
+        else
+        {
+            task->notification = value;
+        }
+        break;
+    default:
+        break;
+    }
+    task->notified = true;
+    pthread_cond_signal(&task->changed);
+    pthread_mutex_unlock(&task->lock);
+    return result;
+}
+
+BaseType_t xTaskNotifyGive(TaskHandle_t task)
+{
+    return xTaskNotify(task, 0, eIncrement);
+}
+
+void vTaskNotifyGiveFromISR(TaskHandle_t task, BaseType_t *higher_priority_task_woken)
+{
+    if (higher_priority_task_woken != NULL)
+    {
+        *higher_priority_task_woken = pdFALSE;
+    }
+    xTaskNotifyGive(task);
+}
+
+BaseType_t xTaskNotifyWait(uint32_t clear_on_entry, uint32_t clear_on_exit, uint32_t *value, TickType_t ticks_to_wait)
+{
+    struct host_task *task = xTaskGetCurrentTaskHandle();
+    struct timespec deadline = deadline_after(ticks_to_wait);
+    pthread_mutex_lock(&task->lock);
+    if (!task->notified)
+    {
+        task->notification &= ~clear_on_entry;
+    }
+    while (!task->notified && (ticks_to_wait != 0) &&
+           wait_for(&task->changed, &task->lock, ticks_to_wait, &deadline))
+    {
+    }
+    BaseType_t result = task->notified ? pdTRUE : pdFALSE;
+    if (value != NULL)
+    {
+        *value = task->notification;
+    }
+    if (task->notified)
+    {
+        task->notification &= ~clear_on_exit;
+        task->notified = false;
+    }
+    pthread_mutex_unlock(&task->lock);
+    return result;
+}
@@ -0,0 +1,239 @@
+/**
+ * @file test_builder.c
+ * @brief Messages are built with sdp_builder_add() and add_to_message(), see sdp_helpers.c
+ * Checks the sections that text, %-formats, 64-bit arguments and %b byte arrays make, that a bare %b
+ * or a too long one is refused, that a message that overflows its buffer keeps being measured but is
+ * not written past the buffer, and that sdp_builder_finish() then refuses it. Also that the preamble
+ * is written in its slot.
+ *
+ * Also reports the MB/s and the heap allocations per message of building a HI message with a builder
+ * on the stack, and with add_to_message().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_log.h>
+
+#include "sdp_helpers.h"
+#include "sdp_crc.h"
+
+#define BENCH_MESSAGES 1000000
+/* Bytes after a buffer that must not be written */
+#define GUARD_LENGTH 16
+#define GUARD 0xa5
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Allocation counting, see the Makefile */
+
+void *__real_malloc(size_t size);
+
+static uint32_t malloc_count = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    __atomic_add_fetch(&malloc_count, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+
+/* The tests */
+
+static void check_payload(const char *what, const uint8_t *payload, int length, const void *expected,
+                          int expected_length)
+{
+    CHECK(length == expected_length, "%s, the payload is %i bytes, not %i.", what, length, expected_length);
+    CHECK((length != expected_length) || (memcmp(payload, expected, length) == 0),
+          "%s, the payload differs.", what);
+}
+
+static void test_sections()
+{
+    uint8_t buffer[64];
+    sdp_message_builder builder;
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    int length = sdp_builder_add(&builder, "TEMP|%i|%s|%.1f C|%x", -12, "outdoor", 21.25, 0xbeef);
+    const char expected[] = "TEMP\0-12\0outdoor\0" "21.2 C\0beef";
+    check_payload("Text and formats", buffer, length, expected, sizeof(expected));
+    CHECK(sdp_builder_finish(&builder, 0, 0) == length, "Finishing without a preamble changed the length.");
+
+    /* Sections are appended over several calls */
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    sdp_builder_add(&builder, "A|%i", 1);
+    length = sdp_builder_add(&builder, "B");
+    check_payload("Added twice", buffer, length, "A\0001\0B", 6);
+}
+
+static void test_64_bit()
+{
+    uint8_t buffer[96];
+    sdp_message_builder builder;
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    /* 32-bit arguments around the 64-bit ones, so that a wrongly fetched argument shifts the rest */
+    int length = sdp_builder_add(&builder, "%i|%" PRIu64 "|%hhu|%" PRId64 "|%lu|%i", 7, UINT64_MAX,
+                                 (unsigned char)200, INT64_MIN, 4000000000UL, -1);
+    const char expected[] = "7\00018446744073709551615\000200\0-9223372036854775808\0004000000000\0-1";
+    check_payload("64-bit arguments", buffer, length, expected, sizeof(expected));
+
+    /* The NEXT message of orchestration.c */
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    length = sdp_builder_add(&builder, "NEXT|%" PRIu64 "|%i", (uint64_t)5000000000ULL, 4000000);
+    const char next[] = "NEXT\0005000000000\0004000000";
+    check_payload("NEXT", buffer, length, next, sizeof(next));
+}
+
+static void test_byte_arrays()
+{
+    uint8_t buffer[64];
+    sdp_message_builder builder;
+    const uint8_t mac_address[6] = {0x24, 0x00, 0x28, 0x00, 0xff, 0x01};
+    const uint8_t one = 0;
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    int length = sdp_builder_add(&builder, "MAC|%b6|%b1|%i", mac_address, &one, 5);
+    const uint8_t expected[] = {'M', 'A', 'C', 0, 0x24, 0x00, 0x28, 0x00, 0xff, 0x01, 0, 0, 0, '5', 0};
+    check_payload("Byte arrays", buffer, length, expected, sizeof(expected));
+
+    /* Without a length it is refused, as with the first add_to_message() */
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    length = sdp_builder_add(&builder, "MAC|%b|%i", mac_address, 5);
+    CHECK(length == -SDP_ERR_PARSING_FAILED, "A bare %%b returned %i, not %i.", length, -SDP_ERR_PARSING_FAILED);
+    CHECK(sdp_builder_finish(&builder, 0, 0) == -SDP_ERR_PARSING_FAILED, "A refused message was finished.");
+    uint8_t *message = NULL;
+    length = add_to_message(&message, "%b", mac_address);
+    CHECK(length == -SDP_ERR_PARSING_FAILED, "add_to_message() of a bare %%b returned %i.", length);
+
+    /* At most 7 digits */
+    sdp_builder_init(&builder, buffer, sizeof(buffer), false);
+    length = sdp_builder_add(&builder, "%b12345678", mac_address);
+    CHECK(length == -SDP_ERR_PARSING_FAILED, "A %%b of 8 digits returned %i.", length);
+}
+
+static void test_overflow()
+{
+    uint8_t buffer[24 + GUARD_LENGTH];
+    sdp_message_builder builder;
+    const char *format = "OVERFLOW|%s|%" PRIu64 "|%b6|end";
+    const char *text = "a string that does not fit";
+    const uint8_t mac_address[6] = {1, 2, 3, 4, 5, 6};
+
+    /* Measured */
+    sdp_builder_init(&builder, NULL, 0, false);
+    int measured = sdp_builder_add(&builder, format, text, UINT64_MAX, mac_address);
+
+    for (int capacity = 0; capacity < 24; capacity++)
+    {
+        memset(buffer, GUARD, sizeof(buffer));
+        sdp_builder_init(&builder, buffer, capacity, true);
+        int length = sdp_builder_add(&builder, format, text, UINT64_MAX, mac_address);
+        CHECK(length == measured, "Over %i bytes the length was %i, measuring gave %i.", capacity, length, measured);
+        int written = 0;
+        for (int i = capacity; i < sizeof(buffer); i++)
+        {
+            written += buffer[i] != GUARD;
+        }
+        CHECK(written == 0, "%i bytes past the %i byte buffer were written.", written, capacity);
+        length = sdp_builder_finish(&builder, DATA, 1);
+        CHECK(length == -SDP_ERR_MESSAGE_TOO_LONG, "Finishing over %i bytes returned %i.", capacity, length);
+    }
+}
+
+static void test_preamble()
+{
+    uint8_t buffer[SDP_PREAMBLE_LENGTH + 32];
+    sdp_message_builder builder;
+    sdp_builder_init(&builder, buffer, sizeof(buffer), true);
+    int payload_length = sdp_builder_add(&builder, "HI|%i", 42);
+    int length = sdp_builder_finish(&builder, HANDSHAKE, 0x0102);
+    CHECK(length == SDP_PREAMBLE_LENGTH + payload_length, "The message is %i bytes, not %i.", length,
+          SDP_PREAMBLE_LENGTH + payload_length);
+    CHECK(memcmp(buffer + SDP_PREAMBLE_LENGTH, "HI\00042", payload_length) == 0, "The payload moved.");
+    CHECK(buffer[4] == HANDSHAKE, "The work type is %hhu, not %i.", buffer[4], HANDSHAKE);
+    CHECK(buffer[5] == 0x02, "The conversation id begins with %hhu, not 2.", buffer[5]);
+    CHECK(buffer[6] == 0x01, "The conversation id ends with %hhu, not 1.", buffer[6]);
+    CHECK(sdp_frame_crc(buffer) == sdp_frame_crc_calc(buffer, length), "The CRC of the preamble is wrong.");
+
+    /* Exactly filling the buffer is not an overflow */
+    sdp_builder_init(&builder, buffer, SDP_PREAMBLE_LENGTH + payload_length, true);
+    sdp_builder_add(&builder, "HI|%i", 42);
+    CHECK(sdp_builder_finish(&builder, HANDSHAKE, 0) == SDP_PREAMBLE_LENGTH + payload_length,
+          "A message that fills the buffer was refused.");
+}
+
+/* The benchmark */
+
+static const uint8_t bench_mac_address[6] = {0x24, 0x6f, 0x28, 0x10, 0x20, 0x30};
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Build a HI message like sdp_peer_send_hi_message(), in a builder on the stack or with add_to_message()
+ */
+static int build_hi(bool allocate)
+{
+    if (allocate)
+    {
+        uint8_t *message = NULL;
+        int length = add_to_message(&message, "HI|%u|%u|%s|%hhu|%" PRIu32 "|%hhu|%b6", 2, 1, "controller",
+                                    (unsigned char)7, (uint32_t)0x12345678, (unsigned char)0, bench_mac_address);
+        free(message);
+        return length;
+    }
+    uint8_t message[SDP_PREAMBLE_LENGTH + 64];
+    sdp_message_builder builder;
+    sdp_builder_init(&builder, message, sizeof(message), true);
+    sdp_builder_add(&builder, "HI|%u|%u|%s|%hhu|%" PRIu32 "|%hhu|%b6", 2, 1, "controller", (unsigned char)7,
+                    (uint32_t)0x12345678, (unsigned char)0, bench_mac_address);
+    return sdp_builder_finish(&builder, HANDSHAKE, 0);
+}
+
+static void bench_hi(bool allocate)
+{
+    int64_t bytes = 0;
+    uint32_t mallocs_before = malloc_count;
+    int64_t started = now_ns();
+    for (int i = 0; i < BENCH_MESSAGES; i++)
+    {
+        bytes += build_hi(allocate);
+    }
+    int64_t elapsed = now_ns() - started;
+    double mallocs = (double)(malloc_count - mallocs_before) / BENCH_MESSAGES;
+    printf("HI message, %-14s %6.1f MB/s, %8.0f messages/s, %.2f allocations per message.\n",
+           allocate ? "add_to_message" : "builder", bytes * 1000.0 / elapsed, BENCH_MESSAGES * 1e9 / elapsed,
+           mallocs);
+    if (!allocate)
+    {
+        CHECK(mallocs == 0, "The builder allocated %.2f times per message.", mallocs);
+    }
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_NONE);
+    test_sections();
+    test_64_bit();
+    test_byte_arrays();
+    test_overflow();
+    test_preamble();
+    bench_hi(false);
+    bench_hi(true);
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,135 @@
+/**
+ * @file test_conversation.c
+ * @brief The conversation table of sdp_messaging.c references the peer of each conversation, so that
+ * the peer is not freed while the conversation is in the table, see sdp_mesh_peer_ref().
+ *
+ * Checks that the reference is taken once when a conversation is added, also when the peer replies to it,
+ * and released when it is ended, when find_conversation() finds it expired, and when it is pruned. Also
+ * that a full table refuses a conversation without referencing the peer.
+ * The conversations time out after CONFIG_SDP_CONVERSATION_TIMEOUT_MS, see the Makefile.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <esp_log.h>
+
+#include "sdp_messaging.h"
+#include "sdp_mesh.h"
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Not in sdp_messaging.h, handle_incoming() adds the conversations of incoming requests */
+int safe_add_conversation(sdp_peer *peer, const char *reason, int conversation_id);
+
+/* The parts of sdp_peer.c that sdp_mesh.c uses */
+
+void sdp_peer_init_peer(sdp_peer *peer)
+{
+}
+
+void sdp_peer_init(char *_log_prefix)
+{
+}
+
+static sdp_peer peers[2];
+
+/* Sleep past the timeout of the conversations */
+static void expire()
+{
+    usleep((CONFIG_SDP_CONVERSATION_TIMEOUT_MS + 5) * 1000);
+}
+
+static void test_end()
+{
+    sdp_peer *peer = &peers[0];
+    int local_id = safe_add_conversation(peer, "local", -1);
+    CHECK(local_id >= 0, "Adding a local conversation failed: %i.", local_id);
+    CHECK(peer->ref_count == 1, "A conversation gave %u references, not 1.", peer->ref_count);
+    /* The peer replies */
+    CHECK(safe_add_conversation(peer, "reply", local_id) == local_id, "The reply got another conversation.");
+    CHECK(peer->ref_count == 1, "A reply gave %u references, not 1.", peer->ref_count);
+    CHECK(safe_add_conversation(peer, "external", 1000) == 1000, "Adding an external conversation failed.");
+    CHECK(peer->ref_count == 2, "Two conversations gave %u references, not 2.", peer->ref_count);
+
+    CHECK(find_conversation(peer, local_id) != NULL, "The local conversation was not found.");
+    CHECK(end_conversation(peer, local_id) == SDP_OK, "Ending the local conversation failed.");
+    CHECK(peer->ref_count == 1, "Ending a conversation left %u references, not 1.", peer->ref_count);
+    CHECK(end_conversation(peer, local_id) != SDP_OK, "The local conversation was ended twice.");
+    CHECK(peer->ref_count == 1, "Ending a conversation twice left %u references, not 1.", peer->ref_count);
+    CHECK(end_conversation(peer, 1000) == SDP_OK, "Ending the external conversation failed.");
+    CHECK(peer->ref_count == 0, "Ending both conversations left %u references.", peer->ref_count);
+}
+
+static void test_expired()
+{
+    sdp_peer *peer = &peers[0];
+    int conversation_id = safe_add_conversation(peer, "found", -1);
+    expire();
+    CHECK(find_conversation(peer, conversation_id) == NULL, "An expired conversation was found.");
+    CHECK(peer->ref_count == 0, "An expired conversation that was looked up left %u references.",
+          peer->ref_count);
+}
+
+static void test_pruned()
+{
+    /* Conversations of one peer expire, while the other one keeps adding */
+    for (int i = 0; i < CONFIG_SDP_CONVERSATION_TABLE_SIZE / 2; i++)
+    {
+        safe_add_conversation(&peers[0], "pruned", -1);
+    }
+    CHECK(peers[0].ref_count == CONFIG_SDP_CONVERSATION_TABLE_SIZE / 2, "%u references, not %i.",
+          peers[0].ref_count, CONFIG_SDP_CONVERSATION_TABLE_SIZE / 2);
+    expire();
+    for (int i = 0; i < CONFIG_SDP_CONVERSATION_TABLE_SIZE; i++)
+    {
+        CHECK(safe_add_conversation(&peers[1], "filling", -1) >= 0, "Conversation %i was refused.", i);
+    }
+    CHECK(peers[0].ref_count == 0, "Pruned conversations left %u references.", peers[0].ref_count);
+    CHECK(peers[1].ref_count == CONFIG_SDP_CONVERSATION_TABLE_SIZE, "%u references, not %i.",
+          peers[1].ref_count, CONFIG_SDP_CONVERSATION_TABLE_SIZE);
+
+    /* The table is full of live conversations */
+    CHECK(safe_add_conversation(&peers[0], "refused", -1) < 0, "A full table took a conversation.");
+    CHECK(peers[0].ref_count == 0, "A refused conversation left %u references.", peers[0].ref_count);
+
+    expire();
+    /* Looks through all of the full table, and prunes it */
+    CHECK(safe_add_conversation(&peers[0], "last", -1) >= 0, "An expired table was not pruned.");
+    CHECK(peers[0].ref_count == 1, "The last conversation gave %u references, not 1.", peers[0].ref_count);
+    CHECK(peers[1].ref_count == 0, "A pruned table left %u references.", peers[1].ref_count);
+}
+
+static void test_no_peer()
+{
+    /* Broadcasts have conversations without a peer */
+    int conversation_id = safe_add_conversation(NULL, "broadcast", -1);
+    CHECK(conversation_id >= 0, "Adding a conversation without a peer failed.");
+    CHECK(end_conversation(NULL, conversation_id) == SDP_OK, "Ending a conversation without a peer failed.");
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_NONE);
+    sdp_init_messaging("Messaging", NULL);
+    peers[0].peer_handle = 1;
+    peers[1].peer_handle = 2;
+    test_end();
+    test_expired();
+    test_pruned();
+    test_no_peer();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,111 @@
+/**
+ * @file test_crc.c
+ * @brief Checks the host implementation of sdp_crc32() against a bit at a time reference, see sdp_crc.c
+ * The reference is the big endian CRC32 of the ESP32 ROM crc32_be(), polynomial 0x04C11DB7, inverted in and out.
+ * Lengths around the eight byte steps are checked at every alignment, as is continuing a CRC over split buffers.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include <esp_random.h>
+
+#include "sdp_crc.h"
+#include "sdp_def.h"
+
+#define BUFFER_LENGTH 1024
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/**
+ * @brief The CRC a bit at a time, as crc32_be() computes it
+ */
+static uint32_t reference_crc32(uint32_t crc, const uint8_t *data, size_t length)
+{
+    crc = ~crc;
+    while (length--)
+    {
+        crc ^= (uint32_t)*data++ << 24;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : (crc << 1);
+        }
+    }
+    return ~crc;
+}
+
+static uint8_t buffer[BUFFER_LENGTH + 8];
+
+static void test_check_value()
+{
+    /* The check value of CRC-32/BZIP2, which is this CRC */
+    uint32_t crc = sdp_crc32(0, "123456789", 9);
+    CHECK(crc == 0xFC891918, "The CRC of \"123456789\" is 0x%08"PRIX32", not 0xFC891918.", crc);
+    CHECK(sdp_crc32(0, buffer, 0) == 0, "The CRC of nothing is not 0.");
+    CHECK(sdp_crc32(0x12345678, buffer, 0) == 0x12345678, "The CRC of nothing does not keep the given CRC.");
+}
+
+static void test_reference()
+{
+    int mismatches = 0;
+    for (int offset = 0; offset < 8; offset++)
+    {
+        for (int length = 0; length <= 80; length++)
+        {
+            mismatches += sdp_crc32(0, buffer + offset, length) != reference_crc32(0, buffer + offset, length);
+        }
+        for (int length = BUFFER_LENGTH - 9; length <= BUFFER_LENGTH; length++)
+        {
+            mismatches += sdp_crc32(0, buffer + offset, length) != reference_crc32(0, buffer + offset, length);
+        }
+    }
+    CHECK(mismatches == 0, "%i CRCs differ from the reference.", mismatches);
+}
+
+/**
+ * @brief The CRC of a buffer is the CRC of its second part, continued from the CRC of its first part
+ */
+static void test_split()
+{
+    int mismatches = 0;
+    uint32_t whole = reference_crc32(0, buffer, BUFFER_LENGTH);
+    for (int split = 0; split <= BUFFER_LENGTH; split++)
+    {
+        uint32_t crc = sdp_crc32(0, buffer, split);
+        mismatches += sdp_crc32(crc, buffer + split, BUFFER_LENGTH - split) != whole;
+    }
+    /* As the frames are checksummed, the preamble after the CRC field, then the payload in segments */
+    uint32_t crc = sdp_crc32(0, buffer + SDP_CRC_LENGTH, SDP_PREAMBLE_LENGTH - SDP_CRC_LENGTH);
+    for (int position = SDP_PREAMBLE_LENGTH; position < BUFFER_LENGTH; position += 13)
+    {
+        int length = BUFFER_LENGTH - position < 13 ? BUFFER_LENGTH - position : 13;
+        crc = sdp_crc32(crc, buffer + position, length);
+    }
+    mismatches += crc != sdp_frame_crc_calc(buffer, BUFFER_LENGTH);
+    CHECK(mismatches == 0, "%i CRCs continued over split buffers differ from the CRC of the whole.", mismatches);
+}
+
+int main()
+{
+    for (int i = 0; i < sizeof(buffer); i++)
+    {
+        buffer[i] = (uint8_t)esp_random();
+    }
+    test_check_value();
+    test_reference();
+    test_split();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
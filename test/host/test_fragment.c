@@ -0,0 +1,380 @@
+/**
+ * @file test_fragment.c
+ * @brief Sends a 64 KiB payload in fragments over a lossy loopback, see sdp_fragment.c
+ * The loopback stands in for the messaging layer: sdp_send_message_media_type_v() and sdp_send_ack_v()
+ * queue the frame, losing some of them, and a receiver task passes them to handle_incoming(), which
+ * checks the CRC and hands fragments and statuses back to sdp_fragment.c, like sdp_messaging.c does.
+ * Fragments and status frames are lost at given rates, each from its own repeatable random sequence.
+ *
+ * Checks that the reassembled frame is identical to the one sent, that the receiver holds no more than
+ * the one frame in memory and frees it, and that frames over CONFIG_SDP_FRAGMENT_MAX_LENGTH are refused.
+ * Also sends over LoRa to a peer addressed by mac addresses, checking that no frame exceeds the radio payload.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_random.h>
+
+#include "sdp_fragment.h"
+#include "sdp_messaging.h"
+#include "sdp_helpers.h"
+#include "sdp_send.h"
+#include "sdp_crc.h"
+
+/* The payload of the test frame, the frame is this and the preamble */
+#define PAYLOAD_LENGTH (64 * 1024)
+#define FRAME_LENGTH (SDP_PREAMBLE_LENGTH + PAYLOAD_LENGTH)
+/* The SX126x/SX127x payload length is 8 bit, see lora_send_message() */
+#define LORA_MAX_PAYLOAD 255
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Memory, counted by wrapping malloc() and free() at link time, see the Makefile */
+
+void *__real_malloc(size_t size);
+void __real_free(void *ptr);
+
+static int64_t heap_in_use = 0;
+static int64_t heap_peak = 0;
+
+void *__wrap_malloc(size_t size)
+{
+    void *ptr = __real_malloc(size);
+    if (ptr != NULL)
+    {
+        int64_t in_use = __atomic_add_fetch(&heap_in_use, (int64_t)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+        int64_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED);
+        while ((in_use > peak) &&
+               !__atomic_compare_exchange_n(&heap_peak, &peak, in_use, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+        }
+    }
+    return ptr;
+}
+
+void __wrap_free(void *ptr)
+{
+    if (ptr != NULL)
+    {
+        __atomic_sub_fetch(&heap_in_use, (int64_t)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+    }
+    __real_free(ptr);
+}
+
+/* The loopback */
+
+typedef struct loopback_frame
+{
+    struct loopback_frame *next;
+    int length;
+    uint8_t data[];
+} loopback_frame;
+
+static loopback_frame *queue_head = NULL;
+static loopback_frame *queue_tail = NULL;
+static portMUX_TYPE queue_mux = portMUX_INITIALIZER_UNLOCKED;
+static SemaphoreHandle_t queue_count = NULL;
+
+/* Per thousand frames that are lost, of fragments and of statuses */
+static uint32_t fragment_loss = 0;
+static uint32_t status_loss = 0;
+/* Separate sequences for the two directions, so that thread timing does not change what is lost */
+static uint64_t fragment_random = 1;
+static uint64_t status_random = 2;
+/* Statuses to lose before the rate applies again */
+static int statuses_to_lose = 0;
+static int lost_fragments = 0;
+static int lost_statuses = 0;
+static int sent_frames = 0;
+
+static sdp_peer test_peer;
+/* The media the fragments are sent and received on */
+static e_media_type media_type = SDP_MT_ESPNOW;
+static uint8_t *expected_frame = NULL;
+static int delivered_length = 0;
+static bool delivered_ok = false;
+static SemaphoreHandle_t delivered = NULL;
+
+static bool lose(uint64_t *state, uint32_t rate)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return ((*state >> 33) % 1000) < rate;
+}
+
+/**
+ * @brief The length of a frame on the air, LoRa frames begin with the addressing, as in lora_send_message()
+ */
+static int air_length(const sdp_peer *peer, int length)
+{
+    if (media_type != SDP_MT_LoRa)
+    {
+        return length;
+    }
+    return length + (peer->state != PEER_UNKNOWN ? sizeof(peer->relation_id) : SDP_MAC_ADDR_LEN * 2);
+}
+
+/**
+ * @brief Put a frame on the loopback, the frames themselves are not counted as memory used by SDP
+ */
+static int loopback_send(const sdp_iovec_t *iov, int iovcnt, uint32_t rate, uint64_t *random_state, int *lost)
+{
+    int length = sdp_iovec_length(iov, iovcnt);
+    if (length > sdp_fragment_mtu(media_type))
+    {
+        printf("FAIL: A %i byte frame is longer than the MTU.\n", length);
+        failures++;
+        return -SDP_ERR_MESSAGE_TOO_LONG;
+    }
+    if ((media_type == SDP_MT_LoRa) && (air_length(&test_peer, length) > LORA_MAX_PAYLOAD))
+    {
+        printf("FAIL: A %i byte frame is %i bytes with the LoRa addressing.\n", length, air_length(&test_peer, length));
+        failures++;
+        return -SDP_ERR_MESSAGE_TOO_LONG;
+    }
+    __atomic_add_fetch(&sent_frames, 1, __ATOMIC_RELAXED);
+    if (lose(random_state, rate))
+    {
+        (*lost)++;
+        return SDP_OK;
+    }
+    loopback_frame *frame = __real_malloc(sizeof(loopback_frame) + length);
+    frame->next = NULL;
+    frame->length = sdp_iovec_gather(frame->data, length, iov, iovcnt);
+
+    portENTER_CRITICAL(&queue_mux);
+    if (queue_tail == NULL)
+    {
+        queue_head = frame;
+    }
+    else
+    {
+        queue_tail->next = frame;
+    }
+    queue_tail = frame;
+    portEXIT_CRITICAL(&queue_mux);
+    xSemaphoreGive(queue_count);
+    return SDP_OK;
+}
+
+/* Fragments */
+int sdp_send_message_media_type_v(struct sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt, e_media_type send_media_type,
+                                  bool just_checking)
+{
+    int result = loopback_send(iov, iovcnt, fragment_loss, &fragment_random, &lost_fragments);
+    return result == SDP_OK ? send_media_type : result;
+}
+
+/* Statuses, from the receiver task, in acknowledgement slots */
+int sdp_send_ack_v(sdp_peer *peer, const sdp_iovec_t *iov, int iovcnt)
+{
+    if (sdp_iovec_length(iov, iovcnt) > SDP_SEND_ACK_MAX_LENGTH)
+    {
+        printf("FAIL: A %i byte status does not fit an acknowledgement slot.\n", sdp_iovec_length(iov, iovcnt));
+        failures++;
+        return -SDP_ERR_OUT_OF_MEMORY;
+    }
+    if (statuses_to_lose > 0)
+    {
+        statuses_to_lose--;
+        lost_statuses++;
+        return SDP_OK;
+    }
+    return loopback_send(iov, iovcnt, status_loss, &status_random, &lost_statuses);
+}
+
+void sdp_write_preamble_v(uint8_t *preamble, e_work_type work_type, uint16_t conversation_id,
+                          const sdp_iovec_t *payload, int iovcnt)
+{
+    /* As in sdp_messaging.c */
+    preamble[SDP_CRC_LENGTH] = (uint8_t)work_type;
+    memcpy(preamble + SDP_CRC_LENGTH + 1, &conversation_id, sizeof(conversation_id));
+    uint32_t crc32 = sdp_crc32(0, preamble + SDP_CRC_LENGTH, SDP_PREAMBLE_LENGTH - SDP_CRC_LENGTH);
+    crc32 = sdp_iovec_crc32(crc32, payload, iovcnt);
+    memcpy(preamble, &crc32, SDP_CRC_LENGTH);
+}
+
+int handle_incoming(sdp_peer *peer, const uint8_t *data, int data_len, e_media_type incoming_media_type)
+{
+    if ((data_len < SDP_PREAMBLE_LENGTH) || (sdp_frame_crc(data) != sdp_frame_crc_calc(data, data_len)))
+    {
+        printf("FAIL: A %i byte frame failed the CRC check.\n", data_len);
+        failures++;
+        return -SDP_ERR_INVALID_PARAM;
+    }
+    switch (data[SDP_CRC_LENGTH])
+    {
+    case FRAGMENT:
+        return sdp_fragment_on_fragment(peer, data, data_len, incoming_media_type);
+    case FRAGMENT_STATUS:
+        return sdp_fragment_on_status(peer, data, data_len);
+    default:
+        delivered_length = data_len;
+        delivered_ok = (data_len == FRAME_LENGTH) && (memcmp(data, expected_frame, FRAME_LENGTH) == 0);
+        xSemaphoreGive(delivered);
+        return SDP_OK;
+    }
+}
+
+static void receiver_task(void *arg)
+{
+    for (;;)
+    {
+        xSemaphoreTake(queue_count, portMAX_DELAY);
+        portENTER_CRITICAL(&queue_mux);
+        loopback_frame *frame = queue_head;
+        queue_head = frame->next;
+        if (queue_head == NULL)
+        {
+            queue_tail = NULL;
+        }
+        portEXIT_CRITICAL(&queue_mux);
+        handle_incoming(&test_peer, frame->data, frame->length, media_type);
+        __real_free(frame);
+    }
+}
+
+/**
+ * @brief Send the test frame over the loopback, and check what arrived
+ * @param rate Per thousand fragments that are lost
+ * @param rate_of_statuses Per thousand statuses that are lost
+ * @param expect_sent If the sender is expected to learn that all fragments arrived
+ */
+static void send_frame(uint32_t rate, uint32_t rate_of_statuses, bool expect_sent)
+{
+    uint8_t preamble[SDP_PREAMBLE_LENGTH];
+    sdp_iovec_t iov[3] = {{.base = preamble, .length = SDP_PREAMBLE_LENGTH},
+                          {.base = expected_frame + SDP_PREAMBLE_LENGTH, .length = PAYLOAD_LENGTH / 3},
+                          {.base = expected_frame + SDP_PREAMBLE_LENGTH + PAYLOAD_LENGTH / 3,
+                           .length = PAYLOAD_LENGTH - PAYLOAD_LENGTH / 3}};
+    sdp_write_preamble_v(preamble, DATA, 42, &iov[1], 2);
+    memcpy(expected_frame, preamble, SDP_PREAMBLE_LENGTH);
+
+    fragment_loss = rate;
+    status_loss = rate_of_statuses;
+    lost_fragments = 0;
+    lost_statuses = 0;
+    sent_frames = 0;
+    delivered_ok = false;
+    delivered_length = 0;
+    xSemaphoreTake(delivered, 0);
+    int64_t heap_before = __atomic_load_n(&heap_in_use, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap_peak, heap_before, __ATOMIC_RELAXED);
+
+    int result = sdp_fragment_send(&test_peer, iov, 3, media_type, false);
+    bool arrived = xSemaphoreTake(delivered, 2000) == pdTRUE;
+    /* Let the receiver finish with the last frames */
+    vTaskDelay(20);
+
+    int64_t peak = __atomic_load_n(&heap_peak, __ATOMIC_RELAXED) - heap_before;
+    int64_t left = __atomic_load_n(&heap_in_use, __ATOMIC_RELAXED) - heap_before;
+    printf("Loss %2"PRIu32".%"PRIu32"%%/%3"PRIu32".%"PRIu32"%%: result %i, %i frames sent, %i fragments and %i statuses lost, "
+           "peak heap %"PRId64" bytes.\n", rate / 10, rate % 10, rate_of_statuses / 10,
+           rate_of_statuses % 10, result, sent_frames, lost_fragments, lost_statuses, peak);
+
+    if (expect_sent)
+    {
+        CHECK(result == media_type, "Sending at %"PRIu32" per mille loss returned %i.", rate, result);
+    }
+    CHECK(arrived, "Nothing was delivered at %"PRIu32" per mille loss.", rate);
+    CHECK(delivered_ok, "The delivered frame (%i bytes) differs from the one sent.", delivered_length);
+    /* The receiver has the frame in one buffer, and nothing else */
+    CHECK(peak <= FRAME_LENGTH + 64, "The peak heap use was %"PRId64" bytes for a %i byte frame.", peak, FRAME_LENGTH);
+    CHECK(left == 0, "%"PRId64" bytes were left allocated.", left);
+}
+
+static void test_too_long()
+{
+    /* The sender refuses */
+    uint8_t *frame = malloc(CONFIG_SDP_FRAGMENT_MAX_LENGTH + 1);
+    sdp_iovec_t iov = {.base = frame, .length = CONFIG_SDP_FRAGMENT_MAX_LENGTH + 1};
+    sent_frames = 0;
+    int result = sdp_fragment_send(&test_peer, &iov, 1, media_type, false);
+    CHECK(result == -SDP_ERR_MESSAGE_TOO_LONG, "A too long frame was not refused, got %i.", result);
+    CHECK(sent_frames == 0, "%i fragments of a too long frame was sent.", sent_frames);
+    free(frame);
+
+    /* The receiver refuses a fragment that says that the frame is too long, before allocating anything */
+    struct __attribute__((packed))
+    {
+        uint8_t preamble[SDP_PREAMBLE_LENGTH];
+        sdp_fragment_header_t header;
+        uint8_t chunk[200];
+    } fragment = {.header = {.message_id = 7, .index = 0, .count = 300, .chunk_size = 200,
+                             .total_length = CONFIG_SDP_FRAGMENT_MAX_LENGTH + 1}};
+    int64_t heap_before = __atomic_load_n(&heap_in_use, __ATOMIC_RELAXED);
+    __atomic_store_n(&heap_peak, heap_before, __ATOMIC_RELAXED);
+    result = sdp_fragment_on_fragment(&test_peer, (uint8_t *)&fragment, sizeof(fragment), media_type);
+    CHECK(result == -SDP_ERR_INVALID_PARAM, "A fragment of a too long frame was not refused, got %i.", result);
+    CHECK(__atomic_load_n(&heap_peak, __ATOMIC_RELAXED) == heap_before, "A fragment of a too long frame allocated memory.");
+}
+
+/**
+ * @brief Send in fragments of the LoRa MTU to a peer without a relation, so every frame begins with two mac
+ * addresses, and all fragments but the last fill the radio payload
+ */
+static void test_lora()
+{
+    media_type = SDP_MT_LoRa;
+    test_peer.state = PEER_UNKNOWN;
+    int mtu = sdp_fragment_mtu(media_type);
+    printf("LoRa, %i byte fragments, %i bytes with the addressing.\n", mtu, air_length(&test_peer, mtu));
+    CHECK(air_length(&test_peer, mtu) <= LORA_MAX_PAYLOAD, "A LoRa frame at the MTU is %i bytes on the air.",
+          air_length(&test_peer, mtu));
+    send_frame(0, 0, true);
+    send_frame(50, 50, true);
+    media_type = SDP_MT_ESPNOW;
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_NONE);
+    strcpy(test_peer.name, "Loopback");
+    queue_count = xSemaphoreCreateCounting(UINT32_MAX, 0);
+    delivered = xSemaphoreCreateBinary();
+    sdp_fragment_init("Fragment");
+    xTaskCreate(receiver_task, "Receiver", 8192, NULL, 5, NULL);
+
+    expected_frame = malloc(FRAME_LENGTH);
+    for (int i = SDP_PREAMBLE_LENGTH; i < FRAME_LENGTH; i++)
+    {
+        expected_frame[i] = (uint8_t)esp_random();
+    }
+    printf("A %i byte frame in %i byte fragments.\n", FRAME_LENGTH, sdp_fragment_mtu(media_type));
+
+    const uint32_t rates[] = {0, 10, 50, 100, 150};
+    for (int i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+    {
+        send_frame(rates[i], rates[i], true);
+    }
+    /* Rounds may lose their status, as long as one of the next rounds get one */
+    statuses_to_lose = SDP_FRAGMENT_ROUNDS - 1;
+    send_frame(0, 0, true);
+    statuses_to_lose = SDP_FRAGMENT_ROUNDS - 2;
+    send_frame(50, 0, true);
+    /* Every status is lost, the sender gives up although the frame arrives */
+    send_frame(0, 1000, false);
+
+    test_too_long();
+    test_lora();
+
+    free(expected_frame);
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,215 @@
+/**
+ * @file test_link_sim.c
+ * @brief Frames are sent to a peer over simulated I2C, ESP-NOW and LoRa links, over the media that
+ * select_media() selects, so only that media gets delivery times and outcomes, like on the devices.
+ * Each link has a latency, a goodput, jitter and a loss rate.
+ *
+ * Checks that the medias that are not selected are probed until they all have link estimates, that the
+ * estimates are close to the links, that the truly fastest media is then selected for each length, and
+ * that the selection follows when the ESP-NOW link slows down.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <esp_log.h>
+
+#include "sdp_peer.h"
+
+#define LINK_COUNT 3
+/* Frames sent before the estimates are checked */
+#define WARM_UP_FRAMES 2000
+/* Frames sent after the ESP-NOW link slows down */
+#define DEGRADED_FRAMES 500
+/* The largest error of a predicted delivery time, in per mille. A media that is only selected for short
+frames has its time per byte fitted from them, so its time for longer frames is extrapolated. */
+#define PREDICTION_MAX_ERROR 350
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* The media scores of i2c_peer.c, espnow_peer.c and lora_peer.c, before there are link estimates */
+
+float i2c_score_peer(sdp_peer *peer, int data_length)
+{
+    return 10;
+}
+
+float espnow_score_peer(sdp_peer *peer, int data_length)
+{
+    return 20;
+}
+
+float lora_score_peer(sdp_peer *peer, int data_length)
+{
+    return 1;
+}
+
+/* The simulated links */
+
+typedef struct sim_link
+{
+    const char *name;
+    e_media_type media_type;
+    struct sdp_peer_media_stats *stats;
+    uint32_t latency;
+    uint32_t goodput;
+    uint32_t jitter;
+    /* Per mille */
+    uint32_t loss;
+    uint32_t selected_count;
+} sim_link;
+
+static sdp_peer peer;
+
+static sim_link links[LINK_COUNT] = {
+    {.name = "I2C", .media_type = SDP_MT_I2C, .stats = &peer.i2c_stats,
+     .latency = 500, .goodput = 10000, .jitter = 100, .loss = 10},
+    {.name = "ESP-NOW", .media_type = SDP_MT_ESPNOW, .stats = &peer.espnow_stats,
+     .latency = 2000, .goodput = 50000, .jitter = 400, .loss = 50},
+    {.name = "LoRa", .media_type = SDP_MT_LoRa, .stats = &peer.lora_stats,
+     .latency = 50000, .goodput = 1000, .jitter = 5000, .loss = 200},
+};
+
+/* A linear congruential generator, so that the runs are repeatable */
+static uint32_t sim_state = 1;
+
+static uint32_t sim_random(uint32_t limit)
+{
+    sim_state = sim_state * 1103515245 + 12345;
+    return (sim_state >> 8) % limit;
+}
+
+/**
+ * @brief The expected time to deliver a frame over a link, including resending it when lost
+ */
+static double true_delivery_time(const sim_link *link, int length)
+{
+    return (link->latency + length * 1e6 / link->goodput) / (1 - link->loss / 1000.0);
+}
+
+static sim_link *fastest_link(int length)
+{
+    sim_link *fastest = &links[0];
+    for (int i = 1; i < LINK_COUNT; i++)
+    {
+        if (true_delivery_time(&links[i], length) < true_delivery_time(fastest, length))
+        {
+            fastest = &links[i];
+        }
+    }
+    return fastest;
+}
+
+/**
+ * @brief Send a frame over the selected media, and tell the statistics how it went, as the medias do
+ */
+static void send_frame(int length)
+{
+    e_media_type media_type = select_media(&peer, length);
+    sim_link *link = NULL;
+    for (int i = 0; i < LINK_COUNT; i++)
+    {
+        if (links[i].media_type == media_type)
+        {
+            link = &links[i];
+        }
+    }
+    if (link == NULL)
+    {
+        CHECK(false, "Media type %hhu was selected.", media_type);
+        return;
+    }
+    link->selected_count++;
+    if (sim_random(1000) < link->loss)
+    {
+        sdp_peer_stats_event(&peer, link->stats, &link->stats->send_failures);
+        return;
+    }
+    uint32_t delivery_time = link->latency + (uint32_t)(length * 1000000ULL / link->goodput) +
+                             sim_random(2 * link->jitter + 1) - link->jitter;
+    sdp_link_on_delivery(&link->stats->link, length, delivery_time);
+    sdp_peer_stats_event(&peer, link->stats, &link->stats->send_successes);
+}
+
+static void send_frames(int count)
+{
+    for (int i = 0; i < LINK_COUNT; i++)
+    {
+        links[i].selected_count = 0;
+    }
+    for (int i = 0; i < count; i++)
+    {
+        send_frame(10 + sim_random(190));
+    }
+}
+
+static void check_selection(const char *when)
+{
+    static const int lengths[] = {8, 40, 100, 200};
+    for (int i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++)
+    {
+        sim_link *fastest = fastest_link(lengths[i]);
+        e_media_type media_type = select_media(&peer, lengths[i]);
+        printf("  %4i bytes: selected %hhu, the fastest is %s.\n", lengths[i], media_type, fastest->name);
+        CHECK(media_type == fastest->media_type, "%s, %s was not selected for %i bytes.", when, fastest->name,
+              lengths[i]);
+    }
+}
+
+static void test_warm_up()
+{
+    send_frames(WARM_UP_FRAMES);
+    for (int i = 0; i < LINK_COUNT; i++)
+    {
+        sim_link *link = &links[i];
+        int64_t predicted = sdp_link_predict_delivery_time(&link->stats->link, 100);
+        double expected = true_delivery_time(link, 100);
+        printf("%-8s selected %4"PRIu32" times, goodput %6"PRIu32" byte/s (%6"PRIu32"), loss %.3f (%.3f), "
+               "100 bytes in %7"PRId64" us (%7.0f).\n",
+               link->name, link->selected_count, sdp_link_goodput(&link->stats->link), link->goodput,
+               sdp_link_loss_rate(&link->stats->link), link->loss / 1000.0, predicted, expected);
+        CHECK(predicted >= 0, "%s was never estimated.", link->name);
+        CHECK(fabs(predicted - expected) * 1000 < expected * PREDICTION_MAX_ERROR,
+              "%s predicted 100 bytes in %"PRId64" us, not %.0f.", link->name, predicted, expected);
+    }
+    check_selection("After warming up");
+}
+
+static void test_degraded()
+{
+    links[1].goodput = 5000;
+    send_frames(DEGRADED_FRAMES);
+    printf("ESP-NOW slowed down to %"PRIu32" byte/s, estimated %"PRIu32" byte/s.\n", links[1].goodput,
+           sdp_link_goodput(&links[1].stats->link));
+    check_selection("After ESP-NOW slowed down");
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    sdp_peer_init("Peer");
+    add_host_supported_media_type(SDP_MT_I2C);
+    add_host_supported_media_type(SDP_MT_ESPNOW);
+    add_host_supported_media_type(SDP_MT_LoRa);
+    strcpy(peer.name, "sim");
+    peer.supported_media_types = SDP_MT_I2C | SDP_MT_ESPNOW | SDP_MT_LoRa;
+    sdp_peer_invalidate_media_selection(&peer);
+
+    test_warm_up();
+    test_degraded();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,247 @@
+/**
+ * @file test_mesh_stress.c
+ * @brief Readers use peers while a writer adds and deletes them, see the read sections in sdp_mesh.c
+ * Freed memory is poisoned and kept in quarantine, never reused, so a reader that uses a freed peer
+ * sees the poison instead of a peer. Readers look peers up and loop the list in read sections, and
+ * half of the time they also take a reference and keep using the peer after the section, like a send.
+ *
+ * Also checks that deleting a peer does not wait for readers or references, and that the peer is freed
+ * once they are gone.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <malloc.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_timer.h>
+#include <esp_random.h>
+
+#include "sdp_mesh.h"
+
+#define READER_COUNT 4
+#define STRESS_MS 2000
+/* Quarantined peers are not freed, so this bounds the memory used on fast hosts */
+#define MAX_DELETES 1000000
+/* Peers the writer keeps, so handles come and go */
+#define LIVE_PEERS 8
+/* Deleting must not wait for readers, this only allows for the host scheduling the writer out */
+#define DELETE_MAX_US 500000
+
+#define POISON 0xdb
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* Quarantine, freed memory is poisoned and never reused, see the Makefile */
+
+void __real_free(void *ptr);
+
+static uint32_t freed_count = 0;
+
+void __wrap_free(void *ptr)
+{
+    if (ptr != NULL)
+    {
+        memset(ptr, POISON, malloc_usable_size(ptr));
+        __atomic_add_fetch(&freed_count, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* The parts of sdp_peer.c that sdp_mesh.c uses */
+
+void sdp_peer_init_peer(sdp_peer *peer)
+{
+}
+
+void sdp_peer_init(char *_log_prefix)
+{
+}
+
+/* The stress test */
+
+static volatile bool stop = false;
+static uint32_t use_count = 0;
+static uint32_t referenced_use_count = 0;
+static uint32_t bad_use_count = 0;
+static int last_handle = 0;
+
+/**
+ * @brief Check that a peer found by a reader is not freed, the writer names them all "peer..."
+ */
+static void use(const sdp_peer *peer)
+{
+    if (strncmp(peer->name, "peer", 4) != 0)
+    {
+        __atomic_add_fetch(&bad_use_count, 1, __ATOMIC_RELAXED);
+    }
+    __atomic_add_fetch(&use_count, 1, __ATOMIC_RELAXED);
+}
+
+static void reader_task(void *arg)
+{
+    SemaphoreHandle_t done = arg;
+    while (!stop)
+    {
+        int handle = __atomic_load_n(&last_handle, __ATOMIC_RELAXED) - (int)(esp_random() % (LIVE_PEERS * 2));
+        sdp_mesh_read_begin();
+        sdp_peer *peer = sdp_mesh_find_peer_by_handle(handle);
+        if (peer == NULL)
+        {
+            /* Loop the list instead */
+            sdp_peer *curr_peer;
+            SLIST_FOREACH(curr_peer, get_peer_list(), next)
+            {
+                use(curr_peer);
+            }
+            sdp_mesh_read_end();
+            continue;
+        }
+        use(peer);
+        if ((esp_random() & 1) == 0)
+        {
+            sdp_mesh_read_end();
+            continue;
+        }
+        /* Keep using it after the section, as sends and queued items do */
+        sdp_mesh_peer_ref(peer);
+        sdp_mesh_read_end();
+        for (int i = 0; i < 4; i++)
+        {
+            taskYIELD();
+            use(peer);
+        }
+        __atomic_add_fetch(&referenced_use_count, 1, __ATOMIC_RELAXED);
+        sdp_mesh_peer_unref(peer);
+    }
+    xSemaphoreGive(done);
+    vTaskDelete(NULL);
+}
+
+static int add_peer(int number)
+{
+    sdp_peer_name name;
+    snprintf(name, sizeof(name), "peer%i", number);
+    return sdp_mesh_peer_add(name);
+}
+
+static void test_stress()
+{
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(READER_COUNT, 0);
+    uint32_t freed_before = freed_count;
+    int handles[LIVE_PEERS];
+    for (int i = 0; i < LIVE_PEERS; i++)
+    {
+        handles[i] = add_peer(i);
+        last_handle = handles[i];
+    }
+    for (int i = 0; i < READER_COUNT; i++)
+    {
+        xTaskCreatePinnedToCore(reader_task, "Reader", 4096, done, 5, NULL, i % portNUM_PROCESSORS);
+    }
+
+    /* Replace a random peer at a time, letting the readers in between */
+    int64_t end = esp_timer_get_time() + STRESS_MS * 1000LL;
+    int64_t slowest_delete = 0;
+    int deleted = 0;
+    for (int number = LIVE_PEERS; (esp_timer_get_time() < end) && (deleted < MAX_DELETES); number++)
+    {
+        int slot = esp_random() % LIVE_PEERS;
+        int64_t start = esp_timer_get_time();
+        CHECK(sdp_mesh_delete_peer(handles[slot]) == 0, "Deleting peer %i failed.", handles[slot]);
+        int64_t took = esp_timer_get_time() - start;
+        slowest_delete = took > slowest_delete ? took : slowest_delete;
+        deleted++;
+        handles[slot] = add_peer(number);
+        CHECK(handles[slot] >= 0, "Adding a peer failed with %i.", handles[slot]);
+        __atomic_store_n(&last_handle, handles[slot], __ATOMIC_RELAXED);
+        if ((number % 64) == 0)
+        {
+            sdp_mesh_on_monitor();
+        }
+        taskYIELD();
+    }
+    stop = true;
+    for (int i = 0; i < READER_COUNT; i++)
+    {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    for (int i = 0; i < LIVE_PEERS; i++)
+    {
+        sdp_mesh_delete_peer(handles[i]);
+        deleted++;
+    }
+    sdp_mesh_on_monitor();
+
+    uint32_t freed = freed_count - freed_before;
+    printf("%i peers deleted, %"PRIu32" freed, %"PRIu32" uses (%"PRIu32" referenced after the section), "
+           "slowest delete %"PRId64" us.\n",
+           deleted, freed, use_count, referenced_use_count, slowest_delete);
+    CHECK(bad_use_count == 0, "%"PRIu32" uses were of freed peers.", bad_use_count);
+    CHECK(freed == deleted, "%i peers were deleted but %"PRIu32" freed.", deleted, freed);
+    CHECK(slowest_delete < DELETE_MAX_US, "A delete took %"PRId64" us.", slowest_delete);
+    vSemaphoreDelete(done);
+}
+
+/**
+ * @brief Delete peers that this thread is using, deleting would never return if it waited for that
+ */
+static void test_delete_while_used()
+{
+    uint32_t freed_before = freed_count;
+    int handle = add_peer(1000);
+
+    /* Referenced, the peer is deleted at once but not freed */
+    sdp_mesh_read_begin();
+    sdp_peer *peer = sdp_mesh_find_peer_by_handle(handle);
+    sdp_mesh_peer_ref(peer);
+    sdp_mesh_read_end();
+    int64_t start = esp_timer_get_time();
+    CHECK(sdp_mesh_delete_peer(handle) == 0, "Deleting a referenced peer failed.");
+    CHECK(esp_timer_get_time() - start < DELETE_MAX_US, "Deleting a referenced peer waited.");
+    sdp_mesh_read_begin();
+    CHECK(sdp_mesh_find_peer_by_handle(handle) == NULL, "A deleted peer was found.");
+    sdp_mesh_read_end();
+    sdp_mesh_on_monitor();
+    CHECK(freed_count == freed_before, "A referenced peer was freed.");
+    use(peer);
+    sdp_mesh_peer_unref(peer);
+    sdp_mesh_on_monitor();
+    CHECK(freed_count == freed_before + 1, "An unreferenced deleted peer was not freed.");
+
+    /* In a read section, the same */
+    handle = add_peer(1001);
+    sdp_mesh_read_begin();
+    peer = sdp_mesh_find_peer_by_handle(handle);
+    CHECK(sdp_mesh_delete_peer(handle) == 0, "Deleting a peer in a read section failed.");
+    sdp_mesh_on_monitor();
+    CHECK(freed_count == freed_before + 1, "A peer was freed in a read section.");
+    use(peer);
+    sdp_mesh_read_end();
+    sdp_mesh_on_monitor();
+    CHECK(freed_count == freed_before + 2, "A deleted peer was not freed after the read section.");
+    CHECK(bad_use_count == 0, "A deleted peer was used after being freed.");
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    sdp_mesh_init("Mesh");
+    test_delete_while_used();
+    test_stress();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file test_parse_message.c
+ * @brief parse_message() splits in one pass, a word at a time, see find_null() in sdp_messaging.c
+ * Its parts are compared to those of the two-pass splitter it replaced, copied below, on data with
+ * empty parts, with and without a trailing null, at every alignment and with every length of tail
+ * after the last whole word. Messages with more parts than the work item holds get pooled parts
+ * arrays, and then heap ones.
+ *
+ * Also reports the MB/s that each splits, for short and long parts.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_log.h>
+#include <esp_random.h>
+
+#include "sdp_messaging.h"
+#include "sdp_pool.h"
+
+/* The largest message, with more parts than the pooled parts arrays hold */
+#define MAX_LENGTH 160
+/* The alignments of the data that are tried */
+#define ALIGNMENTS 8
+#define RANDOM_ROUNDS 200
+#define BENCH_BYTES (64 * 1024 * 1024)
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* The parts of sdp_peer.c that sdp_mesh.c uses, sdp_free_work_item() releases the peer */
+
+void sdp_peer_init_peer(sdp_peer *peer)
+{
+}
+
+void sdp_peer_init(char *_log_prefix)
+{
+}
+
+/* The splitter before, from the first version of sdp_messaging.c, without its warning */
+
+static void two_pass_parse_message(work_queue_item_t *queue_item)
+{
+    if (queue_item->raw_data[queue_item->raw_data_length - 1] != 0)
+    {
+        queue_item->raw_data[queue_item->raw_data_length - 1] = 0;
+    }
+    int nullcount = 0;
+    for (int i = 0; i < queue_item->raw_data_length; i++)
+    {
+        if (queue_item->raw_data[i] == 0)
+        {
+            nullcount++;
+        }
+    }
+    queue_item->parts = malloc(nullcount * sizeof(char *));
+    queue_item->parts[0] = queue_item->raw_data;
+    queue_item->partcount = 1;
+    for (int j = 0; j < queue_item->raw_data_length - 1; j++)
+    {
+        if (queue_item->raw_data[j] == 0)
+        {
+            queue_item->parts[queue_item->partcount] = &(queue_item->raw_data[j + 1]);
+            queue_item->partcount++;
+        }
+    }
+}
+
+/* The comparison */
+
+static uint8_t data[MAX_LENGTH];
+
+/**
+ * @brief Split data[0..length) at an alignment both ways, and compare the parts
+ */
+static void compare(int length, int alignment, const char *what)
+{
+    char expected_data[MAX_LENGTH];
+    work_queue_item_t expected = {.raw_data = expected_data, .raw_data_length = length};
+    memcpy(expected_data, data, length);
+    two_pass_parse_message(&expected);
+
+    /* The pooled receive buffers are aligned, the data is moved along in one */
+    work_queue_item_t *item = sdp_alloc_work_item(MAX_LENGTH + ALIGNMENTS);
+    char *buffer = item->raw_data;
+    item->raw_data = buffer + alignment;
+    item->raw_data_length = length;
+    memcpy(item->raw_data, data, length);
+    parse_message(item);
+
+    bool same = item->partcount == expected.partcount;
+    for (int i = 0; same && (i < item->partcount); i++)
+    {
+        same = (item->parts[i] - item->raw_data) == (expected.parts[i] - expected.raw_data);
+    }
+    same = same && (memcmp(item->raw_data, expected.raw_data, length) == 0);
+    CHECK(same, "%s, %i bytes at alignment %i: %i parts, the two-pass splitter found %i.", what, length,
+          alignment, item->partcount, expected.partcount);
+
+    item->raw_data = buffer;
+    sdp_free_work_item(item);
+    free(expected.parts);
+}
+
+static void compare_all_alignments(int length, const char *what)
+{
+    for (int alignment = 0; alignment < ALIGNMENTS; alignment++)
+    {
+        compare(length, alignment, what);
+    }
+}
+
+static void test_patterns()
+{
+    for (int length = 1; length <= MAX_LENGTH; length++)
+    {
+        /* No separators, and no trailing null */
+        memset(data, 'x', length);
+        compare_all_alignments(length, "Without nulls");
+        /* Only separators, all parts are empty */
+        memset(data, 0, length);
+        compare_all_alignments(length, "Only nulls");
+        /* A null in every position, with and without a trailing one, the rest of the tail after it */
+        for (int at = 0; at < length; at++)
+        {
+            memset(data, 'x', length);
+            data[at] = 0;
+            compare_all_alignments(length, "One null");
+            data[length - 1] = 0;
+            compare_all_alignments(length, "One null and a trailing null");
+        }
+        /* Two empty parts in the middle */
+        memset(data, 'x', length);
+        for (int at = length / 2; (at < length / 2 + 3) && (at < length); at++)
+        {
+            data[at] = 0;
+        }
+        compare_all_alignments(length, "Empty parts");
+    }
+}
+
+static void test_random()
+{
+    /* Up to every other byte a null, so up to MAX_LENGTH / 2 parts, which needs heap parts arrays */
+    const int densities[] = {2, 4, 16, 64};
+    for (int round = 0; round < RANDOM_ROUNDS; round++)
+    {
+        for (int d = 0; d < sizeof(densities) / sizeof(densities[0]); d++)
+        {
+            int length = 1 + esp_random() % MAX_LENGTH;
+            for (int i = 0; i < length; i++)
+            {
+                data[i] = (esp_random() % densities[d]) == 0 ? 0 : 'a' + esp_random() % 26;
+            }
+            compare_all_alignments(length, "Random");
+        }
+    }
+}
+
+/* The benchmark */
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief The MB/s of splitting a message of parts of a length, both ways
+ */
+static void bench(int length, int part_length)
+{
+    char message[MAX_LENGTH];
+    for (int i = 0; i < length; i++)
+    {
+        message[i] = ((i + 1) % part_length) == 0 ? 0 : 'a' + i % 26;
+    }
+    message[length - 1] = 0;
+    int rounds = BENCH_BYTES / length;
+    double mb_per_s[2];
+    for (int way = 0; way < 2; way++)
+    {
+        work_queue_item_t *item = sdp_alloc_work_item(length);
+        memcpy(item->raw_data, message, length);
+        int64_t started = now_ns();
+        for (int i = 0; i < rounds; i++)
+        {
+            if (way == 0)
+            {
+                two_pass_parse_message(item);
+                free(item->parts);
+            }
+            else
+            {
+                parse_message(item);
+            }
+        }
+        mb_per_s[way] = (double)rounds * length * 1000.0 / (now_ns() - started);
+        item->parts = item->inline_parts;
+        sdp_free_work_item(item);
+    }
+    printf("%3i bytes in parts of %2i: two-pass %6.1f MB/s, one pass %6.1f MB/s.\n", length, part_length,
+           mb_per_s[0], mb_per_s[1]);
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_NONE);
+    sdp_pool_init("Pool");
+    test_patterns();
+    test_random();
+    /* A HI message, and readings with short and long values, within the inline parts */
+    bench(40, 8);
+    bench(120, 16);
+    bench(120, 40);
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,223 @@
+/**
+ * @file test_relations.c
+ * @brief Relations are added until the RTC tier is full and they spill into the NVS tier, see sdp_relations.c
+ * NVS is a stub that keeps one blob in memory.
+ *
+ * Checks that every relation id resolves to its MAC address in both tiers, that unknown ids do not, that a
+ * MAC address is only added once in either tier, that relations beyond both tiers are refused, and that the
+ * NVS tier is loaded only when the RTC tier is full and saved only when it has changed.
+ * Also reports how many relation ids per second are resolved in each tier.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <esp_log.h>
+#include <nvs.h>
+
+#include "sdp_relations.h"
+
+#define RELATION_COUNT (CONFIG_SDP_RTC_RELATIONS + CONFIG_SDP_NVS_RELATIONS)
+#define LOOKUPS 4000000
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+/* The NVS stub, one blob, and how it is used */
+
+static uint8_t *nvs_blob = NULL;
+static size_t nvs_blob_length = 0;
+static int nvs_get_count = 0;
+static int nvs_set_count = 0;
+static int nvs_erase_count = 0;
+
+esp_err_t nvs_open(const char *namespace_name, nvs_open_mode_t open_mode, nvs_handle_t *out_handle)
+{
+    *out_handle = 1;
+    return ESP_OK;
+}
+
+esp_err_t nvs_get_blob(nvs_handle_t handle, const char *key, void *out_value, size_t *length)
+{
+    nvs_get_count++;
+    if (nvs_blob == NULL)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    if (*length < nvs_blob_length)
+    {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    memcpy(out_value, nvs_blob, nvs_blob_length);
+    *length = nvs_blob_length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_blob(nvs_handle_t handle, const char *key, const void *value, size_t length)
+{
+    nvs_set_count++;
+    free(nvs_blob);
+    nvs_blob = malloc(length);
+    memcpy(nvs_blob, value, length);
+    nvs_blob_length = length;
+    return ESP_OK;
+}
+
+esp_err_t nvs_erase_key(nvs_handle_t handle, const char *key)
+{
+    nvs_erase_count++;
+    if (nvs_blob == NULL)
+    {
+        return ESP_ERR_NVS_NOT_FOUND;
+    }
+    free(nvs_blob);
+    nvs_blob = NULL;
+    nvs_blob_length = 0;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle_t handle)
+{
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle_t handle)
+{
+}
+
+/* The relations */
+
+static sdp_mac_address mac_addresses[RELATION_COUNT];
+static uint32_t relation_ids[RELATION_COUNT];
+
+static int64_t now_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void make_relations()
+{
+    for (int i = 0; i < RELATION_COUNT; i++)
+    {
+        sdp_mac_address mac_address = {0x24, 0x6f, 0x28, 0x20, (uint8_t)(i >> 8), (uint8_t)i};
+        memcpy(mac_addresses[i], mac_address, SDP_MAC_ADDR_LEN);
+        /* Relation ids are crc32:s, these are spread like them */
+        relation_ids[i] = (uint32_t)(i + 1) * 0x9e3779b1u;
+    }
+}
+
+static void check_lookups(int count, const char *when)
+{
+    int wrong = 0;
+    for (int i = 0; i < count; i++)
+    {
+        sdp_mac_address *mac_address = relation_id_to_mac_address(relation_ids[i]);
+        if ((mac_address == NULL) || (memcmp(*mac_address, mac_addresses[i], SDP_MAC_ADDR_LEN) != 0))
+        {
+            wrong++;
+        }
+    }
+    CHECK(wrong == 0, "%s, %i of %i relation ids did not resolve to their MAC address.", when, wrong, count);
+    CHECK(relation_id_to_mac_address(0x12345678) == NULL, "%s, an unknown relation id was resolved.", when);
+}
+
+static void test_rtc_tier()
+{
+    for (int i = 0; i < CONFIG_SDP_RTC_RELATIONS; i++)
+    {
+        CHECK(add_relation(mac_addresses[i], relation_ids[i]), "Adding relation %i to RTC memory failed.", i);
+    }
+    CHECK(sdp_relations_count() == CONFIG_SDP_RTC_RELATIONS, "There are %i relations, not %i.",
+          sdp_relations_count(), CONFIG_SDP_RTC_RELATIONS);
+    CHECK(nvs_get_count == 0, "NVS was loaded before the RTC tier was full.");
+    check_lookups(CONFIG_SDP_RTC_RELATIONS, "In RTC memory");
+
+    CHECK(!add_relation(mac_addresses[3], 0xabcdef01), "A MAC address in RTC memory was added again.");
+    CHECK(sdp_relations_count() == CONFIG_SDP_RTC_RELATIONS, "A duplicate MAC address was counted.");
+}
+
+static void test_nvs_tier()
+{
+    for (int i = CONFIG_SDP_RTC_RELATIONS; i < RELATION_COUNT; i++)
+    {
+        CHECK(add_relation(mac_addresses[i], relation_ids[i]), "Adding relation %i to NVS failed.", i);
+    }
+    CHECK(sdp_relations_count() == RELATION_COUNT, "There are %i relations, not %i.", sdp_relations_count(),
+          RELATION_COUNT);
+    CHECK(nvs_get_count == 1, "The NVS tier was loaded %i times, not once.", nvs_get_count);
+    check_lookups(RELATION_COUNT, "In both tiers");
+
+    CHECK(!add_relation(mac_addresses[3], 0xabcdef02), "A MAC address in RTC memory was added to NVS.");
+    CHECK(!add_relation(mac_addresses[RELATION_COUNT - 1], 0xabcdef03), "A MAC address in NVS was added again.");
+    sdp_mac_address extra = {0x24, 0x6f, 0x28, 0x30, 0, 0};
+    CHECK(!add_relation(extra, 0xabcdef04), "A relation was added beyond both tiers.");
+    CHECK(sdp_relations_count() == RELATION_COUNT, "Refused relations were counted.");
+    CHECK(relation_id_to_mac_address(0xabcdef03) == NULL, "A refused relation was resolved.");
+}
+
+static void test_save()
+{
+    CHECK(nvs_set_count == 0, "The NVS tier was written while adding, not in a batch.");
+    sdp_relations_save();
+    CHECK(nvs_set_count == 1, "The NVS tier was written %i times, not once.", nvs_set_count);
+    CHECK((nvs_blob_length > 0) && (nvs_blob_length % CONFIG_SDP_NVS_RELATIONS == 0),
+          "%u bytes were saved for %i relations.", (unsigned int)nvs_blob_length, CONFIG_SDP_NVS_RELATIONS);
+    CHECK(memcmp(nvs_blob + nvs_blob_length - nvs_blob_length / CONFIG_SDP_NVS_RELATIONS,
+                 &relation_ids[RELATION_COUNT - 1], sizeof(uint32_t)) == 0,
+          "The last relation saved is not the last one added.");
+    sdp_relations_save();
+    CHECK(nvs_set_count == 1, "The NVS tier was written again without changes.");
+}
+
+/**
+ * @brief Millions of relation ids resolved per second, of the relations first to first + count
+ */
+static double measure(int first, int count)
+{
+    int found = 0;
+    int64_t started = now_ns();
+    for (int i = 0; i < LOOKUPS; i++)
+    {
+        found += relation_id_to_mac_address(relation_ids[first + i % count]) != NULL;
+    }
+    int64_t elapsed = now_ns() - started;
+    CHECK(found == LOOKUPS, "Only %i of %i lookups were found.", found, LOOKUPS);
+    return LOOKUPS * 1000.0 / elapsed;
+}
+
+static void bench_lookups()
+{
+    double rtc = measure(0, CONFIG_SDP_RTC_RELATIONS);
+    double nvs = measure(CONFIG_SDP_RTC_RELATIONS, CONFIG_SDP_NVS_RELATIONS);
+    printf("Millions of relation ids resolved per second: %.1f in RTC memory, %.1f in NVS.\n", rtc, nvs);
+}
+
+int main()
+{
+    /* Refusing relations beyond both tiers logs an error */
+    esp_log_level_set("*", ESP_LOG_NONE);
+    make_relations();
+    sdp_relations_init("Relations");
+    CHECK(nvs_erase_count == 1, "The NVS tier of an earlier boot was not cleared on a cold boot.");
+
+    test_rtc_tier();
+    test_nvs_tier();
+    test_save();
+    bench_lookups();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}
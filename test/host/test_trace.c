@@ -0,0 +1,246 @@
+/**
+ * @file test_trace.c
+ * @brief Trace records are written into the ring and read back, see sdp_trace.c
+ * Checks that records come back in order with what was written, that a reader that falls more than
+ * the ring behind counts the overwritten records as lost and goes on from the oldest one left, that
+ * a cursor can be read in batches, and that while writer tasks wrap the ring under a reader, every
+ * record is either read intact or counted as lost.
+ *
+ * Also reports the CPU time per packet of checking a frame's CRC, with and without a trace record,
+ * which is what SDP_TRACE adds to each packet when tracing is enabled.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <freertos/task.h>
+#include <esp_log.h>
+#include <esp_random.h>
+
+#include "sdp_trace.h"
+#include "sdp_crc.h"
+
+#define RING_SIZE CONFIG_SDP_TRACE_RING_SIZE
+#define WRITER_COUNT 2
+#define WRITES_PER_WRITER 200000
+#define BENCH_PACKETS 2000000
+/* An ESP-NOW frame */
+#define BENCH_FRAME_LENGTH 250
+
+static int failures = 0;
+
+#define CHECK(condition, ...)              \
+    do                                     \
+    {                                      \
+        if (!(condition))                  \
+        {                                  \
+            printf("FAIL: " __VA_ARGS__);  \
+            printf("\n");                  \
+            failures++;                    \
+        }                                  \
+    } while (0)
+
+static sdp_trace_record_t records[RING_SIZE];
+/* The cursor of the tests, the ring is shared by them all */
+static uint32_t cursor = 0;
+
+/**
+ * @brief Write records that tell their own number, in the CRC and the length
+ */
+static void write_numbered(uint32_t first, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        uint32_t number = first + i;
+        sdp_trace_write(SDP_TRACE_RX, NULL, SDP_MT_ESPNOW, number & 0xffff, number);
+    }
+}
+
+static void test_read_back()
+{
+    sdp_peer peer = {.peer_handle = 42};
+    uint32_t lost = 0;
+    sdp_trace_write(SDP_TRACE_TX, &peer, SDP_MT_LoRa, 70000, 0xdeadbeef);
+    write_numbered(1, 9);
+    int count = sdp_trace_read(records, RING_SIZE, &cursor, &lost);
+    CHECK(count == 10, "%i records were read, not 10.", count);
+    CHECK(lost == 0, "%" PRIu32 " records were lost without wrapping.", lost);
+    CHECK((records[0].event == SDP_TRACE_TX) && (records[0].peer_handle == 42) && (records[0].media_type == SDP_MT_LoRa),
+          "The first record is event %hhu, peer %hu, media %hhu.", records[0].event, records[0].peer_handle,
+          records[0].media_type);
+    CHECK(records[0].length == UINT16_MAX, "A 70000 byte frame was traced as %hu bytes.", records[0].length);
+    CHECK(records[0].crc32 == 0xdeadbeef, "The CRC was not kept.");
+    for (int i = 1; i < count; i++)
+    {
+        CHECK((records[i].crc32 == i) && (records[i].peer_handle == UINT16_MAX), "Record %i is record %" PRIu32 ".",
+              i, records[i].crc32);
+        CHECK(records[i].sequence == records[i - 1].sequence + 1, "The sequence skips after record %i.", i);
+    }
+    CHECK(sdp_trace_read(records, RING_SIZE, &cursor, &lost) == 0, "Records were read twice.");
+}
+
+static void test_wrap()
+{
+    const int overrun = 50;
+    uint32_t lost = 0;
+    write_numbered(1000, RING_SIZE + overrun);
+    int count = sdp_trace_read(records, RING_SIZE, &cursor, &lost);
+    CHECK(lost == overrun, "%" PRIu32 " records were counted as lost, not %i.", lost, overrun);
+    CHECK(count == RING_SIZE, "%i records were read after wrapping, not %i.", count, RING_SIZE);
+    CHECK(records[0].crc32 == 1000 + overrun, "Reading went on from record %" PRIu32 ", not the oldest left (%i).",
+          records[0].crc32, 1000 + overrun);
+    CHECK(records[count - 1].crc32 == 1000 + RING_SIZE + overrun - 1, "The last record read is %" PRIu32 ".",
+          records[count - 1].crc32);
+
+    /* Wrapping several times over loses all but a ring */
+    lost = 0;
+    write_numbered(5000, RING_SIZE * 5 + 3);
+    count = sdp_trace_read(records, RING_SIZE, &cursor, &lost);
+    CHECK((lost == RING_SIZE * 4 + 3) && (count == RING_SIZE), "After wrapping 5 times, %i read and %" PRIu32 " lost.",
+          count, lost);
+}
+
+static void test_batches()
+{
+    const int batch = 7;
+    uint32_t lost = 0;
+    write_numbered(20000, RING_SIZE);
+    int total = 0;
+    int count;
+    do
+    {
+        count = sdp_trace_read(records, batch, &cursor, &lost);
+        for (int i = 0; i < count; i++)
+        {
+            CHECK(records[i].crc32 == 20000 + total + i, "Batch record %i is record %" PRIu32 ".", total + i,
+                  records[i].crc32);
+        }
+        total += count;
+    } while (count == batch);
+    CHECK((total == RING_SIZE) && (lost == 0), "In batches of %i, %i were read and %" PRIu32 " lost.", batch, total,
+          lost);
+}
+
+/* Writers wrap the ring while it is read */
+
+static volatile int writers_done = 0;
+
+static void writer_task(void *arg)
+{
+    SemaphoreHandle_t done = arg;
+    for (uint32_t i = 0; i < WRITES_PER_WRITER; i++)
+    {
+        /* A record is intact if its length is the low half of its CRC */
+        uint32_t value = esp_random();
+        sdp_trace_write(SDP_TRACE_RX, NULL, SDP_MT_I2C, value & 0xffff, value);
+        if ((i % 64) == 0)
+        {
+            taskYIELD();
+        }
+    }
+    __atomic_add_fetch(&writers_done, 1, __ATOMIC_RELEASE);
+    xSemaphoreGive(done);
+    vTaskDelete(NULL);
+}
+
+static void test_concurrent()
+{
+    SemaphoreHandle_t done = xSemaphoreCreateCounting(WRITER_COUNT, 0);
+    uint32_t lost = 0;
+    uint32_t read = 0;
+    int torn = 0;
+    for (int i = 0; i < WRITER_COUNT; i++)
+    {
+        xTaskCreatePinnedToCore(writer_task, "Writer", 4096, done, 5, NULL, i % portNUM_PROCESSORS);
+    }
+    bool finished = false;
+    while (!finished)
+    {
+        /* Read once more after the writers are done, to get to the head */
+        finished = __atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) == WRITER_COUNT;
+        int count = sdp_trace_read(records, 16, &cursor, &lost);
+        for (int i = 0; i < count; i++)
+        {
+            torn += records[i].length != (records[i].crc32 & 0xffff);
+        }
+        read += count;
+        taskYIELD();
+    }
+    for (int i = 0; i < WRITER_COUNT; i++)
+    {
+        xSemaphoreTake(done, portMAX_DELAY);
+    }
+    int count;
+    while ((count = sdp_trace_read(records, 16, &cursor, &lost)) > 0)
+    {
+        read += count;
+    }
+    printf("%i writers wrote %i records, %" PRIu32 " were read and %" PRIu32 " lost.\n", WRITER_COUNT,
+           WRITER_COUNT * WRITES_PER_WRITER, read, lost);
+    CHECK(torn == 0, "%i records were read while being written.", torn);
+    CHECK(read + lost == WRITER_COUNT * WRITES_PER_WRITER, "%" PRIu32 " read and %" PRIu32 " lost, not %i in all.",
+          read, lost, WRITER_COUNT * WRITES_PER_WRITER);
+}
+
+/* The CPU time per packet */
+
+static uint8_t frame[BENCH_FRAME_LENGTH];
+/* The results are kept here, so that computing them can not be left out */
+static volatile uint32_t crc_sink;
+
+static int64_t cpu_time_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return (int64_t)now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Nanoseconds of CPU time per packet, each has its CRC checked, and a trace record if traced
+ */
+static double measure(bool traced)
+{
+    uint32_t ok = 0;
+    int64_t started = cpu_time_ns();
+    for (int i = 0; i < BENCH_PACKETS; i++)
+    {
+        frame[SDP_CRC_LENGTH] = (uint8_t)i;
+        uint32_t crc32 = sdp_frame_crc_calc(frame, BENCH_FRAME_LENGTH);
+        ok += crc32 == sdp_frame_crc(frame);
+        if (traced)
+        {
+            /* What SDP_TRACE() is when tracing is enabled, it is ((void)0) when it is not */
+            sdp_trace_write(SDP_TRACE_RX, NULL, SDP_MT_ESPNOW, BENCH_FRAME_LENGTH, crc32);
+        }
+    }
+    crc_sink = ok;
+    return (double)(cpu_time_ns() - started) / BENCH_PACKETS;
+}
+
+static void bench_packets()
+{
+    for (int i = 0; i < BENCH_FRAME_LENGTH; i++)
+    {
+        frame[i] = (uint8_t)esp_random();
+    }
+    double off = measure(false);
+    double on = measure(true);
+    printf("CPU time per %i byte packet: %.1f ns with tracing off, %.1f ns on, %.1f ns for the trace record.\n",
+           BENCH_FRAME_LENGTH, off, on, on - off);
+}
+
+int main()
+{
+    esp_log_level_set("*", ESP_LOG_ERROR);
+    sdp_trace_init("Trace");
+    test_read_back();
+    test_wrap();
+    test_batches();
+    test_concurrent();
+    bench_packets();
+    printf(failures == 0 ? "PASS\n" : "%i FAILED\n", failures);
+    return failures == 0 ? 0 : 1;
+}